@@ -0,0 +1,237 @@
+#include "acam_capcache.h"
+
+#include <limits.h>
+#include <pthread.h>
+
+/**
+ * @brief Capability cache. acam_open needs the bounds and defaults of every control
+ * and the camera's mode table, which costs dozens of ioctls (each a USB control
+ * transfer on a UVC camera). None of it changes for a given device, so once a
+ * directory is set with acam_set_cache_dir, the result is kept in one file per device
+ * and read back on the next open instead.
+ *
+ * A device is identified by the driver, card and bus_info strings and the driver
+ * version from VIDIOC_QUERYCAP; the file name is a hash of them and the file repeats
+ * them in full, so a hash collision is a miss rather than a wrong answer. Files are
+ * written to a temporary name and renamed into place, so concurrent opens never read
+ * a partial file, and the size check turns a file cut short by a crash into a miss.
+ *
+ */
+
+#define CAPCACHE_MAGIC "ACAMCAP"
+#define CAPCACHE_VERSION 1
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t ctrl_size; //sizeof(acam_ctrl_t) and sizeof(acam_mode_t), so a file from a different build is a miss
+    uint32_t mode_size;
+    uint32_t ctrl_count;
+    uint32_t mode_count;
+    uint32_t driver_version;
+    uint8_t driver[16];
+    uint8_t card[32];
+    uint8_t bus_info[32];
+} capcache_header_t;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *cache_dir; //NULL while the cache is off
+
+/**
+ * @brief Turns the capability cache on or off for every camera opened afterwards.
+ *
+ * @param dir the directory holding the cache files, created if it does not exist.
+ * NULL turns the cache off.
+ * @return exit status. 0 on success, ENOMEM, errno if the directory cannot be created.
+ */
+int acam_set_cache_dir(const char *dir)
+{
+    char *copy = NULL;
+    if (dir != NULL)
+    {
+        if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+        {
+            return errno;
+        }
+        copy = strdup(dir);
+        if (copy == NULL)
+        {
+            return ENOMEM;
+        }
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    char *old = cache_dir;
+    cache_dir = copy;
+    pthread_mutex_unlock(&cache_lock);
+    free(old);
+    return 0;
+}
+
+int acam_capcache_enabled(void)
+{
+    pthread_mutex_lock(&cache_lock);
+    int enabled = cache_dir != NULL;
+    pthread_mutex_unlock(&cache_lock);
+    return enabled;
+}
+
+/**
+ * @brief Builds the path of a device's cache file from an FNV-1a hash of its identity.
+ *
+ * @return exit status. 0 on success, ENOENT if the cache is off, ENAMETOOLONG.
+ */
+static int cache_path(const struct v4l2_capability *cap, char *path, size_t size)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    const uint8_t *fields[3] = {cap->driver, cap->card, cap->bus_info};
+    const size_t lengths[3] = {sizeof(cap->driver), sizeof(cap->card), sizeof(cap->bus_info)};
+    for (int f = 0; f < 3; f++)
+    {
+        for (size_t i = 0; i < lengths[f] && fields[f][i] != '\0'; i++)
+        {
+            hash = (hash ^ fields[f][i]) * 0x100000001b3ull;
+        }
+        hash = (hash ^ 0xff) * 0x100000001b3ull; // field separator
+    }
+    hash = (hash ^ cap->version) * 0x100000001b3ull;
+
+    pthread_mutex_lock(&cache_lock);
+    int ret = ENOENT;
+    if (cache_dir != NULL)
+    {
+        int len = snprintf(path, size, "%s/%016llx.cap", cache_dir, (unsigned long long)hash);
+        ret = len < 0 || (size_t)len >= size ? ENAMETOOLONG : 0;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return ret;
+}
+
+static void fill_header(const struct v4l2_capability *cap, uint32_t mode_count, capcache_header_t *header)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, CAPCACHE_MAGIC, sizeof(CAPCACHE_MAGIC));
+    header->version = CAPCACHE_VERSION;
+    header->ctrl_size = sizeof(acam_ctrl_t);
+    header->mode_size = sizeof(acam_mode_t);
+    header->ctrl_count = __ACAM_CTRL_COUNT;
+    header->mode_count = mode_count;
+    header->driver_version = cap->version;
+    memcpy(header->driver, cap->driver, sizeof(header->driver));
+    memcpy(header->card, cap->card, sizeof(header->card));
+    memcpy(header->bus_info, cap->bus_info, sizeof(header->bus_info));
+}
+
+/**
+ * @brief Fills the control table and mode table of a camera from its cache file.
+ *
+ * @param cap the camera's VIDIOC_QUERYCAP answer
+ * @param cam the camera being opened. cam->ctrls, cam->modes and cam->mode_count are
+ * only written on a hit.
+ * @return exit status. 0 on a hit, ENOENT if there is no valid file for the device,
+ * ENOMEM.
+ */
+int acam_capcache_load(const struct v4l2_capability *cap, acam_camera_t *cam)
+{
+    char path[PATH_MAX];
+    int ret = cache_path(cap, path, sizeof(path));
+    if (ret != 0)
+    {
+        return ENOENT;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return ENOENT;
+    }
+
+    capcache_header_t header;
+    capcache_header_t expected;
+    ssize_t got = read(fd, &header, sizeof(header));
+    if (got != (ssize_t)sizeof(header))
+    {
+        close(fd);
+        return ENOENT;
+    }
+    fill_header(cap, header.mode_count, &expected);
+    if (memcmp(&header, &expected, sizeof(header)) != 0 || header.mode_count > 1u << 20)
+    {
+        close(fd);
+        return ENOENT; // another device, build or format version
+    }
+
+    acam_ctrl_t ctrls[__ACAM_CTRL_COUNT];
+    size_t mode_bytes = header.mode_count * sizeof(acam_mode_t);
+    acam_mode_t *modes = NULL;
+    if (mode_bytes > 0 && (modes = malloc(mode_bytes)) == NULL)
+    {
+        close(fd);
+        return ENOMEM;
+    }
+    char extra;
+    int complete = read(fd, ctrls, sizeof(ctrls)) == (ssize_t)sizeof(ctrls) &&
+                   read(fd, modes, mode_bytes) == (ssize_t)mode_bytes && read(fd, &extra, 1) == 0;
+    close(fd);
+    if (!complete)
+    {
+        free(modes);
+        return ENOENT;
+    }
+
+    memcpy(cam->ctrls, ctrls, sizeof(ctrls));
+    cam->modes = modes;
+    cam->mode_count = header.mode_count;
+    return 0;
+}
+
+/**
+ * @brief Saves the control table and mode table of a camera to its cache file,
+ * replacing any previous file atomically.
+ *
+ * @param cap the camera's VIDIOC_QUERYCAP answer
+ * @param cam the camera, with its tables filled from the device.
+ * @return exit status. 0 on success, ENOENT if the cache is off, errno on failure to
+ * write the file.
+ */
+int acam_capcache_store(const struct v4l2_capability *cap, const acam_camera_t *cam)
+{
+    char path[PATH_MAX];
+    char temp[PATH_MAX + 32];
+    int ret = cache_path(cap, path, sizeof(path));
+    if (ret != 0)
+    {
+        return ret;
+    }
+    snprintf(temp, sizeof(temp), "%s.%d.tmp", path, (int)getpid());
+
+    capcache_header_t header;
+    fill_header(cap, cam->mode_count, &header);
+    struct iovec parts[3] = {
+        {&header, sizeof(header)},
+        {(void *)cam->ctrls, sizeof(cam->ctrls)},
+        {cam->modes, cam->mode_count * sizeof(acam_mode_t)},
+    };
+    size_t total = parts[0].iov_len + parts[1].iov_len + parts[2].iov_len;
+
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        return errno;
+    }
+    ssize_t written = writev(fd, parts, 3);
+    ret = written == (ssize_t)total ? 0 : (written == -1 ? errno : EIO);
+    if (close(fd) == -1 && ret == 0)
+    {
+        ret = errno;
+    }
+    if (ret == 0 && rename(temp, path) == -1)
+    {
+        ret = errno;
+    }
+    if (ret != 0)
+    {
+        unlink(temp);
+    }
+    return ret;
+}
@@ -0,0 +1,16 @@
+#ifndef ACAM_CAPCACHE
+#define ACAM_CAPCACHE
+
+/**
+ * @brief Private header of the on-disk capability cache in acam_capcache.c, through
+ * which acam_open skips the control and mode queries for a camera it has seen before.
+ *
+ */
+
+#include "acam_control.h"
+
+int acam_capcache_enabled(void); //1 once acam_set_cache_dir has set a directory
+int acam_capcache_load(const struct v4l2_capability *cap, acam_camera_t *cam); //fills cam->ctrls and the mode table from the cache, ENOENT on a miss
+int acam_capcache_store(const struct v4l2_capability *cap, const acam_camera_t *cam); //saves cam->ctrls and the mode table for the next open
+
+#endif
@@ -1,4 +1,6 @@
 #include "acam_control.h"
+#include "acam_trace.h"
+#include "acam_capcache.h"
 
 #ifndef NDEBUG
 #define DEBUG_PRINT fprintf
@@ -59,28 +61,97 @@ const acam_ctrl_tag_t v4l2_id[__ACAM_CTRL_COUNT] = {
     V4L2_CID_EXPOSURE_AUTO,
     V4L2_CID_EXPOSURE_ABSOLUTE,
     V4L2_CID_EXPOSURE_AUTO_PRIORITY};
+/**
+ * @brief Names of the controls as uvcvideo reports them, kept for controls a camera
+ * does not have.
+ *
+ */
+static const char *const ctrl_names[ACAM_FORMAT] = {
+    "Brightness",
+    "Contrast",
+    "Saturation",
+    "Hue",
+    "White Balance Temperature, Auto",
+    "Gamma",
+    "Gain",
+    "Power Line Frequency",
+    "White Balance Temperature",
+    "Sharpness",
+    "Backlight Compensation",
+    "Exposure, Auto",
+    "Exposure (Absolute)",
+    "Exposure, Auto Priority"};
 
 // function prototypes for private functions:
-static acam_fmt_t get_acam_fmt_tag(int acam_fmt_type, int height);
+static acam_fmt_t get_acam_fmt_tag(int acam_fmt_type, int width, int height);
 static int get_fmt(const acam_camera_t *cam, int *value);
-static int set_fmt(const acam_camera_t *cam, acam_fmt_t acam_fmt_tag);
+static int set_fmt(acam_camera_t *cam, acam_fmt_t acam_fmt_tag);
+static int apply_format(acam_camera_t *cam, uint32_t fourcc, uint32_t width, uint32_t height);
+static int build_modes(acam_camera_t *cam);
+static int add_size(const acam_camera_t *cam, const struct v4l2_fmtdesc *desc, uint32_t width, uint32_t height,
+                    acam_mode_t **modes, unsigned int *count, unsigned int *capacity);
+static int append_mode(const acam_mode_t *mode, acam_mode_t **modes, unsigned int *count, unsigned int *capacity);
+static int fill_mode(const acam_camera_t *cam, const struct v4l2_fmtdesc *desc, acam_mode_t *mode);
+static int compare_mode_size(const void *a, const void *b);
+static int compare_mode(const void *a, const void *b);
+static int read_ctrl_device(const acam_camera_t *cam, acam_ctrl_tag_t ctrl, int *value);
+static int clamp_ctrl(const acam_camera_t *cam, acam_ctrl_tag_t ctrl, int value);
+static int device_owns_ctrl(const acam_camera_t *cam, acam_ctrl_tag_t ctrl);
 static int get_queryctrl(acam_camera_t *cam, acam_ctrl_tag_t ctrl, struct v4l2_queryctrl *query_out);
-static int xioctl(int fd, int request, void *arg);
+static void query_ctrls(acam_camera_t *cam);
+static void store_queryctrl(acam_camera_t *cam, const struct v4l2_queryctrl *query);
+static int xioctl(const acam_camera_t *cam, unsigned long request, void *arg);
+static void warn_bounds(const acam_camera_t *cam, acam_ctrl_tag_t ctrl, int value);
+static int wait_for_frame(const acam_camera_t *cam, int timeout_ms);
+static void *map_buffer(const acam_camera_t *cam, size_t length, off_t offset);
+static int64_t monotonic_ms(void);
+static int free_ring(acam_camera_t *cam, unsigned int mapped);
+static int export_buffer(const acam_camera_t *cam, unsigned int index);
+static int start_ring(acam_camera_t *cam, unsigned int count, acam_pool_t *pool);
+static int get_sizeimage(const acam_camera_t *cam, uint32_t *sizeimage);
+static int dequeue_ready(acam_camera_t *cam, acam_buffer_t **buffer);
+static void account_frame(const acam_camera_t *cam, const struct v4l2_buffer *buf, acam_buffer_t *buffer);
+
+#define STATS_FPS_SHIFT 3 //the frame interval is smoothed over about 2^STATS_FPS_SHIFT frames
+
+/**
+ * @brief Frame accounting of a camera. Written only by the thread that dequeues its
+ * frames; the counters are updated with relaxed atomics so acam_get_stream_stats can
+ * read them from any thread.
+ *
+ */
+struct acam_stream_track
+{
+    uint64_t frames;
+    uint64_t dropped;
+    uint64_t errors;
+    uint64_t jitter[ACAM_JITTER_BUCKETS];
+    uint32_t max_jitter_us;
+    uint32_t max_latency_us;
+    uint64_t latency_frames; //frames with a monotonic timestamp, that latency is measured for
+    uint64_t latency_sum_us;
+    uint64_t interval_ns; //smoothed time between frames
+
+    uint32_t last_sequence;
+    int have_sequence; //0 until the first frame after STREAMON
+    int64_t last_timestamp_us;
+};
 
 /**
  * @brief Helps to interface between V4L2 query of selected pixel
  * format and the format ENUM values.
  *
  * @param acam_fmt_type The V4L2_PIX_FMT enum for either YUYV or MJPEG.
- * @param height The height of the aspect ratio for above pixel format.
- * @return The format ENUM associated with the V4L2 pixel format/aspect ratio
- * (a 0-11 int). __ACAM_FMT_INVALID if the acam_fmt_type and pixel height do not match the ARDUCAM's specs.
+ * @param width The width of the frame size for above pixel format.
+ * @param height The height of the frame size for above pixel format.
+ * @return The format ENUM associated with the V4L2 pixel format/frame size
+ * (a 0-11 int). __ACAM_FMT_INVALID if the acam_fmt_type and frame size do not match the ARDUCAM's specs.
  */
-static acam_fmt_t get_acam_fmt_tag(int acam_fmt_type, int height)
+static acam_fmt_t get_acam_fmt_tag(int acam_fmt_type, int width, int height)
 {
     for (int i = 0; i < __ACAM_FMT_COUNT; i++)
     {
-        if (height == fmts[i].height && acam_fmt_type == fmts[i].v4l2_pix_fmt)
+        if (width == fmts[i].width && height == fmts[i].height && acam_fmt_type == fmts[i].v4l2_pix_fmt)
         {
             return i;
         }
@@ -105,14 +176,14 @@ static int get_fmt(const acam_camera_t *cam, int *value)
     fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     fmt.fmt.pix.field = V4L2_FIELD_NONE;
 
-    if (-1 == ioctl(cam->fd, VIDIOC_G_FMT, &fmt))
+    if (-1 == xioctl(cam, VIDIOC_G_FMT, &fmt))
     {
         DEBUG_PERROR("Getting Pixel Format"); // IOCTL failed
         return errno;
     }
 
-    int ret = get_acam_fmt_tag(fmt.fmt.pix.pixelformat, fmt.fmt.pix.height);
-    if (ret == -1)
+    int ret = get_acam_fmt_tag(fmt.fmt.pix.pixelformat, fmt.fmt.pix.width, fmt.fmt.pix.height);
+    if (ret == __ACAM_FMT_INVALID)
     {
         DEBUG_PRINT(stderr, "Invalid pixel format detected for ARDUCAM.\n");
         return EBADFD; // The pixel format received by the IOCTL was not supported by Arducam
@@ -128,23 +199,56 @@ static int get_fmt(const acam_camera_t *cam, int *value)
  * NOT threadsafe -- undefined behavior arises when this function runs concurrently with
  * acam_capture_image and acam_create_buffer.
  *
+ * Does nothing if the shadow cache says the camera already uses @param acam_fmt_tag.
+ *
  * @param cam pointer to a cam struct
  * @param acam_fmt_tag ENUM for camera format to which the camera will be set
- * @return exit status. 0 on success, errno on IOCTL failure.
+ * @return exit status. 0 on success, errno on IOCTL failure, EINVAL for an unknown format.
+ */
+static int set_fmt(acam_camera_t *cam, acam_fmt_t acam_fmt_tag)
+{
+    assert(cam);
+
+    if ((int)acam_fmt_tag < 0 || acam_fmt_tag >= __ACAM_FMT_COUNT)
+    {
+        return EINVAL;
+    }
+    if (cam->shadow[ACAM_FORMAT] == (int)acam_fmt_tag)
+    {
+        return 0; // already in this format: skip the REQBUFS/S_FMT cycle
+    }
+
+    return apply_format(cam, fmts[acam_fmt_tag].v4l2_pix_fmt, fmts[acam_fmt_tag].width, fmts[acam_fmt_tag].height);
+}
+
+/**
+ * @brief Issues S_FMT for a pixel format and frame size, cycling the requestbuffer
+ * count around it when acam_create_buffer has set one up. Shared by set_fmt and
+ * acam_set_mode.
+ *
+ * @param cam pointer to a cam struct
+ * @param fourcc the V4L2_PIX_FMT code
+ * @param width the frame width
+ * @param height the frame height
+ * @return exit status. 0 on success, errno on IOCTL failure, EBUSY while streaming.
  */
-static int set_fmt(const acam_camera_t *cam, acam_fmt_t acam_fmt_tag)
+static int apply_format(acam_camera_t *cam, uint32_t fourcc, uint32_t width, uint32_t height)
 {
     //before setting a camera's format, we must reset the requestbuffer
     //This enables us to change the format register if we have recently
     //set up a new buffer, else does nothing.
-    assert(cam);
+    if (cam->streaming)
+    {
+        DEBUG_PRINT(stderr, "Cannot change pixel format while streaming.\n");
+        return EBUSY; // the ring was mapped for the current format
+    }
 
     if (cam->stream_on == 1){
         struct v4l2_requestbuffers freebuf = {0};
         freebuf.count = 0;
         freebuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
         freebuf.memory = V4L2_MEMORY_MMAP;
-        if (-1 == xioctl(cam->fd, VIDIOC_REQBUFS, &freebuf))
+        if (-1 == xioctl(cam, VIDIOC_REQBUFS, &freebuf))
         {
             DEBUG_PERROR("Freeing Buffer");
             return errno;
@@ -155,21 +259,24 @@ static int set_fmt(const acam_camera_t *cam, acam_fmt_t acam_fmt_tag)
     struct v4l2_format fmt = {0};
     fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     fmt.fmt.pix.field = V4L2_FIELD_NONE;
-    fmt.fmt.pix.width = fmts[acam_fmt_tag].width;
-    fmt.fmt.pix.height = fmts[acam_fmt_tag].height;
-    fmt.fmt.pix.pixelformat = fmts[acam_fmt_tag].v4l2_pix_fmt;
+    fmt.fmt.pix.width = width;
+    fmt.fmt.pix.height = height;
+    fmt.fmt.pix.pixelformat = fourcc;
 
-    if (-1 == ioctl(cam->fd, VIDIOC_S_FMT, &fmt))
+    if (-1 == xioctl(cam, VIDIOC_S_FMT, &fmt))
     {
         DEBUG_PERROR("Setting Pixel Format");
         return errno;
     }
+    // the driver answers with the mode it actually selected
+    cam->shadow[ACAM_FORMAT] = get_acam_fmt_tag(fmt.fmt.pix.pixelformat, fmt.fmt.pix.width, fmt.fmt.pix.height);
+
     if (cam->stream_on == 1){
             struct v4l2_requestbuffers freebuf = {0};
             freebuf.count = 1;
             freebuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
             freebuf.memory = V4L2_MEMORY_MMAP;
-            if (-1 == xioctl(cam->fd, VIDIOC_REQBUFS, &freebuf))
+            if (-1 == xioctl(cam, VIDIOC_REQBUFS, &freebuf))
             {
                 DEBUG_PERROR("Freeing Buffer");
                 return errno;
@@ -181,694 +288,2406 @@ static int set_fmt(const acam_camera_t *cam, acam_fmt_t acam_fmt_tag)
 }
 
 /**
- * @brief Gets the value of a control.
+ * @brief Layout of the uncompressed formats whose buffer size the mode table
+ * computes itself. Anything else is asked from the driver with TRY_FMT.
  *
- * @param cam a pointer to the cam struct
- * @param ctrl the acam_ctrl_tag ENUM
- * @param value the int into which @param ctrl's value will be passed. If @param ctrl is FORMAT, this will be
- * the number associated with the camera's current format ENUM.
- * @return exit status. 0 on success, errno on IOCTL failure, EBADF if the function retrieved a pixel format
- * not supported by ARDUCAM.
  */
-int acam_get_ctrl(const acam_camera_t *cam, acam_ctrl_tag_t ctrl, int *value)
+static const struct
 {
-    assert(cam && value);
+    uint32_t fourcc;
+    uint32_t stride_bytes; //bytes per pixel of the first plane
+    uint32_t bits; //bits per pixel over all planes
+} packed_layouts[] = {
+    {V4L2_PIX_FMT_YUYV, 2, 16},
+    {V4L2_PIX_FMT_UYVY, 2, 16},
+    {V4L2_PIX_FMT_YVYU, 2, 16},
+    {V4L2_PIX_FMT_VYUY, 2, 16},
+    {V4L2_PIX_FMT_RGB565, 2, 16},
+    {V4L2_PIX_FMT_RGB24, 3, 24},
+    {V4L2_PIX_FMT_BGR24, 3, 24},
+    {V4L2_PIX_FMT_GREY, 1, 8},
+    {V4L2_PIX_FMT_NV12, 1, 12},
+    {V4L2_PIX_FMT_NV21, 1, 12},
+    {V4L2_PIX_FMT_YUV420, 1, 12},
+    {V4L2_PIX_FMT_YVU420, 1, 12},
+};
+#define PACKED_LAYOUT_COUNT (sizeof(packed_layouts) / sizeof(packed_layouts[0]))
 
-    if (ctrl == ACAM_FORMAT)
+/**
+ * @brief Builds the mode table of the camera from VIDIOC_ENUM_FMT,
+ * VIDIOC_ENUM_FRAMESIZES and VIDIOC_ENUM_FRAMEINTERVALS, and sorts it for
+ * acam_find_mode. Stepwise and continuous ranges contribute their smallest and
+ * largest entries. A driver without the enumeration ioctls leaves the table empty.
+ *
+ * @param cam pointer to the cam struct. cam->modes and cam->mode_count are set.
+ * @return exit status. 0 on success, ENOMEM if the table could not be allocated.
+ */
+static int build_modes(acam_camera_t *cam)
+{
+    acam_mode_t *modes = NULL;
+    unsigned int count = 0;
+    unsigned int capacity = 0;
+    int ret = 0;
+
+    struct v4l2_fmtdesc desc = {0};
+    desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    for (desc.index = 0; ret == 0 && xioctl(cam, VIDIOC_ENUM_FMT, &desc) == 0; desc.index++)
     {
-        return get_fmt(cam, value); // format behaves differently from other controls, so we return the result of get_fmt
+        struct v4l2_frmsizeenum size = {0};
+        size.pixel_format = desc.pixelformat;
+        for (size.index = 0; ret == 0 && xioctl(cam, VIDIOC_ENUM_FRAMESIZES, &size) == 0; size.index++)
+        {
+            if (size.type == V4L2_FRMSIZE_TYPE_DISCRETE)
+            {
+                ret = add_size(cam, &desc, size.discrete.width, size.discrete.height, &modes, &count, &capacity);
+                continue;
+            }
+            ret = add_size(cam, &desc, size.stepwise.min_width, size.stepwise.min_height, &modes, &count, &capacity);
+            if (ret == 0)
+                ret = add_size(cam, &desc, size.stepwise.max_width, size.stepwise.max_height, &modes, &count, &capacity);
+            break; // a range is reported once, at index 0
+        }
     }
-
-    // Set up the struct which will receive info from the ioctl
-    struct v4l2_control control = {0};
-    control.id = v4l2_id[ctrl];
-    int ret = ioctl(cam->fd, VIDIOC_G_CTRL, &control);
-
-    if (ret == -1)
+    if (ret != 0)
     {
-        DEBUG_PRINT(stderr, "IOCTL failed for %s: %s\n", cam->ctrls[ctrl].name, strerror(errno));
-        return errno;
+        free(modes);
+        return ret;
     }
-    else
-    {
 
-        *value = control.value;
-        return 0;
-    }
+    qsort(modes, count, sizeof(acam_mode_t), compare_mode);
+    cam->modes = modes;
+    cam->mode_count = count;
+    return 0;
 }
+
 /**
- * @brief Sets the value of a control.
+ * @brief Appends a mode to the table for every frame interval of one frame size.
+ * A size without interval enumeration gets a single mode with a 0/0 interval.
  *
- * @param cam pointer to the cam struct
- * @param ctrl the acam_ctrl_tag ENUM
- * @param value the value to which we will set @param ctrl
- * @return exit status. 0 on success, errno on IOCTL failure.
- * Setting WHITE_BALANCE_TEMPERATURE or EXPOSURE_ABSOLUTE while
- * their respective auto-set functions are on will result in success. Setting
- * a control to a value above/below its upper/lower bounds will result in success and
- * set the control's register to its max/min.
+ * @return exit status. 0 on success, ENOMEM if the table could not grow.
  */
-int acam_set_ctrl(const acam_camera_t *cam, acam_ctrl_tag_t ctrl, int value)
+static int add_size(const acam_camera_t *cam, const struct v4l2_fmtdesc *desc, uint32_t width, uint32_t height,
+                    acam_mode_t **modes, unsigned int *count, unsigned int *capacity)
 {
-    assert(cam);
-
-    if (ctrl == ACAM_FORMAT)
+    acam_mode_t mode = {0};
+    mode.fourcc = desc->pixelformat;
+    mode.width = width;
+    mode.height = height;
+    if (fill_mode(cam, desc, &mode) != 0)
     {
-        return set_fmt(cam, value); // setting pixel format behaves differently from other controls
+        return 0; // the driver rejects this size; leave it out of the table
     }
 
-    // set up struct which will be read into the camera register by ioctl
-    struct v4l2_control control = {0};
-    control.id = v4l2_id[ctrl];
-    control.value = value;
-
-    // begin checking for edge cases
-    if (ctrl == ACAM_WHITE_BALANCE_TEMPERATURE)
+    struct v4l2_frmivalenum ival = {0};
+    ival.pixel_format = desc->pixelformat;
+    ival.width = width;
+    ival.height = height;
+    for (ival.index = 0; xioctl(cam, VIDIOC_ENUM_FRAMEINTERVALS, &ival) == 0; ival.index++)
     {
-        int value;
-        acam_get_ctrl(cam, ACAM_AUTO_WHITE_BALANCE, &value);
-        if (value == 1)
-            return 0; // Still report this as a success
-        // DEBUG_PRINT(stderr, "Cannot set WHITE_BALANCE_TEMPERATURE while AUTO_WHITE_BALANCE is on. Set WHITE_BALANCE to 0 to adjust WHITE_BALANCE_TEMPERATURE\n");
+        if (ival.type == V4L2_FRMIVAL_TYPE_DISCRETE)
+        {
+            mode.interval = ival.discrete;
+            int ret = append_mode(&mode, modes, count, capacity);
+            if (ret != 0)
+                return ret;
+            continue;
+        }
+        mode.interval = ival.stepwise.min;
+        int ret = append_mode(&mode, modes, count, capacity);
+        if (ret != 0)
+            return ret;
+        mode.interval = ival.stepwise.max;
+        return append_mode(&mode, modes, count, capacity);
     }
 
-    if (ctrl == ACAM_EXPOSURE_ABSOLUTE)
+    if (ival.index == 0)
     {
-        int value;
-        acam_get_ctrl(cam, ACAM_EXPOSURE_AUTO, &value);
-        if (value == 3)
-            return 0; // Still report this as a success
-        // DEBUG_PRINT(stderr, "Cannot set EXPOSURE_ABSOLUTE while EXPOSURE_AUTO is set to 3. Set EXPOSURE_AUTO to 1 to adjust exposure.\n");
+        return append_mode(&mode, modes, count, capacity);
     }
+    return 0;
+}
 
-    // Do the ioctl to the camera to set the control
-    int ret = ioctl(cam->fd, VIDIOC_S_CTRL, &control); // set camera's control value to @param value
-    if (ret == -1)
-    {
-        DEBUG_PRINT(stderr, "IOCTL failed for %s: %s\n", cam->ctrls[ctrl].name, strerror(errno));
-        return errno;
-    }
-    else
+/**
+ * @brief Appends one entry to a growing mode table.
+ *
+ * @return exit status. 0 on success, ENOMEM if the table could not grow.
+ */
+static int append_mode(const acam_mode_t *mode, acam_mode_t **modes, unsigned int *count, unsigned int *capacity)
+{
+    if (*count == *capacity)
     {
-
-        if (value < cam->ctrls[ctrl].min_value)
-        {
-            DEBUG_PRINT(stderr, "WARNING: Set value for %s was less than lower bound. %s was automatically set to lower bound: %d\n",
-                        cam->ctrls[ctrl].name, cam->ctrls[ctrl].name, cam->ctrls[ctrl].min_value);
-        }
-
-        else if (value > cam->ctrls[ctrl].max_value)
+        unsigned int grown = *capacity ? *capacity * 2 : 32;
+        acam_mode_t *table = realloc(*modes, grown * sizeof(acam_mode_t));
+        if (table == NULL)
         {
-            DEBUG_PRINT(stderr, "WARNING: Set value for %s exceeds upper bound. %s was automatically set to upper bound: %d\n",
-                        cam->ctrls[ctrl].name, cam->ctrls[ctrl].name, cam->ctrls[ctrl].max_value);
+            return ENOMEM;
         }
-
-        return 0;
+        *modes = table;
+        *capacity = grown;
     }
+    (*modes)[(*count)++] = *mode;
+    return 0;
 }
+
 /**
- * @brief Saves a struct of the camera's current control values
+ * @brief Works out the stride and buffer size of a mode: from packed_layouts for
+ * the common uncompressed formats, as 2 bytes per pixel for compressed formats
+ * (the bound uvcvideo reports for MJPEG), and through TRY_FMT for anything else.
+ * Also links the mode to its acam_fmt_t.
  *
- * @param cam the pointer to the cam struct
- * @param ctrls The struct to which the camera's current control values with be saved.
- * @return exit status. 0 on success, errno on IOCTL failure.
+ * @return exit status. 0 on success, errno if the driver rejects the size.
  */
-int acam_save_struct(const acam_camera_t *cam, acam_ctrls_struct *ctrls)
+static int fill_mode(const acam_camera_t *cam, const struct v4l2_fmtdesc *desc, acam_mode_t *mode)
 {
-    assert(cam && ctrls);
-    for (int i = 0; i < __ACAM_CTRL_COUNT; i++)
+    mode->fmt = get_acam_fmt_tag(mode->fourcc, mode->width, mode->height);
+    mode->compressed = (desc->flags & V4L2_FMT_FLAG_COMPRESSED) != 0;
+    if (mode->compressed)
     {
-        int value;
-        int ret = acam_get_ctrl(cam, i, &value);
-        if (ret != 0)
+        mode->bytesperline = 0;
+        mode->sizeimage = mode->width * mode->height * 2;
+        return 0;
+    }
+
+    for (unsigned int i = 0; i < PACKED_LAYOUT_COUNT; i++)
+    {
+        if (packed_layouts[i].fourcc == mode->fourcc)
         {
-            return ret;
+            mode->bytesperline = mode->width * packed_layouts[i].stride_bytes;
+            mode->sizeimage = mode->width * mode->height * packed_layouts[i].bits / 8;
+            return 0;
         }
+    }
 
-        ctrls->value[i] = value;
+    struct v4l2_format fmt = {0};
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmt.fmt.pix.width = mode->width;
+    fmt.fmt.pix.height = mode->height;
+    fmt.fmt.pix.pixelformat = mode->fourcc;
+    fmt.fmt.pix.field = V4L2_FIELD_NONE;
+    if (-1 == xioctl(cam, VIDIOC_TRY_FMT, &fmt))
+    {
+        return errno;
     }
+    mode->bytesperline = fmt.fmt.pix.bytesperline;
+    mode->sizeimage = fmt.fmt.pix.sizeimage;
     return 0;
 }
 
 /**
- * @brief Saves default values of camera controls to an acam_ctrls_struct.
- *
- * @param cam pointer to the cam struct.
- * @param ctrls the acam_ctrls_struct to which the default values will be saved
+ * @brief Orders modes by format and frame size. See compare_mode.
  */
-void acam_save_default_struct(const acam_camera_t *cam, acam_ctrls_struct *ctrls)
+static int compare_mode_size(const void *a, const void *b)
 {
-    assert(cam && ctrls);
-
-    for (int i = 0; i < __ACAM_CTRL_COUNT; i++)
-    {
-        ctrls->value[i] = cam->ctrls[i].default_val;
-    }
+    const acam_mode_t *x = a;
+    const acam_mode_t *y = b;
+    if (x->fourcc != y->fourcc)
+        return x->fourcc < y->fourcc ? -1 : 1;
+    if (x->width != y->width)
+        return x->width < y->width ? -1 : 1;
+    if (x->height != y->height)
+        return x->height < y->height ? -1 : 1;
+    return 0;
 }
 
 /**
- * @brief Loads values from a acam_ctrls_struct into the camera.
- *
- * @param cam a pointer to a camera struct
- * @param ctrls The struct of camera controls that will be loaded into the camera's control registers.
- * @return exit status. 0 on success, errno on failure.
+ * @brief Orders modes by format, frame size and then frame interval, shortest
+ * interval (highest frame rate) first.
  */
-int acam_load_struct(const acam_camera_t *cam, const acam_ctrls_struct *ctrls)
+static int compare_mode(const void *a, const void *b)
 {
-    assert(cam && ctrls);
-    for (int i = 0; i < __ACAM_CTRL_COUNT; i++)
-    {
-        int value = ctrls->value[i];
-        int ret = acam_set_ctrl(cam, i, value);
-        if (ret != 0)
-        {
-            return ret;
-        }
-    }
+    int ret = compare_mode_size(a, b);
+    if (ret != 0)
+        return ret;
 
+    const acam_mode_t *x = a;
+    const acam_mode_t *y = b;
+    uint64_t lhs = (uint64_t)x->interval.numerator * y->interval.denominator;
+    uint64_t rhs = (uint64_t)y->interval.numerator * x->interval.denominator;
+    if (lhs != rhs)
+        return lhs < rhs ? -1 : 1;
     return 0;
 }
 
 /**
- * @brief Resets a control to its default value
+ * @brief Gets the mode table acam_open built from the driver's format, frame size
+ * and frame interval enumeration. Entries are sorted by fourcc, then width, then
+ * height, then frame interval with the fastest rate first.
  *
- * @param cam a pointer to a cam struct
- * @param ctrl the control value which will be reset
- * @return exit status. 0 on success, errno on IOCTL failure.
+ * @param cam pointer to the cam struct
+ * @param modes set to the table, owned by the camera until acam_close.
+ * @return the number of entries. 0 if the driver does not enumerate its modes.
  */
-int acam_reset_ctrl(const acam_camera_t *cam, acam_ctrl_tag_t ctrl)
+unsigned int acam_get_modes(const acam_camera_t *cam, const acam_mode_t **modes)
 {
+    assert(cam && modes);
 
-    int ret = acam_set_ctrl(cam, ctrl, cam->ctrls[ctrl].default_val);
-
-    return ret;
+    *modes = cam->modes;
+    return cam->mode_count;
 }
 
 /**
- * @brief Resets the camera to its default values
+ * @brief Looks a mode up in the table with a binary search.
  *
- * @param cam a pointer to a cam struct
- * @return exit status. 0 on success, errno on IOCTL failure.
+ * @param cam pointer to the cam struct
+ * @param fourcc the V4L2_PIX_FMT code
+ * @param width the frame width
+ * @param height the frame height
+ * @param interval the frame interval to match exactly (1/30 equals 2/60), or NULL for
+ * the fastest rate of the size.
+ * @return the entry in the camera's table, NULL if the camera has no such mode.
  */
-int acam_reset_all(const acam_camera_t *cam)
+const acam_mode_t *acam_find_mode(const acam_camera_t *cam, uint32_t fourcc, uint32_t width, uint32_t height,
+                                  const struct v4l2_fract *interval)
 {
+    assert(cam);
 
-    for (int i = 0; i < __ACAM_CTRL_COUNT; i++)
+    acam_mode_t key = {0};
+    key.fourcc = fourcc;
+    key.width = width;
+    key.height = height;
+    if (interval != NULL)
     {
-
-        int ret = acam_reset_ctrl(cam, i);
-        if (ret != 0)
-        {
-            return ret;
-        }
+        key.interval = *interval;
+        return bsearch(&key, cam->modes, cam->mode_count, sizeof(acam_mode_t), compare_mode);
     }
 
-    return 0;
+    const acam_mode_t *mode = bsearch(&key, cam->modes, cam->mode_count, sizeof(acam_mode_t), compare_mode_size);
+    while (mode != NULL && mode > cam->modes && compare_mode_size(mode - 1, &key) == 0)
+    {
+        mode--; // the fastest rate sorts first
+    }
+    return mode;
 }
+
 /**
- * @brief Prints a single control's value to the console.
+ * @brief Sets the camera's pixel format, frame size and frame interval to a mode
+ * from its table. The format is only re-negotiated when it changes. Not threadsafe,
+ * see set_fmt.
  *
- * @param cam Pointer to a cam struct
- * @param ctrl The control to be printed
- * @return exit status. 0 on success, errno on ioctl failure.
+ * @param cam pointer to the cam struct
+ * @param mode an entry of the camera's table, see acam_find_mode.
+ * @return exit status. 0 on success, errno on IOCTL failure, EBUSY while streaming.
  */
-int acam_print_ctrl(const acam_camera_t *cam, acam_ctrl_tag_t ctrl)
+int acam_set_mode(acam_camera_t *cam, const acam_mode_t *mode)
 {
-    assert(cam);
-    int value;
-    int ret = acam_get_ctrl(cam, ctrl, &value);
-    if (ret != 0)
-    {
-        return ret;
-    }
-    if (ctrl != ACAM_FORMAT)
+    assert(cam && mode);
+
+    int ret = 0;
+    if (mode->fmt == __ACAM_FMT_INVALID || cam->shadow[ACAM_FORMAT] != (int)mode->fmt)
     {
-        printf("%s:%d\n", cam->ctrls[ctrl].name, value);
+        ret = apply_format(cam, mode->fourcc, mode->width, mode->height);
     }
-    else
+    if (ret != 0 || mode->interval.numerator == 0)
     {
-        printf("%s:%s_%d_%d\n", cam->ctrls[ctrl].name, fmts[value].name, fmts[value].width, fmts[value].height);
+        return ret;
     }
 
-    return 0;
+    struct v4l2_fract interval = mode->interval;
+    return acam_set_frame_interval(cam, &interval);
 }
 
 /**
- * @brief Prints the camera's controls and their current values
+ * @brief Sets the time between frames with VIDIOC_S_PARM. The driver snaps the
+ * request to an interval the current format and frame size offer.
  *
- * @param cam
- * @return 0 on success, errno on IOCTL failure.
+ * @param cam pointer to the cam struct
+ * @param interval the wanted seconds per frame. On success, set to the interval the
+ * driver selected.
+ * @return exit status. 0 on success, errno on IOCTL failure, EINVAL for a zero
+ * interval, ENOTSUP if the driver has no frame interval setting.
  */
-int acam_print_ctrl_all(const acam_camera_t *cam)
+int acam_set_frame_interval(acam_camera_t *cam, struct v4l2_fract *interval)
 {
-    assert(cam);
-    for (int i = 0; i < __ACAM_CTRL_COUNT; i++)
+    assert(cam && interval);
+
+    if (interval->numerator == 0 || interval->denominator == 0)
     {
-        int ret = acam_print_ctrl(cam, i);
-        if (ret != 0)
-        {
-            return ret;
-        }
+        return EINVAL;
+    }
+
+    struct v4l2_streamparm parm = {0};
+    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    parm.parm.capture.timeperframe = *interval;
+    if (-1 == xioctl(cam, VIDIOC_S_PARM, &parm))
+    {
+        DEBUG_PERROR("Setting Frame Interval");
+        return errno;
+    }
+    if (!(parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME))
+    {
+        return ENOTSUP;
     }
 
+    *interval = parm.parm.capture.timeperframe;
     return 0;
 }
+
 /**
- * @brief prints all of the default values for the camera
+ * @brief Gets the current time between frames with VIDIOC_G_PARM.
  *
  * @param cam pointer to the cam struct
+ * @param interval set to the current seconds per frame.
+ * @return exit status. 0 on success, errno on IOCTL failure, ENOTSUP if the driver
+ * has no frame interval setting.
  */
-void acam_print_defaults(const acam_camera_t *cam)
+int acam_get_frame_interval(const acam_camera_t *cam, struct v4l2_fract *interval)
 {
-    assert(cam);
-    printf("DEFAULTS:\n");
-    for (int i = 0; i < __ACAM_CTRL_COUNT; i++)
+    assert(cam && interval);
+
+    struct v4l2_streamparm parm = {0};
+    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (-1 == xioctl(cam, VIDIOC_G_PARM, &parm))
     {
-        printf("%s:%d\n", cam->ctrls[i].name, cam->ctrls[i].default_val);
+        DEBUG_PERROR("Getting Frame Interval");
+        return errno;
     }
+    if (!(parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME))
+    {
+        return ENOTSUP;
+    }
+
+    *interval = parm.parm.capture.timeperframe;
+    return 0;
 }
 
 /**
- * @brief prints all of the bounds values for the camera
+ * @brief Describes the camera's current format, frame size and frame interval with
+ * VIDIOC_G_FMT and VIDIOC_G_PARM. The stride and buffer size are the driver's.
  *
  * @param cam pointer to the cam struct
+ * @param mode filled with the current mode. Its interval is 0/0 if the driver has no
+ * frame interval setting.
+ * @return exit status. 0 on success, errno on IOCTL failure.
  */
-void acam_print_bounds(const acam_camera_t *cam)
+int acam_get_mode(const acam_camera_t *cam, acam_mode_t *mode)
 {
-    assert(cam);
-    printf("BOUNDS:\n");
-    for (int i = 0; i < __ACAM_CTRL_COUNT - 1; i++)
+    assert(cam && mode);
+
+    struct v4l2_format fmt = {0};
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (-1 == xioctl(cam, VIDIOC_G_FMT, &fmt))
     {
-        printf("%s:[%d,%d]\n", cam->ctrls[i].name, cam->ctrls[i].min_value, cam->ctrls[i].max_value);
+        DEBUG_PERROR("Getting Pixel Format");
+        return errno;
     }
+
+    memset(mode, 0, sizeof(acam_mode_t));
+    mode->fourcc = fmt.fmt.pix.pixelformat;
+    mode->width = fmt.fmt.pix.width;
+    mode->height = fmt.fmt.pix.height;
+    mode->bytesperline = fmt.fmt.pix.bytesperline;
+    mode->sizeimage = fmt.fmt.pix.sizeimage;
+    mode->fmt = get_acam_fmt_tag(mode->fourcc, mode->width, mode->height);
+    const acam_mode_t *entry = acam_find_mode(cam, mode->fourcc, mode->width, mode->height, NULL);
+    mode->compressed = entry != NULL ? entry->compressed : mode->bytesperline == 0;
+
+    int ret = acam_get_frame_interval(cam, &mode->interval);
+    if (ret == ENOTSUP)
+    {
+        mode->interval.numerator = 0;
+        mode->interval.denominator = 0;
+        ret = 0;
+    }
+    return ret;
 }
+
 /**
- * @brief Get the queryctrl object
+ * @brief Reads the value of a control from the device, bypassing the shadow cache.
  *
- * @param cam a pointer to the camera struct
- * @param ctrl The control to be queried.
- * @param query_out The struct to which the queryctrl will be written.
- * @return exit status. 0 on success, errno on IOCTL failure.
+ * @param cam a pointer to the cam struct
+ * @param ctrl the acam_ctrl_tag ENUM
+ * @param value the int into which @param ctrl's value will be passed.
+ * @return exit status. 0 on success, errno on IOCTL failure, EBADFD for an unsupported pixel format,
+ * ENOTSUP if the camera does not have @param ctrl.
  */
-static int get_queryctrl(acam_camera_t *cam, acam_ctrl_tag_t ctrl, struct v4l2_queryctrl *query_out)
+static int read_ctrl_device(const acam_camera_t *cam, acam_ctrl_tag_t ctrl, int *value)
 {
-    assert(cam && query_out);
-
-    // set up the struct to which we will save ioctl output
-    struct v4l2_queryctrl query = {0};
-    query.id = v4l2_id[ctrl];
+    if (ctrl == ACAM_FORMAT)
+    {
+        return get_fmt(cam, value); // format behaves differently from other controls, so we return the result of get_fmt
+    }
+    if (!cam->ctrls[ctrl].supported)
+    {
+        return ENOTSUP;
+    }
 
-    int ret = ioctl(cam->fd, VIDIOC_QUERYCTRL, &query);
+    // Set up the struct which will receive info from the ioctl
+    struct v4l2_control control = {0};
+    control.id = v4l2_id[ctrl];
+    int ret = xioctl(cam, VIDIOC_G_CTRL, &control);
 
     if (ret == -1)
     {
-        DEBUG_PRINT(stderr, "IOCTL failed for %s during camera_boot: %s\n", cam->ctrls[ctrl].name, strerror(errno));
+        DEBUG_PRINT(stderr, "IOCTL failed for %s: %s\n", cam->ctrls[ctrl].name, strerror(errno));
         return errno;
     }
     else
     {
 
-        *query_out = query;
+        *value = control.value;
         return 0;
     }
 }
 
 /**
- * @brief Boots the camera. Initializes the following in the camera struct:
- * cam->fd: the camera's file descriptor.
- * cam->ctrls: The list of controls belonging to the minicam. The control struct includes name and default/min/max values.
- * cam->buffer: The memory map which is used to store bits before they are written to an image file.
- * cam->stream_on: Turns on once a buffer has been requested. Enables format to be changed after creating a buffer,
- * although this is highly discouraged.
+ * @brief Whether the camera itself currently drives a control's value, so the
+ * shadow cache cannot know it: WHITE_BALANCE_TEMPERATURE under auto white balance
+ * and EXPOSURE_ABSOLUTE under auto exposure.
+ */
+static int device_owns_ctrl(const acam_camera_t *cam, acam_ctrl_tag_t ctrl)
+{
+    return (ctrl == ACAM_WHITE_BALANCE_TEMPERATURE && cam->shadow[ACAM_AUTO_WHITE_BALANCE] == 1) ||
+           (ctrl == ACAM_EXPOSURE_ABSOLUTE && cam->shadow[ACAM_EXPOSURE_AUTO] == 3);
+}
+
+/**
+ * @brief Clamps a value to a control's bounds, as the camera does when it is set.
+ */
+static int clamp_ctrl(const acam_camera_t *cam, acam_ctrl_tag_t ctrl, int value)
+{
+    if (ctrl == ACAM_FORMAT)
+        return value;
+    if (value < cam->ctrls[ctrl].min_value)
+        return cam->ctrls[ctrl].min_value;
+    if (value > cam->ctrls[ctrl].max_value)
+        return cam->ctrls[ctrl].max_value;
+    return value;
+}
+
+/**
+ * @brief Gets the value of a control. Values are served from the shadow cache
+ * that acam_open fills and every successful set updates, so this costs no device
+ * round trip. WHITE_BALANCE_TEMPERATURE and EXPOSURE_ABSOLUTE are read from the
+ * device while their auto mode is on, since the camera changes them itself.
+ * Use acam_read_ctrl to force a device read.
  *
- * @param cam_file the string for the file name of the camera. Usually one of the video files in the /dev mount.
- * @param error Pointer to an integer which will store the error number on failure.
- * On function exit, @param error will be errno on file open/ioctl failure.
- * @return Pointer to cam struct for @param cam_file on success, NULL on failure.
+ * @param cam a pointer to the cam struct
+ * @param ctrl the acam_ctrl_tag ENUM
+ * @param value the int into which @param ctrl's value will be passed. If @param ctrl is FORMAT, this will be
+ * the number associated with the camera's current format ENUM.
+ * @return exit status. 0 on success, errno on IOCTL failure, EBADF if the function retrieved a pixel format
+ * not supported by ARDUCAM, ENOTSUP if the camera does not have @param ctrl.
  */
-acam_camera_t *acam_open(const char *cam_file, int *error)
+int acam_get_ctrl(const acam_camera_t *cam, acam_ctrl_tag_t ctrl, int *value)
 {
-    assert(cam_file && error);
+    assert(cam && value);
 
-    // attempt to open file descriptor for camera
-    int fd = open(cam_file, O_RDWR | O_NONBLOCK, 0);
-    if (fd == -1)
+    if (!cam->ctrls[ctrl].supported)
     {
-        DEBUG_PERROR("Opening camera file");
-        *error = errno;
-        return NULL;
+        return ENOTSUP;
     }
-    // malloc our camera struct
-    acam_camera_t *cam = malloc(sizeof(acam_camera_t));
-    if (cam == NULL)
+    if (device_owns_ctrl(cam, ctrl) || (ctrl == ACAM_FORMAT && cam->shadow[ACAM_FORMAT] == __ACAM_FMT_INVALID))
     {
-        DEBUG_PERROR("Failed to malloc for camera struct");
-        *error = errno;
-        return NULL;
+        return read_ctrl_device(cam, ctrl, value);
     }
-    // set our camera's file descriptor
-    cam->fd = fd;
 
-    // set up the default values, bounds, and names of our camera's controls
-    for (int i = 0; i < __ACAM_CTRL_COUNT - 1; i++)
+    *value = cam->shadow[ctrl];
+    return 0;
+}
+
+/**
+ * @brief Reads the value of a control from the device and refreshes its entry in
+ * the shadow cache.
+ *
+ * @param cam a pointer to the cam struct
+ * @param ctrl the acam_ctrl_tag ENUM
+ * @param value the int into which @param ctrl's value will be passed.
+ * @return exit status. 0 on success, errno on IOCTL failure, EBADF if the function retrieved a pixel format
+ * not supported by ARDUCAM, ENOTSUP if the camera does not have @param ctrl.
+ */
+int acam_read_ctrl(acam_camera_t *cam, acam_ctrl_tag_t ctrl, int *value)
+{
+    assert(cam && value);
+
+    int ret = read_ctrl_device(cam, ctrl, value);
+    if (ret == 0)
     {
-        struct v4l2_queryctrl query;
-        int ret = get_queryctrl(cam, i, &query);
+        cam->shadow[ctrl] = *value;
+    }
+    return ret;
+}
 
-        if (ret != 0)
-        {
-            *error = ret;
-            return NULL;
-        }
-        strcpy(cam->ctrls[i].name, (char *)query.name);
-        cam->ctrls[i].v4l2_id = query.id;
-        cam->ctrls[i].max_value = query.maximum;
-        cam->ctrls[i].min_value = query.minimum;
-        cam->ctrls[i].default_val = query.default_value;
+/**
+ * @brief Re-reads every control and the format from the device into the shadow cache.
+ * Needed only if something other than this library changes the camera's settings.
+ *
+ * @param cam a pointer to the cam struct
+ * @return exit status. 0 on success, errno on IOCTL failure.
+ */
+int acam_refresh_ctrls(acam_camera_t *cam)
+{
+    assert(cam);
+
+    acam_ctrls_struct ctrls;
+    int ret = acam_get_ctrl_batch(cam, &ctrls);
+    if (ret != 0)
+    {
+        return ret;
     }
-    strcpy(cam->ctrls[ACAM_FORMAT].name, "Format");
-    cam->ctrls[ACAM_FORMAT].default_val = ACAM_MJPEG_1920_1080;
-    cam->stream_on = 0;
+    memcpy(cam->shadow, ctrls.value, sizeof(int) * ACAM_FORMAT);
 
-    return cam;
+    ret = get_fmt(cam, &cam->shadow[ACAM_FORMAT]);
+    if (ret == EBADFD)
+    {
+        cam->shadow[ACAM_FORMAT] = __ACAM_FMT_INVALID; // not one of our modes; the next set_fmt will fix it
+        return 0;
+    }
+    return ret;
 }
 
 /**
- * @brief Deallocates the memory used for the camera and closes the camera's file descriptor.
+ * @brief Sets the value of a control.
  *
- * @param cam the pointer to the camera structure.
- * @return exit status. 0 on success, errno on failure
+ * @param cam pointer to the cam struct
+ * @param ctrl the acam_ctrl_tag ENUM
+ * @param value the value to which we will set @param ctrl
+ * @return exit status. 0 on success, errno on IOCTL failure, ENOTSUP if the camera does
+ * not have @param ctrl.
+ * Setting WHITE_BALANCE_TEMPERATURE or EXPOSURE_ABSOLUTE while
+ * their respective auto-set functions are on will result in success. Setting
+ * a control to a value above/below its upper/lower bounds will result in success and
+ * set the control's register to its max/min. On success the shadow cache holds the
+ * value the camera ended up with.
  */
-int acam_close(acam_camera_t *cam)
+int acam_set_ctrl(acam_camera_t *cam, acam_ctrl_tag_t ctrl, int value)
 {
-
     assert(cam);
-    //make sure that we reset requestbuffer to 0.
-    struct v4l2_requestbuffers freebuf = {0};
-    freebuf.count = 0;
-    freebuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    freebuf.memory = V4L2_MEMORY_MMAP;
-    if (-1 == xioctl(cam->fd, VIDIOC_REQBUFS, &freebuf))
+
+    if (ctrl == ACAM_FORMAT)
     {
-        DEBUG_PERROR("Freeing Buffer");
-        return errno;
+        return set_fmt(cam, value); // setting pixel format behaves differently from other controls
+    }
+    if (!cam->ctrls[ctrl].supported)
+    {
+        return ENOTSUP;
+    }
+
+    // set up struct which will be read into the camera register by ioctl
+    struct v4l2_control control = {0};
+    control.id = v4l2_id[ctrl];
+    control.value = value;
+
+    // begin checking for edge cases. The auto modes come from the shadow cache,
+    // so these checks cost no extra round trip.
+    if (ctrl == ACAM_WHITE_BALANCE_TEMPERATURE && cam->shadow[ACAM_AUTO_WHITE_BALANCE] == 1)
+    {
+        return 0; // Still report this as a success
+        // DEBUG_PRINT(stderr, "Cannot set WHITE_BALANCE_TEMPERATURE while AUTO_WHITE_BALANCE is on. Set WHITE_BALANCE to 0 to adjust WHITE_BALANCE_TEMPERATURE\n");
+    }
+
+    if (ctrl == ACAM_EXPOSURE_ABSOLUTE && cam->shadow[ACAM_EXPOSURE_AUTO] == 3)
+    {
+        return 0; // Still report this as a success
+        // DEBUG_PRINT(stderr, "Cannot set EXPOSURE_ABSOLUTE while EXPOSURE_AUTO is set to 3. Set EXPOSURE_AUTO to 1 to adjust exposure.\n");
     }
 
-    int ret = close(cam->fd);
+    // Do the ioctl to the camera to set the control
+    int ret = xioctl(cam, VIDIOC_S_CTRL, &control); // set camera's control value to @param value
     if (ret == -1)
     {
-        free(cam);
-        DEBUG_PERROR("Closing camera's file descriptor");
+        DEBUG_PRINT(stderr, "IOCTL failed for %s: %s\n", cam->ctrls[ctrl].name, strerror(errno));
         return errno;
     }
-    free(cam);
+    else
+    {
+        warn_bounds(cam, ctrl, value);
+        cam->shadow[ctrl] = clamp_ctrl(cam, ctrl, value);
+        return 0;
+    }
+}
+
+/**
+ * @brief Prints a warning when a control was set outside of its bounds and the
+ * camera clamped it.
+ *
+ * @param cam pointer to the cam struct
+ * @param ctrl the control that was set
+ * @param value the value that was requested
+ */
+static void warn_bounds(const acam_camera_t *cam, acam_ctrl_tag_t ctrl, int value)
+{
+    if (value < cam->ctrls[ctrl].min_value)
+    {
+        DEBUG_PRINT(stderr, "WARNING: Set value for %s was less than lower bound. %s was automatically set to lower bound: %d\n",
+                    cam->ctrls[ctrl].name, cam->ctrls[ctrl].name, cam->ctrls[ctrl].min_value);
+    }
+
+    else if (value > cam->ctrls[ctrl].max_value)
+    {
+        DEBUG_PRINT(stderr, "WARNING: Set value for %s exceeds upper bound. %s was automatically set to upper bound: %d\n",
+                    cam->ctrls[ctrl].name, cam->ctrls[ctrl].name, cam->ctrls[ctrl].max_value);
+    }
+}
+
+/**
+ * @brief Reads every control except FORMAT with a single VIDIOC_G_EXT_CTRLS call.
+ * Falls back to one VIDIOC_G_CTRL per control if the driver rejects the batch.
+ *
+ * @param cam the pointer to the cam struct
+ * @param ctrls The struct to which the camera's current control values will be saved.
+ * ctrls->value[ACAM_FORMAT] is left untouched; controls the camera does not have get their
+ * default value.
+ * @return exit status. 0 on success, errno on IOCTL failure.
+ */
+int acam_get_ctrl_batch(const acam_camera_t *cam, acam_ctrls_struct *ctrls)
+{
+    assert(cam && ctrls);
+
+    struct v4l2_ext_control controls[ACAM_FORMAT] = {{0}};
+    int tags[ACAM_FORMAT];
+    unsigned int count = 0;
+    for (int i = 0; i < ACAM_FORMAT; i++)
+    {
+        ctrls->value[i] = cam->ctrls[i].default_val;
+        if (cam->ctrls[i].supported)
+        {
+            controls[count].id = v4l2_id[i];
+            tags[count++] = i;
+        }
+    }
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    struct v4l2_ext_controls batch = {0};
+    batch.which = V4L2_CTRL_WHICH_CUR_VAL;
+    batch.count = count;
+    batch.controls = controls;
+    if (0 == xioctl(cam, VIDIOC_G_EXT_CTRLS, &batch))
+    {
+        for (unsigned int i = 0; i < count; i++)
+        {
+            ctrls->value[tags[i]] = controls[i].value;
+        }
+        return 0;
+    }
+    DEBUG_PRINT(stderr, "Batched control read rejected (%s), reading controls one by one\n", strerror(errno));
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        int ret = read_ctrl_device(cam, tags[i], &ctrls->value[tags[i]]);
+        if (ret != 0)
+        {
+            return ret;
+        }
+    }
     return 0;
 }
+
 /**
- * @brief Wrapper function for IOCTL. Performs ioctl until definitive success or failure.
- * @return exit status. 0 on success, -1 on failure.
+ * @brief Applies every control except FORMAT with a single VIDIOC_S_EXT_CTRLS call,
+ * so the whole set reaches the camera in one transaction. Only controls that differ
+ * from the shadow cache are sent; nothing is sent if all of them match. Auto modes are
+ * applied before the manual values they govern, and WHITE_BALANCE_TEMPERATURE/EXPOSURE_ABSOLUTE
+ * are left out while @param ctrls turns their auto mode on (as acam_set_ctrl does).
+ * Falls back to one acam_set_ctrl per changed control if the driver rejects the batch.
+ *
+ * @param cam pointer to the cam struct
+ * @param ctrls the values to apply. ctrls->value[ACAM_FORMAT] and the values of controls the
+ * camera does not have are ignored.
+ * @return exit status. 0 on success, errno on IOCTL failure.
  */
-static int xioctl(int fd, int request, void *arg)
+int acam_set_ctrl_batch(acam_camera_t *cam, const acam_ctrls_struct *ctrls)
 {
-    int r;
+    assert(cam && ctrls);
 
-    do
-        r = ioctl(fd, request, arg);
-    while (-1 == r && EINTR == errno);
+    // v4l2_id lists every auto mode ahead of the control it governs, so building the
+    // batch in table order applies AUTO_WHITE_BALANCE and EXPOSURE_AUTO first.
+    struct v4l2_ext_control controls[ACAM_FORMAT] = {{0}};
+    int tags[ACAM_FORMAT];
+    unsigned int count = 0;
+    for (int i = 0; i < ACAM_FORMAT; i++)
+    {
+        if (!cam->ctrls[i].supported)
+            continue;
+        if (i == ACAM_WHITE_BALANCE_TEMPERATURE && ctrls->value[ACAM_AUTO_WHITE_BALANCE] == 1)
+            continue;
+        if (i == ACAM_EXPOSURE_ABSOLUTE && ctrls->value[ACAM_EXPOSURE_AUTO] == 3)
+            continue;
+        // a manual value is resent when its auto mode switches off: the camera moved it meanwhile
+        int released = device_owns_ctrl(cam, i);
+        if (!released && cam->shadow[i] == clamp_ctrl(cam, i, ctrls->value[i]))
+            continue;
+        controls[count].id = v4l2_id[i];
+        controls[count].value = ctrls->value[i];
+        tags[count] = i;
+        count++;
+    }
 
-    return r;
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    struct v4l2_ext_controls batch = {0};
+    batch.which = V4L2_CTRL_WHICH_CUR_VAL;
+    batch.count = count;
+    batch.controls = controls;
+    if (0 == xioctl(cam, VIDIOC_S_EXT_CTRLS, &batch))
+    {
+        for (unsigned int i = 0; i < count; i++)
+        {
+            warn_bounds(cam, tags[i], ctrls->value[tags[i]]);
+            cam->shadow[tags[i]] = clamp_ctrl(cam, tags[i], ctrls->value[tags[i]]);
+        }
+        return 0;
+    }
+    DEBUG_PRINT(stderr, "Batched control write rejected (%s), setting controls one by one\n", strerror(errno));
+
+    // only the entries of the rejected batch: the rest already match the shadow cache
+    for (unsigned int i = 0; i < count; i++)
+    {
+        int ret = acam_set_ctrl(cam, tags[i], controls[i].value);
+        if (ret != 0)
+        {
+            return ret;
+        }
+    }
+    return 0;
 }
 
 /**
- * @brief Prints capabilites of the camera, along with selected
- * recording modes.
+ * @brief Saves a struct of the camera's current control values
  *
- * @param cam the pointer to the camera struct.
- * @return exit status. 0 on success, errno on failure.
+ * @param cam the pointer to the cam struct
+ * @param ctrls The struct to which the camera's current control values with be saved.
+ * @return exit status. 0 on success, errno on IOCTL failure.
  */
-int acam_print_caps(const acam_camera_t *cam)
+int acam_save_struct(const acam_camera_t *cam, acam_ctrls_struct *ctrls)
 {
-    assert(cam != NULL);
-    struct v4l2_capability caps = {0};
-    if (-1 == xioctl(cam->fd, VIDIOC_QUERYCAP, &caps))
+    assert(cam && ctrls);
+    for (int i = 0; i < __ACAM_CTRL_COUNT; i++)
     {
-        DEBUG_PERROR("Querying Capabilities");
-        return errno;
+        if (!cam->ctrls[i].supported)
+        {
+            ctrls->value[i] = cam->ctrls[i].default_val;
+            continue;
+        }
+        int ret = acam_get_ctrl(cam, i, &ctrls->value[i]); // served from the shadow cache
+        if (ret != 0)
+        {
+            return ret;
+        }
     }
+    return 0;
+}
 
-    printf("Driver Caps:\n"
-           "  Driver: \"%s\"\n"
-           "  Card: \"%s\"\n"
-           "  Bus: \"%s\"\n"
-           "  Version: %d.%d\n"
-           "  Capabilities: %08x\n",
-           caps.driver,
-           caps.card,
-           caps.bus_info,
-           (caps.version >> 16) & 0xff,
-           (caps.version >> 24) & 0xff,
-           caps.capabilities);
+/**
+ * @brief Saves default values of camera controls to an acam_ctrls_struct.
+ *
+ * @param cam pointer to the cam struct.
+ * @param ctrls the acam_ctrls_struct to which the default values will be saved
+ */
+void acam_save_default_struct(const acam_camera_t *cam, acam_ctrls_struct *ctrls)
+{
+    assert(cam && ctrls);
+
+    for (int i = 0; i < __ACAM_CTRL_COUNT; i++)
+    {
+        ctrls->value[i] = cam->ctrls[i].default_val;
+    }
+}
+
+/**
+ * @brief Loads values from a acam_ctrls_struct into the camera.
+ *
+ * @param cam a pointer to a camera struct
+ * @param ctrls The struct of camera controls that will be loaded into the camera's control registers.
+ * @return exit status. 0 on success, errno on failure.
+ */
+int acam_load_struct(acam_camera_t *cam, const acam_ctrls_struct *ctrls)
+{
+    assert(cam && ctrls);
+    int ret = acam_set_ctrl_batch(cam, ctrls);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    return acam_set_ctrl(cam, ACAM_FORMAT, ctrls->value[ACAM_FORMAT]);
+}
+
+/**
+ * @brief Resets a control to its default value
+ *
+ * @param cam a pointer to a cam struct
+ * @param ctrl the control value which will be reset
+ * @return exit status. 0 on success, errno on IOCTL failure.
+ */
+int acam_reset_ctrl(acam_camera_t *cam, acam_ctrl_tag_t ctrl)
+{
+
+    int ret = acam_set_ctrl(cam, ctrl, cam->ctrls[ctrl].default_val);
+
+    return ret;
+}
+
+/**
+ * @brief Resets the camera to its default values
+ *
+ * @param cam a pointer to a cam struct
+ * @return exit status. 0 on success, errno on IOCTL failure.
+ */
+int acam_reset_all(acam_camera_t *cam)
+{
+    acam_ctrls_struct defaults;
+    acam_save_default_struct(cam, &defaults);
+
+    return acam_load_struct(cam, &defaults);
+}
+/**
+ * @brief Prints a single control's value to the console.
+ *
+ * @param cam Pointer to a cam struct
+ * @param ctrl The control to be printed
+ * @return exit status. 0 on success, errno on ioctl failure.
+ */
+int acam_print_ctrl(const acam_camera_t *cam, acam_ctrl_tag_t ctrl)
+{
+    assert(cam);
+    int value;
+    int ret = acam_get_ctrl(cam, ctrl, &value);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    if (ctrl != ACAM_FORMAT)
+    {
+        printf("%s:%d\n", cam->ctrls[ctrl].name, value);
+    }
+    else
+    {
+        printf("%s:%s_%d_%d\n", cam->ctrls[ctrl].name, fmts[value].name, fmts[value].width, fmts[value].height);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Prints the camera's controls and their current values
+ *
+ * @param cam
+ * @return 0 on success, errno on IOCTL failure.
+ */
+int acam_print_ctrl_all(const acam_camera_t *cam)
+{
+    assert(cam);
+    for (int i = 0; i < __ACAM_CTRL_COUNT; i++)
+    {
+        if (!cam->ctrls[i].supported)
+        {
+            continue;
+        }
+        int ret = acam_print_ctrl(cam, i);
+        if (ret != 0)
+        {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+/**
+ * @brief prints all of the default values for the camera
+ *
+ * @param cam pointer to the cam struct
+ */
+void acam_print_defaults(const acam_camera_t *cam)
+{
+    assert(cam);
+    printf("DEFAULTS:\n");
+    for (int i = 0; i < __ACAM_CTRL_COUNT; i++)
+    {
+        printf("%s:%d\n", cam->ctrls[i].name, cam->ctrls[i].default_val);
+    }
+}
+
+/**
+ * @brief prints all of the bounds values for the camera
+ *
+ * @param cam pointer to the cam struct
+ */
+void acam_print_bounds(const acam_camera_t *cam)
+{
+    assert(cam);
+    printf("BOUNDS:\n");
+    for (int i = 0; i < __ACAM_CTRL_COUNT - 1; i++)
+    {
+        printf("%s:[%d,%d]\n", cam->ctrls[i].name, cam->ctrls[i].min_value, cam->ctrls[i].max_value);
+    }
+}
+/**
+ * @brief Get the queryctrl object
+ *
+ * @param cam a pointer to the camera struct
+ * @param ctrl The control to be queried.
+ * @param query_out The struct to which the queryctrl will be written.
+ * @return exit status. 0 on success, errno on IOCTL failure.
+ */
+static int get_queryctrl(acam_camera_t *cam, acam_ctrl_tag_t ctrl, struct v4l2_queryctrl *query_out)
+{
+    assert(cam && query_out);
+
+    // set up the struct to which we will save ioctl output
+    struct v4l2_queryctrl query = {0};
+    query.id = v4l2_id[ctrl];
+
+    int ret = xioctl(cam, VIDIOC_QUERYCTRL, &query);
+
+    if (ret == -1)
+    {
+        DEBUG_PRINT(stderr, "IOCTL failed for %s during camera_boot: %s\n", cam->ctrls[ctrl].name, strerror(errno));
+        return errno;
+    }
+    else
+    {
+
+        *query_out = query;
+        return 0;
+    }
+}
+
+/**
+ * @brief Boots the camera. Initializes the following in the camera struct:
+ * cam->fd: the camera's file descriptor.
+ * cam->ctrls: The list of controls belonging to the minicam. The control struct includes name and default/min/max values,
+ * and whether the camera has the control at all.
+ * cam->modes: The formats, frame sizes and frame intervals the camera offers, see acam_get_modes.
+ * Both tables come from the capability cache when acam_set_cache_dir has set one up and it knows the device.
+ * cam->buffer: The memory map which is used to store bits before they are written to an image file.
+ * cam->stream_on: Turns on once a buffer has been requested. Enables format to be changed after creating a buffer,
+ * although this is highly discouraged.
+ *
+ * @param cam_file the string for the file name of the camera. Usually one of the video files in the /dev mount.
+ * Names starting with ACAM_SYNTHETIC_PREFIX open the in-process synthetic camera instead.
+ * @param error Pointer to an integer which will store the error number on failure.
+ * On function exit, @param error will be errno on file open/ioctl failure.
+ * @return Pointer to cam struct for @param cam_file on success, NULL on failure.
+ */
+acam_camera_t *acam_open(const char *cam_file, int *error)
+{
+    assert(cam_file && error);
+
+    if (strncmp(cam_file, ACAM_SYNTHETIC_PREFIX, strlen(ACAM_SYNTHETIC_PREFIX)) == 0)
+    {
+        return acam_open_backend(cam_file, &acam_synthetic_backend, error);
+    }
+
+    return acam_open_backend(cam_file, &acam_v4l2_backend, error);
+}
+
+/**
+ * @brief Boots the camera through a specific device backend. See acam_open.
+ *
+ * @param cam_file the device path handed to @param backend's open function.
+ * @param backend the table of device operations used for every interaction with the camera.
+ * @param error Pointer to an integer which will store the error number on failure.
+ * @return Pointer to cam struct on success, NULL on failure.
+ */
+acam_camera_t *acam_open_backend(const char *cam_file, const acam_backend_t *backend, int *error)
+{
+    assert(cam_file && backend && error);
+
+    // attempt to open file descriptor for camera
+    void *ctx = NULL;
+    int fd = backend->open(cam_file, O_RDWR | O_NONBLOCK, &ctx);
+    if (fd == -1)
+    {
+        DEBUG_PERROR("Opening camera file");
+        *error = errno;
+        return NULL;
+    }
+    // calloc our camera struct
+    acam_camera_t *cam = calloc(1, sizeof(acam_camera_t));
+    if (cam == NULL)
+    {
+        DEBUG_PERROR("Failed to malloc for camera struct");
+        *error = errno;
+        backend->close(ctx, fd);
+        return NULL;
+    }
+    int ret = ENOMEM;
+    cam->track = calloc(1, sizeof(struct acam_stream_track));
+    if (cam->track == NULL)
+    {
+        goto fail;
+    }
+    // set our camera's file descriptor
+    cam->fd = fd;
+    cam->backend = backend;
+    cam->backend_ctx = ctx;
+
+    // set up the default values, bounds, and names of our camera's controls and its
+    // mode table, from the capability cache if it knows this device
+    struct v4l2_capability cap = {0};
+    int identified = acam_capcache_enabled() && xioctl(cam, VIDIOC_QUERYCAP, &cap) == 0;
+    if (!identified || acam_capcache_load(&cap, cam) != 0)
+    {
+        query_ctrls(cam);
+        ret = build_modes(cam);
+        if (ret != 0)
+        {
+            goto fail;
+        }
+        if (identified && acam_capcache_store(&cap, cam) != 0)
+        {
+            DEBUG_PRINT(stderr, "Could not save the capabilities of %s\n", cam_file); // next open queries again
+        }
+    }
+    strcpy(cam->ctrls[ACAM_FORMAT].name, "Format");
+    cam->ctrls[ACAM_FORMAT].default_val = ACAM_MJPEG_1920_1080;
+    cam->ctrls[ACAM_FORMAT].supported = 1;
+    cam->stream_on = 0;
+    cam->streaming = 0;
+    cam->ring_count = 0;
+    cam->ring = NULL;
+    cam->frames = NULL;
+    cam->memory = V4L2_MEMORY_MMAP;
+    cam->pool = NULL;
+
+    // fill the shadow cache that control reads are served from
+    ret = acam_refresh_ctrls(cam);
+    if (ret != 0)
+    {
+        goto fail;
+    }
+
+    return cam;
+
+fail:
+    free(cam->modes);
+    free(cam->track);
+    free(cam);
+    backend->close(ctx, fd);
+    *error = ret;
+    return NULL;
+}
+
+/**
+ * @brief Fills the table of control bounds and defaults, walking the camera's controls
+ * in one pass with V4L2_CTRL_FLAG_NEXT_CTRL. Drivers without the flag are asked control
+ * by control instead. Controls the camera does not have, or has disabled, are marked
+ * unsupported rather than failing the open.
+ *
+ * @param cam pointer to the cam struct being opened.
+ */
+static void query_ctrls(acam_camera_t *cam)
+{
+    for (int i = 0; i < ACAM_FORMAT; i++)
+    {
+        memset(&cam->ctrls[i], 0, sizeof(acam_ctrl_t));
+        strcpy(cam->ctrls[i].name, ctrl_names[i]);
+        cam->ctrls[i].v4l2_id = v4l2_id[i];
+    }
+
+    struct v4l2_queryctrl query = {0};
+    query.id = V4L2_CTRL_FLAG_NEXT_CTRL;
+    unsigned int listed = 0;
+    while (0 == xioctl(cam, VIDIOC_QUERYCTRL, &query))
+    {
+        store_queryctrl(cam, &query);
+        query.id |= V4L2_CTRL_FLAG_NEXT_CTRL;
+        listed++;
+    }
+    if (listed > 0)
+    {
+        return;
+    }
+
+    for (int i = 0; i < ACAM_FORMAT; i++)
+    {
+        if (get_queryctrl(cam, i, &query) == 0)
+        {
+            store_queryctrl(cam, &query);
+        }
+    }
+}
+
+/**
+ * @brief Records the bounds and default of a queried control if it is one of ours.
+ */
+static void store_queryctrl(acam_camera_t *cam, const struct v4l2_queryctrl *query)
+{
+    for (int i = 0; i < ACAM_FORMAT; i++)
+    {
+        if ((uint32_t)v4l2_id[i] == query->id && !(query->flags & V4L2_CTRL_FLAG_DISABLED))
+        {
+            snprintf(cam->ctrls[i].name, sizeof(cam->ctrls[i].name), "%.*s", (int)sizeof(query->name), (const char *)query->name);
+            cam->ctrls[i].max_value = query->maximum;
+            cam->ctrls[i].min_value = query->minimum;
+            cam->ctrls[i].default_val = query->default_value;
+            cam->ctrls[i].supported = 1;
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Deallocates the memory used for the camera and closes the camera's file descriptor.
+ * A running stream is stopped first, so every frame handle must have been released.
+ *
+ * @param cam the pointer to the camera structure.
+ * @return exit status. 0 on success, errno on failure
+ */
+int acam_close(acam_camera_t *cam)
+{
+
+    assert(cam);
+    if (cam->streaming)
+    {
+        int ret = acam_stream_stop(cam);
+        if (ret != 0)
+        {
+            return ret;
+        }
+    }
+    //make sure that we reset requestbuffer to 0.
+    struct v4l2_requestbuffers freebuf = {0};
+    freebuf.count = 0;
+    freebuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    freebuf.memory = V4L2_MEMORY_MMAP;
+    if (-1 == xioctl(cam, VIDIOC_REQBUFS, &freebuf))
+    {
+        DEBUG_PERROR("Freeing Buffer");
+        return errno;
+    }
+
+    free(cam->track);
+    free(cam->modes);
+    int ret = cam->backend->close(cam->backend_ctx, cam->fd);
+    if (ret == -1)
+    {
+        free(cam);
+        DEBUG_PERROR("Closing camera's file descriptor");
+        return errno;
+    }
+    free(cam);
+    return 0;
+}
+/**
+ * @brief Wrapper function for IOCTL. Performs ioctl through the camera's backend
+ * until definitive success or failure.
+ * @return exit status. 0 on success, -1 on failure.
+ */
+static int xioctl(const acam_camera_t *cam, unsigned long request, void *arg)
+{
+    if (ACAM_TRACING())
+    {
+        return acam_trace_ioctl(cam, request, arg);
+    }
+
+    int r;
+
+    do
+        r = cam->backend->ioctl(cam->backend_ctx, cam->fd, request, arg);
+    while (-1 == r && EINTR == errno);
+
+    return r;
+}
+
+/**
+ * @brief Maps a driver buffer into the process through the camera's backend.
+ *
+ * @return the mapping, MAP_FAILED on failure (errno is set).
+ */
+static void *map_buffer(const acam_camera_t *cam, size_t length, off_t offset)
+{
+    if (ACAM_TRACING())
+    {
+        return acam_trace_mmap(cam, length, PROT_READ | PROT_WRITE, MAP_SHARED, offset);
+    }
+
+    return cam->backend->mmap(cam->backend_ctx, cam->fd, length, PROT_READ | PROT_WRITE, MAP_SHARED, offset);
+}
+
+/**
+ * @brief Reads the monotonic clock in milliseconds.
+ */
+static int64_t monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Waits until the camera has a filled buffer ready to be dequeued.
+ *
+ * @param cam pointer to the cam struct
+ * @param timeout_ms how long to wait. Negative waits forever.
+ * @return >0 when a frame is ready, 0 on timeout, -1 on failure (errno is set).
+ */
+static int wait_for_frame(const acam_camera_t *cam, int timeout_ms)
+{
+    if (ACAM_TRACING())
+    {
+        return acam_trace_poll(cam, timeout_ms);
+    }
+
+    int r;
+
+    do
+        r = cam->backend->poll(cam->backend_ctx, cam->fd, timeout_ms);
+    while (-1 == r && EINTR == errno);
+
+    return r;
+}
+
+static int v4l2_open(const char *cam_file, int flags, void **ctx)
+{
+    *ctx = NULL;
+    return open(cam_file, flags, 0);
+}
+
+static int v4l2_close(void *ctx, int fd)
+{
+    (void)ctx;
+    return close(fd);
+}
+
+static int v4l2_ioctl(void *ctx, int fd, unsigned long request, void *arg)
+{
+    (void)ctx;
+    return ioctl(fd, request, arg);
+}
+
+static void *v4l2_mmap(void *ctx, int fd, size_t length, int prot, int flags, off_t offset)
+{
+    (void)ctx;
+    return mmap(NULL, length, prot, flags, fd, offset);
+}
+
+static int v4l2_poll(void *ctx, int fd, int timeout_ms)
+{
+    (void)ctx;
+    struct pollfd pfd = {0};
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, timeout_ms);
+}
+
+const acam_backend_t acam_v4l2_backend = {
+    "v4l2",
+    v4l2_open,
+    v4l2_close,
+    v4l2_ioctl,
+    v4l2_mmap,
+    v4l2_poll,
+};
+
+/**
+ * @brief Prints capabilites of the camera, along with selected
+ * recording modes.
+ *
+ * @param cam the pointer to the camera struct.
+ * @return exit status. 0 on success, errno on failure.
+ */
+int acam_print_caps(const acam_camera_t *cam)
+{
+    assert(cam != NULL);
+    struct v4l2_capability caps = {0};
+    if (-1 == xioctl(cam, VIDIOC_QUERYCAP, &caps))
+    {
+        DEBUG_PERROR("Querying Capabilities");
+        return errno;
+    }
+
+    printf("Driver Caps:\n"
+           "  Driver: \"%s\"\n"
+           "  Card: \"%s\"\n"
+           "  Bus: \"%s\"\n"
+           "  Version: %d.%d\n"
+           "  Capabilities: %08x\n",
+           caps.driver,
+           caps.card,
+           caps.bus_info,
+           (caps.version >> 16) & 0xff,
+           (caps.version >> 24) & 0xff,
+           caps.capabilities);
+
+    struct v4l2_cropcap cropcap = {0};
+    cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (-1 == xioctl(cam, VIDIOC_CROPCAP, &cropcap))
+    {
+        DEBUG_PERROR("Querying Cropping Capabilities");
+        return errno;
+    }
+
+    printf("Camera Cropping:\n"
+           "  Bounds: %dx%d+%d+%d\n"
+           "  Default: %dx%d+%d+%d\n"
+           "  Aspect: %d/%d\n",
+           cropcap.bounds.width, cropcap.bounds.height, cropcap.bounds.left, cropcap.bounds.top,
+           cropcap.defrect.width, cropcap.defrect.height, cropcap.defrect.left, cropcap.defrect.top,
+           cropcap.pixelaspect.numerator, cropcap.pixelaspect.denominator);
+
+    struct v4l2_fmtdesc fmtdesc = {0};
+    fmtdesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    char fourcc[5] = {0};
+    char c, e;
+    printf("  FMT : CE Desc\n--------------------\n");
+    while (0 == xioctl(cam, VIDIOC_ENUM_FMT, &fmtdesc))
+    {
+        strncpy(fourcc, (char *)&fmtdesc.pixelformat, 4);
+        c = fmtdesc.flags & 1 ? 'C' : ' ';
+        e = fmtdesc.flags & 2 ? 'E' : ' ';
+        printf("  %s: %c%c %s\n", fourcc, c, e, fmtdesc.description);
+        fmtdesc.index++;
+    }
+
+    struct v4l2_format fmt = {0};
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmt.fmt.pix.field = V4L2_FIELD_NONE;
+
+    if (-1 == xioctl(cam, VIDIOC_G_FMT, &fmt))
+    {
+        DEBUG_PERROR("Getting Pixel Format");
+        return errno;
+    }
+
+    strncpy(fourcc, (char *)&fmt.fmt.pix.pixelformat, 4);
+    printf("Selected Camera Mode:\n"
+           "  Width: %d\n"
+           "  Height: %d\n"
+           "  PixFmt: %s\n"
+           "  Field: %d\n",
+           fmt.fmt.pix.width,
+           fmt.fmt.pix.height,
+           fourcc,
+           fmt.fmt.pix.field);
+    return 0;
+}
+
+/**
+ * @brief Writes an image from the camera to a file. Needs a buffer to have been
+ * created with acam_create_buffer. This buffer must be passed into the function.
+ *
+ * @param cam pointer to the cam struct
+ * @param buffer The acam_buffer_t which will store the image. The image bytes are stored
+ * in buffer->buf.
+ * @return int errno on failure, 0 on success.
+ */
+int acam_write_to_file(const char *file_name, const acam_buffer_t *buffer)
+{
+    assert(file_name && buffer);
+    // write contents of buffer to local file, replacing what was there
+    int outfd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (outfd == -1)
+    {
+        DEBUG_PRINT(stderr, "Problem opening file %s: %s\n", file_name, strerror(errno));
+        return errno;
+    }
+
+    const char *data = buffer->buf;
+    size_t left = buffer->bytes_used;
+    while (left > 0)
+    {
+        ssize_t written = write(outfd, data, left);
+        if (written == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written == -1)
+        {
+            int err = errno;
+            DEBUG_PRINT(stderr, "Problem writing to file %s: %s\n", file_name, strerror(err));
+            close(outfd);
+            return err;
+        }
+        data += written;
+        left -= written;
+    }
+    int ret = close(outfd);
+    if (ret == -1)
+    {
+        DEBUG_PRINT(stderr, "Problem closing file %s: %s\n", file_name, strerror(errno));
+        return errno;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Initializes the buffer that stores bytes captured by the camera. Multiple
+ * buffers exist at any given time.
+ *
+ * @param cam the pointer to the camera object.
+ * @param error keeps track of error code on failure.
+ * @return acam_buffer_t, which stores a buffer calibrated for the camera's
+ * current pixel format/aspect ratio.
+ */
+acam_buffer_t *acam_create_buffer(acam_camera_t *cam, int *error)
+{
+    assert(cam);
+
+    if (cam->streaming)
+    {
+        DEBUG_PRINT(stderr, "Cannot create a buffer while streaming.\n");
+        *error = EBUSY;
+        return NULL;
+    }
+
+    acam_buffer_t *buffer = malloc(sizeof(acam_buffer_t));
+    struct v4l2_requestbuffers req = {0};
+    req.count = 1;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+    if (-1 == xioctl(cam, VIDIOC_REQBUFS, &req))
+    {
+        DEBUG_PERROR("Requesting Buffer");
+        *error = errno;
+        return NULL;
+    }
+
+    cam->stream_on = 1; //is a camera global, but is thread safe
+
+    struct v4l2_buffer qbuf = {0};
+    qbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    qbuf.memory = V4L2_MEMORY_MMAP;
+    qbuf.index = 0;
+
+    if (-1 == xioctl(cam, VIDIOC_QUERYBUF, &qbuf))
+    {
+        DEBUG_PERROR("Querying Buffer");
+        *error = errno;
+        return NULL;
+    }
+    buffer->buf = map_buffer(cam, qbuf.length, qbuf.m.offset);
+    buffer->bytes_used = 0;
+    buffer->length = qbuf.length;
+    buffer->index = 0;
+    if (buffer->buf == MAP_FAILED)
+    {
+        DEBUG_PRINT(stderr, "Error mapping memory");
+        *error =  ENOMEM;
+        return NULL;
+    }
+
+    int ret = acam_capture_image(cam, buffer);
+    if (ret != 0){
+        DEBUG_PRINT(stderr, "Unable to take picture with buffer");
+        *error = ret;
+        return NULL;
+    }
+
+    return buffer;
+}
+
+/**
+ * @brief Captures a single image and writes it to @param buffer
+ *
+ * @param cam the pointer to the camera file
+ * @param buffer The buffer which will store the captured image. Its timestamp, sequence,
+ * field and flags are set from the driver's description of the frame.
+ * @return exit status. 0 on success, errno on ioctl failure, ENOMEM on failure
+ * to map/unmap memory to/from user space, EINVAL if the buffer is of incorrect
+ * size, EBUSY if the camera is streaming.
+ */
+int acam_capture_image(const acam_camera_t *cam, acam_buffer_t *buffer)
+{
+    assert(cam);
+    if (cam->streaming)
+    {
+        DEBUG_PRINT(stderr, "Use acam_stream_dequeue while streaming.\n");
+        return EBUSY; // buffer 0 belongs to the ring
+    }
+    //make sure cam's pixel format matches the buffer's pixel format
+    struct v4l2_buffer qbuf = {0};
+    qbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    qbuf.memory = V4L2_MEMORY_MMAP;
+    qbuf.index = 0;
+
+    if (-1 == xioctl(cam, VIDIOC_QUERYBUF, &qbuf))
+    {
+        DEBUG_PERROR("Querying Buffer");
+        return errno;
+    }
+
+    if (buffer->length != qbuf.length){
+        DEBUG_PRINT(stderr, "buffer is incorrectly formatted for current camera pix format");
+        return EINVAL;
+    }
+    //done checking
+
+    struct v4l2_buffer buf = {0};
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = 0;
+    if (-1 == xioctl(cam, VIDIOC_QBUF, &buf))
+    {
+        DEBUG_PERROR("Query Buffer");
+        return errno;
+    }
+
+    if (-1 == xioctl(cam, VIDIOC_STREAMON, &buf.type))
+    {
+        DEBUG_PERROR("Start Capture");
+        return errno;
+    }
+    cam->track->have_sequence = 0; // sequence numbers restart with every STREAMON
+
+    int r = wait_for_frame(cam, 1000);
+    if (-1 == r)
+    {
+        DEBUG_PERROR("Waiting for Frame");
+        return errno;
+    }
+
+    if (-1 == xioctl(cam, VIDIOC_DQBUF, &buf))
+    {
+        DEBUG_PERROR("Retrieving Frame");
+        return errno;
+    }
+
+    // keep track of how many bytes were used, and of when and how the frame was captured
+    buffer->bytes_used = buf.bytesused;
+    account_frame(cam, &buf, buffer);
+
+    // clear buffers in the camera and turn streaming off
+    if (-1 == xioctl(cam, VIDIOC_STREAMOFF, &buf.type))
+    {
+        DEBUG_PERROR("End Capture");
+        return errno;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Deallocates memory for a buffer created with 
+ * acam_create_buffer.
+ * 
+ * @param buffer The buffer struct to be destroyed
+ * @return errno on munmap failure, 0 on success.
+ */
+int acam_destroy_buffer(acam_buffer_t *buffer)
+{
+    assert(buffer);
+    int ret = munmap(buffer->buf, buffer->length);
+    if (ret != 0)
+    {
+        DEBUG_PRINT(stderr, "Error unmapping memory");
+        return errno;
+    }
+    free(buffer);
+    return 0;
+}
+/**
+ * @brief Unmaps the first @param mapped buffers of the ring and releases the
+ * driver's buffers. Used to unwind acam_stream_start and by acam_stream_stop.
+ *
+ * @param cam pointer to the cam struct
+ * @param mapped the number of ring entries which hold a valid mapping.
+ * @return exit status. 0 on success, errno on munmap/ioctl failure.
+ */
+static int free_ring(acam_camera_t *cam, unsigned int mapped)
+{
+    int ret = 0;
+    for (unsigned int i = 0; i < mapped && cam->memory == V4L2_MEMORY_MMAP; i++)
+    {
+        if (-1 == munmap(cam->ring[i].buf, cam->ring[i].length))
+        {
+            DEBUG_PERROR("Unmapping ring buffer");
+            ret = errno;
+        }
+    }
+    if (cam->frames != NULL)
+    {
+        for (unsigned int i = 0; i < cam->ring_count; i++)
+        {
+            if (cam->frames[i].fd != -1)
+                close(cam->frames[i].fd);
+        }
+    }
+    free(cam->frames);
+    cam->frames = NULL;
+    free(cam->ring);
+    cam->ring = NULL;
+    cam->ring_count = 0;
+    cam->pool = NULL;
+
+    struct v4l2_requestbuffers freebuf = {0};
+    freebuf.count = 0;
+    freebuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    freebuf.memory = cam->memory;
+    if (-1 == xioctl(cam, VIDIOC_REQBUFS, &freebuf))
+    {
+        DEBUG_PERROR("Freeing Buffer");
+        return errno;
+    }
+    cam->stream_on = 0;
+    cam->memory = V4L2_MEMORY_MMAP;
+
+    return ret;
+}
+
+/**
+ * @brief Exports a ring buffer as a DMABUF file descriptor with VIDIOC_EXPBUF.
+ *
+ * @param cam pointer to the cam struct
+ * @param index the V4L2 buffer index to export.
+ * @return the DMABUF fd, or -1 if the driver cannot export buffers.
+ */
+static int export_buffer(const acam_camera_t *cam, unsigned int index)
+{
+    struct v4l2_exportbuffer expbuf = {0};
+    expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    expbuf.index = index;
+    expbuf.flags = O_RDONLY | O_CLOEXEC;
+    if (-1 == xioctl(cam, VIDIOC_EXPBUF, &expbuf))
+    {
+        DEBUG_PRINT(stderr, "Exporting buffer %u: %s\n", index, strerror(errno));
+        return -1;
+    }
+
+    return expbuf.fd;
+}
+
+/**
+ * @brief Requests the ring's buffers, maps (MMAP) or points (USERPTR) a ring entry at
+ * each of them, queues all of them and turns streaming on.
+ *
+ * @param cam pointer to the cam struct
+ * @param count the number of mmap buffers to request. Ignored when @param pool is given.
+ * @param pool the arena to capture into with V4L2_MEMORY_USERPTR, NULL for mmap buffers.
+ * @return exit status. 0 on success, errno on ioctl failure, ENOMEM on failure to map memory.
+ */
+static int start_ring(acam_camera_t *cam, unsigned int count, acam_pool_t *pool)
+{
+    cam->memory = pool ? V4L2_MEMORY_USERPTR : V4L2_MEMORY_MMAP;
+    cam->pool = pool;
+
+    struct v4l2_requestbuffers req = {0};
+    req.count = pool ? pool->count : count;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = cam->memory;
+    if (-1 == xioctl(cam, VIDIOC_REQBUFS, &req))
+    {
+        DEBUG_PERROR("Requesting Buffers");
+        return errno;
+    }
+    cam->stream_on = 1;
+    if (pool && req.count > pool->count)
+    {
+        req.count = pool->count; // the driver wants more buffers than the pool holds; use what we have
+    }
+
+    cam->ring = calloc(req.count, sizeof(acam_buffer_t));
+    cam->frames = calloc(req.count, sizeof(acam_frame_t));
+    if (cam->ring == NULL || cam->frames == NULL || req.count == 0)
+    {
+        DEBUG_PRINT(stderr, "Unable to allocate ring of %u buffers\n", req.count);
+        free_ring(cam, 0);
+        return ENOMEM;
+    }
+    cam->ring_count = req.count;
+    for (unsigned int i = 0; i < req.count; i++)
+    {
+        cam->frames[i].fd = -1; // free_ring closes every exported fd, also when unwinding part way through
+    }
+
+    for (unsigned int i = 0; i < req.count; i++)
+    {
+        struct v4l2_buffer qbuf = {0};
+        qbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        qbuf.memory = cam->memory;
+        qbuf.index = i;
+        cam->frames[i].buffer = &cam->ring[i];
+        cam->frames[i].cam = cam;
+
+        if (pool)
+        {
+            // the driver writes straight into the caller's arena
+            cam->ring[i].buf = pool->base + i * pool->buffer_size;
+            cam->ring[i].length = pool->buffer_size;
+            qbuf.m.userptr = (unsigned long)cam->ring[i].buf;
+            qbuf.length = pool->buffer_size;
+        }
+        else
+        {
+            if (-1 == xioctl(cam, VIDIOC_QUERYBUF, &qbuf))
+            {
+                DEBUG_PERROR("Querying Buffer");
+                int ret = errno;
+                free_ring(cam, i);
+                return ret;
+            }
+
+            void *mem = map_buffer(cam, qbuf.length, qbuf.m.offset);
+            if (mem == MAP_FAILED)
+            {
+                DEBUG_PERROR("Mapping ring buffer");
+                free_ring(cam, i);
+                return ENOMEM;
+            }
+            cam->ring[i].buf = mem;
+            cam->ring[i].length = qbuf.length;
+            cam->frames[i].fd = export_buffer(cam, i);
+        }
+        cam->ring[i].bytes_used = 0;
+        cam->ring[i].index = i;
+
+        if (-1 == xioctl(cam, VIDIOC_QBUF, &qbuf))
+        {
+            DEBUG_PERROR("Queueing Buffer");
+            int ret = errno;
+            free_ring(cam, i + 1);
+            return ret;
+        }
+    }
+
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (-1 == xioctl(cam, VIDIOC_STREAMON, &type))
+    {
+        DEBUG_PERROR("Start Capture");
+        int ret = errno;
+        free_ring(cam, cam->ring_count);
+        return ret;
+    }
+    cam->streaming = 1;
+    cam->track->have_sequence = 0;
+
+    return 0;
+}
+
+/**
+ * @brief Requests a ring of mmap buffers, queues all of them and turns streaming on.
+ * The device stays STREAMON until acam_stream_stop, so frames are delivered at the
+ * sensor's rate instead of paying for a stream start-up per image. While streaming,
+ * acam_capture_image, acam_create_buffer and format changes return EBUSY.
+ *
+ * @param cam pointer to the cam struct
+ * @param count the number of buffers to request. 0 selects ACAM_STREAM_DEFAULT_BUFFERS.
+ * The driver may grant a different number; cam->ring_count holds the granted count.
+ * @return exit status. 0 on success, errno on ioctl failure, ENOMEM on failure to
+ * map memory, EBUSY if the camera is already streaming.
+ */
+int acam_stream_start(acam_camera_t *cam, unsigned int count)
+{
+    assert(cam);
+    if (cam->streaming)
+    {
+        return EBUSY;
+    }
+    if (count == 0)
+    {
+        count = ACAM_STREAM_DEFAULT_BUFFERS;
+    }
+
+    return start_ring(cam, count, NULL);
+}
+
+/**
+ * @brief Starts streaming with V4L2_MEMORY_USERPTR: the driver writes frames straight
+ * into the buffers of @param pool instead of its own mmap buffers. Works like
+ * acam_stream_start otherwise. Frame handles carry no DMABUF fd in this mode.
+ *
+ * @param cam pointer to the cam struct
+ * @param pool a pool from acam_pool_create or acam_pool_wrap whose buffers can hold a
+ * frame of the current format. It must outlive the stream.
+ * @return exit status. 0 on success, errno on ioctl failure, EBUSY if the camera is
+ * already streaming, EINVAL if the pool's buffers are too small for the current format.
+ */
+int acam_stream_start_userptr(acam_camera_t *cam, acam_pool_t *pool)
+{
+    assert(cam && pool);
+    if (cam->streaming)
+    {
+        return EBUSY;
+    }
+
+    uint32_t needed;
+    int ret = get_sizeimage(cam, &needed);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    if (pool->buffer_size < needed)
+    {
+        DEBUG_PRINT(stderr, "Pool buffers hold %zu bytes, the current format needs %u\n", pool->buffer_size, needed);
+        return EINVAL;
+    }
+
+    return start_ring(cam, pool->count, pool);
+}
+
+/**
+ * @brief Gets the buffer size the driver negotiated for the current format.
+ *
+ * @param cam pointer to the cam struct
+ * @param sizeimage set to the negotiated size of one frame in bytes.
+ * @return exit status. 0 on success, errno on IOCTL failure.
+ */
+static int get_sizeimage(const acam_camera_t *cam, uint32_t *sizeimage)
+{
+    struct v4l2_format fmt = {0};
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (-1 == xioctl(cam, VIDIOC_G_FMT, &fmt))
+    {
+        DEBUG_PERROR("Getting Pixel Format");
+        return errno;
+    }
+
+    *sizeimage = fmt.fmt.pix.sizeimage;
+    return 0;
+}
+
+/**
+ * @brief Allocates a capture arena once, sized for @param count frames of the camera's
+ * current format, for use with acam_stream_start_userptr. Each buffer is rounded up to
+ * a page so every frame starts page aligned.
+ *
+ * @param cam pointer to the cam struct. Its format should be set before the pool is created.
+ * @param count the number of buffers in the pool. 0 selects ACAM_STREAM_DEFAULT_BUFFERS.
+ * @param flags ACAM_POOL_HUGEPAGE to back the arena with huge pages (falling back to
+ * transparent huge pages if none are reserved), ACAM_POOL_MLOCK to lock it into RAM.
+ * @param error keeps track of error code on failure.
+ * @return the pool on success, NULL on failure.
+ */
+acam_pool_t *acam_pool_create(const acam_camera_t *cam, unsigned int count, int flags, int *error)
+{
+    assert(cam && error);
+    if (count == 0)
+    {
+        count = ACAM_STREAM_DEFAULT_BUFFERS;
+    }
+
+    uint32_t sizeimage;
+    int ret = get_sizeimage(cam, &sizeimage);
+    if (ret != 0)
+    {
+        *error = ret;
+        return NULL;
+    }
+
+    acam_pool_t *pool = calloc(1, sizeof(acam_pool_t));
+    if (pool == NULL)
+    {
+        *error = ENOMEM;
+        return NULL;
+    }
+    size_t page = getpagesize();
+    pool->buffer_size = (sizeimage + page - 1) / page * page;
+    pool->count = count;
+    pool->size = pool->buffer_size * count;
+    pool->flags = flags;
+    pool->owned = 1;
+
+    void *mem = MAP_FAILED;
+    if (flags & ACAM_POOL_HUGEPAGE)
+    {
+        size_t huge_size = (pool->size + ACAM_HUGEPAGE_SIZE - 1) / ACAM_HUGEPAGE_SIZE * ACAM_HUGEPAGE_SIZE;
+        mem = mmap(NULL, huge_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (mem != MAP_FAILED)
+        {
+            pool->size = huge_size;
+        }
+    }
+    if (mem == MAP_FAILED)
+    {
+        mem = mmap(NULL, pool->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+        {
+            DEBUG_PERROR("Allocating buffer pool");
+            *error = ENOMEM;
+            free(pool);
+            return NULL;
+        }
+        if (flags & ACAM_POOL_HUGEPAGE)
+        {
+            madvise(mem, pool->size, MADV_HUGEPAGE); // no reserved huge pages: ask for transparent ones
+        }
+    }
+    pool->base = mem;
+
+    if (flags & ACAM_POOL_MLOCK)
+    {
+        if (-1 == mlock(pool->base, pool->size))
+        {
+            DEBUG_PERROR("Locking buffer pool");
+            *error = errno;
+            munmap(pool->base, pool->size);
+            free(pool);
+            return NULL;
+        }
+        pool->locked = 1;
+    }
+
+    return pool;
+}
+
+/**
+ * @brief Wraps caller-owned memory as a pool for acam_stream_start_userptr. The memory
+ * is not copied, locked or freed by the library.
+ *
+ * @param mem the start of the caller's arena. Must be page aligned.
+ * @param buffer_size the size of each buffer in bytes. Must be a multiple of the page
+ * size, so every frame starts page aligned.
+ * @param count the number of buffers laid out back to back from @param mem.
+ * @param error keeps track of error code on failure.
+ * @return the pool on success, NULL on failure. @param error is EINVAL for an empty pool,
+ * misaligned memory or a buffer size that is not a whole number of pages.
+ */
+acam_pool_t *acam_pool_wrap(void *mem, size_t buffer_size, unsigned int count, int *error)
+{
+    assert(mem && error);
+    size_t page = getpagesize();
+    if (buffer_size == 0 || count == 0 || (uintptr_t)mem % page != 0 || buffer_size % page != 0 ||
+        buffer_size > SIZE_MAX / count)
+    {
+        DEBUG_PRINT(stderr, "Cannot wrap %u buffers of %zu bytes at %p as a pool\n", count, buffer_size, mem);
+        *error = EINVAL;
+        return NULL;
+    }
 
-    struct v4l2_cropcap cropcap = {0};
-    cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    if (-1 == xioctl(cam->fd, VIDIOC_CROPCAP, &cropcap))
+    acam_pool_t *pool = calloc(1, sizeof(acam_pool_t));
+    if (pool == NULL)
     {
-        DEBUG_PERROR("Querying Cropping Capabilities");
-        return errno;
+        *error = ENOMEM;
+        return NULL;
     }
+    pool->base = mem;
+    pool->buffer_size = buffer_size;
+    pool->count = count;
+    pool->size = buffer_size * count;
 
-    printf("Camera Cropping:\n"
-           "  Bounds: %dx%d+%d+%d\n"
-           "  Default: %dx%d+%d+%d\n"
-           "  Aspect: %d/%d\n",
-           cropcap.bounds.width, cropcap.bounds.height, cropcap.bounds.left, cropcap.bounds.top,
-           cropcap.defrect.width, cropcap.defrect.height, cropcap.defrect.left, cropcap.defrect.top,
-           cropcap.pixelaspect.numerator, cropcap.pixelaspect.denominator);
+    return pool;
+}
 
-    struct v4l2_fmtdesc fmtdesc = {0};
-    fmtdesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    char fourcc[5] = {0};
-    char c, e;
-    printf("  FMT : CE Desc\n--------------------\n");
-    while (0 == xioctl(cam->fd, VIDIOC_ENUM_FMT, &fmtdesc))
+/**
+ * @brief Frees a pool. Memory allocated by acam_pool_create is unlocked and unmapped;
+ * wrapped memory is left to its owner. The pool must not be in use by a stream.
+ *
+ * @param pool the pool to destroy
+ * @return exit status. 0 on success, errno on munmap failure.
+ */
+int acam_pool_destroy(acam_pool_t *pool)
+{
+    assert(pool);
+    int ret = 0;
+    if (pool->owned)
     {
-        strncpy(fourcc, (char *)&fmtdesc.pixelformat, 4);
-        c = fmtdesc.flags & 1 ? 'C' : ' ';
-        e = fmtdesc.flags & 2 ? 'E' : ' ';
-        printf("  %s: %c%c %s\n", fourcc, c, e, fmtdesc.description);
-        fmtdesc.index++;
+        if (pool->locked)
+        {
+            munlock(pool->base, pool->size);
+        }
+        if (-1 == munmap(pool->base, pool->size))
+        {
+            DEBUG_PERROR("Unmapping buffer pool");
+            ret = errno;
+        }
     }
+    free(pool);
 
-    struct v4l2_format fmt = {0};
-    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    fmt.fmt.pix.field = V4L2_FIELD_NONE;
+    return ret;
+}
 
-    if (-1 == xioctl(cam->fd, VIDIOC_G_FMT, &fmt))
+/**
+ * @brief Dequeues one filled buffer from the driver without waiting and records its
+ * metadata in the ring and frame tables.
+ *
+ * @param cam pointer to the cam struct. Must be streaming.
+ * @param buffer set to the ring entry holding the frame.
+ * @return exit status. 0 on success, EAGAIN if no buffer is filled yet, errno on
+ * ioctl failure, EIO if the driver returned a buffer outside the ring.
+ */
+static int dequeue_ready(acam_camera_t *cam, acam_buffer_t **buffer)
+{
+    struct v4l2_buffer buf = {0};
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = cam->memory;
+    if (-1 == xioctl(cam, VIDIOC_DQBUF, &buf))
     {
-        DEBUG_PERROR("Getting Pixel Format");
+        if (errno != EAGAIN)
+        {
+            DEBUG_PERROR("Retrieving Frame");
+        }
         return errno;
     }
 
-    strncpy(fourcc, (char *)&fmt.fmt.pix.pixelformat, 4);
-    printf("Selected Camera Mode:\n"
-           "  Width: %d\n"
-           "  Height: %d\n"
-           "  PixFmt: %s\n"
-           "  Field: %d\n",
-           fmt.fmt.pix.width,
-           fmt.fmt.pix.height,
-           fourcc,
-           fmt.fmt.pix.field);
+    if (buf.index >= cam->ring_count)
+    {
+        DEBUG_PRINT(stderr, "Driver returned unknown buffer index %u\n", buf.index);
+        return EIO;
+    }
+    cam->ring[buf.index].bytes_used = buf.bytesused;
+    *buffer = &cam->ring[buf.index];
+    account_frame(cam, &buf, *buffer);
+
+    acam_frame_t *frame = &cam->frames[buf.index];
+    frame->bytes_used = buf.bytesused;
+    frame->fmt = cam->shadow[ACAM_FORMAT];
+    frame->timestamp = buf.timestamp;
+    frame->sequence = buf.sequence;
+    frame->field = buf.field;
+    frame->flags = buf.flags;
+
     return 0;
 }
 
 /**
- * @brief Writes an image from the camera to a file. Needs a buffer to have been
- * created with acam_create_buffer. This buffer must be passed into the function.
+ * @brief Copies a dequeued buffer's metadata into @param buffer and accounts the frame
+ * in the camera's streaming statistics: sequence gaps, error flags, the smoothed frame
+ * interval, how far this interval strays from it, and how long the frame waited
+ * between capture and dequeue.
  *
  * @param cam pointer to the cam struct
- * @param buffer The acam_buffer_t which will store the image. The image bytes are stored
- * in buffer->buf.
- * @return int errno on failure, 0 on success.
+ * @param buf the v4l2_buffer filled by VIDIOC_DQBUF.
+ * @param buffer the acam buffer holding the frame.
  */
-int acam_write_to_file(const char *file_name, const acam_buffer_t *buffer)
+static void account_frame(const acam_camera_t *cam, const struct v4l2_buffer *buf, acam_buffer_t *buffer)
 {
-    assert(file_name && buffer);
-    // write contents of buffer to local file
-    int outfd = open(file_name, O_RDWR | O_CREAT, 0644);
-    if (outfd == -1)
+    buffer->timestamp = buf->timestamp;
+    buffer->sequence = buf->sequence;
+    buffer->field = buf->field;
+    buffer->flags = buf->flags;
+
+    struct acam_stream_track *track = cam->track;
+    uint32_t gap = track->have_sequence && buf->sequence > track->last_sequence ? buf->sequence - track->last_sequence : 1;
+    if (gap > 1)
     {
-        DEBUG_PRINT(stderr, "Problem opening file %s: %s\n", file_name, strerror(errno));
-        return errno;
+        __atomic_add_fetch(&track->dropped, gap - 1, __ATOMIC_RELAXED);
+    }
+    if (buf->flags & V4L2_BUF_FLAG_ERROR)
+    {
+        __atomic_add_fetch(&track->errors, 1, __ATOMIC_RELAXED);
     }
 
-    int ret = write(outfd, buffer->buf, buffer->bytes_used);
-    if (ret == -1)
+    int64_t ts_us = (int64_t)buf->timestamp.tv_sec * 1000000 + buf->timestamp.tv_usec;
+    if (track->have_sequence && ts_us > track->last_timestamp_us)
     {
-        DEBUG_PRINT(stderr, "Problem writing to file %s: %s\n", file_name, strerror(errno));
-        return errno;
+        // an interval spanning dropped frames is compared with as many smoothed intervals
+        uint64_t interval_ns = (uint64_t)(ts_us - track->last_timestamp_us) * 1000;
+        if (track->interval_ns != 0)
+        {
+            uint64_t expected_ns = track->interval_ns * gap;
+            uint64_t jitter_us = (interval_ns > expected_ns ? interval_ns - expected_ns : expected_ns - interval_ns) / 1000;
+            unsigned int bucket = 0;
+            while (bucket < ACAM_JITTER_BUCKETS - 1 && jitter_us >= (uint64_t)ACAM_JITTER_BUCKET_US << bucket)
+            {
+                bucket++;
+            }
+            __atomic_add_fetch(&track->jitter[bucket], 1, __ATOMIC_RELAXED);
+            if (jitter_us > track->max_jitter_us)
+            {
+                __atomic_store_n(&track->max_jitter_us, jitter_us > UINT32_MAX ? UINT32_MAX : (uint32_t)jitter_us, __ATOMIC_RELAXED);
+            }
+        }
+        interval_ns /= gap;
+        uint64_t smoothed = track->interval_ns == 0 ? interval_ns : track->interval_ns - (track->interval_ns >> STATS_FPS_SHIFT) + (interval_ns >> STATS_FPS_SHIFT);
+        __atomic_store_n(&track->interval_ns, smoothed, __ATOMIC_RELAXED);
     }
-    ret = close(outfd);
-    if (ret == -1)
+
+    if ((buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
     {
-        DEBUG_PRINT(stderr, "Problem closing file %s: %s\n", file_name, strerror(errno));
-        return errno;
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int64_t latency_us = (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000 - ts_us;
+        if (latency_us >= 0)
+        {
+            __atomic_add_fetch(&track->latency_sum_us, latency_us, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&track->latency_frames, 1, __ATOMIC_RELAXED);
+            if (latency_us > track->max_latency_us)
+            {
+                __atomic_store_n(&track->max_latency_us, latency_us > UINT32_MAX ? UINT32_MAX : (uint32_t)latency_us, __ATOMIC_RELAXED);
+            }
+        }
     }
 
-    return 0;
+    track->last_sequence = buf->sequence;
+    track->last_timestamp_us = ts_us;
+    track->have_sequence = 1;
+    __atomic_add_fetch(&track->frames, 1, __ATOMIC_RELAXED);
 }
 
 /**
- * @brief Initializes the buffer that stores bytes captured by the camera. Multiple
- * buffers exist at any given time.
+ * @brief Reads a camera's frame accounting. Every frame dequeued since the camera was
+ * opened or the statistics were reset is counted, however it was dequeued. A steady
+ * rise in dropped frames, error-flagged frames or jitter while the frame rate falls
+ * short of the format's usually means the USB bus is out of bandwidth. Safe to call
+ * from any thread.
  *
- * @param cam the pointer to the camera object.
- * @param error keeps track of error code on failure.
- * @return acam_buffer_t, which stores a buffer calibrated for the camera's
- * current pixel format/aspect ratio.
+ * @param cam pointer to the cam struct
+ * @param stats filled with a snapshot of the counters. fps is 0 until two frames of
+ * one stream have arrived, the latencies are 0 for drivers whose timestamps are not
+ * monotonic.
  */
-acam_buffer_t *acam_create_buffer(acam_camera_t *cam, int *error)
+void acam_get_stream_stats(const acam_camera_t *cam, acam_stream_stats_t *stats)
 {
-    assert(cam);
-
-    acam_buffer_t *buffer = malloc(sizeof(acam_buffer_t));
-    struct v4l2_requestbuffers req = {0};
-    req.count = 1;
-    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    req.memory = V4L2_MEMORY_MMAP;
-    if (-1 == xioctl(cam->fd, VIDIOC_REQBUFS, &req))
+    assert(cam && stats);
+    struct acam_stream_track *track = cam->track;
+    stats->frames = __atomic_load_n(&track->frames, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&track->dropped, __ATOMIC_RELAXED);
+    stats->errors = __atomic_load_n(&track->errors, __ATOMIC_RELAXED);
+    uint64_t interval_ns = __atomic_load_n(&track->interval_ns, __ATOMIC_RELAXED);
+    stats->fps = interval_ns ? 1e9 / interval_ns : 0;
+    for (int i = 0; i < ACAM_JITTER_BUCKETS; i++)
     {
-        DEBUG_PERROR("Requesting Buffer");
-        *error = errno;
-        return NULL;
+        stats->jitter[i] = __atomic_load_n(&track->jitter[i], __ATOMIC_RELAXED);
     }
+    stats->max_jitter_us = __atomic_load_n(&track->max_jitter_us, __ATOMIC_RELAXED);
+    uint64_t latency_frames = __atomic_load_n(&track->latency_frames, __ATOMIC_RELAXED);
+    uint64_t latency_sum_us = __atomic_load_n(&track->latency_sum_us, __ATOMIC_RELAXED);
+    stats->mean_latency_us = latency_frames ? (uint32_t)(latency_sum_us / latency_frames) : 0;
+    stats->max_latency_us = __atomic_load_n(&track->max_latency_us, __ATOMIC_RELAXED);
+}
 
-    cam->stream_on = 1; //is a camera global, but is thread safe
-
-    struct v4l2_buffer qbuf = {0};
-    qbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    qbuf.memory = V4L2_MEMORY_MMAP;
-    qbuf.index = 0;
+/**
+ * @brief Zeroes a camera's frame accounting, for instance after changing the format.
+ * The smoothed frame interval and sequence tracking are kept.
+ *
+ * @param cam pointer to the cam struct
+ */
+void acam_reset_stream_stats(acam_camera_t *cam)
+{
+    assert(cam);
+    struct acam_stream_track *track = cam->track;
+    __atomic_store_n(&track->frames, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&track->dropped, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&track->errors, 0, __ATOMIC_RELAXED);
+    for (int i = 0; i < ACAM_JITTER_BUCKETS; i++)
+    {
+        __atomic_store_n(&track->jitter[i], 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&track->max_jitter_us, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&track->latency_frames, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&track->latency_sum_us, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&track->max_latency_us, 0, __ATOMIC_RELAXED);
+}
 
-    if (-1 == xioctl(cam->fd, VIDIOC_QUERYBUF, &qbuf))
+/**
+ * @brief Waits for the next filled buffer in the ring and hands it to the caller.
+ * The buffer belongs to the caller until it is given back with acam_stream_requeue;
+ * the driver can keep filling the remaining ring buffers in the meantime.
+ *
+ * @param cam pointer to the cam struct
+ * @param buffer set to the ring entry holding the frame. buffer->bytes_used holds the frame size.
+ * @param timeout_ms how long to wait for a frame. Negative waits forever, 0 does not wait.
+ * @return exit status. 0 on success, errno on ioctl/poll failure, ETIMEDOUT if no frame
+ * arrived in time, EINVAL if the camera is not streaming.
+ */
+int acam_stream_dequeue(acam_camera_t *cam, acam_buffer_t **buffer, int timeout_ms)
+{
+    assert(cam && buffer);
+    if (!cam->streaming)
     {
-        DEBUG_PERROR("Querying Buffer");
-        *error = errno;
-        return NULL;
+        return EINVAL;
     }
-    buffer->buf = mmap(NULL, qbuf.length, PROT_READ | PROT_WRITE, MAP_SHARED, cam->fd, qbuf.m.offset);
-    buffer->bytes_used = 0;
-    buffer->length = qbuf.length;
-    if (buffer->buf == NULL)
+
+    int64_t deadline_ms = 0;
+    int ret;
+    while (EAGAIN == (ret = dequeue_ready(cam, buffer)))
     {
-        DEBUG_PRINT(stderr, "Error mapping memory");
-        *error =  ENOMEM;
-        return NULL;
+        // nothing ready yet: wait for the driver to fill a buffer. A wake-up does
+        // not guarantee a frame, so the timeout is measured against a deadline.
+        int remaining = timeout_ms;
+        if (timeout_ms > 0)
+        {
+            if (deadline_ms == 0)
+            {
+                deadline_ms = monotonic_ms() + timeout_ms;
+            }
+            remaining = deadline_ms - monotonic_ms();
+            if (remaining < 0)
+            {
+                remaining = 0;
+            }
+        }
+        int r = remaining == 0 ? 0 : wait_for_frame(cam, remaining);
+        if (-1 == r)
+        {
+            DEBUG_PERROR("Waiting for Frame");
+            return errno;
+        }
+        if (r == 0)
+        {
+            return ETIMEDOUT;
+        }
     }
 
-    int ret = acam_capture_image(cam, buffer);
-    if (ret != 0){
-        DEBUG_PRINT(stderr, "Unable to take picture with buffer");
-        *error = ret;
-        return NULL;
+    return ret;
+}
+
+/**
+ * @brief Takes the next filled buffer from the ring if one is ready, without waiting.
+ * Meant for event loops: wait for the fd from acam_get_fd to become readable, then
+ * call this until it returns EAGAIN. Otherwise works like acam_stream_dequeue.
+ *
+ * @param cam pointer to the cam struct
+ * @param buffer set to the ring entry holding the frame. buffer->bytes_used holds the frame size.
+ * @return exit status. 0 on success, EAGAIN if no frame is ready, errno on ioctl
+ * failure, EINVAL if the camera is not streaming.
+ */
+int acam_stream_try_dequeue(acam_camera_t *cam, acam_buffer_t **buffer)
+{
+    assert(cam && buffer);
+    if (!cam->streaming)
+    {
+        return EINVAL;
     }
 
-    return buffer;
+    return dequeue_ready(cam, buffer);
 }
 
 /**
- * @brief Captures a single image and writes it to @param buffer
+ * @brief Gets the fd to watch for frames with poll, epoll or io_uring. It becomes
+ * readable (POLLIN) when a filled buffer is waiting in the ring. The fd stays owned by
+ * the camera: do not read from, close or change the flags of it.
  *
- * @param cam the pointer to the camera file
- * @param buffer The buffer which will store the captured image.
- * @return exit status. 0 on success, errno on ioctl failure, ENOMEM on failure
- * to map/unmap memory to/from user space, EINVAL if the buffer is of incorrect
- * size.
+ * @param cam pointer to the cam struct
+ * @return the camera's pollable fd.
  */
-int acam_capture_image(const acam_camera_t *cam, acam_buffer_t *buffer)
+int acam_get_fd(const acam_camera_t *cam)
 {
     assert(cam);
-    //make sure cam's pixel format matches the buffer's pixel format
-    struct v4l2_buffer qbuf = {0};
-    qbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    qbuf.memory = V4L2_MEMORY_MMAP;
-    qbuf.index = 0;
+    return cam->fd;
+}
 
-    if (-1 == xioctl(cam->fd, VIDIOC_QUERYBUF, &qbuf))
+/**
+ * @brief Gives a buffer obtained from acam_stream_dequeue back to the driver so
+ * it can be filled again.
+ *
+ * @param cam pointer to the cam struct
+ * @param buffer a ring entry returned by acam_stream_dequeue.
+ * @return exit status. 0 on success, errno on ioctl failure, EINVAL if @param buffer
+ * does not belong to the ring or the camera is not streaming.
+ */
+int acam_stream_requeue(acam_camera_t *cam, acam_buffer_t *buffer)
+{
+    assert(cam && buffer);
+    if (!cam->streaming || buffer < cam->ring || buffer >= cam->ring + cam->ring_count)
     {
-        DEBUG_PERROR("Querying Buffer");
-        return errno;
-    }
-
-    if (buffer->length != qbuf.length){
-        DEBUG_PRINT(stderr, "buffer is incorrectly formatted for current camera pix format");
         return EINVAL;
     }
-    //done checking
 
     struct v4l2_buffer buf = {0};
     buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    buf.memory = V4L2_MEMORY_MMAP;
-    buf.index = 0;
-    if (-1 == xioctl(cam->fd, VIDIOC_QBUF, &buf))
+    buf.memory = cam->memory;
+    buf.index = buffer->index;
+    if (cam->memory == V4L2_MEMORY_USERPTR)
     {
-        DEBUG_PERROR("Query Buffer");
-        return errno;
+        buf.m.userptr = (unsigned long)buffer->buf;
+        buf.length = buffer->length;
     }
-
-    if (-1 == xioctl(cam->fd, VIDIOC_STREAMON, &buf.type))
+    if (-1 == xioctl(cam, VIDIOC_QBUF, &buf))
     {
-        DEBUG_PERROR("Start Capture");
+        DEBUG_PERROR("Queueing Buffer");
         return errno;
     }
 
-    fd_set fds;
-    FD_ZERO(&fds);
-    FD_SET(cam->fd, &fds);
-    struct timeval tv = {0};
-    tv.tv_sec = 1;
-    int r = select(cam->fd + 1, &fds, NULL, NULL, &tv);
-    if (-1 == r)
+    return 0;
+}
+
+/**
+ * @brief Turns streaming off, unmaps the ring and releases the driver's buffers.
+ * Any acam_buffer_t pointers obtained from acam_stream_dequeue become invalid, and
+ * the frame handles are freed: every acam_frame_t must have been released by then,
+ * as a release racing with the stop would requeue into a freed ring.
+ *
+ * @param cam pointer to the cam struct
+ * @return exit status. 0 on success, errno on ioctl/munmap failure, EINVAL if the
+ * camera is not streaming.
+ */
+int acam_stream_stop(acam_camera_t *cam)
+{
+    assert(cam);
+    if (!cam->streaming)
     {
-        DEBUG_PERROR("Waiting for Frame");
-        return errno;
+        return EINVAL;
     }
 
-    if (-1 == xioctl(cam->fd, VIDIOC_DQBUF, &buf))
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (-1 == xioctl(cam, VIDIOC_STREAMOFF, &type))
     {
-        DEBUG_PERROR("Retrieving Frame");
+        DEBUG_PERROR("End Capture");
         return errno;
     }
+    cam->streaming = 0;
 
-    // keep track of how many bytes were used
-    buffer->bytes_used = buf.bytesused;
+    return free_ring(cam, cam->ring_count);
+}
 
-    // clear buffers in the camera and turn streaming off
-    if (-1 == xioctl(cam->fd, VIDIOC_STREAMOFF, &buf.type))
+/**
+ * @brief Waits for the next frame in the ring and returns it as a shared handle.
+ * The handle carries the buffer's DMABUF fd (frame->fd), its size, format, timestamp
+ * and sequence number, and starts with one holder. Pass it on with acam_frame_ref;
+ * the buffer goes back to the driver when the last holder calls acam_frame_release.
+ * All frames must be released before acam_stream_stop.
+ *
+ * @param cam pointer to the cam struct
+ * @param frame set to the handle of the dequeued frame.
+ * @param timeout_ms how long to wait for a frame. Negative waits forever, 0 does not wait.
+ * @return exit status. 0 on success, otherwise as acam_stream_dequeue.
+ */
+int acam_stream_dequeue_frame(acam_camera_t *cam, acam_frame_t **frame, int timeout_ms)
+{
+    assert(cam && frame);
+
+    acam_buffer_t *buffer;
+    int ret = acam_stream_dequeue(cam, &buffer, timeout_ms);
+    if (ret != 0)
     {
-        DEBUG_PERROR("End Capture");
-        return errno;
+        return ret;
     }
 
+    *frame = &cam->frames[buffer->index];
+    __atomic_store_n(&(*frame)->refs, 1, __ATOMIC_RELEASE);
+
     return 0;
 }
 
 /**
- * @brief Deallocates memory for a buffer created with 
- * acam_create_buffer.
- * 
- * @param buffer The buffer struct to be destroyed
- * @return errno on munmap failure, 0 on success.
+ * @brief Takes the next frame from the ring as a shared handle if one is ready,
+ * without waiting. Otherwise works like acam_stream_dequeue_frame.
+ *
+ * @param cam pointer to the cam struct
+ * @param frame set to the handle of the dequeued frame.
+ * @return exit status. 0 on success, otherwise as acam_stream_try_dequeue.
  */
-int acam_destroy_buffer(acam_buffer_t *buffer)
+int acam_stream_try_dequeue_frame(acam_camera_t *cam, acam_frame_t **frame)
 {
-    assert(buffer);
-    int ret = munmap(buffer, buffer->length);
+    assert(cam && frame);
+    acam_buffer_t *buffer;
+    int ret = acam_stream_try_dequeue(cam, &buffer);
     if (ret != 0)
     {
-        return errno;
-        DEBUG_PRINT(stderr, "Error unmapping memory");
+        return ret;
     }
-    free(buffer);
+
+    *frame = &cam->frames[buffer->index];
+    __atomic_store_n(&(*frame)->refs, 1, __ATOMIC_RELEASE);
+
     return 0;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Adds a holder to a frame. Safe to call from any thread while the stream runs.
+ *
+ * @param frame a frame handle from acam_stream_dequeue_frame that the caller holds.
+ */
+void acam_frame_ref(acam_frame_t *frame)
+{
+    assert(frame);
+    __atomic_add_fetch(&frame->refs, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Drops a holder from a frame. When the last holder lets go, the buffer is
+ * requeued so the driver can fill it again. Safe to call from any thread while the stream
+ * runs, but not concurrently with acam_stream_stop or acam_close: the caller must make
+ * sure every holder has released its frames before the stream is stopped.
+ *
+ * @param frame a frame handle from acam_stream_dequeue_frame that the caller holds.
+ * @return exit status. 0 on success, errno on ioctl failure when requeueing.
+ */
+int acam_frame_release(acam_frame_t *frame)
+{
+    assert(frame);
+    if (__atomic_sub_fetch(&frame->refs, 1, __ATOMIC_ACQ_REL) != 0)
+    {
+        return 0;
+    }
+
+    return acam_stream_requeue(frame->cam, frame->buffer);
+}
@@ -15,9 +15,12 @@ extern "C" {
 
 #include <sys/mman.h>
 #include <sys/select.h>
+#include <poll.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <linux/videodev2.h>
 #include <linux/uvcvideo.h>
@@ -42,9 +45,39 @@ typedef struct{
     char *buf;
     uint32_t bytes_used;
     unsigned int length;
+    unsigned int index; //the V4L2 buffer index backing this buffer
+    struct timeval timestamp; //when the driver captured the frame held
+    uint32_t sequence; //the driver's frame counter; gaps are frames it dropped
+    uint32_t field; //enum v4l2_field of the frame
+    uint32_t flags; //V4L2_BUF_FLAG_* of the frame; V4L2_BUF_FLAG_ERROR marks possibly corrupt data
 
 } acam_buffer_t;
 
+//number of buffers used by acam_stream_start when 0 is requested
+#define ACAM_STREAM_DEFAULT_BUFFERS 4
+
+/**
+ * @brief An arena of equally sized capture buffers that the driver writes frames
+ * into directly (V4L2_MEMORY_USERPTR). Created by the library with acam_pool_create,
+ * or wrapped around the caller's memory with acam_pool_wrap.
+ *
+ */
+typedef struct
+{
+    char *base;
+    size_t size; //total size of the arena in bytes
+    size_t buffer_size; //bytes per buffer; buffer i starts at base + i * buffer_size
+    unsigned int count;
+    int flags; //ACAM_POOL_* flags the pool was created with
+    int owned; //1 if the library allocated the arena and frees it in acam_pool_destroy
+    int locked; //1 if the arena is mlock'ed
+
+} acam_pool_t;
+
+#define ACAM_POOL_HUGEPAGE 0x1 //back the arena with huge pages
+#define ACAM_POOL_MLOCK 0x2 //lock the arena into RAM
+#define ACAM_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
 typedef const enum
 {
     ACAM_BRIGHTNESS = 0,
@@ -107,18 +140,579 @@ typedef struct
     int min_value;
     int max_value;
     int default_val;
+    int supported; //0 if the camera does not have the control; getting or setting it returns ENOTSUP
 } acam_ctrl_t;
 
+/**
+ * @brief Table of device operations behind an acam_camera_t. Every device
+ * interaction in the library goes through these, so a camera can be backed by
+ * a real V4L2 node or by an in-process stand-in.
+ * Functions follow the conventions of the system calls they replace: -1 and errno
+ * on failure. Memory returned by mmap must be releasable with munmap(2).
+ *
+ */
+typedef struct
+{
+    const char *name;
+    int (*open)(const char *cam_file, int flags, void **ctx); //returns a pollable fd
+    int (*close)(void *ctx, int fd);
+    int (*ioctl)(void *ctx, int fd, unsigned long request, void *arg);
+    void *(*mmap)(void *ctx, int fd, size_t length, int prot, int flags, off_t offset);
+    int (*poll)(void *ctx, int fd, int timeout_ms); //>0 when a frame is ready, 0 on timeout
+} acam_backend_t;
+
+extern const acam_backend_t acam_v4l2_backend; //talks to /dev/videoN through the kernel
+extern const acam_backend_t acam_synthetic_backend; //in-process fake UB0212, see acam_synthetic.c
+
+//device paths starting with this prefix are opened with acam_synthetic_backend by acam_open
+#define ACAM_SYNTHETIC_PREFIX "synthetic"
+
+struct acam_camera;
+
+/**
+ * @brief A handle to one captured frame of the streaming ring, shared between
+ * any number of holders. The frame is exported as a DMABUF fd so it can be passed
+ * to encoders or other processes without copying. The underlying buffer goes back
+ * to the driver only once every holder has called acam_frame_release. Handles belong to
+ * the stream and are freed by acam_stream_stop, so all of them must be released first.
+ *
+ */
+typedef struct
+{
+    int fd; //DMABUF fd of the buffer, -1 if the driver cannot export. Owned by the camera; dup it to keep it
+    uint32_t bytes_used;
+    acam_fmt_t fmt;
+    struct timeval timestamp;
+    uint32_t sequence;
+    uint32_t field; //enum v4l2_field of the frame
+    uint32_t flags; //V4L2_BUF_FLAG_* of the frame, see acam_buffer_t
+    acam_buffer_t *buffer; //the same memory mapped into this process
+    struct acam_camera *cam;
+    int refs; //number of holders, only touched through acam_frame_ref/acam_frame_release
+
+} acam_frame_t;
+
+/**
+ * @brief How a capture worker hands frames to its consumer, see acam_worker_start.
+ *
+ */
+typedef enum
+{
+    ACAM_WORKER_KEEP_LATEST = 0, //only the newest frame is kept; stale frames are dropped
+    ACAM_WORKER_KEEP_ALL //every frame is kept in order; a slow consumer makes the driver drop frames
+
+} acam_worker_policy_t;
+
+/**
+ * @brief Counters of a capture worker, see acam_worker_get_stats.
+ *
+ */
+typedef struct
+{
+    uint64_t captured; //frames dequeued from the camera
+    uint64_t delivered; //frames taken by consumers
+    uint64_t dropped_stale; //KEEP_LATEST: frames replaced by a newer one before anyone took them
+    uint64_t dropped_device; //frames the driver dropped because no buffer was free (sequence gaps)
+    unsigned int queue_high_water; //KEEP_ALL: most frames waiting for the consumer at once
+
+} acam_worker_stats_t;
+
+typedef struct acam_worker acam_worker_t; //background capture thread of one camera, see acam_worker.c
+
+/**
+ * @brief Counters of one camera in a camera group, see acam_group_get_stats.
+ *
+ */
+typedef struct
+{
+    uint64_t frames; //frames dequeued from the camera
+    uint64_t processed; //frames the callback has finished with
+    uint64_t dropped_device; //frames the driver dropped because no buffer was free (sequence gaps)
+    double fps; //frame rate measured from the driver's timestamps, smoothed over the last few frames
+    int error; //errno that took the camera, or the group's event loop, out of service; 0 while it delivers frames
+
+} acam_group_stats_t;
+
+typedef struct acam_group acam_group_t; //cameras sharing one I/O thread and worker pool, see acam_group.c
+typedef void (*acam_group_frame_cb_t)(acam_frame_t *frame, unsigned int camera, void *user); //runs on a worker for every frame
+
+#define ACAM_MJPEG_MAX_IOV 3
+
+/**
+ * @brief An MJPEG frame described as a standards-compliant JPEG, see acam_mjpeg_prepare.
+ * The pieces point into the frame's buffer, so writing them with writev never copies it.
+ *
+ */
+typedef struct
+{
+    struct iovec iov[ACAM_MJPEG_MAX_IOV];
+    int iovcnt;
+    size_t size; //total bytes of the JPEG
+    unsigned int width; //from the frame header
+    unsigned int height;
+    int flags; //ACAM_MJPEG_* flags describing what was changed
+
+} acam_mjpeg_t;
+
+#define ACAM_MJPEG_DHT_INSERTED 0x1 //the frame had no Huffman tables; the standard ones were spliced in
+#define ACAM_MJPEG_TRIMMED 0x2 //bytes after the EOI were left out
+
+/**
+ * @brief The 1/8-scale image of an MJPEG frame and its luma statistics, see
+ * acam_mjpeg_decode_dc. Each plane has one sample per 8x8 block of its component:
+ * the block's mean, from its DC coefficient.
+ *
+ */
+typedef struct
+{
+    unsigned int width; //frame size in pixels
+    unsigned int height;
+    unsigned int components; //1 for grayscale, 3 for YCbCr
+    unsigned int plane_width[3]; //size of the Y, Cb and Cr planes
+    unsigned int plane_height[3];
+    uint8_t *planes[3]; //the planes inside the caller's memory, rows packed; NULL past components
+    size_t size; //bytes the planes take
+    uint32_t histogram[256]; //of the luma plane
+    double mean; //of the luma plane, 0..255
+    double variance; //of the luma plane
+    double detail; //mean count of non-zero AC coefficients per luma block; rises with texture and focus
+
+} acam_mjpeg_dc_t;
+
+/**
+ * @brief One frame of a burst for acam_mjpeg_decode_dc_burst.
+ *
+ */
+typedef struct
+{
+    const acam_buffer_t *buffer; //the MJPEG frame
+    uint8_t *dst; //memory for its planes
+    size_t dst_size;
+    acam_mjpeg_dc_t result;
+    int error; //exit status of the frame, as acam_mjpeg_decode_dc returns it
+
+} acam_mjpeg_dc_job_t;
+
+/**
+ * @brief Matrix and range a YUYV frame is encoded with, see acam_yuyv_to_rgb24.
+ *
+ */
+typedef enum
+{
+    ACAM_BT601_LIMITED = 0, //SDTV matrix, luma in 16..235. What UVC cameras send unless they say otherwise
+    ACAM_BT601_FULL, //SDTV matrix, luma in 0..255 (JPEG/JFIF)
+    ACAM_BT709_LIMITED, //HDTV matrix, luma in 16..235
+    ACAM_BT709_FULL, //HDTV matrix, luma in 0..255
+
+    __ACAM_COLOR_COUNT
+
+} acam_color_t;
+
+/**
+ * @brief Instruction sets the frame conversion routines can run on, see acam_convert_set_isa.
+ *
+ */
+typedef enum
+{
+    ACAM_ISA_AUTO = 0, //the fastest one the CPU supports
+    ACAM_ISA_SCALAR, //portable C, the reference the others match byte for byte
+    ACAM_ISA_SSE41,
+    ACAM_ISA_AVX2,
+    ACAM_ISA_NEON,
+
+    __ACAM_ISA_COUNT
+
+} acam_isa_t;
+
+/**
+ * @brief How acam_yuyv_scale_rgb24 resamples, see acam_scale_target_t.
+ *
+ */
+typedef enum
+{
+    ACAM_SCALE_BOX = 0, //averages every source pixel an output pixel covers; sharp and alias-free when shrinking
+    ACAM_SCALE_BILINEAR, //blends the four source pixels nearest each output pixel; for small factors and enlarging
+
+    __ACAM_SCALE_FILTER_COUNT
+
+} acam_scale_filter_t;
+
+#define ACAM_SCALE_MAX_TARGETS 8 //output images one acam_yuyv_scale_rgb24 call produces at most
+#define ACAM_SCALE_MAX_BOX_ROWS 256 //source rows a box-filtered output row may average
+
+/**
+ * @brief One output image of acam_yuyv_scale_rgb24: a region of the frame scaled to
+ * packed RGB24 in the caller's memory.
+ *
+ */
+typedef struct
+{
+    unsigned int crop_x; //region of the frame to scale; a crop_width or crop_height of 0 selects the whole frame
+    unsigned int crop_y;
+    unsigned int crop_width;
+    unsigned int crop_height;
+    unsigned int width; //output size in pixels
+    unsigned int height;
+    acam_scale_filter_t filter;
+    uint8_t *dst; //where the image is written, width * height * 3 bytes
+    size_t dst_size;
+
+} acam_scale_target_t;
+
+#define ACAM_STATS_DEFAULT_BLOCK 64 //side of a motion block in pixels
+
+/**
+ * @brief Settings of a statistics pass, see acam_stats_create.
+ *
+ */
+typedef struct
+{
+    unsigned int step; //1, 2, 4 or 8: luma is sampled at every step-th pixel of every step-th row; 0 selects 1
+    unsigned int block; //side of a motion block in pixels, a multiple of 8 * step; 0 selects ACAM_STATS_DEFAULT_BLOCK
+    unsigned int motion_threshold; //change of a block's mean luma, 0..255, above which the block counts as moving
+
+} acam_stats_config_t;
+
+/**
+ * @brief Statistics of one frame, see acam_stats_compute. All of them are taken over
+ * the sampling grid.
+ *
+ */
+typedef struct
+{
+    uint32_t histogram[256]; //sampled luma values
+    uint32_t samples; //luma samples taken, the sum of histogram
+    double mean; //mean luma, 0..255
+    double variance; //variance of the luma
+    double sharpness; //Tenengrad focus score: mean squared Sobel gradient magnitude between neighbouring samples
+    double motion; //mean absolute change of the block means since the previous frame, 0..255
+    uint32_t moving_blocks; //blocks whose mean changed by more than motion_threshold
+    uint32_t blocks; //blocks compared with the previous frame; 0 for the first frame, when there is no motion score
+
+} acam_frame_stats_t;
+
+typedef struct acam_stats acam_stats_t; //statistics pass of one stream, keeps the previous frame's block means
+
+#define ACAM_JPEG_DEFAULT_QUALITY 85
+
+/**
+ * @brief Settings of a YUYV to JPEG encoder, see acam_jpeg_encoder_create.
+ *
+ */
+typedef struct
+{
+    unsigned int quality; //1..100, scaling the Annex K tables as libjpeg does; 0 selects ACAM_JPEG_DEFAULT_QUALITY
+    unsigned int threads; //threads encoding slices, the calling thread included; 0 uses one per online CPU
+    unsigned int restart_rows; //rows of 8 pixels per restart interval, the unit encoded in parallel; 0 picks about four per thread
+    acam_color_t color; //range of the frames; limited-range luma and chroma are stretched to the full range JFIF expects
+
+} acam_jpeg_config_t;
+
+typedef struct acam_jpeg_encoder acam_jpeg_encoder_t; //baseline JPEG encoder for YUYV frames of one size, owns the JPEG it last produced
+
+/**
+ * @brief When an asynchronous writer flushes a written file to the disk, see acam_writer_create.
+ *
+ */
+typedef enum
+{
+    ACAM_WRITER_NO_SYNC = 0, //leave it to the page cache
+    ACAM_WRITER_FDATASYNC, //fdatasync every file before its callback runs
+    ACAM_WRITER_FSYNC //fsync every file, metadata included, before its callback runs
+
+} acam_writer_sync_t;
+
+#define ACAM_WRITER_DIRECT 0x1 //open files with O_DIRECT, bypassing the page cache
+#define ACAM_WRITER_NO_URING 0x2 //write with pwrite even if io_uring is available
+#define ACAM_WRITER_DEFAULT_DEPTH 16
+
+/**
+ * @brief Settings of an asynchronous writer, see acam_writer_create.
+ *
+ */
+typedef struct
+{
+    unsigned int depth; //jobs that can wait at once; 0 selects ACAM_WRITER_DEFAULT_DEPTH
+    acam_writer_sync_t sync;
+    int flags; //ACAM_WRITER_* flags
+
+} acam_writer_config_t;
+
+/**
+ * @brief Counters of an asynchronous writer, see acam_writer_get_stats.
+ *
+ */
+typedef struct
+{
+    uint64_t submitted; //jobs accepted into the queue
+    uint64_t written; //files written and closed successfully
+    uint64_t failed; //jobs whose open, write, sync or close failed
+    uint64_t rejected; //submissions refused with EAGAIN because the queue was full
+    uint64_t bytes; //bytes written successfully
+    unsigned int queue_high_water; //most jobs waiting at once
+
+} acam_writer_stats_t;
+
+typedef struct acam_writer acam_writer_t; //background file writer, see acam_writer.c
+typedef void (*acam_writer_cb_t)(const char *file_name, int error, void *user); //runs on the writer thread when a job is done
+
+#define ACAM_RECORDER_DEFAULT_SEGMENT (1024ull * 1024 * 1024) //bytes per segment file of a recording
+
+typedef struct acam_recorder acam_recorder_t; //appends frames to an indexed recording, see acam_recorder.c
+typedef struct acam_reader acam_reader_t; //reads frames of a recording through mmap
+
+/**
+ * @brief One frame of a recording, see acam_reader_get.
+ *
+ */
+typedef struct
+{
+    const char *data; //the frame's bytes inside the mapped segment
+    uint32_t size;
+    acam_fmt_t fmt;
+    struct timeval timestamp;
+    uint32_t sequence;
+
+} acam_record_t;
+
+#define ACAM_PRETRIGGER_DEFAULT_FRAMES 1024
+#define ACAM_PRETRIGGER_MLOCK 0x1 //lock the ring into RAM
+
+/**
+ * @brief Settings of a pre-trigger ring, see acam_pretrigger_create. Memory is
+ * bounded by ring_bytes; to keep N seconds, size it for N seconds of the largest
+ * frames at the camera's frame rate.
+ *
+ */
+typedef struct
+{
+    size_t ring_bytes; //memory reserved for frames; the ring never uses more
+    unsigned int max_frames; //frames the ring holds at most; 0 selects ACAM_PRETRIGGER_DEFAULT_FRAMES
+    unsigned int pre_ms; //history kept before a trigger; 0 keeps whatever fits in ring_bytes
+    unsigned int post_ms; //frames are recorded until this long after a trigger
+    uint64_t segment_size; //segment size of the event recordings, see acam_recorder_open
+    int flags; //ACAM_PRETRIGGER_* flags
+
+} acam_pretrigger_config_t;
+
+/**
+ * @brief Counters of a pre-trigger ring, see acam_pretrigger_get_stats.
+ *
+ */
+typedef struct
+{
+    uint64_t pushed; //frames copied into the ring
+    uint64_t evicted; //frames aged out or pushed out of the ring without being recorded
+    uint64_t dropped; //frames refused because the ring was full of frames waiting to be written
+    uint64_t events; //triggers that started a recording
+    uint64_t written; //frames appended to event recordings
+    uint64_t failed; //frames that could not be appended
+    unsigned int ring_frames; //frames in the ring now
+    size_t ring_used; //bytes of the ring in use now, padding included
+    int error; //errno of the last event that failed, 0 if none did
+
+} acam_pretrigger_stats_t;
+
+typedef struct acam_pretrigger acam_pretrigger_t; //RAM ring of recent frames recorded on a trigger, see acam_pretrigger.c
+
+#define ACAM_SHM_DEFAULT_SLOTS 8
+#define ACAM_SHM_DEFAULT_SLOT_SIZE (1920 * 1080 * 2) //a YUYV frame at the largest acam_fmt_t
+
+typedef struct acam_publisher acam_publisher_t; //frame ring in a memfd shared with other processes, see acam_shm.c
+typedef struct acam_subscriber acam_subscriber_t; //read-only view of a publisher's ring
+
+/**
+ * @brief A frame read in place from a publisher's ring, see acam_subscriber_next.
+ *
+ */
+typedef struct
+{
+    const void *data; //the frame in the shared ring; valid until acam_subscriber_check fails
+    uint32_t bytes_used;
+    acam_fmt_t fmt;
+    struct timeval timestamp;
+    uint32_t sequence;
+    uint32_t field; //enum v4l2_field of the frame
+    uint32_t flags; //V4L2_BUF_FLAG_* of the frame, see acam_buffer_t
+    uint64_t index; //position in the publisher's stream
+
+} acam_shm_frame_t;
+
+/**
+ * @brief Counters of a publisher, see acam_publisher_get_stats.
+ *
+ */
+typedef struct
+{
+    uint64_t published; //frames copied into the ring
+    uint64_t oversized; //frames refused because they are larger than a slot
+
+} acam_publisher_stats_t;
+
+/**
+ * @brief Counters of a subscriber, see acam_subscriber_get_stats.
+ *
+ */
+typedef struct
+{
+    uint64_t received; //frames handed out by acam_subscriber_next
+    uint64_t dropped; //frames the publisher overwrote before they were read
+    uint64_t stale; //frames acam_subscriber_check found overwritten while in use
+
+} acam_subscriber_stats_t;
+
+#define ACAM_SERVER_DEFAULT_CLIENTS 64
+
+typedef struct acam_server acam_server_t; //serves one camera's frames and controls on a Unix socket, see acam_server.c
+typedef struct acam_client acam_client_t; //a connection to a server
+
+/**
+ * @brief Settings of a frame server, see acam_server_start. Zero selects the default
+ * of every field.
+ *
+ */
+typedef struct
+{
+    unsigned int buffers; //driver buffers streamed, 0 selects ACAM_STREAM_DEFAULT_BUFFERS
+    unsigned int slots; //frames kept in the shared ring, 0 selects ACAM_SHM_DEFAULT_SLOTS
+    size_t slot_size; //largest frame served, 0 selects the largest buffer of the camera's mode table
+    unsigned int max_clients; //connections served at once, 0 selects ACAM_SERVER_DEFAULT_CLIENTS
+
+} acam_server_config_t;
+
+/**
+ * @brief Counters of a frame server, see acam_server_get_stats.
+ *
+ */
+typedef struct
+{
+    uint64_t frames; //frames published to the clients
+    uint64_t accepted; //connections accepted
+    uint64_t refused; //connections closed at once because max_clients were connected
+    uint64_t requests; //control and format requests answered
+    uint64_t busy; //change requests refused because another client holds the lock
+    unsigned int clients; //clients connected now
+    int error; //errno that stopped the stream, 0 while it runs
+
+} acam_server_stats_t;
+
+#define ACAM_JITTER_BUCKETS 12
+#define ACAM_JITTER_BUCKET_US 64 //upper bound of the first jitter bucket; each bucket doubles it
+
+/**
+ * @brief Frame accounting of a camera, see acam_get_stream_stats. Kept for every
+ * frame dequeued, whether by acam_capture_image, a stream, a worker or a group.
+ *
+ */
+typedef struct
+{
+    uint64_t frames; //frames dequeued
+    uint64_t dropped; //frames the driver skipped, from gaps in the sequence numbers
+    uint64_t errors; //frames flagged with V4L2_BUF_FLAG_ERROR
+    double fps; //frame rate from the driver's timestamps, smoothed over the last few frames
+    uint64_t jitter[ACAM_JITTER_BUCKETS]; //frame intervals by distance from the smoothed interval: bucket i counts those under ACAM_JITTER_BUCKET_US << i microseconds, the last one everything above too
+    uint32_t max_jitter_us;
+    uint32_t mean_latency_us; //time from the driver's timestamp to the dequeue, for drivers with monotonic timestamps
+    uint32_t max_latency_us;
+
+} acam_stream_stats_t;
+
+#define ACAM_TRACE_COUNTERS 0x1 //count calls and time them into per-request histograms
+#define ACAM_TRACE_EVENTS 0x2 //hand every call to the callback set with acam_trace_set_callback
+
+#define ACAM_TRACE_BUCKETS 16 //latency histogram: bucket i counts calls under 1 << i microseconds, the last one everything above too
+#define ACAM_TRACE_MAX_ENTRIES 259 //every ioctl number of the 'V' type, other ioctls, mmap and poll
+
+/**
+ * @brief What kind of device interaction a trace entry or event describes.
+ *
+ */
+typedef enum
+{
+    ACAM_TRACE_IOCTL = 0,
+    ACAM_TRACE_MMAP,
+    ACAM_TRACE_POLL //a wait for a frame
+
+} acam_trace_kind_t;
+
+/**
+ * @brief Counters of one ioctl request code, of mmap or of poll, see acam_trace_snapshot.
+ *
+ */
+typedef struct
+{
+    acam_trace_kind_t kind;
+    unsigned long request; //the ioctl request code; for ioctls outside the 'V' type, the last one seen
+    const char *name; //"VIDIOC_DQBUF", "mmap", "poll", "ioctl" for unknown request codes
+    uint64_t calls; //calls that returned, EINTR retries not counted separately
+    uint64_t errors; //calls that failed after their retries
+    uint64_t retries; //EINTR restarts
+    uint64_t total_ns; //time spent in the calls, retries included
+    uint64_t max_ns;
+    uint64_t histogram[ACAM_TRACE_BUCKETS];
+
+} acam_trace_entry_t;
+
+/**
+ * @brief One traced call, handed to the callback set with acam_trace_set_callback.
+ *
+ */
+typedef struct
+{
+    acam_trace_kind_t kind;
+    unsigned long request; //the ioctl request code, 0 for mmap and poll
+    const struct acam_camera *cam;
+    int result; //what the call returned
+    int error; //errno if it failed, 0 otherwise
+    unsigned int retries; //EINTR restarts
+    uint64_t start_ns; //CLOCK_MONOTONIC when the call was made
+    uint64_t duration_ns;
+
+} acam_trace_event_t;
+
+typedef void (*acam_trace_cb_t)(const acam_trace_event_t *event, void *user); //runs on the calling thread after every traced call
+
+/**
+ * @brief One format, frame size and frame interval combination the camera offers,
+ * from the mode table acam_open builds. See acam_get_modes.
+ *
+ */
+typedef struct
+{
+    uint32_t fourcc; //V4L2_PIX_FMT_* code
+    uint32_t width;
+    uint32_t height;
+    struct v4l2_fract interval; //seconds per frame
+    uint32_t bytesperline; //stride of a row, 0 for compressed formats
+    uint32_t sizeimage; //bytes a buffer needs for one frame; for compressed formats the uvcvideo estimate of 2 bytes per pixel
+    int compressed; //1 for MJPEG and other compressed formats
+    acam_fmt_t fmt; //the matching acam_fmt_t, __ACAM_FMT_INVALID if there is none
+
+} acam_mode_t;
+
 /**
  * @brief The structure which maintains static info
  * about the ARDUCAM.
  * 
  */
-typedef struct
+typedef struct acam_camera
 {
     int fd;
+    const acam_backend_t *backend;
+    void *backend_ctx;
     int stream_on;
     acam_ctrl_t ctrls[__ACAM_CTRL_COUNT];
+    int shadow[__ACAM_CTRL_COUNT]; //last known value of every control, see acam_get_ctrl
+
+    int streaming; //1 while the mmap ring is queued and the device is STREAMON
+    unsigned int ring_count;
+    acam_buffer_t *ring; //buffers mapped by acam_stream_start
+    acam_frame_t *frames; //frame handles for the ring, one per buffer
+    unsigned int memory; //V4L2_MEMORY_MMAP, or V4L2_MEMORY_USERPTR when streaming into a pool
+    acam_pool_t *pool; //the pool being streamed into, NULL for mmap buffers
+    struct acam_stream_track *track; //frame accounting behind acam_get_stream_stats, see acam_control.c
+    acam_mode_t *modes; //every mode the camera offers, sorted for acam_find_mode
+    unsigned int mode_count;
 
 } acam_camera_t;
 
@@ -138,22 +732,145 @@ typedef struct
 //each function definition in controls.c
 
 acam_camera_t *acam_open(const char *cam_file, int *error); //start the camera
+acam_camera_t *acam_open_backend(const char *cam_file, const acam_backend_t *backend, int *error); //start the camera through a given backend
 int acam_close(acam_camera_t *cam); //close the camera
+int acam_get_fd(const acam_camera_t *cam); //the fd to watch in an event loop; readable when a frame is ready
+int acam_set_cache_dir(const char *dir); //keeps each camera's control and mode tables on disk so reopening it skips the queries
 
 int acam_capture_image(const acam_camera_t *cam, acam_buffer_t *buffer); //captures a single image to a buffer
 int acam_write_to_file(const char *file_name, const acam_buffer_t *buffer); //writes contents of a buffer to an external file
 acam_buffer_t *acam_create_buffer(acam_camera_t *cam, int *error); //creates a buffer of size corresponding with current pixel format
 int acam_destroy_buffer(acam_buffer_t *buffer); //destroys buffer 
 
-int acam_get_ctrl(const acam_camera_t *cam, acam_ctrl_tag_t ctrl, int *value); //get the current value of a control
-int acam_set_ctrl(const acam_camera_t *cam, acam_ctrl_tag_t ctrl, int value); //set the value of a control
+int acam_stream_start(acam_camera_t *cam, unsigned int count); //maps a ring of count buffers and turns streaming on
+int acam_stream_start_userptr(acam_camera_t *cam, acam_pool_t *pool); //turns streaming on, capturing straight into the buffers of a pool
+int acam_stream_dequeue(acam_camera_t *cam, acam_buffer_t **buffer, int timeout_ms); //waits for the next filled buffer in the ring
+int acam_stream_try_dequeue(acam_camera_t *cam, acam_buffer_t **buffer); //takes a filled buffer if one is ready, EAGAIN otherwise
+int acam_stream_requeue(acam_camera_t *cam, acam_buffer_t *buffer); //hands a dequeued buffer back to the driver
+int acam_stream_stop(acam_camera_t *cam); //turns streaming off and unmaps the ring
+void acam_get_stream_stats(const acam_camera_t *cam, acam_stream_stats_t *stats); //reads the frame rate, jitter, drop, error and latency counters
+void acam_reset_stream_stats(acam_camera_t *cam); //zeroes the frame accounting
+
+acam_pool_t *acam_pool_create(const acam_camera_t *cam, unsigned int count, int flags, int *error); //allocates a capture arena sized for the current format
+acam_pool_t *acam_pool_wrap(void *mem, size_t buffer_size, unsigned int count, int *error); //describes caller-owned memory as a capture pool
+int acam_pool_destroy(acam_pool_t *pool); //frees a pool
+
+int acam_stream_dequeue_frame(acam_camera_t *cam, acam_frame_t **frame, int timeout_ms); //waits for the next frame and returns a shared, DMABUF-exported handle
+int acam_stream_try_dequeue_frame(acam_camera_t *cam, acam_frame_t **frame); //takes the next frame handle if one is ready, EAGAIN otherwise
+void acam_frame_ref(acam_frame_t *frame); //adds a holder to a frame
+int acam_frame_release(acam_frame_t *frame); //drops a holder; the last one requeues the buffer
+
+acam_worker_t *acam_worker_start(acam_camera_t *cam, acam_worker_policy_t policy, unsigned int count, int *error); //starts a thread that dequeues frames continuously
+int acam_worker_get_frame(acam_worker_t *worker, acam_frame_t **frame, int timeout_ms); //takes the newest (KEEP_LATEST) or oldest (KEEP_ALL) published frame
+void acam_worker_get_stats(const acam_worker_t *worker, acam_worker_stats_t *stats); //reads the worker's frame and drop counters
+int acam_worker_stop(acam_worker_t *worker); //stops the thread and frees the worker
+
+acam_group_t *acam_group_open(const char *const *cam_files, unsigned int count, unsigned int workers, int *error); //opens a set of cameras to be driven together
+acam_camera_t *acam_group_get_camera(const acam_group_t *group, unsigned int index); //one camera of the group, for setting its format and controls
+int acam_group_start(acam_group_t *group, unsigned int buffers, acam_group_frame_cb_t callback, void *user); //starts streaming every camera and dispatching frames to the workers
+int acam_group_get_stats(const acam_group_t *group, unsigned int index, acam_group_stats_t *stats); //reads the frame rate and drop counters of one camera
+int acam_group_stop(acam_group_t *group); //stops dispatching and streaming
+int acam_group_close(acam_group_t *group); //closes every camera and frees the group
+
+acam_writer_t *acam_writer_create(const acam_writer_config_t *config, int *error); //starts a background thread that writes frames to files
+int acam_writer_submit(acam_writer_t *writer, const char *file_name, const acam_buffer_t *buffer, acam_writer_cb_t callback, void *user); //queues a copy of a buffer to be written, EAGAIN if the queue is full
+int acam_writer_submit_frame(acam_writer_t *writer, const char *file_name, acam_frame_t *frame, acam_writer_cb_t callback, void *user); //queues a frame to be written without copying it
+int acam_writer_flush(acam_writer_t *writer); //waits until every submitted job is written
+void acam_writer_get_stats(acam_writer_t *writer, acam_writer_stats_t *stats); //reads the writer's counters
+int acam_writer_destroy(acam_writer_t *writer); //writes what is queued, stops the thread and frees the writer
+
+acam_recorder_t *acam_recorder_open(const char *dir, uint64_t segment_size, int *error); //creates or continues an indexed recording
+int acam_recorder_append(acam_recorder_t *rec, const acam_buffer_t *buffer, acam_fmt_t fmt, const struct timeval *timestamp, uint32_t sequence); //appends a frame
+int acam_recorder_append_frame(acam_recorder_t *rec, const acam_frame_t *frame); //appends a streaming frame with its own metadata
+int acam_recorder_sync(acam_recorder_t *rec); //flushes the recording to the disk
+int acam_recorder_close(acam_recorder_t *rec); //closes a recording
+acam_reader_t *acam_reader_open(const char *dir, int *error); //opens a recording for reading
+int acam_reader_refresh(acam_reader_t *reader); //picks up frames appended since the reader was opened
+uint64_t acam_reader_count(const acam_reader_t *reader); //the number of frames in the recording
+int acam_reader_get(acam_reader_t *reader, uint64_t n, acam_record_t *record); //gets frame n without copying it
+int acam_reader_find_time(const acam_reader_t *reader, const struct timeval *timestamp, uint64_t *n); //finds the first frame at or after a time
+int acam_reader_close(acam_reader_t *reader); //closes a reader
+
+acam_pretrigger_t *acam_pretrigger_create(const acam_pretrigger_config_t *config, int *error); //allocates a ring that keeps the last frames in RAM
+int acam_pretrigger_push(acam_pretrigger_t *pt, const acam_buffer_t *buffer, acam_fmt_t fmt, const struct timeval *timestamp, uint32_t sequence); //copies a frame into the ring
+int acam_pretrigger_push_frame(acam_pretrigger_t *pt, const acam_frame_t *frame); //copies a streaming frame into the ring with its own metadata
+int acam_pretrigger_trigger(acam_pretrigger_t *pt, const char *dir); //records the ring and the next post_ms of frames in the background
+int acam_pretrigger_flush(acam_pretrigger_t *pt); //ends the current event and waits until it is written
+void acam_pretrigger_get_stats(acam_pretrigger_t *pt, acam_pretrigger_stats_t *stats); //reads the ring's counters
+int acam_pretrigger_destroy(acam_pretrigger_t *pt); //writes the current event, stops the thread and frees the ring
+
+acam_publisher_t *acam_publisher_create(unsigned int slots, size_t slot_size, int *error); //creates a frame ring in a sealed memfd
+int acam_publisher_get_fd(const acam_publisher_t *pub); //the memfd to hand to subscribers
+int acam_publisher_push(acam_publisher_t *pub, const acam_buffer_t *buffer, acam_fmt_t fmt); //copies a frame into the ring and wakes subscribers; never blocks
+int acam_publisher_push_frame(acam_publisher_t *pub, const acam_frame_t *frame); //publishes a streaming frame with its own metadata
+void acam_publisher_get_stats(const acam_publisher_t *pub, acam_publisher_stats_t *stats); //reads the publisher's counters
+int acam_publisher_destroy(acam_publisher_t *pub); //closes the ring; subscribers read what is left, then get EPIPE
+acam_subscriber_t *acam_subscriber_open(int fd, int *error); //maps a publisher's ring from its memfd
+int acam_subscriber_next(acam_subscriber_t *sub, acam_shm_frame_t *frame, int timeout_ms); //waits for the next frame and hands it out in place
+int acam_subscriber_check(acam_subscriber_t *sub, const acam_shm_frame_t *frame); //ESTALE if the frame was overwritten while in use
+void acam_subscriber_get_stats(const acam_subscriber_t *sub, acam_subscriber_stats_t *stats); //reads the received, dropped and stale counters
+int acam_subscriber_close(acam_subscriber_t *sub); //unmaps the ring
+
+acam_server_t *acam_server_start(acam_camera_t *cam, const char *socket_path, const acam_server_config_t *config, int *error); //streams a camera to clients of a Unix socket
+void acam_server_get_stats(const acam_server_t *server, acam_server_stats_t *stats); //reads the server's counters
+int acam_server_stop(acam_server_t *server); //disconnects every client, stops the stream and frees the server
+acam_client_t *acam_client_connect(const char *socket_path, int *error); //connects to a server and maps its frame ring
+int acam_client_next(acam_client_t *client, acam_shm_frame_t *frame, int timeout_ms); //waits for the next frame and hands it out in place
+acam_subscriber_t *acam_client_get_subscriber(const acam_client_t *client); //the client's view of the frame ring, for acam_subscriber_check and its counters
+int acam_client_get_ctrl(acam_client_t *client, acam_ctrl_tag_t ctrl, int *value); //gets a control of the served camera
+int acam_client_set_ctrl(acam_client_t *client, acam_ctrl_tag_t ctrl, int value); //sets a control of the served camera
+int acam_client_get_mode(acam_client_t *client, acam_mode_t *mode); //describes the mode being served
+int acam_client_set_mode(acam_client_t *client, uint32_t fourcc, uint32_t width, uint32_t height, const struct v4l2_fract *interval); //switches every client to another mode
+int acam_client_lock(acam_client_t *client); //reserves control and format changes to this client
+int acam_client_unlock(acam_client_t *client); //lets every client make changes again
+int acam_client_close(acam_client_t *client); //disconnects and unmaps the ring
+
+int acam_mjpeg_prepare(const acam_buffer_t *buffer, acam_mjpeg_t *jpeg); //checks an MJPEG frame and describes it as a complete JPEG without copying
+int acam_mjpeg_writev(int fd, const acam_mjpeg_t *jpeg); //writes a prepared JPEG with writev
+int acam_write_mjpeg_to_file(const char *file_name, const acam_buffer_t *buffer); //writes an MJPEG frame to a file as a complete JPEG
+int acam_mjpeg_decode_dc(const acam_buffer_t *buffer, uint8_t *dst, size_t dst_size, acam_mjpeg_dc_t *result); //decodes the 1/8-scale image and luma statistics of an MJPEG frame from its DC coefficients
+int acam_mjpeg_decode_dc_burst(acam_mjpeg_dc_job_t *jobs, unsigned int count, unsigned int threads); //acam_mjpeg_decode_dc for many frames on several threads
+
+int acam_yuyv_to_rgb24(const acam_buffer_t *buffer, unsigned int width, unsigned int height, acam_color_t color, uint8_t *dst, size_t dst_size); //converts a YUYV frame to packed RGB into the caller's memory
+int acam_yuyv_to_nv12(const acam_buffer_t *buffer, unsigned int width, unsigned int height, uint8_t *dst, size_t dst_size); //converts a YUYV frame to NV12 into the caller's memory
+int acam_yuyv_to_i420(const acam_buffer_t *buffer, unsigned int width, unsigned int height, uint8_t *dst, size_t dst_size); //converts a YUYV frame to I420 into the caller's memory
+int acam_yuyv_scale_rgb24(const acam_buffer_t *buffer, unsigned int width, unsigned int height, acam_color_t color, const acam_scale_target_t *targets, unsigned int count, unsigned int threads); //crops, scales and converts a YUYV frame to one or more RGB images in one pass
+acam_stats_t *acam_stats_create(unsigned int width, unsigned int height, const acam_stats_config_t *config, int *error); //prepares a statistics pass over YUYV frames of one size
+int acam_stats_compute(acam_stats_t *stats, const acam_buffer_t *buffer, acam_frame_stats_t *result); //luma histogram, mean, variance, sharpness and motion of a YUYV frame
+void acam_stats_reset(acam_stats_t *stats); //forgets the previous frame, e.g. after a scene cut
+int acam_stats_destroy(acam_stats_t *stats); //frees a statistics pass
+acam_jpeg_encoder_t *acam_jpeg_encoder_create(unsigned int width, unsigned int height, const acam_jpeg_config_t *config, int *error); //prepares a JPEG encoder for YUYV frames of one size
+int acam_jpeg_encode(acam_jpeg_encoder_t *enc, const acam_buffer_t *buffer, const uint8_t **jpeg, size_t *size); //compresses a YUYV frame to a baseline JPEG on several threads
+int acam_write_jpeg_to_file(const char *file_name, acam_jpeg_encoder_t *enc, const acam_buffer_t *buffer); //compresses a YUYV frame and writes it to a file
+int acam_jpeg_encoder_destroy(acam_jpeg_encoder_t *enc); //frees a JPEG encoder and its output
+int acam_convert_set_isa(acam_isa_t isa); //selects the SIMD kernels used by the conversion routines
+acam_isa_t acam_convert_get_isa(void); //the instruction set the conversion routines run on
+
+int acam_trace_set_flags(int flags); //turns ioctl, mmap and poll instrumentation on or off
+int acam_trace_set_callback(acam_trace_cb_t callback, void *user); //sets the callback for ACAM_TRACE_EVENTS
+unsigned int acam_trace_snapshot(acam_trace_entry_t *entries, unsigned int max); //copies the counters of every request seen
+void acam_trace_reset(void); //zeroes the instrumentation counters
+
+unsigned int acam_get_modes(const acam_camera_t *cam, const acam_mode_t **modes); //the mode table built at open, sorted by format, size and interval
+const acam_mode_t *acam_find_mode(const acam_camera_t *cam, uint32_t fourcc, uint32_t width, uint32_t height, const struct v4l2_fract *interval); //looks a mode up; a NULL interval selects its fastest rate
+int acam_set_mode(acam_camera_t *cam, const acam_mode_t *mode); //sets format, size and frame interval of a mode
+int acam_set_frame_interval(acam_camera_t *cam, struct v4l2_fract *interval); //sets the frame interval, updated to what the driver selected
+int acam_get_frame_interval(const acam_camera_t *cam, struct v4l2_fract *interval); //gets the current frame interval
+int acam_get_mode(const acam_camera_t *cam, acam_mode_t *mode); //describes the current format, frame size and frame interval
+
+int acam_get_ctrl(const acam_camera_t *cam, acam_ctrl_tag_t ctrl, int *value); //get the current value of a control from the shadow cache
+int acam_read_ctrl(acam_camera_t *cam, acam_ctrl_tag_t ctrl, int *value); //get the current value of a control from the device
+int acam_refresh_ctrls(acam_camera_t *cam); //re-read all controls from the device into the shadow cache
+int acam_set_ctrl(acam_camera_t *cam, acam_ctrl_tag_t ctrl, int value); //set the value of a control
 
 int acam_save_struct(const acam_camera_t *cam, acam_ctrls_struct *ctrls); //save a acam_ctrls_struct with current camera control values and format
 void acam_save_default_struct(const acam_camera_t *cam, acam_ctrls_struct *ctrls); //save a acam_ctrls_struct with default camera values and format
-int acam_load_struct(const acam_camera_t *cam, const acam_ctrls_struct *ctrls); //load control values and format from acam_ctrls_struct into camera
+int acam_load_struct(acam_camera_t *cam, const acam_ctrls_struct *ctrls); //load control values and format from acam_ctrls_struct into camera
+int acam_get_ctrl_batch(const acam_camera_t *cam, acam_ctrls_struct *ctrls); //read all controls except format in one extended-controls call
+int acam_set_ctrl_batch(acam_camera_t *cam, const acam_ctrls_struct *ctrls); //apply all controls except format in one extended-controls call
 
-int acam_reset_ctrl(const acam_camera_t *cam, acam_ctrl_tag_t ctrl); //resets the value of a single control to its default
-int acam_reset_all(const acam_camera_t *cam); //resets all controls in camera to their defaults
+int acam_reset_ctrl(acam_camera_t *cam, acam_ctrl_tag_t ctrl); //resets the value of a single control to its default
+int acam_reset_all(acam_camera_t *cam); //resets all controls in camera to their defaults
 
 int acam_print_ctrl(const acam_camera_t *cam, acam_ctrl_tag_t ctrl); //print the value of a single control
 int acam_print_ctrl_all(const acam_camera_t *cam); //print values of all controls
@@ -0,0 +1,3068 @@
+#include "acam_control.h"
+#include "acam_jpeg_tables.h"
+
+#include <limits.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ACAM_CONVERT_X86
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#define ACAM_CONVERT_NEON
+#include <arm_neon.h>
+#endif
+
+#ifndef NDEBUG
+#define DEBUG_PRINT fprintf
+#define DEBUG_PERROR perror
+#else
+#define DEBUG_PRINT
+#define DEBUG_PERROR
+#endif
+
+/**
+ * @brief Conversion of packed YUYV 4:2:2 frames to RGB24, NV12 and I420,
+ * cropping and scaling them to RGB24, see acam_yuyv_scale_rgb24 below, their
+ * luma statistics, see acam_stats_compute, and their compression to JPEG, see
+ * acam_jpeg_encode.
+ *
+ * Every kernel works one row (or, for JPEG, one 16x8 block of pixels) at a time
+ * and exists in a portable scalar version and in AVX2, SSE4.1 and NEON versions. The instruction set is picked at runtime from
+ * what the CPU supports, so the library needs no special compiler flags.
+ *
+ * The SIMD kernels compute exactly what the scalar ones compute: RGB uses 13-bit
+ * fixed-point coefficients with 32-bit intermediates, rounds once before the shift
+ * and saturates to 0..255, and chroma rows are merged with the rounding average
+ * (a + b + 1) >> 1 that SIMD units implement natively. Any kernel can therefore be
+ * checked byte for byte against the scalar one.
+ *
+ */
+
+#define COEFF_SHIFT 13
+#define COEFF_ROUND (1 << (COEFF_SHIFT - 1))
+
+/**
+ * @brief Fixed-point YUV to RGB matrix, scaled by 1 << COEFF_SHIFT.
+ *
+ */
+typedef struct
+{
+    int y_offset; //16 for limited range, 0 for full range
+    int cy;       //luma gain
+    int crv;      //V contribution to R
+    int cgu;      //U contribution to G
+    int cgv;      //V contribution to G
+    int cbu;      //U contribution to B
+
+} color_coeffs_t;
+
+static const color_coeffs_t color_coeffs[__ACAM_COLOR_COUNT] = {
+    {16, 9539, 13075, -3209, -6660, 16525}, //ACAM_BT601_LIMITED
+    {0, 8192, 11485, -2819, -5850, 14516},  //ACAM_BT601_FULL
+    {16, 9539, 14686, -1747, -4366, 17305}, //ACAM_BT709_LIMITED
+    {0, 8192, 12901, -1535, -3835, 15201},  //ACAM_BT709_FULL
+};
+
+/*
+ * The JPEG forward DCT is libjpeg's jfdctint: the Loeffler, Ligtenberg and
+ * Moschytz algorithm with 13-bit constants, columns first and then rows, its output
+ * scaled by 8. Its rotations are folded into one row of constants per output so
+ * that SIMD units compute each output with pairwise multiply-adds on 16-bit values
+ * into 32-bit sums, exactly as the scalar code does.
+ */
+#define DCT_CONST_BITS 13
+#define DCT_PASS1_BITS 2
+#define DCT_SHIFT1 (DCT_CONST_BITS - DCT_PASS1_BITS)
+#define DCT_SHIFT2 (DCT_CONST_BITS + DCT_PASS1_BITS)
+
+#define DCT_EVEN_A 10703 //out2 = t13 * A + t12 * B, out6 = t13 * B + t12 * C
+#define DCT_EVEN_B 4433
+#define DCT_EVEN_C (-10704)
+
+//out1, out3, out5 and out7 from t4, t5, t6 and t7 (the differences d3-d4, d2-d5, d1-d6, d0-d7)
+static const int16_t dct_odd[4][4] = {
+    {2260, 6437, 9633, 11363}, {-6436, -11362, -2259, 9633}, {9633, 2261, -11362, 6437}, {-11363, 9633, -6436, 2260}};
+
+#define JPEG_Y_GAIN 19077 //255 / 219 in 1/16384: limited-range luma stretched to 0..255
+#define JPEG_C_GAIN 18651 //255 / 224 in 1/16384: limited-range chroma stretched to -128..127
+
+/**
+ * @brief Divisors of one quantization table as reciprocals, so that
+ * round(x / d) = ((|x| + corr) * recip >> 16) * scale >> 16 in unsigned 16-bit
+ * arithmetic, as libjpeg-turbo's SIMD quantizers do. Entries are in the order the
+ * DCT kernels store coefficients: column-major, see jpeg_mcu.
+ *
+ */
+typedef struct
+{
+    uint16_t recip[64];
+    uint16_t corr[64];
+    uint16_t scale[64];
+} jpeg_quant_t;
+
+/**
+ * @brief Row kernels of one instruction set. Widths are in pixels and always even.
+ *
+ */
+typedef struct
+{
+    acam_isa_t isa;
+    void (*rgb24_row)(const uint8_t *src, uint8_t *dst, unsigned int width, const color_coeffs_t *c);
+    void (*luma_row)(const uint8_t *src, uint8_t *y, unsigned int width);
+    void (*uv_row)(const uint8_t *row0, const uint8_t *row1, uint8_t *uv, unsigned int width); //interleaved, NV12
+    void (*u_v_row)(const uint8_t *row0, const uint8_t *row1, uint8_t *u, uint8_t *v, unsigned int width); //planar, I420
+    void (*vsum_row)(const uint8_t *src, uint16_t *acc, unsigned int n, int first); //box scaling: adds n bytes of a row to the column sums
+    void (*vlerp_row)(const uint8_t *row0, const uint8_t *row1, unsigned int weight, uint16_t *out, unsigned int n); //bilinear scaling: row0 * (256 - weight) + row1 * weight
+    void (*sample_row)(const uint8_t *src, uint8_t *y, unsigned int n, unsigned int step); //statistics: n luma samples, step pixels apart
+    void (*chunk_sum_row)(const uint8_t *y, unsigned int n, uint32_t *chunks); //statistics: adds the sums of every 8 samples
+    uint64_t (*sumsq_row)(const uint8_t *y, unsigned int n); //statistics: sum of the squared samples
+    uint64_t (*tenengrad_row)(const uint8_t *r0, const uint8_t *r1, const uint8_t *r2, unsigned int n); //statistics: sum of gx^2 + gy^2 of r1[1..n-2]
+    //JPEG: the Y, Y, Cb and Cr blocks of 16x8 pixels, level-shifted, transformed and quantized with quant[0] (Y) and
+    //quant[1] (chroma); each block's coefficients go to coefs in column-major order (u * 8 + v for horizontal
+    //frequency u and vertical frequency v) and bit u * 8 + v of its masks entry is set when that coefficient is not 0
+    void (*jpeg_mcu)(const uint8_t *src, size_t stride, int limited, const jpeg_quant_t quant[2], int16_t *coefs, uint64_t masks[4]);
+} kernels_t;
+
+static inline uint8_t clamp_u8(int x)
+{
+    return x < 0 ? 0 : x > 255 ? 255 : (uint8_t)x;
+}
+
+static void rgb24_row_scalar(const uint8_t *src, uint8_t *dst, unsigned int width, const color_coeffs_t *c)
+{
+    for (unsigned int i = 0; i < width; i += 2, src += 4, dst += 6)
+    {
+        int y0 = c->cy * (src[0] - c->y_offset);
+        int y1 = c->cy * (src[2] - c->y_offset);
+        int u = src[1] - 128;
+        int v = src[3] - 128;
+        int rv = c->crv * v + COEFF_ROUND;
+        int guv = c->cgu * u + c->cgv * v + COEFF_ROUND;
+        int bu = c->cbu * u + COEFF_ROUND;
+
+        dst[0] = clamp_u8((y0 + rv) >> COEFF_SHIFT);
+        dst[1] = clamp_u8((y0 + guv) >> COEFF_SHIFT);
+        dst[2] = clamp_u8((y0 + bu) >> COEFF_SHIFT);
+        dst[3] = clamp_u8((y1 + rv) >> COEFF_SHIFT);
+        dst[4] = clamp_u8((y1 + guv) >> COEFF_SHIFT);
+        dst[5] = clamp_u8((y1 + bu) >> COEFF_SHIFT);
+    }
+}
+
+static void luma_row_scalar(const uint8_t *src, uint8_t *y, unsigned int width)
+{
+    for (unsigned int i = 0; i < width; i++)
+    {
+        y[i] = src[2 * i];
+    }
+}
+
+static void uv_row_scalar(const uint8_t *row0, const uint8_t *row1, uint8_t *uv, unsigned int width)
+{
+    for (unsigned int i = 0; i < width; i += 2)
+    {
+        uv[i] = (row0[2 * i + 1] + row1[2 * i + 1] + 1) >> 1;
+        uv[i + 1] = (row0[2 * i + 3] + row1[2 * i + 3] + 1) >> 1;
+    }
+}
+
+static void u_v_row_scalar(const uint8_t *row0, const uint8_t *row1, uint8_t *u, uint8_t *v, unsigned int width)
+{
+    for (unsigned int i = 0; i < width / 2; i++)
+    {
+        u[i] = (row0[4 * i + 1] + row1[4 * i + 1] + 1) >> 1;
+        v[i] = (row0[4 * i + 3] + row1[4 * i + 3] + 1) >> 1;
+    }
+}
+
+static void vsum_row_scalar(const uint8_t *src, uint16_t *acc, unsigned int n, int first)
+{
+    for (unsigned int i = 0; i < n; i++)
+    {
+        acc[i] = (first ? 0 : acc[i]) + src[i];
+    }
+}
+
+static void vlerp_row_scalar(const uint8_t *row0, const uint8_t *row1, unsigned int weight, uint16_t *out, unsigned int n)
+{
+    for (unsigned int i = 0; i < n; i++)
+    {
+        out[i] = row0[i] * (256 - weight) + row1[i] * weight;
+    }
+}
+
+static void sample_row_scalar(const uint8_t *src, uint8_t *y, unsigned int n, unsigned int step)
+{
+    for (unsigned int i = 0; i < n; i++)
+    {
+        y[i] = src[2 * step * i];
+    }
+}
+
+static void chunk_sum_row_scalar(const uint8_t *y, unsigned int n, uint32_t *chunks)
+{
+    for (unsigned int i = 0; i < n; i++)
+    {
+        chunks[i / 8] += y[i];
+    }
+}
+
+static uint64_t sumsq_row_scalar(const uint8_t *y, unsigned int n)
+{
+    uint64_t sum = 0;
+    for (unsigned int i = 0; i < n; i++)
+    {
+        sum += y[i] * y[i];
+    }
+    return sum;
+}
+
+static uint64_t tenengrad_row_scalar(const uint8_t *r0, const uint8_t *r1, const uint8_t *r2, unsigned int n)
+{
+    uint64_t sum = 0;
+    for (unsigned int i = 1; i + 1 < n; i++)
+    {
+        int gx = (r0[i + 1] + 2 * r1[i + 1] + r2[i + 1]) - (r0[i - 1] + 2 * r1[i - 1] + r2[i - 1]);
+        int gy = (r2[i - 1] + 2 * r2[i] + r2[i + 1]) - (r0[i - 1] + 2 * r0[i] + r0[i + 1]);
+        sum += (uint32_t)(gx * gx + gy * gy);
+    }
+    return sum;
+}
+
+//limited-range samples are stretched with the rounding high multiply of SIMD units: (2 * x * gain + 2^14) >> 15
+static inline int jpeg_luma(int y, int limited)
+{
+    if (!limited)
+    {
+        return y - 128;
+    }
+    int v = ((y - 16) * 2 * JPEG_Y_GAIN + (1 << 14)) >> 15;
+    return (v < 0 ? 0 : v > 255 ? 255 : v) - 128;
+}
+
+static inline int jpeg_chroma(int c, int limited)
+{
+    if (!limited)
+    {
+        return c - 128;
+    }
+    int v = ((c - 128) * 2 * JPEG_C_GAIN + (1 << 14)) >> 15;
+    return v < -128 ? -128 : v > 127 ? 127 : v;
+}
+
+/**
+ * @brief One pass of the 8-point forward DCT over @param d. The first pass keeps
+ * DCT_PASS1_BITS more bits, the second takes them off again.
+ *
+ */
+static void fdct8_scalar(const int32_t *d, int32_t *out, int pass)
+{
+    int32_t t0 = d[0] + d[7], t7 = d[0] - d[7], t1 = d[1] + d[6], t6 = d[1] - d[6];
+    int32_t t2 = d[2] + d[5], t5 = d[2] - d[5], t3 = d[3] + d[4], t4 = d[3] - d[4];
+    int32_t t10 = t0 + t3, t13 = t0 - t3, t11 = t1 + t2, t12 = t1 - t2;
+    int shift = pass == 1 ? DCT_SHIFT1 : DCT_SHIFT2;
+    int32_t round = 1 << (shift - 1);
+
+    if (pass == 1)
+    {
+        out[0] = (t10 + t11) * (1 << DCT_PASS1_BITS);
+        out[4] = (t10 - t11) * (1 << DCT_PASS1_BITS);
+    }
+    else
+    {
+        out[0] = (t10 + t11 + (1 << (DCT_PASS1_BITS - 1))) >> DCT_PASS1_BITS;
+        out[4] = (t10 - t11 + (1 << (DCT_PASS1_BITS - 1))) >> DCT_PASS1_BITS;
+    }
+    out[2] = (t13 * DCT_EVEN_A + t12 * DCT_EVEN_B + round) >> shift;
+    out[6] = (t13 * DCT_EVEN_B + t12 * DCT_EVEN_C + round) >> shift;
+    for (int k = 0; k < 4; k++)
+    {
+        out[2 * k + 1] = (t4 * dct_odd[k][0] + t5 * dct_odd[k][1] + t6 * dct_odd[k][2] + t7 * dct_odd[k][3] + round) >> shift;
+    }
+}
+
+static inline int16_t jpeg_quantize(int32_t x, const jpeg_quant_t *q, int i)
+{
+    uint16_t t = (uint16_t)((x < 0 ? -x : x) + q->corr[i]);
+    t = (uint16_t)(((uint32_t)t * q->recip[i]) >> 16);
+    t = (uint16_t)(((uint32_t)t * q->scale[i]) >> 16);
+    return x < 0 ? -(int16_t)t : x > 0 ? (int16_t)t : 0;
+}
+
+static uint64_t fdct_quant_scalar(const int32_t *samples, const jpeg_quant_t *q, int16_t *out)
+{
+    int32_t ws[64], column[8], result[8];
+    for (int c = 0; c < 8; c++)
+    {
+        for (int r = 0; r < 8; r++)
+        {
+            column[r] = samples[r * 8 + c];
+        }
+        fdct8_scalar(column, result, 1);
+        for (int v = 0; v < 8; v++)
+        {
+            ws[v * 8 + c] = result[v];
+        }
+    }
+    uint64_t nonzero = 0;
+    for (int v = 0; v < 8; v++)
+    {
+        fdct8_scalar(ws + v * 8, result, 2);
+        for (int u = 0; u < 8; u++)
+        {
+            out[u * 8 + v] = jpeg_quantize(result[u], q, u * 8 + v);
+            nonzero |= (uint64_t)(out[u * 8 + v] != 0) << (u * 8 + v);
+        }
+    }
+    return nonzero;
+}
+
+static void jpeg_mcu_scalar(const uint8_t *src, size_t stride, int limited, const jpeg_quant_t quant[2], int16_t *coefs, uint64_t masks[4])
+{
+    int32_t samples[4][64];
+    for (int y = 0; y < 8; y++)
+    {
+        const uint8_t *row = src + y * stride;
+        for (int x = 0; x < 16; x++)
+        {
+            samples[x / 8][y * 8 + x % 8] = jpeg_luma(row[2 * x], limited);
+        }
+        for (int x = 0; x < 8; x++)
+        {
+            samples[2][y * 8 + x] = jpeg_chroma(row[4 * x + 1], limited);
+            samples[3][y * 8 + x] = jpeg_chroma(row[4 * x + 3], limited);
+        }
+    }
+    for (int b = 0; b < 4; b++)
+    {
+        masks[b] = fdct_quant_scalar(samples[b], &quant[b / 2], coefs + 64 * b);
+    }
+}
+
+static const kernels_t scalar_kernels = {ACAM_ISA_SCALAR, rgb24_row_scalar, luma_row_scalar, uv_row_scalar, u_v_row_scalar,
+                                         vsum_row_scalar, vlerp_row_scalar, sample_row_scalar, chunk_sum_row_scalar,
+                                         sumsq_row_scalar, tenengrad_row_scalar, jpeg_mcu_scalar};
+
+#ifdef ACAM_CONVERT_X86
+
+/*
+ * The x86 kernels convert 8 pixels per 128-bit lane. The even and odd pixels of a
+ * lane come out of the arithmetic in separate registers, so after packing to bytes
+ * 16 pixels sit in the order 0 2 4 6 1 3 5 7 8 10 12 14 9 11 13 15. The shuffles
+ * below undo that order while interleaving R, G and B into the 48 output bytes:
+ * rgb24_shuffle[k][ch] moves channel ch into output bytes 16k..16k+15.
+ */
+static const int8_t rgb24_shuffle[3][3][16] = {
+    {{0, -1, -1, 4, -1, -1, 1, -1, -1, 5, -1, -1, 2, -1, -1, 6},
+     {-1, 0, -1, -1, 4, -1, -1, 1, -1, -1, 5, -1, -1, 2, -1, -1},
+     {-1, -1, 0, -1, -1, 4, -1, -1, 1, -1, -1, 5, -1, -1, 2, -1}},
+    {{-1, -1, 3, -1, -1, 7, -1, -1, 8, -1, -1, 12, -1, -1, 9, -1},
+     {6, -1, -1, 3, -1, -1, 7, -1, -1, 8, -1, -1, 12, -1, -1, 9},
+     {-1, 6, -1, -1, 3, -1, -1, 7, -1, -1, 8, -1, -1, 12, -1, -1}},
+    {{-1, 13, -1, -1, 10, -1, -1, 14, -1, -1, 11, -1, -1, 15, -1, -1},
+     {-1, -1, 13, -1, -1, 10, -1, -1, 14, -1, -1, 11, -1, -1, 15, -1},
+     {9, -1, -1, 13, -1, -1, 10, -1, -1, 14, -1, -1, 11, -1, -1, 15}},
+};
+
+//two int16 values packed so that _mm_madd_epi16 multiplies the even lane by lo and the odd lane by hi
+static inline int pair16(int lo, int hi)
+{
+    return (int)((uint32_t)(uint16_t)lo | (uint32_t)(uint16_t)hi << 16);
+}
+
+/**
+ * @brief Converts 8 YUYV pixels to R, G and B as saturated int16, even pixels first.
+ *
+ */
+__attribute__((target("sse4.1"))) static inline void rgb8_sse41(__m128i px, const color_coeffs_t *c, __m128i *r, __m128i *g, __m128i *b)
+{
+    __m128i y = _mm_sub_epi16(_mm_and_si128(px, _mm_set1_epi16(0x00ff)), _mm_set1_epi16(c->y_offset));
+    __m128i uv = _mm_sub_epi16(_mm_srli_epi16(px, 8), _mm_set1_epi16(128));
+    __m128i round = _mm_set1_epi32(COEFF_ROUND);
+
+    __m128i ye = _mm_madd_epi16(y, _mm_set1_epi32(pair16(c->cy, 0)));
+    __m128i yo = _mm_madd_epi16(y, _mm_set1_epi32(pair16(0, c->cy)));
+    __m128i rv = _mm_add_epi32(_mm_madd_epi16(uv, _mm_set1_epi32(pair16(0, c->crv))), round);
+    __m128i guv = _mm_add_epi32(_mm_madd_epi16(uv, _mm_set1_epi32(pair16(c->cgu, c->cgv))), round);
+    __m128i bu = _mm_add_epi32(_mm_madd_epi16(uv, _mm_set1_epi32(pair16(c->cbu, 0))), round);
+
+    *r = _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(ye, rv), COEFF_SHIFT), _mm_srai_epi32(_mm_add_epi32(yo, rv), COEFF_SHIFT));
+    *g = _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(ye, guv), COEFF_SHIFT), _mm_srai_epi32(_mm_add_epi32(yo, guv), COEFF_SHIFT));
+    *b = _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(ye, bu), COEFF_SHIFT), _mm_srai_epi32(_mm_add_epi32(yo, bu), COEFF_SHIFT));
+}
+
+__attribute__((target("sse4.1"))) static void rgb24_row_sse41(const uint8_t *src, uint8_t *dst, unsigned int width, const color_coeffs_t *c)
+{
+    __m128i mask[3][3];
+    for (int k = 0; k < 3; k++)
+        for (int ch = 0; ch < 3; ch++)
+            mask[k][ch] = _mm_loadu_si128((const __m128i *)rgb24_shuffle[k][ch]);
+
+    unsigned int i = 0;
+    for (; i + 16 <= width; i += 16, src += 32, dst += 48)
+    {
+        __m128i r0, g0, b0, r1, g1, b1;
+        rgb8_sse41(_mm_loadu_si128((const __m128i *)src), c, &r0, &g0, &b0);
+        rgb8_sse41(_mm_loadu_si128((const __m128i *)(src + 16)), c, &r1, &g1, &b1);
+        __m128i r = _mm_packus_epi16(r0, r1);
+        __m128i g = _mm_packus_epi16(g0, g1);
+        __m128i b = _mm_packus_epi16(b0, b1);
+        for (int k = 0; k < 3; k++)
+        {
+            __m128i out = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(r, mask[k][0]), _mm_shuffle_epi8(g, mask[k][1])),
+                                       _mm_shuffle_epi8(b, mask[k][2]));
+            _mm_storeu_si128((__m128i *)(dst + 16 * k), out);
+        }
+    }
+    rgb24_row_scalar(src, dst, width - i, c);
+}
+
+__attribute__((target("sse4.1"))) static void luma_row_sse41(const uint8_t *src, uint8_t *y, unsigned int width)
+{
+    const __m128i low = _mm_set1_epi16(0x00ff);
+    unsigned int i = 0;
+    for (; i + 16 <= width; i += 16)
+    {
+        __m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i *)(src + 2 * i)), low);
+        __m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i *)(src + 2 * i + 16)), low);
+        _mm_storeu_si128((__m128i *)(y + i), _mm_packus_epi16(a, b));
+    }
+    luma_row_scalar(src + 2 * i, y + i, width - i);
+}
+
+__attribute__((target("sse4.1"))) static inline __m128i chroma8_sse41(const uint8_t *row0, const uint8_t *row1)
+{
+    //U V of 8 pixels as int16, rows averaged
+    __m128i avg = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)row0), _mm_loadu_si128((const __m128i *)row1));
+    return _mm_srli_epi16(avg, 8);
+}
+
+__attribute__((target("sse4.1"))) static void uv_row_sse41(const uint8_t *row0, const uint8_t *row1, uint8_t *uv, unsigned int width)
+{
+    unsigned int i = 0;
+    for (; i + 16 <= width; i += 16)
+    {
+        __m128i a = chroma8_sse41(row0 + 2 * i, row1 + 2 * i);
+        __m128i b = chroma8_sse41(row0 + 2 * i + 16, row1 + 2 * i + 16);
+        _mm_storeu_si128((__m128i *)(uv + i), _mm_packus_epi16(a, b));
+    }
+    uv_row_scalar(row0 + 2 * i, row1 + 2 * i, uv + i, width - i);
+}
+
+__attribute__((target("sse4.1"))) static void u_v_row_sse41(const uint8_t *row0, const uint8_t *row1, uint8_t *u, uint8_t *v, unsigned int width)
+{
+    const __m128i low = _mm_set1_epi16(0x00ff);
+    unsigned int i = 0;
+    for (; i + 32 <= width; i += 32)
+    {
+        const uint8_t *p0 = row0 + 2 * i, *p1 = row1 + 2 * i;
+        __m128i lo = _mm_packus_epi16(chroma8_sse41(p0, p1), chroma8_sse41(p0 + 16, p1 + 16));
+        __m128i hi = _mm_packus_epi16(chroma8_sse41(p0 + 32, p1 + 32), chroma8_sse41(p0 + 48, p1 + 48));
+        _mm_storeu_si128((__m128i *)(u + i / 2), _mm_packus_epi16(_mm_and_si128(lo, low), _mm_and_si128(hi, low)));
+        _mm_storeu_si128((__m128i *)(v + i / 2), _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+    }
+    u_v_row_scalar(row0 + 2 * i, row1 + 2 * i, u + i / 2, v + i / 2, width - i);
+}
+
+__attribute__((target("sse4.1"))) static void vsum_row_sse41(const uint8_t *src, uint16_t *acc, unsigned int n, int first)
+{
+    const __m128i zero = _mm_setzero_si128();
+    unsigned int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i px = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i lo = _mm_cvtepu8_epi16(px);
+        __m128i hi = _mm_unpackhi_epi8(px, zero);
+        if (!first)
+        {
+            lo = _mm_add_epi16(lo, _mm_loadu_si128((const __m128i *)(acc + i)));
+            hi = _mm_add_epi16(hi, _mm_loadu_si128((const __m128i *)(acc + i + 8)));
+        }
+        _mm_storeu_si128((__m128i *)(acc + i), lo);
+        _mm_storeu_si128((__m128i *)(acc + i + 8), hi);
+    }
+    vsum_row_scalar(src + i, acc + i, n - i, first);
+}
+
+__attribute__((target("sse4.1"))) static void vlerp_row_sse41(const uint8_t *row0, const uint8_t *row1, unsigned int weight, uint16_t *out, unsigned int n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i w0 = _mm_set1_epi16(256 - weight);
+    const __m128i w1 = _mm_set1_epi16(weight);
+    unsigned int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        //products stay below 65536, so the low 16 bits are exact
+        __m128i a = _mm_loadu_si128((const __m128i *)(row0 + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(row1 + i));
+        __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_cvtepu8_epi16(a), w0), _mm_mullo_epi16(_mm_cvtepu8_epi16(b), w1));
+        __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), w0), _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), w1));
+        _mm_storeu_si128((__m128i *)(out + i), lo);
+        _mm_storeu_si128((__m128i *)(out + i + 8), hi);
+    }
+    vlerp_row_scalar(row0 + i, row1 + i, weight, out + i, n - i);
+}
+
+__attribute__((target("sse4.1"))) static void sample_row_sse41(const uint8_t *src, uint8_t *y, unsigned int n, unsigned int step)
+{
+    unsigned int i = 0;
+    if (step == 1)
+    {
+        const __m128i mask = _mm_set1_epi16(0xff);
+        for (; i + 16 <= n; i += 16)
+        {
+            __m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i *)(src + 2 * i)), mask);
+            __m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i *)(src + 2 * i + 16)), mask);
+            _mm_storeu_si128((__m128i *)(y + i), _mm_packus_epi16(a, b));
+        }
+    }
+    else if (step == 2)
+    {
+        const __m128i mask = _mm_set1_epi32(0xff);
+        for (; i + 16 <= n; i += 16)
+        {
+            const __m128i *p = (const __m128i *)(src + 4 * i);
+            __m128i ab = _mm_packus_epi32(_mm_and_si128(_mm_loadu_si128(p), mask), _mm_and_si128(_mm_loadu_si128(p + 1), mask));
+            __m128i cd = _mm_packus_epi32(_mm_and_si128(_mm_loadu_si128(p + 2), mask), _mm_and_si128(_mm_loadu_si128(p + 3), mask));
+            _mm_storeu_si128((__m128i *)(y + i), _mm_packus_epi16(ab, cd));
+        }
+    }
+    sample_row_scalar(src + 2 * step * i, y + i, n - i, step);
+}
+
+__attribute__((target("sse4.1"))) static void chunk_sum_row_sse41(const uint8_t *y, unsigned int n, uint32_t *chunks)
+{
+    const __m128i zero = _mm_setzero_si128();
+    unsigned int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i sad = _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(y + i)), zero);
+        chunks[i / 8] += (uint32_t)_mm_cvtsi128_si32(sad);
+        chunks[i / 8 + 1] += (uint32_t)_mm_extract_epi32(sad, 2);
+    }
+    chunk_sum_row_scalar(y + i, n - i, chunks + i / 8);
+}
+
+__attribute__((target("sse4.1"))) static uint64_t sum_u32_sse41(__m128i v)
+{
+    return (uint64_t)(uint32_t)_mm_extract_epi32(v, 0) + (uint32_t)_mm_extract_epi32(v, 1) + (uint32_t)_mm_extract_epi32(v, 2) +
+           (uint32_t)_mm_extract_epi32(v, 3);
+}
+
+__attribute__((target("sse4.1"))) static uint64_t sumsq_row_sse41(const uint8_t *y, unsigned int n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    uint64_t sum = 0;
+    unsigned int i = 0;
+    while (i + 16 <= n)
+    {
+        //a 32-bit lane gains at most 4 * 255^2 a step, so it is emptied every 4096 steps
+        __m128i acc = zero;
+        for (unsigned int k = 0; k < 4096 && i + 16 <= n; k++, i += 16)
+        {
+            __m128i px = _mm_loadu_si128((const __m128i *)(y + i));
+            __m128i lo = _mm_cvtepu8_epi16(px);
+            __m128i hi = _mm_unpackhi_epi8(px, zero);
+            acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+        }
+        sum += sum_u32_sse41(acc);
+    }
+    return sum + sumsq_row_scalar(y + i, n - i);
+}
+
+__attribute__((target("sse4.1"))) static inline __m128i load8_sse41(const uint8_t *p)
+{
+    return _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)p));
+}
+
+__attribute__((target("sse4.1"))) static uint64_t tenengrad_row_sse41(const uint8_t *r0, const uint8_t *r1, const uint8_t *r2, unsigned int n)
+{
+    uint64_t sum = 0;
+    unsigned int i = 1;
+    while (i + 9 <= n)
+    {
+        //a 32-bit lane gains at most 4 * 1020^2 a step, so it is emptied every 256 steps
+        __m128i acc = _mm_setzero_si128();
+        for (unsigned int k = 0; k < 256 && i + 9 <= n; k++, i += 8)
+        {
+            __m128i a0 = load8_sse41(r0 + i - 1), a1 = load8_sse41(r0 + i), a2 = load8_sse41(r0 + i + 1);
+            __m128i b0 = load8_sse41(r1 + i - 1), b2 = load8_sse41(r1 + i + 1);
+            __m128i c0 = load8_sse41(r2 + i - 1), c1 = load8_sse41(r2 + i), c2 = load8_sse41(r2 + i + 1);
+            __m128i gx = _mm_sub_epi16(_mm_add_epi16(_mm_add_epi16(a2, c2), _mm_slli_epi16(b2, 1)),
+                                       _mm_add_epi16(_mm_add_epi16(a0, c0), _mm_slli_epi16(b0, 1)));
+            __m128i gy = _mm_sub_epi16(_mm_add_epi16(_mm_add_epi16(c0, c2), _mm_slli_epi16(c1, 1)),
+                                       _mm_add_epi16(_mm_add_epi16(a0, a2), _mm_slli_epi16(a1, 1)));
+            acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_madd_epi16(gx, gx), _mm_madd_epi16(gy, gy)));
+        }
+        sum += sum_u32_sse41(acc);
+    }
+    return sum + tenengrad_row_scalar(r0 + i - 1, r1 + i - 1, r2 + i - 1, n - i + 1);
+}
+
+//8x8 transpose of 16-bit values
+__attribute__((target("sse4.1"))) static inline void transpose8_sse41(__m128i *r)
+{
+    __m128i a0 = _mm_unpacklo_epi16(r[0], r[1]), a1 = _mm_unpackhi_epi16(r[0], r[1]);
+    __m128i a2 = _mm_unpacklo_epi16(r[2], r[3]), a3 = _mm_unpackhi_epi16(r[2], r[3]);
+    __m128i a4 = _mm_unpacklo_epi16(r[4], r[5]), a5 = _mm_unpackhi_epi16(r[4], r[5]);
+    __m128i a6 = _mm_unpacklo_epi16(r[6], r[7]), a7 = _mm_unpackhi_epi16(r[6], r[7]);
+    __m128i b0 = _mm_unpacklo_epi32(a0, a2), b1 = _mm_unpackhi_epi32(a0, a2);
+    __m128i b2 = _mm_unpacklo_epi32(a1, a3), b3 = _mm_unpackhi_epi32(a1, a3);
+    __m128i b4 = _mm_unpacklo_epi32(a4, a6), b5 = _mm_unpackhi_epi32(a4, a6);
+    __m128i b6 = _mm_unpacklo_epi32(a5, a7), b7 = _mm_unpackhi_epi32(a5, a7);
+    r[0] = _mm_unpacklo_epi64(b0, b4), r[1] = _mm_unpackhi_epi64(b0, b4);
+    r[2] = _mm_unpacklo_epi64(b1, b5), r[3] = _mm_unpackhi_epi64(b1, b5);
+    r[4] = _mm_unpacklo_epi64(b2, b6), r[5] = _mm_unpackhi_epi64(b2, b6);
+    r[6] = _mm_unpacklo_epi64(b3, b7), r[7] = _mm_unpackhi_epi64(b3, b7);
+}
+
+//rounds and shifts 32-bit sums of the low and high four lanes back to 16 bits
+__attribute__((target("sse4.1"))) static inline __m128i descale_sse41(__m128i lo, __m128i hi, int shift)
+{
+    __m128i round = _mm_set1_epi32(1 << (shift - 1));
+    return _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(lo, round), shift), _mm_srai_epi32(_mm_add_epi32(hi, round), shift));
+}
+
+//one pass of fdct8_scalar on 8 lanes at once: d[i] holds value i of every lane
+__attribute__((target("sse4.1"))) static inline void fdct8_sse41(__m128i *d, int pass)
+{
+    __m128i t0 = _mm_add_epi16(d[0], d[7]), t7 = _mm_sub_epi16(d[0], d[7]);
+    __m128i t1 = _mm_add_epi16(d[1], d[6]), t6 = _mm_sub_epi16(d[1], d[6]);
+    __m128i t2 = _mm_add_epi16(d[2], d[5]), t5 = _mm_sub_epi16(d[2], d[5]);
+    __m128i t3 = _mm_add_epi16(d[3], d[4]), t4 = _mm_sub_epi16(d[3], d[4]);
+    __m128i t10 = _mm_add_epi16(t0, t3), t13 = _mm_sub_epi16(t0, t3);
+    __m128i t11 = _mm_add_epi16(t1, t2), t12 = _mm_sub_epi16(t1, t2);
+    int shift = pass == 1 ? DCT_SHIFT1 : DCT_SHIFT2;
+
+    if (pass == 1)
+    {
+        d[0] = _mm_slli_epi16(_mm_add_epi16(t10, t11), DCT_PASS1_BITS);
+        d[4] = _mm_slli_epi16(_mm_sub_epi16(t10, t11), DCT_PASS1_BITS);
+    }
+    else
+    {
+        __m128i round = _mm_set1_epi16(1 << (DCT_PASS1_BITS - 1));
+        d[0] = _mm_srai_epi16(_mm_add_epi16(_mm_add_epi16(t10, t11), round), DCT_PASS1_BITS);
+        d[4] = _mm_srai_epi16(_mm_add_epi16(_mm_sub_epi16(t10, t11), round), DCT_PASS1_BITS);
+    }
+    __m128i even_lo = _mm_unpacklo_epi16(t13, t12), even_hi = _mm_unpackhi_epi16(t13, t12);
+    __m128i k2 = _mm_set1_epi32(pair16(DCT_EVEN_A, DCT_EVEN_B)), k6 = _mm_set1_epi32(pair16(DCT_EVEN_B, DCT_EVEN_C));
+    d[2] = descale_sse41(_mm_madd_epi16(even_lo, k2), _mm_madd_epi16(even_hi, k2), shift);
+    d[6] = descale_sse41(_mm_madd_epi16(even_lo, k6), _mm_madd_epi16(even_hi, k6), shift);
+
+    __m128i t45_lo = _mm_unpacklo_epi16(t4, t5), t45_hi = _mm_unpackhi_epi16(t4, t5);
+    __m128i t67_lo = _mm_unpacklo_epi16(t6, t7), t67_hi = _mm_unpackhi_epi16(t6, t7);
+    for (int k = 0; k < 4; k++)
+    {
+        __m128i k45 = _mm_set1_epi32(pair16(dct_odd[k][0], dct_odd[k][1]));
+        __m128i k67 = _mm_set1_epi32(pair16(dct_odd[k][2], dct_odd[k][3]));
+        d[2 * k + 1] = descale_sse41(_mm_add_epi32(_mm_madd_epi16(t45_lo, k45), _mm_madd_epi16(t67_lo, k67)),
+                                     _mm_add_epi32(_mm_madd_epi16(t45_hi, k45), _mm_madd_epi16(t67_hi, k67)), shift);
+    }
+}
+
+__attribute__((target("sse4.1"))) static inline __m128i quantize_sse41(__m128i x, const jpeg_quant_t *q, int i)
+{
+    __m128i t = _mm_add_epi16(_mm_abs_epi16(x), _mm_loadu_si128((const __m128i *)(q->corr + i)));
+    t = _mm_mulhi_epu16(t, _mm_loadu_si128((const __m128i *)(q->recip + i)));
+    t = _mm_mulhi_epu16(t, _mm_loadu_si128((const __m128i *)(q->scale + i)));
+    return _mm_sign_epi16(t, x);
+}
+
+//transforms and quantizes the block whose row i is r[i]; returns the mask of non-zero coefficients
+__attribute__((target("sse4.1"))) static uint64_t fdct_quant_sse41(__m128i *r, const jpeg_quant_t *q, int16_t *out)
+{
+    fdct8_sse41(r, 1);
+    transpose8_sse41(r);
+    fdct8_sse41(r, 2);
+    uint64_t nonzero = 0;
+    for (int u = 0; u < 8; u += 2)
+    {
+        __m128i c0 = quantize_sse41(r[u], q, u * 8), c1 = quantize_sse41(r[u + 1], q, u * 8 + 8);
+        _mm_storeu_si128((__m128i *)(out + u * 8), c0);
+        _mm_storeu_si128((__m128i *)(out + u * 8 + 8), c1);
+        __m128i zero = _mm_cmpeq_epi8(_mm_packs_epi16(c0, c1), _mm_setzero_si128());
+        nonzero |= (uint64_t)(~_mm_movemask_epi8(zero) & 0xffff) << (u * 8);
+    }
+    return nonzero;
+}
+
+__attribute__((target("sse4.1"))) static inline __m128i jpeg_luma_sse41(__m128i y, int limited)
+{
+    if (!limited)
+    {
+        return _mm_sub_epi16(y, _mm_set1_epi16(128));
+    }
+    __m128i v = _mm_mulhrs_epi16(_mm_slli_epi16(_mm_sub_epi16(y, _mm_set1_epi16(16)), 1), _mm_set1_epi16(JPEG_Y_GAIN));
+    v = _mm_min_epi16(_mm_max_epi16(v, _mm_setzero_si128()), _mm_set1_epi16(255));
+    return _mm_sub_epi16(v, _mm_set1_epi16(128));
+}
+
+__attribute__((target("sse4.1"))) static inline __m128i jpeg_chroma_sse41(__m128i c, int limited)
+{
+    c = _mm_sub_epi16(c, _mm_set1_epi16(128));
+    if (!limited)
+    {
+        return c;
+    }
+    __m128i v = _mm_mulhrs_epi16(_mm_slli_epi16(c, 1), _mm_set1_epi16(JPEG_C_GAIN));
+    return _mm_min_epi16(_mm_max_epi16(v, _mm_set1_epi16(-128)), _mm_set1_epi16(127));
+}
+
+__attribute__((target("sse4.1"))) static void jpeg_mcu_sse41(const uint8_t *src, size_t stride, int limited, const jpeg_quant_t quant[2],
+                                                           int16_t *coefs, uint64_t masks[4])
+{
+    const __m128i luma = _mm_set1_epi16(0x00ff);
+    const __m128i split = _mm_setr_epi8(0, 1, 4, 5, 8, 9, 12, 13, 2, 3, 6, 7, 10, 11, 14, 15); //U U U U V V V V
+    __m128i y0[8], y1[8], cb[8], cr[8];
+    for (int r = 0; r < 8; r++)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + r * stride));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + r * stride + 16));
+        y0[r] = jpeg_luma_sse41(_mm_and_si128(a, luma), limited);
+        y1[r] = jpeg_luma_sse41(_mm_and_si128(b, luma), limited);
+        __m128i uv_a = _mm_shuffle_epi8(_mm_srli_epi16(a, 8), split);
+        __m128i uv_b = _mm_shuffle_epi8(_mm_srli_epi16(b, 8), split);
+        cb[r] = jpeg_chroma_sse41(_mm_unpacklo_epi64(uv_a, uv_b), limited);
+        cr[r] = jpeg_chroma_sse41(_mm_unpackhi_epi64(uv_a, uv_b), limited);
+    }
+    masks[0] = fdct_quant_sse41(y0, &quant[0], coefs);
+    masks[1] = fdct_quant_sse41(y1, &quant[0], coefs + 64);
+    masks[2] = fdct_quant_sse41(cb, &quant[1], coefs + 128);
+    masks[3] = fdct_quant_sse41(cr, &quant[1], coefs + 192);
+}
+
+static const kernels_t sse41_kernels = {ACAM_ISA_SSE41, rgb24_row_sse41, luma_row_sse41, uv_row_sse41, u_v_row_sse41,
+                                        vsum_row_sse41, vlerp_row_sse41, sample_row_sse41, chunk_sum_row_sse41,
+                                        sumsq_row_sse41, tenengrad_row_sse41, jpeg_mcu_sse41};
+
+/*
+ * The AVX2 kernels do the same per 128-bit lane. Packing two registers interleaves
+ * their lanes, so every pack to bytes is followed by a qword permute that puts the
+ * pixels back in memory order.
+ */
+#define QWORD_ORDER _MM_SHUFFLE(3, 1, 2, 0)
+
+__attribute__((target("avx2"))) static inline void rgb16_avx2(__m256i px, const color_coeffs_t *c, __m256i *r, __m256i *g, __m256i *b)
+{
+    __m256i y = _mm256_sub_epi16(_mm256_and_si256(px, _mm256_set1_epi16(0x00ff)), _mm256_set1_epi16(c->y_offset));
+    __m256i uv = _mm256_sub_epi16(_mm256_srli_epi16(px, 8), _mm256_set1_epi16(128));
+    __m256i round = _mm256_set1_epi32(COEFF_ROUND);
+
+    __m256i ye = _mm256_madd_epi16(y, _mm256_set1_epi32(pair16(c->cy, 0)));
+    __m256i yo = _mm256_madd_epi16(y, _mm256_set1_epi32(pair16(0, c->cy)));
+    __m256i rv = _mm256_add_epi32(_mm256_madd_epi16(uv, _mm256_set1_epi32(pair16(0, c->crv))), round);
+    __m256i guv = _mm256_add_epi32(_mm256_madd_epi16(uv, _mm256_set1_epi32(pair16(c->cgu, c->cgv))), round);
+    __m256i bu = _mm256_add_epi32(_mm256_madd_epi16(uv, _mm256_set1_epi32(pair16(c->cbu, 0))), round);
+
+    *r = _mm256_packs_epi32(_mm256_srai_epi32(_mm256_add_epi32(ye, rv), COEFF_SHIFT), _mm256_srai_epi32(_mm256_add_epi32(yo, rv), COEFF_SHIFT));
+    *g = _mm256_packs_epi32(_mm256_srai_epi32(_mm256_add_epi32(ye, guv), COEFF_SHIFT), _mm256_srai_epi32(_mm256_add_epi32(yo, guv), COEFF_SHIFT));
+    *b = _mm256_packs_epi32(_mm256_srai_epi32(_mm256_add_epi32(ye, bu), COEFF_SHIFT), _mm256_srai_epi32(_mm256_add_epi32(yo, bu), COEFF_SHIFT));
+}
+
+__attribute__((target("avx2"))) static void rgb24_row_avx2(const uint8_t *src, uint8_t *dst, unsigned int width, const color_coeffs_t *c)
+{
+    __m256i mask[3][3];
+    for (int k = 0; k < 3; k++)
+        for (int ch = 0; ch < 3; ch++)
+            mask[k][ch] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)rgb24_shuffle[k][ch]));
+
+    unsigned int i = 0;
+    for (; i + 32 <= width; i += 32, src += 64, dst += 96)
+    {
+        __m256i r0, g0, b0, r1, g1, b1;
+        rgb16_avx2(_mm256_loadu_si256((const __m256i *)src), c, &r0, &g0, &b0);
+        rgb16_avx2(_mm256_loadu_si256((const __m256i *)(src + 32)), c, &r1, &g1, &b1);
+        //lane 0 holds pixels 0..15, lane 1 pixels 16..31
+        __m256i r = _mm256_permute4x64_epi64(_mm256_packus_epi16(r0, r1), QWORD_ORDER);
+        __m256i g = _mm256_permute4x64_epi64(_mm256_packus_epi16(g0, g1), QWORD_ORDER);
+        __m256i b = _mm256_permute4x64_epi64(_mm256_packus_epi16(b0, b1), QWORD_ORDER);
+        for (int k = 0; k < 3; k++)
+        {
+            __m256i out = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(r, mask[k][0]), _mm256_shuffle_epi8(g, mask[k][1])),
+                                          _mm256_shuffle_epi8(b, mask[k][2]));
+            _mm_storeu_si128((__m128i *)(dst + 16 * k), _mm256_castsi256_si128(out));
+            _mm_storeu_si128((__m128i *)(dst + 48 + 16 * k), _mm256_extracti128_si256(out, 1));
+        }
+    }
+    rgb24_row_scalar(src, dst, width - i, c);
+}
+
+__attribute__((target("avx2"))) static void luma_row_avx2(const uint8_t *src, uint8_t *y, unsigned int width)
+{
+    const __m256i low = _mm256_set1_epi16(0x00ff);
+    unsigned int i = 0;
+    for (; i + 32 <= width; i += 32)
+    {
+        __m256i a = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(src + 2 * i)), low);
+        __m256i b = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(src + 2 * i + 32)), low);
+        _mm256_storeu_si256((__m256i *)(y + i), _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), QWORD_ORDER));
+    }
+    luma_row_scalar(src + 2 * i, y + i, width - i);
+}
+
+__attribute__((target("avx2"))) static inline __m256i chroma16_avx2(const uint8_t *row0, const uint8_t *row1)
+{
+    //U V of 16 pixels as int16, rows averaged
+    __m256i avg = _mm256_avg_epu8(_mm256_loadu_si256((const __m256i *)row0), _mm256_loadu_si256((const __m256i *)row1));
+    return _mm256_srli_epi16(avg, 8);
+}
+
+__attribute__((target("avx2"))) static inline __m256i chroma32_avx2(const uint8_t *row0, const uint8_t *row1)
+{
+    //U V of 32 pixels as bytes, in memory order
+    __m256i packed = _mm256_packus_epi16(chroma16_avx2(row0, row1), chroma16_avx2(row0 + 32, row1 + 32));
+    return _mm256_permute4x64_epi64(packed, QWORD_ORDER);
+}
+
+__attribute__((target("avx2"))) static void uv_row_avx2(const uint8_t *row0, const uint8_t *row1, uint8_t *uv, unsigned int width)
+{
+    unsigned int i = 0;
+    for (; i + 32 <= width; i += 32)
+    {
+        _mm256_storeu_si256((__m256i *)(uv + i), chroma32_avx2(row0 + 2 * i, row1 + 2 * i));
+    }
+    uv_row_scalar(row0 + 2 * i, row1 + 2 * i, uv + i, width - i);
+}
+
+__attribute__((target("avx2"))) static void u_v_row_avx2(const uint8_t *row0, const uint8_t *row1, uint8_t *u, uint8_t *v, unsigned int width)
+{
+    const __m256i low = _mm256_set1_epi16(0x00ff);
+    unsigned int i = 0;
+    for (; i + 64 <= width; i += 64)
+    {
+        __m256i lo = chroma32_avx2(row0 + 2 * i, row1 + 2 * i);
+        __m256i hi = chroma32_avx2(row0 + 2 * i + 64, row1 + 2 * i + 64);
+        __m256i us = _mm256_packus_epi16(_mm256_and_si256(lo, low), _mm256_and_si256(hi, low));
+        __m256i vs = _mm256_packus_epi16(_mm256_srli_epi16(lo, 8), _mm256_srli_epi16(hi, 8));
+        _mm256_storeu_si256((__m256i *)(u + i / 2), _mm256_permute4x64_epi64(us, QWORD_ORDER));
+        _mm256_storeu_si256((__m256i *)(v + i / 2), _mm256_permute4x64_epi64(vs, QWORD_ORDER));
+    }
+    u_v_row_scalar(row0 + 2 * i, row1 + 2 * i, u + i / 2, v + i / 2, width - i);
+}
+
+__attribute__((target("avx2"))) static void vsum_row_avx2(const uint8_t *src, uint16_t *acc, unsigned int n, int first)
+{
+    unsigned int i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i lo = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(src + i)));
+        __m256i hi = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(src + i + 16)));
+        if (!first)
+        {
+            lo = _mm256_add_epi16(lo, _mm256_loadu_si256((const __m256i *)(acc + i)));
+            hi = _mm256_add_epi16(hi, _mm256_loadu_si256((const __m256i *)(acc + i + 16)));
+        }
+        _mm256_storeu_si256((__m256i *)(acc + i), lo);
+        _mm256_storeu_si256((__m256i *)(acc + i + 16), hi);
+    }
+    vsum_row_scalar(src + i, acc + i, n - i, first);
+}
+
+__attribute__((target("avx2"))) static void vlerp_row_avx2(const uint8_t *row0, const uint8_t *row1, unsigned int weight, uint16_t *out, unsigned int n)
+{
+    const __m256i w0 = _mm256_set1_epi16(256 - weight);
+    const __m256i w1 = _mm256_set1_epi16(weight);
+    unsigned int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(row0 + i)));
+        __m256i b = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(row1 + i)));
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_add_epi16(_mm256_mullo_epi16(a, w0), _mm256_mullo_epi16(b, w1)));
+    }
+    vlerp_row_scalar(row0 + i, row1 + i, weight, out + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void sample_row_avx2(const uint8_t *src, uint8_t *y, unsigned int n, unsigned int step)
+{
+    unsigned int i = 0;
+    if (step == 1)
+    {
+        const __m256i mask = _mm256_set1_epi16(0xff);
+        for (; i + 32 <= n; i += 32)
+        {
+            __m256i a = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(src + 2 * i)), mask);
+            __m256i b = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(src + 2 * i + 32)), mask);
+            //packing works per 128-bit lane; put the four 8-byte runs back in order
+            _mm256_storeu_si256((__m256i *)(y + i), _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8));
+        }
+    }
+    else if (step == 2)
+    {
+        const __m256i mask = _mm256_set1_epi32(0xff);
+        const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+        for (; i + 32 <= n; i += 32)
+        {
+            const __m256i *p = (const __m256i *)(src + 4 * i);
+            __m256i ab = _mm256_packus_epi32(_mm256_and_si256(_mm256_loadu_si256(p), mask), _mm256_and_si256(_mm256_loadu_si256(p + 1), mask));
+            __m256i cd = _mm256_packus_epi32(_mm256_and_si256(_mm256_loadu_si256(p + 2), mask), _mm256_and_si256(_mm256_loadu_si256(p + 3), mask));
+            _mm256_storeu_si256((__m256i *)(y + i), _mm256_permutevar8x32_epi32(_mm256_packus_epi16(ab, cd), order));
+        }
+    }
+    sample_row_scalar(src + 2 * step * i, y + i, n - i, step);
+}
+
+__attribute__((target("avx2"))) static void chunk_sum_row_avx2(const uint8_t *y, unsigned int n, uint32_t *chunks)
+{
+    unsigned int i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i sad = _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *)(y + i)), _mm256_setzero_si256());
+        chunks[i / 8] += (uint32_t)_mm256_extract_epi32(sad, 0);
+        chunks[i / 8 + 1] += (uint32_t)_mm256_extract_epi32(sad, 2);
+        chunks[i / 8 + 2] += (uint32_t)_mm256_extract_epi32(sad, 4);
+        chunks[i / 8 + 3] += (uint32_t)_mm256_extract_epi32(sad, 6);
+    }
+    chunk_sum_row_scalar(y + i, n - i, chunks + i / 8);
+}
+
+__attribute__((target("avx2"))) static uint64_t sum_u32_avx2(__m256i v)
+{
+    uint32_t lanes[8];
+    _mm256_storeu_si256((__m256i *)lanes, v);
+    uint64_t sum = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        sum += lanes[i];
+    }
+    return sum;
+}
+
+__attribute__((target("avx2"))) static uint64_t sumsq_row_avx2(const uint8_t *y, unsigned int n)
+{
+    uint64_t sum = 0;
+    unsigned int i = 0;
+    while (i + 32 <= n)
+    {
+        //a 32-bit lane gains at most 4 * 255^2 a step, so it is emptied every 4096 steps
+        __m256i acc = _mm256_setzero_si256();
+        for (unsigned int k = 0; k < 4096 && i + 32 <= n; k++, i += 32)
+        {
+            __m256i lo = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(y + i)));
+            __m256i hi = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(y + i + 16)));
+            acc = _mm256_add_epi32(acc, _mm256_add_epi32(_mm256_madd_epi16(lo, lo), _mm256_madd_epi16(hi, hi)));
+        }
+        sum += sum_u32_avx2(acc);
+    }
+    return sum + sumsq_row_scalar(y + i, n - i);
+}
+
+__attribute__((target("avx2"))) static inline __m256i load16_avx2(const uint8_t *p)
+{
+    return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)p));
+}
+
+__attribute__((target("avx2"))) static uint64_t tenengrad_row_avx2(const uint8_t *r0, const uint8_t *r1, const uint8_t *r2, unsigned int n)
+{
+    uint64_t sum = 0;
+    unsigned int i = 1;
+    while (i + 17 <= n)
+    {
+        //a 32-bit lane gains at most 4 * 1020^2 a step, so it is emptied every 256 steps
+        __m256i acc = _mm256_setzero_si256();
+        for (unsigned int k = 0; k < 256 && i + 17 <= n; k++, i += 16)
+        {
+            __m256i a0 = load16_avx2(r0 + i - 1), a1 = load16_avx2(r0 + i), a2 = load16_avx2(r0 + i + 1);
+            __m256i b0 = load16_avx2(r1 + i - 1), b2 = load16_avx2(r1 + i + 1);
+            __m256i c0 = load16_avx2(r2 + i - 1), c1 = load16_avx2(r2 + i), c2 = load16_avx2(r2 + i + 1);
+            __m256i gx = _mm256_sub_epi16(_mm256_add_epi16(_mm256_add_epi16(a2, c2), _mm256_slli_epi16(b2, 1)),
+                                          _mm256_add_epi16(_mm256_add_epi16(a0, c0), _mm256_slli_epi16(b0, 1)));
+            __m256i gy = _mm256_sub_epi16(_mm256_add_epi16(_mm256_add_epi16(c0, c2), _mm256_slli_epi16(c1, 1)),
+                                          _mm256_add_epi16(_mm256_add_epi16(a0, a2), _mm256_slli_epi16(a1, 1)));
+            acc = _mm256_add_epi32(acc, _mm256_add_epi32(_mm256_madd_epi16(gx, gx), _mm256_madd_epi16(gy, gy)));
+        }
+        sum += sum_u32_avx2(acc);
+    }
+    return sum + tenengrad_row_scalar(r0 + i - 1, r1 + i - 1, r2 + i - 1, n - i + 1);
+}
+
+/*
+ * The AVX2 JPEG kernel transforms two blocks at once, one per 128-bit lane: the two
+ * luma blocks, then Cb and Cr. The unpacks of the transpose stay within lanes.
+ */
+__attribute__((target("avx2"))) static inline void transpose8_avx2(__m256i *r)
+{
+    __m256i a0 = _mm256_unpacklo_epi16(r[0], r[1]), a1 = _mm256_unpackhi_epi16(r[0], r[1]);
+    __m256i a2 = _mm256_unpacklo_epi16(r[2], r[3]), a3 = _mm256_unpackhi_epi16(r[2], r[3]);
+    __m256i a4 = _mm256_unpacklo_epi16(r[4], r[5]), a5 = _mm256_unpackhi_epi16(r[4], r[5]);
+    __m256i a6 = _mm256_unpacklo_epi16(r[6], r[7]), a7 = _mm256_unpackhi_epi16(r[6], r[7]);
+    __m256i b0 = _mm256_unpacklo_epi32(a0, a2), b1 = _mm256_unpackhi_epi32(a0, a2);
+    __m256i b2 = _mm256_unpacklo_epi32(a1, a3), b3 = _mm256_unpackhi_epi32(a1, a3);
+    __m256i b4 = _mm256_unpacklo_epi32(a4, a6), b5 = _mm256_unpackhi_epi32(a4, a6);
+    __m256i b6 = _mm256_unpacklo_epi32(a5, a7), b7 = _mm256_unpackhi_epi32(a5, a7);
+    r[0] = _mm256_unpacklo_epi64(b0, b4), r[1] = _mm256_unpackhi_epi64(b0, b4);
+    r[2] = _mm256_unpacklo_epi64(b1, b5), r[3] = _mm256_unpackhi_epi64(b1, b5);
+    r[4] = _mm256_unpacklo_epi64(b2, b6), r[5] = _mm256_unpackhi_epi64(b2, b6);
+    r[6] = _mm256_unpacklo_epi64(b3, b7), r[7] = _mm256_unpackhi_epi64(b3, b7);
+}
+
+__attribute__((target("avx2"))) static inline __m256i descale_avx2(__m256i lo, __m256i hi, int shift)
+{
+    __m256i round = _mm256_set1_epi32(1 << (shift - 1));
+    return _mm256_packs_epi32(_mm256_srai_epi32(_mm256_add_epi32(lo, round), shift),
+                              _mm256_srai_epi32(_mm256_add_epi32(hi, round), shift));
+}
+
+__attribute__((target("avx2"))) static inline void fdct8_avx2(__m256i *d, int pass)
+{
+    __m256i t0 = _mm256_add_epi16(d[0], d[7]), t7 = _mm256_sub_epi16(d[0], d[7]);
+    __m256i t1 = _mm256_add_epi16(d[1], d[6]), t6 = _mm256_sub_epi16(d[1], d[6]);
+    __m256i t2 = _mm256_add_epi16(d[2], d[5]), t5 = _mm256_sub_epi16(d[2], d[5]);
+    __m256i t3 = _mm256_add_epi16(d[3], d[4]), t4 = _mm256_sub_epi16(d[3], d[4]);
+    __m256i t10 = _mm256_add_epi16(t0, t3), t13 = _mm256_sub_epi16(t0, t3);
+    __m256i t11 = _mm256_add_epi16(t1, t2), t12 = _mm256_sub_epi16(t1, t2);
+    int shift = pass == 1 ? DCT_SHIFT1 : DCT_SHIFT2;
+
+    if (pass == 1)
+    {
+        d[0] = _mm256_slli_epi16(_mm256_add_epi16(t10, t11), DCT_PASS1_BITS);
+        d[4] = _mm256_slli_epi16(_mm256_sub_epi16(t10, t11), DCT_PASS1_BITS);
+    }
+    else
+    {
+        __m256i round = _mm256_set1_epi16(1 << (DCT_PASS1_BITS - 1));
+        d[0] = _mm256_srai_epi16(_mm256_add_epi16(_mm256_add_epi16(t10, t11), round), DCT_PASS1_BITS);
+        d[4] = _mm256_srai_epi16(_mm256_add_epi16(_mm256_sub_epi16(t10, t11), round), DCT_PASS1_BITS);
+    }
+    __m256i even_lo = _mm256_unpacklo_epi16(t13, t12), even_hi = _mm256_unpackhi_epi16(t13, t12);
+    __m256i k2 = _mm256_set1_epi32(pair16(DCT_EVEN_A, DCT_EVEN_B)), k6 = _mm256_set1_epi32(pair16(DCT_EVEN_B, DCT_EVEN_C));
+    d[2] = descale_avx2(_mm256_madd_epi16(even_lo, k2), _mm256_madd_epi16(even_hi, k2), shift);
+    d[6] = descale_avx2(_mm256_madd_epi16(even_lo, k6), _mm256_madd_epi16(even_hi, k6), shift);
+
+    __m256i t45_lo = _mm256_unpacklo_epi16(t4, t5), t45_hi = _mm256_unpackhi_epi16(t4, t5);
+    __m256i t67_lo = _mm256_unpacklo_epi16(t6, t7), t67_hi = _mm256_unpackhi_epi16(t6, t7);
+    for (int k = 0; k < 4; k++)
+    {
+        __m256i k45 = _mm256_set1_epi32(pair16(dct_odd[k][0], dct_odd[k][1]));
+        __m256i k67 = _mm256_set1_epi32(pair16(dct_odd[k][2], dct_odd[k][3]));
+        d[2 * k + 1] = descale_avx2(_mm256_add_epi32(_mm256_madd_epi16(t45_lo, k45), _mm256_madd_epi16(t67_lo, k67)),
+                                    _mm256_add_epi32(_mm256_madd_epi16(t45_hi, k45), _mm256_madd_epi16(t67_hi, k67)), shift);
+    }
+}
+
+__attribute__((target("avx2"))) static inline __m256i quantize_avx2(__m256i x, const jpeg_quant_t *q, int i)
+{
+    __m256i corr = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(q->corr + i)));
+    __m256i recip = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(q->recip + i)));
+    __m256i scale = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(q->scale + i)));
+    __m256i t = _mm256_mulhi_epu16(_mm256_add_epi16(_mm256_abs_epi16(x), corr), recip);
+    return _mm256_sign_epi16(_mm256_mulhi_epu16(t, scale), x);
+}
+
+//transforms and quantizes the blocks in the low and high lanes of r into out and out + 64
+__attribute__((target("avx2"))) static void fdct_quant_avx2(__m256i *r, const jpeg_quant_t *q, int16_t *out, uint64_t masks[2])
+{
+    fdct8_avx2(r, 1);
+    transpose8_avx2(r);
+    fdct8_avx2(r, 2);
+    masks[0] = masks[1] = 0;
+    for (int u = 0; u < 8; u += 2)
+    {
+        __m256i c0 = quantize_avx2(r[u], q, u * 8), c1 = quantize_avx2(r[u + 1], q, u * 8 + 8);
+        _mm_storeu_si128((__m128i *)(out + u * 8), _mm256_castsi256_si128(c0));
+        _mm_storeu_si128((__m128i *)(out + u * 8 + 8), _mm256_castsi256_si128(c1));
+        _mm_storeu_si128((__m128i *)(out + 64 + u * 8), _mm256_extracti128_si256(c0, 1));
+        _mm_storeu_si128((__m128i *)(out + 64 + u * 8 + 8), _mm256_extracti128_si256(c1, 1));
+        __m256i zero = _mm256_cmpeq_epi8(_mm256_packs_epi16(c0, c1), _mm256_setzero_si256());
+        uint32_t nonzero = ~(uint32_t)_mm256_movemask_epi8(zero);
+        masks[0] |= (uint64_t)(nonzero & 0xffff) << (u * 8);
+        masks[1] |= (uint64_t)(nonzero >> 16) << (u * 8);
+    }
+}
+
+__attribute__((target("avx2"))) static void jpeg_mcu_avx2(const uint8_t *src, size_t stride, int limited, const jpeg_quant_t quant[2],
+                                                          int16_t *coefs, uint64_t masks[4])
+{
+    const __m256i split = _mm256_setr_epi8(0, 1, 4, 5, 8, 9, 12, 13, 2, 3, 6, 7, 10, 11, 14, 15,
+                                           0, 1, 4, 5, 8, 9, 12, 13, 2, 3, 6, 7, 10, 11, 14, 15);
+    __m256i y[8], c[8];
+    for (int r = 0; r < 8; r++)
+    {
+        __m256i px = _mm256_loadu_si256((const __m256i *)(src + r * stride));
+        __m256i luma = _mm256_and_si256(px, _mm256_set1_epi16(0x00ff)); //pixels 0-7 | 8-15
+        __m256i uv = _mm256_shuffle_epi8(_mm256_srli_epi16(px, 8), split); //U0-3 V0-3 | U4-7 V4-7
+        uv = _mm256_permute4x64_epi64(uv, QWORD_ORDER); //U0-7 | V0-7
+        if (limited)
+        {
+            luma = _mm256_mulhrs_epi16(_mm256_slli_epi16(_mm256_sub_epi16(luma, _mm256_set1_epi16(16)), 1), _mm256_set1_epi16(JPEG_Y_GAIN));
+            luma = _mm256_min_epi16(_mm256_max_epi16(luma, _mm256_setzero_si256()), _mm256_set1_epi16(255));
+            uv = _mm256_mulhrs_epi16(_mm256_slli_epi16(_mm256_sub_epi16(uv, _mm256_set1_epi16(128)), 1), _mm256_set1_epi16(JPEG_C_GAIN));
+            uv = _mm256_min_epi16(_mm256_max_epi16(uv, _mm256_set1_epi16(-128)), _mm256_set1_epi16(127));
+            y[r] = _mm256_sub_epi16(luma, _mm256_set1_epi16(128));
+            c[r] = uv;
+        }
+        else
+        {
+            y[r] = _mm256_sub_epi16(luma, _mm256_set1_epi16(128));
+            c[r] = _mm256_sub_epi16(uv, _mm256_set1_epi16(128));
+        }
+    }
+    fdct_quant_avx2(y, &quant[0], coefs, masks);
+    fdct_quant_avx2(c, &quant[1], coefs + 128, masks + 2);
+}
+
+static const kernels_t avx2_kernels = {ACAM_ISA_AVX2, rgb24_row_avx2, luma_row_avx2, uv_row_avx2, u_v_row_avx2,
+                                       vsum_row_avx2, vlerp_row_avx2, sample_row_avx2, chunk_sum_row_avx2,
+                                       sumsq_row_avx2, tenengrad_row_avx2, jpeg_mcu_avx2};
+
+#endif
+
+#ifdef ACAM_CONVERT_NEON
+
+//R, G or B of 8 pixels from their luma and shared chroma terms, saturated to 0..255
+static inline uint8x8_t rgb_channel_neon(int32x4_t y_lo, int32x4_t y_hi, int32x4_t c_lo, int32x4_t c_hi)
+{
+    int16x8_t wide = vcombine_s16(vqshrn_n_s32(vaddq_s32(y_lo, c_lo), COEFF_SHIFT), vqshrn_n_s32(vaddq_s32(y_hi, c_hi), COEFF_SHIFT));
+    return vqmovun_s16(wide);
+}
+
+static void rgb24_row_neon(const uint8_t *src, uint8_t *dst, unsigned int width, const color_coeffs_t *c)
+{
+    const int16x8_t y_offset = vdupq_n_s16(c->y_offset);
+    const int16x8_t uv_offset = vdupq_n_s16(128);
+    const int32x4_t round = vdupq_n_s32(COEFF_ROUND);
+
+    unsigned int i = 0;
+    for (; i + 16 <= width; i += 16, src += 32, dst += 48)
+    {
+        uint8x8x4_t px = vld4_u8(src); //Y0 U Y1 V of 8 pixel pairs
+        int16x8_t y0 = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(px.val[0])), y_offset);
+        int16x8_t y1 = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(px.val[2])), y_offset);
+        int16x8_t u = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(px.val[1])), uv_offset);
+        int16x8_t v = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(px.val[3])), uv_offset);
+
+        int32x4_t ye_lo = vmull_n_s16(vget_low_s16(y0), c->cy), ye_hi = vmull_n_s16(vget_high_s16(y0), c->cy);
+        int32x4_t yo_lo = vmull_n_s16(vget_low_s16(y1), c->cy), yo_hi = vmull_n_s16(vget_high_s16(y1), c->cy);
+        int32x4_t rv_lo = vmlal_n_s16(round, vget_low_s16(v), c->crv), rv_hi = vmlal_n_s16(round, vget_high_s16(v), c->crv);
+        int32x4_t guv_lo = vmlal_n_s16(vmlal_n_s16(round, vget_low_s16(u), c->cgu), vget_low_s16(v), c->cgv);
+        int32x4_t guv_hi = vmlal_n_s16(vmlal_n_s16(round, vget_high_s16(u), c->cgu), vget_high_s16(v), c->cgv);
+        int32x4_t bu_lo = vmlal_n_s16(round, vget_low_s16(u), c->cbu), bu_hi = vmlal_n_s16(round, vget_high_s16(u), c->cbu);
+
+        uint8x8x2_t r = vzip_u8(rgb_channel_neon(ye_lo, ye_hi, rv_lo, rv_hi), rgb_channel_neon(yo_lo, yo_hi, rv_lo, rv_hi));
+        uint8x8x2_t g = vzip_u8(rgb_channel_neon(ye_lo, ye_hi, guv_lo, guv_hi), rgb_channel_neon(yo_lo, yo_hi, guv_lo, guv_hi));
+        uint8x8x2_t b = vzip_u8(rgb_channel_neon(ye_lo, ye_hi, bu_lo, bu_hi), rgb_channel_neon(yo_lo, yo_hi, bu_lo, bu_hi));
+        uint8x16x3_t out;
+        out.val[0] = vcombine_u8(r.val[0], r.val[1]);
+        out.val[1] = vcombine_u8(g.val[0], g.val[1]);
+        out.val[2] = vcombine_u8(b.val[0], b.val[1]);
+        vst3q_u8(dst, out);
+    }
+    rgb24_row_scalar(src, dst, width - i, c);
+}
+
+static void luma_row_neon(const uint8_t *src, uint8_t *y, unsigned int width)
+{
+    unsigned int i = 0;
+    for (; i + 16 <= width; i += 16)
+    {
+        vst1q_u8(y + i, vld2q_u8(src + 2 * i).val[0]);
+    }
+    luma_row_scalar(src + 2 * i, y + i, width - i);
+}
+
+static void uv_row_neon(const uint8_t *row0, const uint8_t *row1, uint8_t *uv, unsigned int width)
+{
+    unsigned int i = 0;
+    for (; i + 16 <= width; i += 16)
+    {
+        vst1q_u8(uv + i, vrhaddq_u8(vld2q_u8(row0 + 2 * i).val[1], vld2q_u8(row1 + 2 * i).val[1]));
+    }
+    uv_row_scalar(row0 + 2 * i, row1 + 2 * i, uv + i, width - i);
+}
+
+static void u_v_row_neon(const uint8_t *row0, const uint8_t *row1, uint8_t *u, uint8_t *v, unsigned int width)
+{
+    unsigned int i = 0;
+    for (; i + 32 <= width; i += 32)
+    {
+        uint8x16x4_t a = vld4q_u8(row0 + 2 * i);
+        uint8x16x4_t b = vld4q_u8(row1 + 2 * i);
+        vst1q_u8(u + i / 2, vrhaddq_u8(a.val[1], b.val[1]));
+        vst1q_u8(v + i / 2, vrhaddq_u8(a.val[3], b.val[3]));
+    }
+    u_v_row_scalar(row0 + 2 * i, row1 + 2 * i, u + i / 2, v + i / 2, width - i);
+}
+
+static void vsum_row_neon(const uint8_t *src, uint16_t *acc, unsigned int n, int first)
+{
+    unsigned int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        uint8x16_t px = vld1q_u8(src + i);
+        uint16x8_t lo = first ? vdupq_n_u16(0) : vld1q_u16(acc + i);
+        uint16x8_t hi = first ? vdupq_n_u16(0) : vld1q_u16(acc + i + 8);
+        vst1q_u16(acc + i, vaddw_u8(lo, vget_low_u8(px)));
+        vst1q_u16(acc + i + 8, vaddw_u8(hi, vget_high_u8(px)));
+    }
+    vsum_row_scalar(src + i, acc + i, n - i, first);
+}
+
+static void vlerp_row_neon(const uint8_t *row0, const uint8_t *row1, unsigned int weight, uint16_t *out, unsigned int n)
+{
+    unsigned int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        uint16x8_t a = vmulq_n_u16(vmovl_u8(vld1_u8(row0 + i)), 256 - weight);
+        vst1q_u16(out + i, vmlaq_n_u16(a, vmovl_u8(vld1_u8(row1 + i)), weight));
+    }
+    vlerp_row_scalar(row0 + i, row1 + i, weight, out + i, n - i);
+}
+
+static void sample_row_neon(const uint8_t *src, uint8_t *y, unsigned int n, unsigned int step)
+{
+    unsigned int i = 0;
+    if (step == 1)
+    {
+        for (; i + 16 <= n; i += 16)
+        {
+            vst1q_u8(y + i, vld2q_u8(src + 2 * i).val[0]);
+        }
+    }
+    else if (step == 2)
+    {
+        for (; i + 16 <= n; i += 16)
+        {
+            vst1q_u8(y + i, vld4q_u8(src + 4 * i).val[0]);
+        }
+    }
+    sample_row_scalar(src + 2 * step * i, y + i, n - i, step);
+}
+
+static void chunk_sum_row_neon(const uint8_t *y, unsigned int n, uint32_t *chunks)
+{
+    unsigned int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        uint64x2_t sums = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(vld1q_u8(y + i))));
+        chunks[i / 8] += (uint32_t)vgetq_lane_u64(sums, 0);
+        chunks[i / 8 + 1] += (uint32_t)vgetq_lane_u64(sums, 1);
+    }
+    chunk_sum_row_scalar(y + i, n - i, chunks + i / 8);
+}
+
+static uint64_t sum_u32_neon(uint32x4_t v)
+{
+    uint64x2_t pairs = vpaddlq_u32(v);
+    return vgetq_lane_u64(pairs, 0) + vgetq_lane_u64(pairs, 1);
+}
+
+static uint64_t sumsq_row_neon(const uint8_t *y, unsigned int n)
+{
+    uint64_t sum = 0;
+    unsigned int i = 0;
+    while (i + 16 <= n)
+    {
+        //a 32-bit lane gains at most 4 * 255^2 a step, so it is emptied every 4096 steps
+        uint32x4_t acc = vdupq_n_u32(0);
+        for (unsigned int k = 0; k < 4096 && i + 16 <= n; k++, i += 16)
+        {
+            uint8x16_t px = vld1q_u8(y + i);
+            acc = vpadalq_u16(acc, vmull_u8(vget_low_u8(px), vget_low_u8(px)));
+            acc = vpadalq_u16(acc, vmull_u8(vget_high_u8(px), vget_high_u8(px)));
+        }
+        sum += sum_u32_neon(acc);
+    }
+    return sum + sumsq_row_scalar(y + i, n - i);
+}
+
+static inline int16x8_t load8_neon(const uint8_t *p)
+{
+    return vreinterpretq_s16_u16(vmovl_u8(vld1_u8(p)));
+}
+
+static uint64_t tenengrad_row_neon(const uint8_t *r0, const uint8_t *r1, const uint8_t *r2, unsigned int n)
+{
+    uint64_t sum = 0;
+    unsigned int i = 1;
+    while (i + 9 <= n)
+    {
+        //a 32-bit lane gains at most 4 * 1020^2 a step, so it is emptied every 256 steps
+        int32x4_t acc = vdupq_n_s32(0);
+        for (unsigned int k = 0; k < 256 && i + 9 <= n; k++, i += 8)
+        {
+            int16x8_t a0 = load8_neon(r0 + i - 1), a1 = load8_neon(r0 + i), a2 = load8_neon(r0 + i + 1);
+            int16x8_t b0 = load8_neon(r1 + i - 1), b2 = load8_neon(r1 + i + 1);
+            int16x8_t c0 = load8_neon(r2 + i - 1), c1 = load8_neon(r2 + i), c2 = load8_neon(r2 + i + 1);
+            int16x8_t gx = vsubq_s16(vaddq_s16(vaddq_s16(a2, c2), vshlq_n_s16(b2, 1)), vaddq_s16(vaddq_s16(a0, c0), vshlq_n_s16(b0, 1)));
+            int16x8_t gy = vsubq_s16(vaddq_s16(vaddq_s16(c0, c2), vshlq_n_s16(c1, 1)), vaddq_s16(vaddq_s16(a0, a2), vshlq_n_s16(a1, 1)));
+            acc = vmlal_s16(acc, vget_low_s16(gx), vget_low_s16(gx));
+            acc = vmlal_s16(acc, vget_high_s16(gx), vget_high_s16(gx));
+            acc = vmlal_s16(acc, vget_low_s16(gy), vget_low_s16(gy));
+            acc = vmlal_s16(acc, vget_high_s16(gy), vget_high_s16(gy));
+        }
+        sum += sum_u32_neon(vreinterpretq_u32_s32(acc));
+    }
+    return sum + tenengrad_row_scalar(r0 + i - 1, r1 + i - 1, r2 + i - 1, n - i + 1);
+}
+
+static inline void transpose8_neon(int16x8_t *r)
+{
+    int16x8x2_t a0 = vtrnq_s16(r[0], r[1]), a1 = vtrnq_s16(r[2], r[3]);
+    int16x8x2_t a2 = vtrnq_s16(r[4], r[5]), a3 = vtrnq_s16(r[6], r[7]);
+    //columns 0 and 4, 2 and 6 of rows 0-3 (b0) and 4-7 (b2); 1 and 5, 3 and 7 in b1 and b3
+    int32x4x2_t b0 = vtrnq_s32(vreinterpretq_s32_s16(a0.val[0]), vreinterpretq_s32_s16(a1.val[0]));
+    int32x4x2_t b1 = vtrnq_s32(vreinterpretq_s32_s16(a0.val[1]), vreinterpretq_s32_s16(a1.val[1]));
+    int32x4x2_t b2 = vtrnq_s32(vreinterpretq_s32_s16(a2.val[0]), vreinterpretq_s32_s16(a3.val[0]));
+    int32x4x2_t b3 = vtrnq_s32(vreinterpretq_s32_s16(a2.val[1]), vreinterpretq_s32_s16(a3.val[1]));
+    r[0] = vreinterpretq_s16_s32(vcombine_s32(vget_low_s32(b0.val[0]), vget_low_s32(b2.val[0])));
+    r[1] = vreinterpretq_s16_s32(vcombine_s32(vget_low_s32(b1.val[0]), vget_low_s32(b3.val[0])));
+    r[2] = vreinterpretq_s16_s32(vcombine_s32(vget_low_s32(b0.val[1]), vget_low_s32(b2.val[1])));
+    r[3] = vreinterpretq_s16_s32(vcombine_s32(vget_low_s32(b1.val[1]), vget_low_s32(b3.val[1])));
+    r[4] = vreinterpretq_s16_s32(vcombine_s32(vget_high_s32(b0.val[0]), vget_high_s32(b2.val[0])));
+    r[5] = vreinterpretq_s16_s32(vcombine_s32(vget_high_s32(b1.val[0]), vget_high_s32(b3.val[0])));
+    r[6] = vreinterpretq_s16_s32(vcombine_s32(vget_high_s32(b0.val[1]), vget_high_s32(b2.val[1])));
+    r[7] = vreinterpretq_s16_s32(vcombine_s32(vget_high_s32(b1.val[1]), vget_high_s32(b3.val[1])));
+}
+
+//vrshrn rounds exactly as the scalar code does; its shift must be a constant
+static inline int16x8_t descale_neon(int32x4_t lo, int32x4_t hi, int pass)
+{
+    if (pass == 1)
+    {
+        return vcombine_s16(vrshrn_n_s32(lo, DCT_SHIFT1), vrshrn_n_s32(hi, DCT_SHIFT1));
+    }
+    return vcombine_s16(vrshrn_n_s32(lo, DCT_SHIFT2), vrshrn_n_s32(hi, DCT_SHIFT2));
+}
+
+static inline int16x8_t dot2_neon(int16x8_t a, int16x8_t b, int16_t ka, int16_t kb, int pass)
+{
+    int32x4_t lo = vmlal_n_s16(vmull_n_s16(vget_low_s16(a), ka), vget_low_s16(b), kb);
+    int32x4_t hi = vmlal_n_s16(vmull_n_s16(vget_high_s16(a), ka), vget_high_s16(b), kb);
+    return descale_neon(lo, hi, pass);
+}
+
+static inline int16x8_t dot4_neon(int16x8_t a, int16x8_t b, int16x8_t c, int16x8_t d, const int16_t k[4], int pass)
+{
+    int32x4_t lo = vmull_n_s16(vget_low_s16(a), k[0]), hi = vmull_n_s16(vget_high_s16(a), k[0]);
+    lo = vmlal_n_s16(lo, vget_low_s16(b), k[1]), hi = vmlal_n_s16(hi, vget_high_s16(b), k[1]);
+    lo = vmlal_n_s16(lo, vget_low_s16(c), k[2]), hi = vmlal_n_s16(hi, vget_high_s16(c), k[2]);
+    lo = vmlal_n_s16(lo, vget_low_s16(d), k[3]), hi = vmlal_n_s16(hi, vget_high_s16(d), k[3]);
+    return descale_neon(lo, hi, pass);
+}
+
+static inline void fdct8_neon(int16x8_t *d, int pass)
+{
+    int16x8_t t0 = vaddq_s16(d[0], d[7]), t7 = vsubq_s16(d[0], d[7]);
+    int16x8_t t1 = vaddq_s16(d[1], d[6]), t6 = vsubq_s16(d[1], d[6]);
+    int16x8_t t2 = vaddq_s16(d[2], d[5]), t5 = vsubq_s16(d[2], d[5]);
+    int16x8_t t3 = vaddq_s16(d[3], d[4]), t4 = vsubq_s16(d[3], d[4]);
+    int16x8_t t10 = vaddq_s16(t0, t3), t13 = vsubq_s16(t0, t3);
+    int16x8_t t11 = vaddq_s16(t1, t2), t12 = vsubq_s16(t1, t2);
+
+    if (pass == 1)
+    {
+        d[0] = vshlq_n_s16(vaddq_s16(t10, t11), DCT_PASS1_BITS);
+        d[4] = vshlq_n_s16(vsubq_s16(t10, t11), DCT_PASS1_BITS);
+    }
+    else
+    {
+        d[0] = vrshrq_n_s16(vaddq_s16(t10, t11), DCT_PASS1_BITS);
+        d[4] = vrshrq_n_s16(vsubq_s16(t10, t11), DCT_PASS1_BITS);
+    }
+    d[2] = dot2_neon(t13, t12, DCT_EVEN_A, DCT_EVEN_B, pass);
+    d[6] = dot2_neon(t13, t12, DCT_EVEN_B, DCT_EVEN_C, pass);
+    for (int k = 0; k < 4; k++)
+    {
+        d[2 * k + 1] = dot4_neon(t4, t5, t6, t7, dct_odd[k], pass);
+    }
+}
+
+//(a * b) >> 16 of unsigned 16-bit lanes
+static inline uint16x8_t mulhi_u16_neon(uint16x8_t a, uint16x8_t b)
+{
+    return vcombine_u16(vshrn_n_u32(vmull_u16(vget_low_u16(a), vget_low_u16(b)), 16),
+                        vshrn_n_u32(vmull_u16(vget_high_u16(a), vget_high_u16(b)), 16));
+}
+
+static inline int16x8_t quantize_neon(int16x8_t x, const jpeg_quant_t *q, int i)
+{
+    uint16x8_t t = vaddq_u16(vreinterpretq_u16_s16(vabsq_s16(x)), vld1q_u16(q->corr + i));
+    t = mulhi_u16_neon(mulhi_u16_neon(t, vld1q_u16(q->recip + i)), vld1q_u16(q->scale + i));
+    int16x8_t v = vreinterpretq_s16_u16(t);
+    v = vbslq_s16(vcltq_s16(x, vdupq_n_s16(0)), vnegq_s16(v), v);
+    return vandq_s16(v, vreinterpretq_s16_u16(vtstq_s16(x, x)));
+}
+
+static uint64_t fdct_quant_neon(int16x8_t *r, const jpeg_quant_t *q, int16_t *out)
+{
+    static const uint8_t weights[8] = {1, 2, 4, 8, 16, 32, 64, 128};
+    const uint8x8_t bit = vld1_u8(weights);
+    fdct8_neon(r, 1);
+    transpose8_neon(r);
+    fdct8_neon(r, 2);
+    uint8x8_t rows[8];
+    for (int u = 0; u < 8; u++)
+    {
+        int16x8_t c = quantize_neon(r[u], q, u * 8);
+        vst1q_s16(out + u * 8, c);
+        rows[u] = vand_u8(vmovn_u16(vtstq_s16(c, c)), bit);
+    }
+    //pairwise sums fold the bits of row u into byte u
+    uint8x8_t folded = vpadd_u8(vpadd_u8(vpadd_u8(rows[0], rows[1]), vpadd_u8(rows[2], rows[3])),
+                                vpadd_u8(vpadd_u8(rows[4], rows[5]), vpadd_u8(rows[6], rows[7])));
+    return vget_lane_u64(vreinterpret_u64_u8(folded), 0);
+}
+
+static inline int16x8_t jpeg_luma_neon(uint8x8_t y, int limited)
+{
+    int16x8_t v = vreinterpretq_s16_u16(vmovl_u8(y));
+    if (limited)
+    {
+        v = vqrdmulhq_n_s16(vshlq_n_s16(vsubq_s16(v, vdupq_n_s16(16)), 1), JPEG_Y_GAIN);
+        v = vminq_s16(vmaxq_s16(v, vdupq_n_s16(0)), vdupq_n_s16(255));
+    }
+    return vsubq_s16(v, vdupq_n_s16(128));
+}
+
+static inline int16x8_t jpeg_chroma_neon(uint8x8_t c, int limited)
+{
+    int16x8_t v = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(c)), vdupq_n_s16(128));
+    if (limited)
+    {
+        v = vqrdmulhq_n_s16(vshlq_n_s16(v, 1), JPEG_C_GAIN);
+        v = vminq_s16(vmaxq_s16(v, vdupq_n_s16(-128)), vdupq_n_s16(127));
+    }
+    return v;
+}
+
+static void jpeg_mcu_neon(const uint8_t *src, size_t stride, int limited, const jpeg_quant_t quant[2], int16_t *coefs, uint64_t masks[4])
+{
+    int16x8_t y0[8], y1[8], cb[8], cr[8];
+    for (int r = 0; r < 8; r++)
+    {
+        uint8x8x4_t px = vld4_u8(src + r * stride); //Y0 U Y1 V of 8 pixel pairs
+        uint8x8x2_t y = vzip_u8(px.val[0], px.val[2]);
+        y0[r] = jpeg_luma_neon(y.val[0], limited);
+        y1[r] = jpeg_luma_neon(y.val[1], limited);
+        cb[r] = jpeg_chroma_neon(px.val[1], limited);
+        cr[r] = jpeg_chroma_neon(px.val[3], limited);
+    }
+    masks[0] = fdct_quant_neon(y0, &quant[0], coefs);
+    masks[1] = fdct_quant_neon(y1, &quant[0], coefs + 64);
+    masks[2] = fdct_quant_neon(cb, &quant[1], coefs + 128);
+    masks[3] = fdct_quant_neon(cr, &quant[1], coefs + 192);
+}
+
+static const kernels_t neon_kernels = {ACAM_ISA_NEON, rgb24_row_neon, luma_row_neon, uv_row_neon, u_v_row_neon,
+                                       vsum_row_neon, vlerp_row_neon, sample_row_neon, chunk_sum_row_neon,
+                                       sumsq_row_neon, tenengrad_row_neon, jpeg_mcu_neon};
+
+#endif
+
+static const kernels_t *active_kernels; //NULL until the first conversion or acam_convert_set_isa
+
+static const kernels_t *kernels_for(acam_isa_t isa)
+{
+    switch (isa)
+    {
+    case ACAM_ISA_SCALAR:
+        return &scalar_kernels;
+#ifdef ACAM_CONVERT_X86
+    case ACAM_ISA_SSE41:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse4.1") ? &sse41_kernels : NULL;
+    case ACAM_ISA_AVX2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") ? &avx2_kernels : NULL;
+#endif
+#ifdef ACAM_CONVERT_NEON
+    case ACAM_ISA_NEON:
+        return &neon_kernels;
+#endif
+    default:
+        return NULL;
+    }
+}
+
+static const kernels_t *best_kernels(void)
+{
+    static const acam_isa_t preference[] = {ACAM_ISA_AVX2, ACAM_ISA_NEON, ACAM_ISA_SSE41};
+    for (size_t i = 0; i < sizeof(preference) / sizeof(preference[0]); i++)
+    {
+        const kernels_t *k = kernels_for(preference[i]);
+        if (k != NULL)
+        {
+            return k;
+        }
+    }
+    return &scalar_kernels;
+}
+
+static const kernels_t *get_kernels(void)
+{
+    const kernels_t *k = __atomic_load_n(&active_kernels, __ATOMIC_ACQUIRE);
+    if (k == NULL)
+    {
+        // racing first callers all pick the same table
+        k = best_kernels();
+        __atomic_store_n(&active_kernels, k, __ATOMIC_RELEASE);
+    }
+    return k;
+}
+
+/**
+ * @brief Selects the instruction set used by the conversion routines. By default the
+ * fastest one the CPU supports is picked on first use.
+ *
+ * @param isa ACAM_ISA_AUTO to pick the fastest supported one again, or a specific one.
+ * @return exit status. 0 on success, ENOTSUP if the CPU or the build does not support
+ * @param isa, EINVAL if it is not an acam_isa_t.
+ */
+int acam_convert_set_isa(acam_isa_t isa)
+{
+    const kernels_t *k;
+    if (isa == ACAM_ISA_AUTO)
+    {
+        k = best_kernels();
+    }
+    else if (isa >= __ACAM_ISA_COUNT)
+    {
+        return EINVAL;
+    }
+    else if ((k = kernels_for(isa)) == NULL)
+    {
+        return ENOTSUP;
+    }
+    __atomic_store_n(&active_kernels, k, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * @brief Gets the instruction set used by the conversion routines.
+ *
+ * @return the acam_isa_t in use, never ACAM_ISA_AUTO.
+ */
+acam_isa_t acam_convert_get_isa(void)
+{
+    return get_kernels()->isa;
+}
+
+/**
+ * @brief Checks that a buffer holds a whole YUYV frame of the given size.
+ *
+ * @return 0 if it does, EINVAL otherwise.
+ */
+static int check_yuyv(const acam_buffer_t *buffer, unsigned int width, unsigned int height)
+{
+    if (width == 0 || height == 0 || width % 2 != 0)
+    {
+        DEBUG_PRINT(stderr, "YUYV frames need a non-zero, even width and a non-zero height (got %ux%u).\n", width, height);
+        return EINVAL;
+    }
+    if (buffer->bytes_used < (uint64_t)width * height * 2)
+    {
+        DEBUG_PRINT(stderr, "Buffer holds %u bytes, a %ux%u YUYV frame needs %llu.\n", buffer->bytes_used, width, height,
+                    (unsigned long long)width * height * 2);
+        return EINVAL;
+    }
+    return 0;
+}
+
+/**
+ * @brief Converts a YUYV frame to packed 24-bit RGB (R, G, B byte order).
+ *
+ * @param buffer a buffer holding a YUYV frame with rows of width * 2 bytes.
+ * @param width the frame width in pixels. Must be even.
+ * @param height the frame height in pixels.
+ * @param color the matrix and range the camera encoded the frame with.
+ * @param dst where the RGB image is written, width * height * 3 bytes.
+ * @param dst_size the size of @param dst in bytes.
+ * @return exit status. 0 on success, EINVAL if the frame size, @param color or
+ * @param dst_size is invalid.
+ */
+int acam_yuyv_to_rgb24(const acam_buffer_t *buffer, unsigned int width, unsigned int height, acam_color_t color, uint8_t *dst, size_t dst_size)
+{
+    assert(buffer && dst);
+    if (color >= __ACAM_COLOR_COUNT)
+    {
+        return EINVAL;
+    }
+    int ret = check_yuyv(buffer, width, height);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    if (dst_size < (size_t)width * height * 3)
+    {
+        DEBUG_PRINT(stderr, "RGB24 output of %zu bytes is too small for %ux%u.\n", dst_size, width, height);
+        return EINVAL;
+    }
+
+    const kernels_t *k = get_kernels();
+    const color_coeffs_t *c = &color_coeffs[color];
+    const uint8_t *src = (const uint8_t *)buffer->buf;
+    for (unsigned int row = 0; row < height; row++)
+    {
+        k->rgb24_row(src + (size_t)row * width * 2, dst + (size_t)row * width * 3, width, c);
+    }
+    return 0;
+}
+
+/**
+ * @brief Converts a YUYV frame to a 4:2:0 frame with a luma plane followed by either
+ * one interleaved chroma plane (NV12) or separate U and V planes (I420).
+ *
+ */
+static int yuyv_to_420(const acam_buffer_t *buffer, unsigned int width, unsigned int height, uint8_t *dst, size_t dst_size, int planar)
+{
+    assert(buffer && dst);
+    int ret = check_yuyv(buffer, width, height);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    size_t luma_size = (size_t)width * height;
+    size_t chroma_rows = (height + 1) / 2;
+    if (dst_size < luma_size + chroma_rows * width)
+    {
+        DEBUG_PRINT(stderr, "4:2:0 output of %zu bytes is too small for %ux%u.\n", dst_size, width, height);
+        return EINVAL;
+    }
+
+    const kernels_t *k = get_kernels();
+    const uint8_t *src = (const uint8_t *)buffer->buf;
+    size_t stride = (size_t)width * 2;
+    for (unsigned int row = 0; row < height; row++)
+    {
+        k->luma_row(src + row * stride, dst + row * width, width);
+    }
+
+    uint8_t *u = dst + luma_size;
+    uint8_t *v = u + chroma_rows * (width / 2);
+    for (size_t row = 0; row < chroma_rows; row++)
+    {
+        const uint8_t *row0 = src + 2 * row * stride;
+        // an odd last row has no partner and keeps its own chroma
+        const uint8_t *row1 = 2 * row + 1 < height ? row0 + stride : row0;
+        if (planar)
+        {
+            k->u_v_row(row0, row1, u + row * (width / 2), v + row * (width / 2), width);
+        }
+        else
+        {
+            k->uv_row(row0, row1, u + row * width, width);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Converts a YUYV frame to NV12: a luma plane followed by one plane of
+ * interleaved U and V samples at half the height. Vertically adjacent chroma samples
+ * are averaged.
+ *
+ * @param buffer a buffer holding a YUYV frame with rows of width * 2 bytes.
+ * @param width the frame width in pixels. Must be even.
+ * @param height the frame height in pixels.
+ * @param dst where the NV12 image is written, width * height + width * ((height + 1) / 2) bytes.
+ * @param dst_size the size of @param dst in bytes.
+ * @return exit status. 0 on success, EINVAL if the frame size or @param dst_size is invalid.
+ */
+int acam_yuyv_to_nv12(const acam_buffer_t *buffer, unsigned int width, unsigned int height, uint8_t *dst, size_t dst_size)
+{
+    return yuyv_to_420(buffer, width, height, dst, dst_size, 0);
+}
+
+/**
+ * @brief Converts a YUYV frame to I420: a luma plane followed by a U plane and a V
+ * plane, each at half the width and height. Vertically adjacent chroma samples are
+ * averaged.
+ *
+ * @param buffer a buffer holding a YUYV frame with rows of width * 2 bytes.
+ * @param width the frame width in pixels. Must be even.
+ * @param height the frame height in pixels.
+ * @param dst where the I420 image is written, width * height + width * ((height + 1) / 2) bytes.
+ * @param dst_size the size of @param dst in bytes.
+ * @return exit status. 0 on success, EINVAL if the frame size or @param dst_size is invalid.
+ */
+int acam_yuyv_to_i420(const acam_buffer_t *buffer, unsigned int width, unsigned int height, uint8_t *dst, size_t dst_size)
+{
+    return yuyv_to_420(buffer, width, height, dst, dst_size, 1);
+}
+
+/*
+ * Scaling. acam_yuyv_scale_rgb24 crops, scales and converts in one pass, straight
+ * from the YUYV frame: for every output row, the source rows it covers are reduced
+ * vertically into one row of 16-bit YUYV column values by the SIMD kernels (a sum
+ * for the box filter, a weighted blend of two rows for bilinear). That row is
+ * reduced horizontally into a YUYV row at the output width, one chroma pair per
+ * two output pixels, and converted by the same RGB24 row kernel as
+ * acam_yuyv_to_rgb24. Only the crop is read, no full-size intermediate image
+ * exists, and the horizontal pass, which is shared by every instruction set, keeps
+ * the results identical whichever one runs.
+ *
+ * Several targets are produced from one read of the frame: the source is walked in
+ * bands of SCALE_BAND_ROWS rows, and every target writes the output rows that end
+ * within the band before the next band is read, so the other targets find the rows
+ * in cache. With more than one thread, each one takes the same share of the output
+ * rows of every target, and so of the source.
+ */
+
+#define SCALE_BAND_ROWS 16
+#define SCALE_RECIP_SHIFT 24 //box averages divide by multiplying with a 2^24-scaled reciprocal
+
+/**
+ * @brief A target of acam_yuyv_scale_rgb24 with its crop resolved and its column
+ * table filled.
+ *
+ */
+typedef struct
+{
+    const acam_scale_target_t *target;
+    unsigned int x, y, width, height; //the crop
+    unsigned int pair0; //first YUYV pixel pair the crop touches
+    unsigned int span; //bytes of a source row the crop touches, from pair0 on
+    uint32_t *x0; //box: first source column of each output column; bilinear: its left column
+    uint32_t *x1; //box: one past its last source column; bilinear: weight of the right column, 0..255
+    unsigned int taps; //box: source columns each output column is given weights for
+    unsigned int pair_taps; //box: source pairs each output pair is given weights for
+    uint8_t *weights; //box: taps weights of each output column from x0 on, then pair_taps of each output pair
+} scale_plan_t;
+
+typedef struct
+{
+    const uint8_t *src;
+    size_t stride;
+    const scale_plan_t *plans;
+    unsigned int count;
+    const color_coeffs_t *c;
+    const kernels_t *k;
+    unsigned int part; //this job takes rows [part * height / parts, (part + 1) * height / parts) of every target
+    unsigned int parts;
+    pthread_t thread;
+    int ret;
+} scale_job_t;
+
+/**
+ * @brief Where output sample @param o of @param n lands on a source axis of
+ * @param size samples, with the centres of the first and last samples aligned.
+ *
+ * @param pos set to the source sample at or left of it, clamped to the axis.
+ * @param weight set to the share of sample @param pos + 1, in 1/256. 0 at the edges.
+ */
+static void bilinear_tap(unsigned int o, unsigned int n, unsigned int size, uint32_t *pos, uint32_t *weight)
+{
+    int64_t fixed = (int64_t)(2 * o + 1) * size * 128 / n - 128;
+    if (fixed < 0)
+        fixed = 0;
+    if (fixed > (int64_t)(size - 1) * 256)
+        fixed = (int64_t)(size - 1) * 256;
+    *pos = (uint32_t)(fixed >> 8);
+    *weight = (uint32_t)(fixed & 255);
+}
+
+/**
+ * @brief The source rows [*y0, *y1) output row @param oy of a target reads. For
+ * bilinear, *weight is the share of the second one.
+ */
+static void source_rows(const scale_plan_t *p, unsigned int oy, unsigned int *y0, unsigned int *y1, uint32_t *weight)
+{
+    unsigned int out_height = p->target->height;
+    if (p->target->filter == ACAM_SCALE_BOX)
+    {
+        *y0 = (uint64_t)oy * p->height / out_height;
+        *y1 = (uint64_t)(oy + 1) * p->height / out_height;
+        if (*y1 <= *y0)
+            *y1 = *y0 + 1; // upscaling repeats rows
+        *weight = 0;
+    }
+    else
+    {
+        uint32_t pos;
+        bilinear_tap(oy, out_height, p->height, &pos, weight);
+        *y0 = pos;
+        *y1 = *weight ? pos + 2 : pos + 1;
+    }
+    *y0 += p->y;
+    *y1 += p->y;
+}
+
+/**
+ * @brief Sets a target's box tap counts: the most source columns an output column
+ * covers, and the most source pairs the columns of an output pair cover. Zero for
+ * bilinear targets. Fixed counts keep the resampling loops free of data-dependent
+ * trip counts.
+ *
+ * @return the bytes of the target's weight table.
+ */
+static size_t plan_taps(scale_plan_t *p)
+{
+    unsigned int out_width = p->target->width;
+    p->taps = p->pair_taps = 0;
+    if (p->target->filter != ACAM_SCALE_BOX)
+    {
+        return 0;
+    }
+    p->taps = (p->width + out_width - 1) / out_width;
+    p->pair_taps = ((2 * p->width + out_width - 1) / out_width + 2) / 2;
+    return (size_t)out_width * p->taps + (size_t)(out_width + 1) / 2 * p->pair_taps;
+}
+
+/**
+ * @brief Fills a target's column table and, for box targets, its weight table.
+ */
+static void plan_columns(scale_plan_t *p)
+{
+    unsigned int out_width = p->target->width;
+    for (unsigned int ox = 0; ox < out_width; ox++)
+    {
+        if (p->target->filter == ACAM_SCALE_BOX)
+        {
+            uint32_t x0 = (uint64_t)ox * p->width / out_width;
+            uint32_t x1 = (uint64_t)(ox + 1) * p->width / out_width;
+            p->x0[ox] = p->x + x0;
+            p->x1[ox] = p->x + (x1 > x0 ? x1 : x0 + 1);
+        }
+        else
+        {
+            bilinear_tap(ox, out_width, p->width, &p->x0[ox], &p->x1[ox]);
+            p->x0[ox] += p->x;
+        }
+    }
+    if (p->target->filter != ACAM_SCALE_BOX)
+    {
+        return;
+    }
+
+    uint8_t *w = p->weights;
+    for (unsigned int ox = 0; ox < out_width; ox++, w += p->taps)
+    {
+        for (unsigned int k = 0; k < p->taps; k++)
+        {
+            w[k] = p->x0[ox] + k < p->x1[ox];
+        }
+    }
+    //every source column in an output pair weighs its own pair's chroma
+    for (unsigned int ox = 0; ox < out_width; ox += 2, w += p->pair_taps)
+    {
+        uint32_t first = p->x0[ox], last = p->x1[ox + 1 < out_width ? ox + 1 : ox];
+        for (unsigned int k = 0; k < p->pair_taps; k++)
+        {
+            uint32_t column = 2 * (first / 2 + k);
+            uint32_t from = column > first ? column : first;
+            uint32_t to = column + 2 < last ? column + 2 : last;
+            w[k] = to > from ? to - from : 0;
+        }
+    }
+}
+
+/**
+ * @brief Scratch of one job for one target.
+ *
+ */
+typedef struct
+{
+    uint16_t *acc; //one row of column values, span entries and room for the last taps
+    uint8_t *yuyv; //the output row before color conversion, (width + 1) / 2 pairs
+    uint32_t *recip[2]; //box: reciprocals of the sizes of the row's pixels, then of its pairs
+    unsigned int recip_rows[2]; //the row count each was computed for, 0 if none
+} scale_scratch_t;
+
+static inline uint8_t box_average(uint32_t sum, uint32_t recip)
+{
+    uint32_t avg = (uint32_t)((sum * (uint64_t)recip + (1u << (SCALE_RECIP_SHIFT - 1))) >> SCALE_RECIP_SHIFT);
+    return avg > 255 ? 255 : (uint8_t)avg;
+}
+
+/**
+ * @brief Writes output row @param oy of a target. The row is resampled into YUYV
+ * at the output width, each output pair taking the average chroma of both pixels,
+ * and converted by the RGB kernel; an odd last pixel has a pair of its own.
+ */
+static void scale_row(const scale_job_t *job, const scale_plan_t *p, unsigned int oy, scale_scratch_t *scratch)
+{
+    const acam_scale_target_t *t = p->target;
+    const uint32_t *x0 = p->x0, *x1 = p->x1;
+    const uint16_t *acc = scratch->acc;
+    uint8_t *yuyv = scratch->yuyv;
+    unsigned int out_width = t->width;
+    unsigned int y0, y1;
+    uint32_t weight;
+    source_rows(p, oy, &y0, &y1, &weight);
+    const uint8_t *base = job->src + (size_t)p->pair0 * 4;
+    unsigned int lead = 2 * p->pair0; //source column of acc[0]; even, so pairs line up
+
+    if (t->filter == ACAM_SCALE_BOX)
+    {
+        for (unsigned int y = y0; y < y1; y++)
+        {
+            job->k->vsum_row(base + y * job->stride, scratch->acc, p->span, y == y0);
+        }
+        unsigned int rows = y1 - y0;
+        //a target's rows cover either floor or ceil of the ratio, so parity picks the cache
+        uint32_t *recip = scratch->recip[rows % 2];
+        if (scratch->recip_rows[rows % 2] != rows)
+        {
+            for (unsigned int ox = 0; ox < out_width; ox++)
+            {
+                uint32_t n = (x1[ox] - x0[ox]) * rows;
+                recip[ox] = ((1u << SCALE_RECIP_SHIFT) + n / 2) / n;
+            }
+            for (unsigned int ox = 0; ox < out_width; ox += 2)
+            {
+                uint32_t n = (x1[ox + 1 < out_width ? ox + 1 : ox] - x0[ox]) * rows;
+                recip[out_width + ox / 2] = ((1u << SCALE_RECIP_SHIFT) + n / 2) / n;
+            }
+            scratch->recip_rows[rows % 2] = rows;
+        }
+        const uint8_t *w = p->weights;
+        for (unsigned int ox = 0; ox < out_width; ox++, w += p->taps)
+        {
+            const uint16_t *column = acc + 2 * (x0[ox] - lead);
+            uint32_t sum = 0;
+            for (unsigned int k = 0; k < p->taps; k++)
+            {
+                sum += column[2 * k] * w[k];
+            }
+            yuyv[2 * ox] = box_average(sum, recip[ox]);
+        }
+        for (unsigned int ox = 0; ox < out_width; ox += 2, w += p->pair_taps)
+        {
+            const uint16_t *pair = acc + 4 * ((x0[ox] - lead) / 2);
+            uint32_t su = 0, sv = 0;
+            for (unsigned int k = 0; k < p->pair_taps; k++)
+            {
+                su += pair[4 * k + 1] * w[k];
+                sv += pair[4 * k + 3] * w[k];
+            }
+            yuyv[2 * ox + 1] = box_average(su, recip[out_width + ox / 2]);
+            yuyv[2 * ox + 3] = box_average(sv, recip[out_width + ox / 2]);
+        }
+    }
+    else
+    {
+        const uint8_t *row0 = base + y0 * job->stride;
+        job->k->vlerp_row(row0, y1 - y0 > 1 ? row0 + job->stride : row0, weight, scratch->acc, p->span);
+        uint32_t su = 0, sv = 0;
+        for (unsigned int ox = 0; ox < out_width; ox++)
+        {
+            //8.8 column values blended with 8-bit weights: 16 fractional bits
+            uint32_t w = x1[ox];
+            unsigned int l = x0[ox] - lead;
+            unsigned int r = w ? l + 1 : l;
+            uint32_t y = acc[2 * l] * (256 - w) + acc[2 * r] * w;
+            su += acc[2 * (l & ~1u) + 1] * (256 - w) + acc[2 * (r & ~1u) + 1] * w;
+            sv += acc[2 * (l & ~1u) + 3] * (256 - w) + acc[2 * (r & ~1u) + 3] * w;
+            yuyv[2 * ox] = (y + 32768) >> 16;
+            if (ox % 2 == 1 || ox + 1 == out_width)
+            {
+                unsigned int shift = ox % 2 == 1 ? 17 : 16;
+                unsigned int pair = 4 * (ox / 2);
+                yuyv[pair + 1] = (su + (1u << (shift - 1))) >> shift;
+                yuyv[pair + 3] = (sv + (1u << (shift - 1))) >> shift;
+                su = sv = 0;
+            }
+        }
+    }
+
+    uint8_t *dst = t->dst + (size_t)oy * out_width * 3;
+    unsigned int even = out_width & ~1u;
+    job->k->rgb24_row(yuyv, dst, even, job->c);
+    if (even != out_width)
+    {
+        uint8_t rgb[6];
+        rgb24_row_scalar(yuyv + 2 * even, rgb, 2, job->c); // its pair's second pixel is scratch
+        memcpy(dst + 3 * even, rgb, 3);
+    }
+}
+
+static size_t acc_entries(const scale_plan_t *p)
+{
+    return p->span + 2 * (size_t)p->taps + 4 * (size_t)p->pair_taps;
+}
+
+/**
+ * @brief Writes this job's share of the rows of every target, band by band.
+ */
+static void *scale_main(void *arg)
+{
+    scale_job_t *job = arg;
+    unsigned int next[ACAM_SCALE_MAX_TARGETS], end[ACAM_SCALE_MAX_TARGETS];
+    scale_scratch_t scratch[ACAM_SCALE_MAX_TARGETS];
+
+    size_t scratch_size = 0;
+    for (unsigned int i = 0; i < job->count; i++)
+    {
+        unsigned int out_width = job->plans[i].target->width;
+        scratch_size += 2 * (out_width + (out_width + 1) / 2) * sizeof(uint32_t) + acc_entries(&job->plans[i]) * sizeof(uint16_t) +
+                        4 * ((out_width + 1) / 2);
+    }
+    char *memory = malloc(scratch_size);
+    if (memory == NULL)
+    {
+        job->ret = ENOMEM;
+        return NULL;
+    }
+
+    unsigned int band = UINT_MAX; //source rows below this are done with
+    char *cursor = memory;
+    for (unsigned int i = 0; i < job->count; i++)
+    {
+        const scale_plan_t *p = &job->plans[i];
+        unsigned int out_width = p->target->width;
+        for (int r = 0; r < 2; r++)
+        {
+            scratch[i].recip[r] = (uint32_t *)cursor;
+            scratch[i].recip_rows[r] = 0;
+            cursor += (out_width + (out_width + 1) / 2) * sizeof(uint32_t);
+        }
+        scratch[i].acc = (uint16_t *)cursor;
+        memset(cursor, 0, acc_entries(p) * sizeof(uint16_t)); // the taps past the span have weight 0
+        cursor += acc_entries(p) * sizeof(uint16_t);
+        scratch[i].yuyv = (uint8_t *)cursor;
+        cursor += 4 * ((out_width + 1) / 2);
+        next[i] = (uint64_t)p->target->height * job->part / job->parts;
+        end[i] = (uint64_t)p->target->height * (job->part + 1) / job->parts;
+        if (next[i] < end[i])
+        {
+            unsigned int y0, y1;
+            uint32_t weight;
+            source_rows(p, next[i], &y0, &y1, &weight);
+            band = y0 < band ? y0 : band;
+        }
+    }
+
+    for (int pending = band != UINT_MAX; pending;)
+    {
+        band += SCALE_BAND_ROWS;
+        pending = 0;
+        for (unsigned int i = 0; i < job->count; i++)
+        {
+            for (; next[i] < end[i]; next[i]++)
+            {
+                unsigned int y0, y1;
+                uint32_t weight;
+                source_rows(&job->plans[i], next[i], &y0, &y1, &weight);
+                if (y1 > band)
+                {
+                    pending = 1;
+                    break;
+                }
+                scale_row(job, &job->plans[i], next[i], &scratch[i]);
+            }
+        }
+    }
+
+    free(memory);
+    return NULL;
+}
+
+/**
+ * @brief Checks a target against the frame and resolves its crop.
+ *
+ * @return 0 if it is valid, EINVAL otherwise.
+ */
+static int plan_target(const acam_scale_target_t *t, unsigned int width, unsigned int height, scale_plan_t *p)
+{
+    p->target = t;
+    p->x = t->crop_x;
+    p->y = t->crop_y;
+    p->width = t->crop_width;
+    p->height = t->crop_height;
+    if (p->width == 0 || p->height == 0)
+    {
+        p->x = p->y = 0;
+        p->width = width;
+        p->height = height;
+    }
+    if (t->dst == NULL || t->width == 0 || t->height == 0 || (int)t->filter < 0 || t->filter >= __ACAM_SCALE_FILTER_COUNT ||
+        (uint64_t)p->x + p->width > width || (uint64_t)p->y + p->height > height)
+    {
+        DEBUG_PRINT(stderr, "Invalid scale target %ux%u from %ux%u at %u,%u.\n", t->width, t->height, p->width, p->height, p->x, p->y);
+        return EINVAL;
+    }
+    if (t->dst_size < (size_t)t->width * t->height * 3)
+    {
+        DEBUG_PRINT(stderr, "RGB24 output of %zu bytes is too small for %ux%u.\n", t->dst_size, t->width, t->height);
+        return EINVAL;
+    }
+    if (t->filter == ACAM_SCALE_BOX && p->height > (uint64_t)t->height * ACAM_SCALE_MAX_BOX_ROWS)
+    {
+        DEBUG_PRINT(stderr, "Box scaling from %u to %u rows averages more than %u rows.\n", p->height, t->height, ACAM_SCALE_MAX_BOX_ROWS);
+        return EINVAL;
+    }
+    p->pair0 = p->x / 2;
+    p->span = 4 * ((p->x + p->width + 1) / 2 - p->pair0);
+    return 0;
+}
+
+/**
+ * @brief Crops, scales and converts a YUYV frame to packed 24-bit RGB (R, G, B byte
+ * order) in one pass, for one or more output images at once. Each target has its
+ * own crop, size and filter; the frame is read once for all of them. A 1:1 box
+ * target produces exactly what acam_yuyv_to_rgb24 produces.
+ *
+ * @param buffer a buffer holding a YUYV frame with rows of width * 2 bytes.
+ * @param width the frame width in pixels. Must be even.
+ * @param height the frame height in pixels.
+ * @param color the matrix and range the camera encoded the frame with.
+ * @param targets the output images, at most ACAM_SCALE_MAX_TARGETS.
+ * @param count the number of targets.
+ * @param threads the number of threads the rows are split across, the calling
+ * thread included. 0 and 1 run on the calling thread only.
+ * @return exit status. 0 on success, EINVAL if the frame size, @param color, the
+ * target count or a target is invalid, ENOMEM if scratch memory could not be
+ * allocated.
+ */
+int acam_yuyv_scale_rgb24(const acam_buffer_t *buffer, unsigned int width, unsigned int height, acam_color_t color,
+                          const acam_scale_target_t *targets, unsigned int count, unsigned int threads)
+{
+    assert(buffer && targets);
+    if (color >= __ACAM_COLOR_COUNT || count == 0 || count > ACAM_SCALE_MAX_TARGETS)
+    {
+        return EINVAL;
+    }
+    int ret = check_yuyv(buffer, width, height);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    scale_plan_t plans[ACAM_SCALE_MAX_TARGETS];
+    size_t columns = 0, weights = 0;
+    unsigned int max_rows = 0;
+    for (unsigned int i = 0; i < count; i++)
+    {
+        ret = plan_target(&targets[i], width, height, &plans[i]);
+        if (ret != 0)
+        {
+            return ret;
+        }
+        columns += targets[i].width;
+        weights += plan_taps(&plans[i]);
+        max_rows = targets[i].height > max_rows ? targets[i].height : max_rows;
+    }
+    threads = threads == 0 ? 1 : threads > max_rows ? max_rows : threads;
+
+    uint32_t *tables = malloc(2 * columns * sizeof(uint32_t) + weights);
+    scale_job_t *jobs = calloc(threads, sizeof(scale_job_t));
+    if (tables == NULL || jobs == NULL)
+    {
+        free(tables);
+        free(jobs);
+        return ENOMEM;
+    }
+    uint32_t *cursor = tables;
+    uint8_t *weight = (uint8_t *)(tables + 2 * columns);
+    for (unsigned int i = 0; i < count; i++)
+    {
+        plans[i].x0 = cursor;
+        plans[i].x1 = cursor + targets[i].width;
+        plans[i].weights = weight;
+        cursor += 2 * targets[i].width;
+        weight += plan_taps(&plans[i]);
+        plan_columns(&plans[i]);
+    }
+
+    for (unsigned int j = 0; j < threads; j++)
+    {
+        scale_job_t *job = &jobs[j];
+        job->src = (const uint8_t *)buffer->buf;
+        job->stride = (size_t)width * 2;
+        job->plans = plans;
+        job->count = count;
+        job->c = &color_coeffs[color];
+        job->k = get_kernels();
+        job->part = j;
+        job->parts = threads;
+    }
+    // the calling thread takes the first share; a share whose thread cannot start runs here too
+    int *started = calloc(threads, sizeof(int));
+    for (unsigned int j = 1; j < threads && started != NULL; j++)
+    {
+        started[j] = pthread_create(&jobs[j].thread, NULL, scale_main, &jobs[j]) == 0;
+    }
+    for (unsigned int j = 0; j < threads; j++)
+    {
+        if (j == 0 || started == NULL || !started[j])
+        {
+            scale_main(&jobs[j]);
+        }
+    }
+    for (unsigned int j = 0; j < threads; j++)
+    {
+        if (started != NULL && started[j])
+        {
+            pthread_join(jobs[j].thread, NULL);
+        }
+        if (jobs[j].ret != 0)
+        {
+            ret = jobs[j].ret;
+        }
+    }
+
+    free(started);
+    free(jobs);
+    free(tables);
+    return ret;
+}
+
+/*
+ * Statistics. acam_stats_compute reads the luma of a YUYV frame on a grid of every
+ * step-th pixel of every step-th row. Each sampled row is gathered into a plain
+ * row of bytes by the SIMD kernels, which then add up its samples in runs of 8,
+ * its squares, and the Sobel gradients of the row before it. The histogram is
+ * counted in four interleaved tables so repeated values do not stall on each
+ * other. The runs of 8 add up to the mean of every motion block, which is compared
+ * with the same block of the previous frame.
+ *
+ * Everything is counted in integers, so every instruction set produces the same
+ * results.
+ */
+
+struct acam_stats
+{
+    unsigned int width, height;
+    acam_stats_config_t config;
+    unsigned int columns, rows; //samples per sampled row, sampled rows
+    unsigned int block; //side of a block in samples, a multiple of 8
+    unsigned int blocks_x, blocks_y;
+    unsigned int chunks_x; //runs of 8 samples in a sampled row
+    uint8_t *sampled[3]; //the last three sampled rows
+    uint32_t *chunks; //sums of the runs of 8 in the current row of blocks
+    uint16_t *means; //block means in 1/256 of the last frame
+    int has_previous; //means holds the previous frame
+};
+
+/**
+ * @brief Prepares a statistics pass over YUYV frames of one size. The pass keeps the
+ * block means of the frame it saw last for the motion score, so use one per stream.
+ *
+ * @param width the frame width in pixels. Must be even.
+ * @param height the frame height in pixels.
+ * @param config the sampling grid, block size and motion threshold.
+ * @param error set to the exit status on failure: EINVAL if the size or @param config
+ * is invalid, ENOMEM if memory could not be allocated.
+ * @return the pass, or NULL on failure.
+ */
+acam_stats_t *acam_stats_create(unsigned int width, unsigned int height, const acam_stats_config_t *config, int *error)
+{
+    assert(config && error);
+    unsigned int step = config->step ? config->step : 1;
+    unsigned int block = config->block ? config->block : ACAM_STATS_DEFAULT_BLOCK;
+    if (width == 0 || height == 0 || width % 2 != 0 || (step != 1 && step != 2 && step != 4 && step != 8) ||
+        block % (8 * step) != 0 || config->motion_threshold > 255)
+    {
+        DEBUG_PRINT(stderr, "Invalid statistics pass over %ux%u with step %u and blocks of %u.\n", width, height, step, block);
+        *error = EINVAL;
+        return NULL;
+    }
+
+    acam_stats_t *stats = calloc(1, sizeof(acam_stats_t));
+    if (stats == NULL)
+    {
+        *error = ENOMEM;
+        return NULL;
+    }
+    stats->width = width;
+    stats->height = height;
+    stats->config = *config;
+    stats->config.step = step;
+    stats->config.block = block;
+    stats->columns = (width + step - 1) / step;
+    stats->rows = (height + step - 1) / step;
+    stats->block = block / step;
+    stats->blocks_x = (stats->columns + stats->block - 1) / stats->block;
+    stats->blocks_y = (stats->rows + stats->block - 1) / stats->block;
+    stats->chunks_x = (stats->columns + 7) / 8;
+
+    stats->sampled[0] = malloc(3 * (size_t)stats->columns);
+    stats->chunks = malloc(stats->chunks_x * sizeof(uint32_t));
+    stats->means = malloc((size_t)stats->blocks_x * stats->blocks_y * sizeof(uint16_t));
+    if (stats->sampled[0] == NULL || stats->chunks == NULL || stats->means == NULL)
+    {
+        acam_stats_destroy(stats);
+        *error = ENOMEM;
+        return NULL;
+    }
+    stats->sampled[1] = stats->sampled[0] + stats->columns;
+    stats->sampled[2] = stats->sampled[1] + stats->columns;
+    *error = 0;
+    return stats;
+}
+
+/**
+ * @brief Turns the run sums of a finished row of blocks into block means, compares
+ * them with the previous frame and clears the runs.
+ *
+ * @param by the row of blocks.
+ * @param rows the sampled rows it has, fewer than block at the bottom edge.
+ * @param change increased by the absolute changes of the means, in 1/256.
+ * @param moving increased by the blocks that changed by more than the threshold.
+ * @return the sum of the samples of the row of blocks.
+ */
+static uint64_t finish_blocks(acam_stats_t *stats, unsigned int by, unsigned int rows, uint64_t *change, uint32_t *moving)
+{
+    uint64_t total = 0;
+    unsigned int per_block = stats->block / 8;
+    uint32_t threshold = stats->config.motion_threshold * 256;
+    for (unsigned int bx = 0; bx < stats->blocks_x; bx++)
+    {
+        unsigned int first = bx * per_block;
+        unsigned int last = first + per_block < stats->chunks_x ? first + per_block : stats->chunks_x;
+        uint64_t sum = 0;
+        for (unsigned int c = first; c < last; c++)
+        {
+            sum += stats->chunks[c];
+        }
+        unsigned int columns = bx * stats->block + stats->block <= stats->columns ? stats->block : stats->columns - bx * stats->block;
+        uint64_t count = (uint64_t)columns * rows;
+        uint16_t mean = (uint16_t)((sum * 256 + count / 2) / count);
+
+        uint16_t *previous = &stats->means[(size_t)by * stats->blocks_x + bx];
+        if (stats->has_previous)
+        {
+            uint32_t d = mean > *previous ? mean - *previous : *previous - mean;
+            *change += d;
+            *moving += d > threshold;
+        }
+        *previous = mean;
+        total += sum;
+    }
+    memset(stats->chunks, 0, stats->chunks_x * sizeof(uint32_t));
+    return total;
+}
+
+/**
+ * @brief Computes the luma statistics of a YUYV frame: histogram, mean and variance,
+ * a Tenengrad sharpness score and a block-wise motion score against the previous
+ * frame given to this pass. The cost shrinks with the square of the sampling step.
+ * A pass must not be used by two threads at once.
+ *
+ * @param stats a pass from acam_stats_create.
+ * @param buffer a buffer or frame->buffer holding a frame of the pass's size, rows
+ * packed at width * 2 bytes.
+ * @param result set to the statistics.
+ * @return exit status. 0 on success, EINVAL if the buffer is too small for the size.
+ */
+int acam_stats_compute(acam_stats_t *stats, const acam_buffer_t *buffer, acam_frame_stats_t *result)
+{
+    assert(stats && buffer && result);
+    int ret = check_yuyv(buffer, stats->width, stats->height);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    const kernels_t *k = get_kernels();
+    const uint8_t *src = (const uint8_t *)buffer->buf;
+    size_t stride = (size_t)stats->width * 2 * stats->config.step;
+    unsigned int n = stats->columns;
+    uint32_t histograms[4][256];
+    uint64_t sum = 0, squares = 0, gradients = 0, change = 0;
+    uint32_t moving = 0;
+    memset(histograms, 0, sizeof(histograms));
+    memset(stats->chunks, 0, stats->chunks_x * sizeof(uint32_t));
+
+    for (unsigned int r = 0; r < stats->rows; r++)
+    {
+        uint8_t *row = stats->sampled[r % 3];
+        k->sample_row(src + r * stride, row, n, stats->config.step);
+        unsigned int i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            histograms[0][row[i]]++;
+            histograms[1][row[i + 1]]++;
+            histograms[2][row[i + 2]]++;
+            histograms[3][row[i + 3]]++;
+        }
+        for (; i < n; i++)
+        {
+            histograms[0][row[i]]++;
+        }
+        k->chunk_sum_row(row, n, stats->chunks);
+        squares += k->sumsq_row(row, n);
+        if (r >= 2)
+        {
+            gradients += k->tenengrad_row(stats->sampled[(r - 2) % 3], stats->sampled[(r - 1) % 3], row, n);
+        }
+        if ((r + 1) % stats->block == 0 || r + 1 == stats->rows)
+        {
+            sum += finish_blocks(stats, r / stats->block, r % stats->block + 1, &change, &moving);
+        }
+    }
+
+    memset(result, 0, sizeof(*result));
+    for (int v = 0; v < 256; v++)
+    {
+        result->histogram[v] = histograms[0][v] + histograms[1][v] + histograms[2][v] + histograms[3][v];
+    }
+    result->samples = n * stats->rows;
+    result->mean = (double)sum / result->samples;
+    result->variance = (double)squares / result->samples - result->mean * result->mean;
+    if (result->variance < 0)
+    {
+        result->variance = 0; // rounding of a flat frame
+    }
+    if (n >= 3 && stats->rows >= 3)
+    {
+        result->sharpness = (double)gradients / ((uint64_t)(n - 2) * (stats->rows - 2));
+    }
+    if (stats->has_previous)
+    {
+        result->blocks = stats->blocks_x * stats->blocks_y;
+        result->moving_blocks = moving;
+        result->motion = (double)change / result->blocks / 256.0;
+    }
+    stats->has_previous = 1;
+    return 0;
+}
+
+/**
+ * @brief Forgets the previous frame, so the next acam_stats_compute has no motion
+ * score. Use after a scene cut, a mode change or a gap in the stream.
+ *
+ * @param stats a pass from acam_stats_create.
+ */
+void acam_stats_reset(acam_stats_t *stats)
+{
+    assert(stats);
+    stats->has_previous = 0;
+}
+
+/**
+ * @brief Frees a statistics pass.
+ *
+ * @param stats a pass from acam_stats_create.
+ * @return exit status. 0 on success.
+ */
+int acam_stats_destroy(acam_stats_t *stats)
+{
+    assert(stats);
+    free(stats->sampled[0]);
+    free(stats->chunks);
+    free(stats->means);
+    free(stats);
+    return 0;
+}
+
+/*
+ * JPEG encoding. acam_jpeg_encode compresses a YUYV frame as a baseline JPEG with
+ * 4:2:2 sampling, the layout YUYV already has, so the chroma is used as it is.
+ * The frame is cut into slices of restart_rows rows of 16x8-pixel MCUs, each one
+ * restart interval: its DC predictions start over and it ends on a byte boundary,
+ * followed by an RSTn marker. Threads therefore encode slices independently into
+ * buffers of their own, which are then copied one after the other behind the
+ * headers. The kernels level-shift, transform and quantize one MCU at a time, and
+ * the Huffman coder only visits the non-zero coefficients of each block, through
+ * the bit masks the kernels return.
+ */
+
+#define JPEG_MCU_BYTES 2048 //room kept free in a slice buffer for one MCU: four blocks of the longest codes, every byte stuffed
+#define JPEG_HEADER_BYTES 1024
+
+/**
+ * @brief Huffman codes and their lengths by symbol.
+ *
+ */
+typedef struct
+{
+    uint16_t code[256];
+    uint8_t size[256];
+} jpeg_huff_t;
+
+typedef struct
+{
+    uint8_t *data;
+    size_t size; //bytes of the last frame's slice, RSTn marker included
+    size_t cap;
+    int error;
+} jpeg_slice_t;
+
+struct acam_jpeg_encoder
+{
+    unsigned int width, height;
+    int limited; //stretch limited-range samples to full range
+    unsigned int threads;
+    unsigned int mcu_cols, mcu_rows;
+    unsigned int restart_rows; //MCU rows per slice
+    unsigned int slices;
+    jpeg_quant_t quant[2]; //luma, chroma
+    jpeg_huff_t dc[2], ac[2];
+    jpeg_slice_t *slice;
+    pthread_t *helpers; //threads - 1 entries
+    uint8_t *out; //the headers, then the entropy-coded data and EOI of the last frame
+    size_t header_size;
+    size_t out_cap;
+};
+
+typedef struct
+{
+    acam_jpeg_encoder_t *enc;
+    const uint8_t *src;
+    const kernels_t *k;
+    unsigned int next; //the next slice to take, shared by the threads
+} jpeg_job_t;
+
+typedef struct
+{
+    uint8_t *p; //where the next byte goes
+    uint64_t acc;
+    int bits; //bits of acc not written yet, fewer than 32 between calls
+} jpeg_bits_t;
+
+static uint64_t zigzag_bits[8][256]; //byte i of a kernel's mask -> the zig-zag positions of the coefficients it marks
+static uint8_t zigzag_coef[64]; //zig-zag position -> index of the coefficient in a kernel's column-major block
+static pthread_once_t zigzag_once = PTHREAD_ONCE_INIT;
+
+static void build_zigzag(void)
+{
+    for (int z = 0; z < 64; z++)
+    {
+        int n = acam_jpeg_zigzag[z];
+        int i = (n % 8) * 8 + n / 8;
+        zigzag_coef[z] = i;
+        for (int byte = 0; byte < 256; byte++)
+        {
+            if (byte >> (i % 8) & 1)
+            {
+                zigzag_bits[i / 8][byte] |= 1ull << z;
+            }
+        }
+    }
+}
+
+static void jpeg_build_huff(const uint8_t bits[16], const uint8_t *vals, jpeg_huff_t *h)
+{
+    unsigned int k = 0, code = 0;
+    for (int l = 1; l <= 16; l++)
+    {
+        for (int i = 0; i < bits[l - 1]; i++, k++)
+        {
+            h->code[vals[k]] = code++;
+            h->size[vals[k]] = l;
+        }
+        code <<= 1;
+    }
+}
+
+/**
+ * @brief Scales an Annex K table to a quality as libjpeg does, writes it in zig-zag
+ * order to @param table for the DQT segment, and prepares its reciprocals.
+ *
+ */
+static void jpeg_prepare_quant(const uint8_t *base, unsigned int quality, uint8_t *table, jpeg_quant_t *q)
+{
+    unsigned int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+    for (int z = 0; z < 64; z++)
+    {
+        int n = acam_jpeg_zigzag[z];
+        unsigned int t = (base[n] * scale + 50) / 100;
+        t = t < 1 ? 1 : t > 255 ? 255 : t;
+        table[z] = t;
+
+        // libjpeg-turbo's compute_reciprocal; the DCT output is scaled by 8
+        unsigned int divisor = t * 8;
+        int r = 16 + 31 - __builtin_clz(divisor);
+        uint32_t recip = (1u << r) / divisor, rest = (1u << r) % divisor;
+        unsigned int corr = divisor / 2;
+        if (rest == 0)
+        {
+            recip >>= 1;
+            r--;
+        }
+        else if (rest <= divisor / 2)
+        {
+            corr++;
+        }
+        else
+        {
+            recip++;
+        }
+        int i = (n % 8) * 8 + n / 8;
+        q->recip[i] = recip;
+        q->corr[i] = corr;
+        q->scale[i] = 1u << (32 - r);
+    }
+}
+
+static inline void jpeg_put_byte(jpeg_bits_t *b, uint8_t byte)
+{
+    *b->p++ = byte;
+    if (byte == 0xff)
+    {
+        *b->p++ = 0x00; // byte stuffing
+    }
+}
+
+static inline void jpeg_put(jpeg_bits_t *b, uint32_t value, int length)
+{
+    b->acc = b->acc << length | value;
+    b->bits += length;
+    if (b->bits >= 32)
+    {
+        b->bits -= 32;
+        uint32_t word = (uint32_t)(b->acc >> b->bits);
+        if (((~word - 0x01010101u) & word & 0x80808080u) == 0)
+        {
+            // no 0xFF byte to stuff
+            b->p[0] = word >> 24;
+            b->p[1] = word >> 16;
+            b->p[2] = word >> 8;
+            b->p[3] = word;
+            b->p += 4;
+        }
+        else
+        {
+            for (int shift = 24; shift >= 0; shift -= 8)
+            {
+                jpeg_put_byte(b, word >> shift);
+            }
+        }
+    }
+}
+
+static void jpeg_flush(jpeg_bits_t *b)
+{
+    int pad = (8 - b->bits % 8) % 8;
+    jpeg_put(b, (1u << pad) - 1, pad); // pad the last byte with 1-bits
+    while (b->bits > 0)
+    {
+        b->bits -= 8;
+        jpeg_put_byte(b, b->acc >> b->bits);
+    }
+}
+
+//the Huffman code of symbol (run << 4 | size) followed by the size low bits of v
+static inline void jpeg_put_value(jpeg_bits_t *b, const jpeg_huff_t *h, int run, int v)
+{
+    unsigned int magnitude = v < 0 ? -v : v;
+    int size = magnitude ? 32 - __builtin_clz(magnitude) : 0;
+    int symbol = run << 4 | size;
+    jpeg_put(b, (uint32_t)h->code[symbol] << size | ((uint32_t)(v - (v < 0)) & ((1u << size) - 1)), h->size[symbol] + size);
+}
+
+static inline void encode_block(jpeg_bits_t *b, const int16_t *coefs, uint64_t mask, int *pred, const jpeg_huff_t *dc,
+                                const jpeg_huff_t *ac)
+{
+    jpeg_put_value(b, dc, 0, coefs[0] - *pred);
+    *pred = coefs[0];
+    if ((mask & ~1ull) == 0)
+    {
+        jpeg_put(b, ac->code[0x00], ac->size[0x00]); // EOB
+        return;
+    }
+
+    uint64_t zigzag = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        zigzag |= zigzag_bits[i][(mask >> (8 * i)) & 0xff];
+    }
+    int last = 0;
+    for (zigzag &= ~1ull; zigzag != 0; zigzag &= zigzag - 1)
+    {
+        int z = __builtin_ctzll(zigzag);
+        int run = z - last - 1;
+        for (; run > 15; run -= 16)
+        {
+            jpeg_put(b, ac->code[0xf0], ac->size[0xf0]); // ZRL: 16 zeros
+        }
+        jpeg_put_value(b, ac, run, coefs[zigzag_coef[z]]);
+        last = z;
+    }
+    if (last != 63)
+    {
+        jpeg_put(b, ac->code[0x00], ac->size[0x00]);
+    }
+}
+
+/**
+ * @brief Copies the MCU at (@param x, @param y) of a frame it sticks out of,
+ * repeating the last pixel of each row and the last row, as 8 rows of 32 bytes.
+ *
+ */
+static void edge_mcu(const acam_jpeg_encoder_t *enc, const uint8_t *src, unsigned int x, unsigned int y, uint8_t *edge)
+{
+    unsigned int pairs = enc->width / 2;
+    for (unsigned int r = 0; r < 8; r++)
+    {
+        const uint8_t *row = src + (size_t)(y + r < enc->height ? y + r : enc->height - 1) * enc->width * 2;
+        const uint8_t *last = row + (pairs - 1) * 4;
+        for (unsigned int p = 0; p < 8; p++)
+        {
+            uint8_t *out = edge + r * 32 + p * 4;
+            if (x / 2 + p < pairs)
+            {
+                memcpy(out, row + (x / 2 + p) * 4, 4);
+            }
+            else
+            {
+                out[0] = out[2] = last[2];
+                out[1] = last[1];
+                out[3] = last[3];
+            }
+        }
+    }
+}
+
+static void encode_slice(const jpeg_job_t *job, unsigned int s)
+{
+    acam_jpeg_encoder_t *enc = job->enc;
+    jpeg_slice_t *slice = &enc->slice[s];
+    unsigned int row0 = s * enc->restart_rows;
+    unsigned int row1 = row0 + enc->restart_rows < enc->mcu_rows ? row0 + enc->restart_rows : enc->mcu_rows;
+    size_t stride = (size_t)enc->width * 2;
+    int16_t coefs[256];
+    uint64_t masks[4];
+    uint8_t edge[8 * 32];
+    int pred[3] = {0, 0, 0};
+    jpeg_bits_t b = {slice->data, 0, 0};
+
+    for (unsigned int my = row0; my < row1; my++)
+    {
+        for (unsigned int mx = 0; mx < enc->mcu_cols; mx++)
+        {
+            size_t used = b.p - slice->data;
+            if (slice->cap - used < JPEG_MCU_BYTES)
+            {
+                uint8_t *data = realloc(slice->data, slice->cap * 2);
+                if (data == NULL)
+                {
+                    slice->error = ENOMEM;
+                    return;
+                }
+                slice->data = data;
+                slice->cap *= 2;
+                b.p = data + used;
+            }
+
+            unsigned int x = mx * 16, y = my * 8;
+            if (x + 16 <= enc->width && y + 8 <= enc->height)
+            {
+                job->k->jpeg_mcu(job->src + y * stride + x * 2, stride, enc->limited, enc->quant, coefs, masks);
+            }
+            else
+            {
+                edge_mcu(enc, job->src, x, y, edge);
+                job->k->jpeg_mcu(edge, 32, enc->limited, enc->quant, coefs, masks);
+            }
+            encode_block(&b, coefs, masks[0], &pred[0], &enc->dc[0], &enc->ac[0]);
+            encode_block(&b, coefs + 64, masks[1], &pred[0], &enc->dc[0], &enc->ac[0]);
+            encode_block(&b, coefs + 128, masks[2], &pred[1], &enc->dc[1], &enc->ac[1]);
+            encode_block(&b, coefs + 192, masks[3], &pred[2], &enc->dc[1], &enc->ac[1]);
+        }
+    }
+    jpeg_flush(&b);
+    if (s + 1 < enc->slices)
+    {
+        *b.p++ = 0xff;
+        *b.p++ = 0xd0 + s % 8; // RSTn
+    }
+    slice->size = b.p - slice->data;
+    slice->error = 0;
+}
+
+static void *jpeg_main(void *arg)
+{
+    jpeg_job_t *job = arg;
+    unsigned int s;
+    while ((s = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->enc->slices)
+    {
+        encode_slice(job, s);
+    }
+    return NULL;
+}
+
+static uint8_t *put_segment(uint8_t *p, uint8_t marker, uint16_t length)
+{
+    *p++ = 0xff;
+    *p++ = marker;
+    *p++ = length >> 8;
+    *p++ = length & 0xff;
+    return p;
+}
+
+static uint8_t *put_huff_table(uint8_t *p, uint8_t class_id, const uint8_t bits[16], const uint8_t *vals)
+{
+    unsigned int count = 0;
+    for (int i = 0; i < 16; i++)
+    {
+        count += bits[i];
+    }
+    *p++ = class_id;
+    memcpy(p, bits, 16);
+    memcpy(p + 16, vals, count);
+    return p + 16 + count;
+}
+
+/**
+ * @brief Writes SOI, JFIF APP0, DQT, SOF0, DHT, DRI (with more than one slice) and
+ * SOS, which are the same for every frame of an encoder.
+ *
+ * @return the bytes written.
+ */
+static size_t jpeg_write_headers(const acam_jpeg_encoder_t *enc, const uint8_t tables[2][64], uint8_t *out)
+{
+    static const uint8_t jfif[14] = {'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0};
+    uint8_t *p = out;
+    *p++ = 0xff;
+    *p++ = 0xd8; // SOI
+    p = put_segment(p, 0xe0, 2 + sizeof(jfif));
+    memcpy(p, jfif, sizeof(jfif));
+    p += sizeof(jfif);
+
+    p = put_segment(p, 0xdb, 2 + 2 * 65);
+    for (int t = 0; t < 2; t++)
+    {
+        *p++ = t;
+        memcpy(p, tables[t], 64);
+        p += 64;
+    }
+
+    p = put_segment(p, 0xc0, 17); // SOF0: 4:2:2, Cb and Cr share table 1
+    static const uint8_t components[9] = {1, 0x21, 0, 2, 0x11, 1, 3, 0x11, 1};
+    *p++ = 8;
+    *p++ = enc->height >> 8;
+    *p++ = enc->height & 0xff;
+    *p++ = enc->width >> 8;
+    *p++ = enc->width & 0xff;
+    *p++ = 3;
+    memcpy(p, components, sizeof(components));
+    p += sizeof(components);
+
+    p = put_segment(p, 0xc4, 2 + 4 * 17 + 2 * 12 + 2 * 162);
+    p = put_huff_table(p, 0x00, acam_std_dc_luma_bits, acam_std_dc_luma_vals);
+    p = put_huff_table(p, 0x10, acam_std_ac_luma_bits, acam_std_ac_luma_vals);
+    p = put_huff_table(p, 0x01, acam_std_dc_chroma_bits, acam_std_dc_chroma_vals);
+    p = put_huff_table(p, 0x11, acam_std_ac_chroma_bits, acam_std_ac_chroma_vals);
+
+    if (enc->slices > 1)
+    {
+        unsigned int interval = enc->restart_rows * enc->mcu_cols;
+        p = put_segment(p, 0xdd, 4);
+        *p++ = interval >> 8;
+        *p++ = interval & 0xff;
+    }
+
+    static const uint8_t scan[10] = {3, 1, 0x00, 2, 0x11, 3, 0x11, 0, 63, 0};
+    p = put_segment(p, 0xda, 2 + sizeof(scan));
+    memcpy(p, scan, sizeof(scan));
+    p += sizeof(scan);
+    return p - out;
+}
+
+/**
+ * @brief Prepares a baseline JPEG encoder for YUYV frames of one size: scales the
+ * quantization tables, splits the frame into slices and writes the headers every
+ * JPEG it produces starts with.
+ *
+ * @param width the frame width in pixels. Must be even.
+ * @param height the frame height in pixels.
+ * @param config the quality, threads, restart interval and color range.
+ * @param error set to the exit status on failure: EINVAL if the size or @param config
+ * is invalid, ENOMEM if memory could not be allocated.
+ * @return the encoder, or NULL on failure.
+ */
+acam_jpeg_encoder_t *acam_jpeg_encoder_create(unsigned int width, unsigned int height, const acam_jpeg_config_t *config, int *error)
+{
+    assert(config && error);
+    unsigned int quality = config->quality ? config->quality : ACAM_JPEG_DEFAULT_QUALITY;
+    if (width == 0 || height == 0 || width % 2 != 0 || width > 65535 || height > 65535 || quality > 100 ||
+        config->color >= __ACAM_COLOR_COUNT)
+    {
+        DEBUG_PRINT(stderr, "Invalid JPEG encoder for %ux%u at quality %u.\n", width, height, quality);
+        *error = EINVAL;
+        return NULL;
+    }
+    pthread_once(&zigzag_once, build_zigzag);
+
+    acam_jpeg_encoder_t *enc = calloc(1, sizeof(acam_jpeg_encoder_t));
+    if (enc == NULL)
+    {
+        *error = ENOMEM;
+        return NULL;
+    }
+    enc->width = width;
+    enc->height = height;
+    enc->limited = config->color == ACAM_BT601_LIMITED || config->color == ACAM_BT709_LIMITED;
+    enc->mcu_cols = (width + 15) / 16;
+    enc->mcu_rows = (height + 7) / 8;
+    enc->threads = config->threads;
+    if (enc->threads == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        enc->threads = cpus > 0 ? (unsigned int)cpus : 1;
+    }
+    unsigned int rows = config->restart_rows;
+    if (rows == 0)
+    {
+        rows = enc->threads == 1 ? enc->mcu_rows : (enc->mcu_rows + 4 * enc->threads - 1) / (4 * enc->threads);
+    }
+    if (rows < enc->mcu_rows && rows * enc->mcu_cols > 65535)
+    {
+        rows = 65535 / enc->mcu_cols; // the DRI segment holds the interval in 16 bits
+    }
+    enc->restart_rows = rows < enc->mcu_rows ? rows : enc->mcu_rows;
+    enc->slices = (enc->mcu_rows + enc->restart_rows - 1) / enc->restart_rows;
+    enc->threads = enc->threads > enc->slices ? enc->slices : enc->threads;
+
+    uint8_t tables[2][64];
+    jpeg_prepare_quant(acam_std_quant_luma, quality, tables[0], &enc->quant[0]);
+    jpeg_prepare_quant(acam_std_quant_chroma, quality, tables[1], &enc->quant[1]);
+    jpeg_build_huff(acam_std_dc_luma_bits, acam_std_dc_luma_vals, &enc->dc[0]);
+    jpeg_build_huff(acam_std_ac_luma_bits, acam_std_ac_luma_vals, &enc->ac[0]);
+    jpeg_build_huff(acam_std_dc_chroma_bits, acam_std_dc_chroma_vals, &enc->dc[1]);
+    jpeg_build_huff(acam_std_ac_chroma_bits, acam_std_ac_chroma_vals, &enc->ac[1]);
+
+    // about 4 bits per pixel to start with; slices grow when a frame needs more
+    size_t slice_cap = (size_t)enc->restart_rows * enc->mcu_cols * 64 + JPEG_MCU_BYTES;
+    enc->out_cap = JPEG_HEADER_BYTES + (size_t)enc->slices * slice_cap;
+    enc->out = malloc(enc->out_cap);
+    enc->slice = calloc(enc->slices, sizeof(jpeg_slice_t));
+    enc->helpers = enc->threads > 1 ? calloc(enc->threads - 1, sizeof(pthread_t)) : NULL;
+    int ok = enc->out != NULL && enc->slice != NULL && (enc->threads == 1 || enc->helpers != NULL);
+    for (unsigned int s = 0; ok && s < enc->slices; s++)
+    {
+        enc->slice[s].data = malloc(slice_cap);
+        enc->slice[s].cap = slice_cap;
+        ok = enc->slice[s].data != NULL;
+    }
+    if (!ok)
+    {
+        acam_jpeg_encoder_destroy(enc);
+        *error = ENOMEM;
+        return NULL;
+    }
+    enc->header_size = jpeg_write_headers(enc, (const uint8_t(*)[64])tables, enc->out);
+    *error = 0;
+    return enc;
+}
+
+/**
+ * @brief Compresses a YUYV frame to a baseline JPEG. The slices of the frame are
+ * encoded on up to the encoder's number of threads, the calling thread included,
+ * and joined into one JPEG. An encoder must not be used by two threads at once.
+ *
+ * @param enc an encoder from acam_jpeg_encoder_create.
+ * @param buffer a buffer or frame->buffer holding a frame of the encoder's size, rows
+ * packed at width * 2 bytes.
+ * @param jpeg set to the JPEG, which stays in the encoder's memory until the next
+ * call or acam_jpeg_encoder_destroy.
+ * @param size set to the size of the JPEG in bytes.
+ * @return exit status. 0 on success, EINVAL if the buffer is too small, ENOMEM if a
+ * slice outgrew its memory and no more could be allocated.
+ */
+int acam_jpeg_encode(acam_jpeg_encoder_t *enc, const acam_buffer_t *buffer, const uint8_t **jpeg, size_t *size)
+{
+    assert(enc && buffer && jpeg && size);
+    int ret = check_yuyv(buffer, enc->width, enc->height);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    jpeg_job_t job = {enc, (const uint8_t *)buffer->buf, get_kernels(), 0};
+    unsigned int started = 0;
+    while (started + 1 < enc->threads && pthread_create(&enc->helpers[started], NULL, jpeg_main, &job) == 0)
+    {
+        started++;
+    }
+    jpeg_main(&job);
+    for (unsigned int i = 0; i < started; i++)
+    {
+        pthread_join(enc->helpers[i], NULL);
+    }
+
+    size_t total = enc->header_size + 2;
+    for (unsigned int s = 0; s < enc->slices; s++)
+    {
+        if (enc->slice[s].error != 0)
+        {
+            return enc->slice[s].error;
+        }
+        total += enc->slice[s].size;
+    }
+    if (total > enc->out_cap)
+    {
+        uint8_t *out = realloc(enc->out, total);
+        if (out == NULL)
+        {
+            return ENOMEM;
+        }
+        enc->out = out;
+        enc->out_cap = total;
+    }
+    uint8_t *p = enc->out + enc->header_size;
+    for (unsigned int s = 0; s < enc->slices; s++)
+    {
+        memcpy(p, enc->slice[s].data, enc->slice[s].size);
+        p += enc->slice[s].size;
+    }
+    *p++ = 0xff;
+    *p++ = 0xd9; // EOI
+    *jpeg = enc->out;
+    *size = total;
+    return 0;
+}
+
+/**
+ * @brief Compresses a YUYV frame with acam_jpeg_encode and writes the JPEG to a
+ * file, truncating an existing one.
+ *
+ * @param file_name the file to create or replace.
+ * @param enc an encoder from acam_jpeg_encoder_create.
+ * @param buffer a buffer holding a frame of the encoder's size.
+ * @return exit status. 0 on success, the errors of acam_jpeg_encode, errno on
+ * failure to open or write the file.
+ */
+int acam_write_jpeg_to_file(const char *file_name, acam_jpeg_encoder_t *enc, const acam_buffer_t *buffer)
+{
+    assert(file_name && enc && buffer);
+    const uint8_t *jpeg;
+    size_t size;
+    int ret = acam_jpeg_encode(enc, buffer, &jpeg, &size);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    int fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        DEBUG_PRINT(stderr, "Problem opening file %s: %s\n", file_name, strerror(errno));
+        return errno;
+    }
+    while (size > 0)
+    {
+        ssize_t written = write(fd, jpeg, size);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            DEBUG_PRINT(stderr, "Problem writing file %s: %s\n", file_name, strerror(errno));
+            ret = errno;
+            break;
+        }
+        jpeg += written;
+        size -= written;
+    }
+    if (close(fd) == -1 && ret == 0)
+    {
+        DEBUG_PRINT(stderr, "Problem closing file %s: %s\n", file_name, strerror(errno));
+        ret = errno;
+    }
+    return ret;
+}
+
+/**
+ * @brief Frees a JPEG encoder, and with it the last JPEG it produced.
+ *
+ * @param enc an encoder from acam_jpeg_encoder_create.
+ * @return exit status. 0 on success.
+ */
+int acam_jpeg_encoder_destroy(acam_jpeg_encoder_t *enc)
+{
+    assert(enc);
+    for (unsigned int s = 0; enc->slice != NULL && s < enc->slices; s++)
+    {
+        free(enc->slice[s].data);
+    }
+    free(enc->slice);
+    free(enc->helpers);
+    free(enc->out);
+    free(enc);
+    return 0;
+}
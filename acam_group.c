@@ -0,0 +1,651 @@
+#define _GNU_SOURCE
+#include "acam_control.h"
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#ifndef NDEBUG
+#define DEBUG_PRINT fprintf
+#define DEBUG_PERROR perror
+#else
+#define DEBUG_PRINT
+#define DEBUG_PERROR
+#endif
+
+/**
+ * @brief Camera groups: many cameras driven by one I/O thread and a small pool of
+ * processing workers, instead of a thread per device.
+ *
+ * The I/O thread waits on every camera's fd with a single epoll instance, drains the
+ * ready cameras with acam_stream_try_dequeue_frame and turns each frame into a task.
+ * Every worker owns a task deque; a camera's frames go to the deque of the worker it
+ * is pinned to (camera index modulo worker count), which keeps a camera's frames on
+ * one core while the load is even. An idle worker steals from the other deques, so a
+ * slow camera or a long callback does not leave frames waiting behind a busy worker.
+ * Owners and thieves both take the oldest task of a deque, which keeps latency low.
+ *
+ */
+
+#define GROUP_PARK_RETRY_MS 10 //how often cameras with no queued buffers are polled again
+#define GROUP_FPS_SHIFT 3      //weight of a new frame interval in the smoothed rate: 1/8
+
+typedef struct
+{
+    acam_frame_t *frame;
+    unsigned int camera;
+} group_task_t;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    group_task_t *tasks; //circular, capacity slots
+    unsigned int head;
+    unsigned int len;
+} group_deque_t;
+
+typedef struct
+{
+    acam_camera_t *cam;
+    int parked; //1 while the fd is out of the epoll set, see io_main
+    int failed;
+
+    uint32_t last_sequence;
+    int have_sequence;
+    uint64_t last_timestamp_us;
+    uint64_t interval_ns; //smoothed time between frames, 0 until two frames arrived
+
+    uint64_t frames;
+    uint64_t processed;
+    uint64_t dropped_device;
+    int error;
+} group_camera_t;
+
+typedef struct
+{
+    struct acam_group *group;
+    unsigned int index;
+    pthread_t thread;
+} group_worker_t;
+
+struct acam_group
+{
+    group_camera_t *cameras;
+    unsigned int camera_count;
+
+    group_worker_t *workers;
+    group_deque_t *deques;
+    group_task_t *slots; //backing store of every deque
+    unsigned int worker_count;
+    unsigned int capacity; //slots per deque: every frame of every ring fits in one deque
+    sem_t pending; //number of tasks in all deques
+
+    acam_group_frame_cb_t callback;
+    void *user;
+
+    int epoll_fd;
+    int wake_fd; //eventfd that interrupts the I/O thread on stop
+    pthread_t io_thread;
+    int running;
+    int stop;
+    int workers_stop;
+    int error; //errno that ended the I/O thread, 0 while it runs; reported for every camera
+};
+
+static int64_t monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void push_task(acam_group_t *group, unsigned int worker, group_task_t task)
+{
+    group_deque_t *dq = &group->deques[worker];
+    pthread_mutex_lock(&dq->lock);
+    dq->tasks[(dq->head + dq->len) % group->capacity] = task;
+    dq->len++;
+    pthread_mutex_unlock(&dq->lock);
+    sem_post(&group->pending);
+}
+
+static int pop_task(acam_group_t *group, unsigned int worker, group_task_t *task)
+{
+    group_deque_t *dq = &group->deques[worker];
+    int found = 0;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->len > 0)
+    {
+        *task = dq->tasks[dq->head];
+        dq->head = (dq->head + 1) % group->capacity;
+        dq->len--;
+        found = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+/**
+ * @brief Takes a task from the worker's own deque, or steals one from the others.
+ *
+ * @return 1 if a task was found, 0 if every deque is empty.
+ */
+static int find_task(acam_group_t *group, unsigned int worker, group_task_t *task)
+{
+    for (unsigned int i = 0; i < group->worker_count; i++)
+    {
+        if (pop_task(group, (worker + i) % group->worker_count, task))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void *worker_main(void *arg)
+{
+    group_worker_t *self = arg;
+    acam_group_t *group = self->group;
+
+    for (;;)
+    {
+        while (-1 == sem_wait(&group->pending) && errno == EINTR)
+            ;
+
+        group_task_t task;
+        if (!find_task(group, self->index, &task))
+        {
+            // every task is accounted for by one post, so an empty search only
+            // happens for the posts that stop the workers
+            if (__atomic_load_n(&group->workers_stop, __ATOMIC_ACQUIRE))
+            {
+                break;
+            }
+            continue;
+        }
+
+        group->callback(task.frame, task.camera, group->user);
+        acam_frame_release(task.frame);
+        __atomic_add_fetch(&group->cameras[task.camera].processed, 1, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Records a dequeued frame in its camera's counters.
+ */
+static void account_frame(group_camera_t *gc, const acam_frame_t *frame)
+{
+    if (gc->have_sequence && frame->sequence > gc->last_sequence + 1)
+    {
+        __atomic_add_fetch(&gc->dropped_device, frame->sequence - gc->last_sequence - 1, __ATOMIC_RELAXED);
+    }
+    gc->last_sequence = frame->sequence;
+
+    uint64_t ts_us = (uint64_t)frame->timestamp.tv_sec * 1000000 + frame->timestamp.tv_usec;
+    if (gc->have_sequence && ts_us > gc->last_timestamp_us)
+    {
+        // frame rate from the driver's timestamps, smoothed over the last few frames
+        uint64_t interval_ns = (ts_us - gc->last_timestamp_us) * 1000;
+        uint64_t smoothed = gc->interval_ns == 0 ? interval_ns : gc->interval_ns - (gc->interval_ns >> GROUP_FPS_SHIFT) + (interval_ns >> GROUP_FPS_SHIFT);
+        __atomic_store_n(&gc->interval_ns, smoothed, __ATOMIC_RELAXED);
+    }
+    gc->last_timestamp_us = ts_us;
+    gc->have_sequence = 1;
+
+    __atomic_add_fetch(&gc->frames, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Takes every ready frame of one camera and hands them to the workers.
+ *
+ * @return 1 if at least one frame was taken, 0 otherwise.
+ */
+static int drain_camera(acam_group_t *group, unsigned int index)
+{
+    group_camera_t *gc = &group->cameras[index];
+    int taken = 0;
+
+    for (;;)
+    {
+        acam_frame_t *frame;
+        int ret = acam_stream_try_dequeue_frame(gc->cam, &frame);
+        if (ret == EAGAIN)
+        {
+            break;
+        }
+        if (ret != 0)
+        {
+            DEBUG_PRINT(stderr, "Camera %u left the group: %s\n", index, strerror(ret));
+            __atomic_store_n(&gc->error, ret, __ATOMIC_RELAXED);
+            gc->failed = 1;
+            epoll_ctl(group->epoll_fd, EPOLL_CTL_DEL, acam_get_fd(gc->cam), NULL);
+            break;
+        }
+
+        account_frame(gc, frame);
+        group_task_t task = {frame, index};
+        push_task(group, index % group->worker_count, task);
+        taken = 1;
+    }
+
+    return taken;
+}
+
+static void set_parked(acam_group_t *group, unsigned int index, int parked)
+{
+    group_camera_t *gc = &group->cameras[index];
+    struct epoll_event ev = {0};
+    ev.events = parked ? 0 : EPOLLIN;
+    ev.data.u32 = index;
+    epoll_ctl(group->epoll_fd, EPOLL_CTL_MOD, acam_get_fd(gc->cam), &ev);
+    gc->parked = parked;
+}
+
+static void *io_main(void *arg)
+{
+    acam_group_t *group = arg;
+    struct epoll_event events[64];
+    unsigned int parked = 0;
+    int64_t retry_at_ms = 0;
+
+    while (!__atomic_load_n(&group->stop, __ATOMIC_ACQUIRE))
+    {
+        int n = epoll_wait(group->epoll_fd, events, 64, parked ? GROUP_PARK_RETRY_MS : -1);
+        if (n == -1 && errno != EINTR)
+        {
+            DEBUG_PERROR("Waiting for cameras");
+            __atomic_store_n(&group->error, errno, __ATOMIC_RELAXED);
+            break;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            unsigned int index = events[i].data.u32;
+            if (index >= group->camera_count)
+            {
+                continue; // the wake eventfd
+            }
+            // A V4L2 node with every buffer held by the workers reports EPOLLERR until
+            // one is requeued. Take it out of the set and retry it on a timer instead
+            // of spinning on the error.
+            if (!drain_camera(group, index) && (events[i].events & EPOLLERR) && !group->cameras[index].failed)
+            {
+                set_parked(group, index, 1);
+                if (parked++ == 0)
+                {
+                    retry_at_ms = monotonic_ms() + GROUP_PARK_RETRY_MS;
+                }
+            }
+        }
+
+        if (parked && monotonic_ms() >= retry_at_ms)
+        {
+            for (unsigned int c = 0; c < group->camera_count; c++)
+            {
+                if (group->cameras[c].parked)
+                {
+                    set_parked(group, c, 0);
+                    parked--;
+                }
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Ends the worker threads once every task handed to them is done. No more
+ * tasks may arrive: one extra post per worker ends it when the deques are empty.
+ *
+ * @param group the group
+ * @param started the number of workers that were started.
+ */
+static void stop_workers(acam_group_t *group, unsigned int started)
+{
+    __atomic_store_n(&group->workers_stop, 1, __ATOMIC_RELEASE);
+    for (unsigned int i = 0; i < started; i++)
+    {
+        sem_post(&group->pending);
+    }
+    for (unsigned int i = 0; i < started; i++)
+    {
+        pthread_join(group->workers[i].thread, NULL);
+    }
+    for (unsigned int i = 0; i < group->worker_count; i++)
+    {
+        pthread_mutex_destroy(&group->deques[i].lock);
+    }
+    sem_destroy(&group->pending);
+}
+
+/**
+ * @brief Opens a group of cameras. Set up each camera (format, controls) through
+ * acam_group_get_camera, then start capturing with acam_group_start.
+ *
+ * @param cam_files the device paths, as accepted by acam_open.
+ * @param count the number of paths.
+ * @param workers the number of processing threads. 0 selects one per online CPU.
+ * @param error keeps track of error code on failure.
+ * @return the group on success, NULL on failure.
+ */
+acam_group_t *acam_group_open(const char *const *cam_files, unsigned int count, unsigned int workers, int *error)
+{
+    assert(cam_files && error);
+    if (count == 0)
+    {
+        *error = EINVAL;
+        return NULL;
+    }
+    if (workers == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cpus > 0 ? cpus : 1;
+    }
+
+    acam_group_t *group = calloc(1, sizeof(acam_group_t));
+    if (group == NULL)
+    {
+        *error = ENOMEM;
+        return NULL;
+    }
+    group->epoll_fd = -1;
+    group->wake_fd = -1;
+    group->worker_count = workers;
+    group->cameras = calloc(count, sizeof(group_camera_t));
+    if (group->cameras == NULL)
+    {
+        *error = ENOMEM;
+        acam_group_close(group);
+        return NULL;
+    }
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        group->cameras[i].cam = acam_open(cam_files[i], error);
+        if (group->cameras[i].cam == NULL)
+        {
+            DEBUG_PRINT(stderr, "Opening %s for the group failed\n", cam_files[i]);
+            acam_group_close(group);
+            return NULL;
+        }
+        group->camera_count = i + 1;
+    }
+
+    return group;
+}
+
+/**
+ * @brief Gets one camera of the group, e.g. to set its format or controls before
+ * acam_group_start. Do not stream, capture or close it directly.
+ *
+ * @param group the group
+ * @param index the camera's position in the paths given to acam_group_open.
+ * @return the camera, NULL if @param index is out of range.
+ */
+acam_camera_t *acam_group_get_camera(const acam_group_t *group, unsigned int index)
+{
+    assert(group);
+    return index < group->camera_count ? group->cameras[index].cam : NULL;
+}
+
+/**
+ * @brief Starts streaming on every camera and begins dispatching frames. @param callback
+ * runs on a worker thread for every frame; the group releases the frame when it
+ * returns, so call acam_frame_ref to keep it longer. Frames of one camera can be
+ * processed concurrently by different workers.
+ *
+ * @param group the group
+ * @param buffers the number of buffers per camera. 0 selects ACAM_STREAM_DEFAULT_BUFFERS.
+ * @param callback called with each frame and the index of its camera.
+ * @param user passed to @param callback unchanged.
+ * @return exit status. 0 on success, errno on failure to start a camera or a thread,
+ * EBUSY if the group is already running.
+ */
+int acam_group_start(acam_group_t *group, unsigned int buffers, acam_group_frame_cb_t callback, void *user)
+{
+    assert(group && callback);
+    if (group->running)
+    {
+        return EBUSY;
+    }
+    group->callback = callback;
+    group->user = user;
+    group->stop = 0;
+    group->workers_stop = 0;
+    group->error = 0;
+
+    int ret = 0;
+    group->capacity = 0;
+    for (unsigned int i = 0; i < group->camera_count; i++)
+    {
+        group_camera_t *gc = &group->cameras[i];
+        ret = acam_stream_start(gc->cam, buffers);
+        if (ret != 0)
+        {
+            while (i-- > 0)
+            {
+                acam_stream_stop(group->cameras[i].cam);
+            }
+            return ret;
+        }
+        group->capacity += gc->cam->ring_count;
+        gc->parked = 0;
+        gc->failed = 0;
+        gc->have_sequence = 0;
+        gc->interval_ns = 0;
+        gc->error = 0;
+    }
+
+    group->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    group->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    group->deques = calloc(group->worker_count, sizeof(group_deque_t));
+    group->workers = calloc(group->worker_count, sizeof(group_worker_t));
+    if (group->epoll_fd == -1 || group->wake_fd == -1)
+    {
+        DEBUG_PERROR("Creating group event loop");
+        ret = errno;
+        goto fail;
+    }
+    if (group->deques == NULL || group->workers == NULL)
+    {
+        ret = ENOMEM;
+        goto fail;
+    }
+
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.u32 = UINT32_MAX;
+    if (-1 == epoll_ctl(group->epoll_fd, EPOLL_CTL_ADD, group->wake_fd, &ev))
+    {
+        DEBUG_PERROR("Adding wake event to group event loop");
+        ret = errno;
+        goto fail;
+    }
+    for (unsigned int i = 0; i < group->camera_count; i++)
+    {
+        ev.data.u32 = i;
+        if (-1 == epoll_ctl(group->epoll_fd, EPOLL_CTL_ADD, acam_get_fd(group->cameras[i].cam), &ev))
+        {
+            DEBUG_PERROR("Adding camera to group event loop");
+            ret = errno;
+            goto fail;
+        }
+    }
+
+    // every deque must exist before the first worker starts stealing
+    group->slots = malloc((size_t)group->worker_count * group->capacity * sizeof(group_task_t));
+    if (group->slots == NULL)
+    {
+        ret = ENOMEM;
+        goto fail;
+    }
+    for (unsigned int i = 0; i < group->worker_count; i++)
+    {
+        pthread_mutex_init(&group->deques[i].lock, NULL);
+        group->deques[i].tasks = group->slots + (size_t)i * group->capacity;
+        group->workers[i].group = group;
+        group->workers[i].index = i;
+    }
+    sem_init(&group->pending, 0, 0);
+
+    unsigned int started = 0;
+    for (; started < group->worker_count && ret == 0; started++)
+    {
+        ret = pthread_create(&group->workers[started].thread, NULL, worker_main, &group->workers[started]);
+    }
+    if (ret == 0)
+    {
+        ret = pthread_create(&group->io_thread, NULL, io_main, group);
+    }
+    else
+    {
+        started--;
+    }
+    if (ret != 0)
+    {
+        DEBUG_PRINT(stderr, "Starting group threads: %s\n", strerror(ret));
+        stop_workers(group, started);
+        goto fail;
+    }
+
+    group->running = 1;
+    return 0;
+
+fail:
+    for (unsigned int i = 0; i < group->camera_count; i++)
+    {
+        acam_stream_stop(group->cameras[i].cam);
+    }
+    if (group->epoll_fd != -1)
+    {
+        close(group->epoll_fd);
+        group->epoll_fd = -1;
+    }
+    if (group->wake_fd != -1)
+    {
+        close(group->wake_fd);
+        group->wake_fd = -1;
+    }
+    free(group->slots);
+    free(group->deques);
+    free(group->workers);
+    group->slots = NULL;
+    group->deques = NULL;
+    group->workers = NULL;
+    return ret;
+}
+
+/**
+ * @brief Stops dispatching, lets the workers finish every frame already handed to
+ * them and turns streaming off on every camera. Frames kept with acam_frame_ref must
+ * be released first.
+ *
+ * @param group the group
+ * @return exit status. 0 on success, errno on failure to stop a camera, EINVAL if the
+ * group is not running.
+ */
+int acam_group_stop(acam_group_t *group)
+{
+    assert(group);
+    if (!group->running)
+    {
+        return EINVAL;
+    }
+
+    __atomic_store_n(&group->stop, 1, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    if (-1 == write(group->wake_fd, &one, sizeof(one)))
+    {
+        DEBUG_PERROR("Waking group event loop");
+    }
+    pthread_join(group->io_thread, NULL);
+
+    stop_workers(group, group->worker_count);
+    free(group->slots);
+    free(group->deques);
+    free(group->workers);
+    group->slots = NULL;
+    group->deques = NULL;
+    group->workers = NULL;
+
+    int ret = 0;
+    for (unsigned int i = 0; i < group->camera_count; i++)
+    {
+        int r = acam_stream_stop(group->cameras[i].cam);
+        if (r != 0 && ret == 0)
+        {
+            ret = r;
+        }
+    }
+    close(group->epoll_fd);
+    close(group->wake_fd);
+    group->epoll_fd = -1;
+    group->wake_fd = -1;
+    group->running = 0;
+
+    return ret;
+}
+
+/**
+ * @brief Reads the counters of one camera in the group.
+ *
+ * @param group the group
+ * @param index the camera's position in the paths given to acam_group_open.
+ * @param stats filled with a snapshot of the camera's counters.
+ * @return exit status. 0 on success, EINVAL if @param index is out of range.
+ */
+int acam_group_get_stats(const acam_group_t *group, unsigned int index, acam_group_stats_t *stats)
+{
+    assert(group && stats);
+    if (index >= group->camera_count)
+    {
+        return EINVAL;
+    }
+
+    const group_camera_t *gc = &group->cameras[index];
+    stats->frames = __atomic_load_n(&gc->frames, __ATOMIC_RELAXED);
+    stats->processed = __atomic_load_n(&gc->processed, __ATOMIC_RELAXED);
+    stats->dropped_device = __atomic_load_n(&gc->dropped_device, __ATOMIC_RELAXED);
+    stats->error = __atomic_load_n(&gc->error, __ATOMIC_RELAXED);
+    if (stats->error == 0)
+    {
+        stats->error = __atomic_load_n(&group->error, __ATOMIC_RELAXED); // the I/O thread stopped serving every camera
+    }
+    uint64_t interval_ns = __atomic_load_n(&gc->interval_ns, __ATOMIC_RELAXED);
+    stats->fps = interval_ns ? 1e9 / interval_ns : 0.0;
+
+    return 0;
+}
+
+/**
+ * @brief Stops the group if it is running, closes every camera and frees the group.
+ *
+ * @param group the group to close
+ * @return exit status. 0 on success, errno of the first camera that failed to close.
+ */
+int acam_group_close(acam_group_t *group)
+{
+    assert(group);
+    int ret = 0;
+    if (group->running)
+    {
+        ret = acam_group_stop(group);
+    }
+
+    for (unsigned int i = 0; i < group->camera_count; i++)
+    {
+        int r = acam_close(group->cameras[i].cam);
+        if (r != 0 && ret == 0)
+        {
+            ret = r;
+        }
+    }
+    free(group->cameras);
+    free(group);
+
+    return ret;
+}
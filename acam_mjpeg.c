@@ -0,0 +1,1083 @@
+#include "acam_control.h"
+#include "acam_jpeg_tables.h"
+
+#include <pthread.h>
+#include <stddef.h>
+
+#ifndef NDEBUG
+#define DEBUG_PRINT fprintf
+#define DEBUG_PERROR perror
+#else
+#define DEBUG_PRINT
+#define DEBUG_PERROR
+#endif
+
+/**
+ * @brief MJPEG frame post-processing, and decoding of the 1/8-scale image of a frame,
+ * see acam_mjpeg_decode_dc below. UVC cameras send each MJPEG frame as a bare
+ * JPEG that usually leaves out the DHT segment, relying on the standard Huffman
+ * tables, and a frame cut short on the bus arrives without its EOI. Most decoders
+ * reject both.
+ *
+ * acam_mjpeg_prepare walks the marker segments of the header, then searches the
+ * entropy-coded data for marker bytes with memchr, which glibc implements with SIMD
+ * loads, and checks every 0xFF it finds until the EOI. The result is a list of iovecs
+ * pointing into the frame itself, with the standard DHT segment spliced in before the
+ * SOS when the frame has none, so the frame is never copied.
+ *
+ */
+
+#define M_SOI 0xd8
+#define M_EOI 0xd9
+#define M_SOS 0xda
+#define M_DHT 0xc4
+#define M_RST0 0xd0
+#define M_RST7 0xd7
+#define M_TEM 0x01
+
+#define DHT_SIZE (4 + 4 * 17 + 12 + 12 + 162 + 162)
+
+static uint8_t std_dht[DHT_SIZE]; //the DHT segment of the standard tables, built once
+static pthread_once_t std_dht_once = PTHREAD_ONCE_INIT;
+
+static size_t put_table(uint8_t *p, uint8_t class_id, const uint8_t *bits, const uint8_t *vals, size_t count)
+{
+    p[0] = class_id;
+    memcpy(p + 1, bits, 16);
+    memcpy(p + 17, vals, count);
+    return 17 + count;
+}
+
+static void build_std_dht(void)
+{
+    uint8_t *p = std_dht;
+    p[0] = 0xff;
+    p[1] = M_DHT;
+    p[2] = (DHT_SIZE - 2) >> 8;
+    p[3] = (DHT_SIZE - 2) & 0xff;
+    size_t pos = 4;
+    pos += put_table(p + pos, 0x00, acam_std_dc_luma_bits, acam_std_dc_luma_vals, sizeof(acam_std_dc_luma_vals));
+    pos += put_table(p + pos, 0x10, acam_std_ac_luma_bits, acam_std_ac_luma_vals, sizeof(acam_std_ac_luma_vals));
+    pos += put_table(p + pos, 0x01, acam_std_dc_chroma_bits, acam_std_dc_chroma_vals, sizeof(acam_std_dc_chroma_vals));
+    pos += put_table(p + pos, 0x11, acam_std_ac_chroma_bits, acam_std_ac_chroma_vals, sizeof(acam_std_ac_chroma_vals));
+    assert(pos == DHT_SIZE);
+}
+
+static int is_sof(uint8_t marker)
+{
+    // C0..CF are frame headers except DHT (C4), JPG (C8) and DAC (CC)
+    return marker >= 0xc0 && marker <= 0xcf && marker != M_DHT && marker != 0xc8 && marker != 0xcc;
+}
+
+/**
+ * @brief Finds the end of an entropy-coded segment: the first 0xFF that is neither
+ * byte stuffing (FF 00), a restart marker nor fill before another 0xFF.
+ *
+ * @param data the frame
+ * @param pos where the entropy-coded data starts
+ * @param size the number of bytes in the frame
+ * @return the offset of the 0xFF that starts the next marker, or size if there is none.
+ */
+static size_t find_marker(const uint8_t *data, size_t pos, size_t size)
+{
+    while (pos < size)
+    {
+        const uint8_t *ff = memchr(data + pos, 0xff, size - pos);
+        if (ff == NULL)
+        {
+            return size;
+        }
+        pos = ff - data;
+        if (pos + 1 >= size)
+        {
+            return size; // a lone 0xFF as the last byte: the frame was cut
+        }
+        uint8_t next = data[pos + 1];
+        if (next == 0x00 || (next >= M_RST0 && next <= M_RST7))
+        {
+            pos += 2;
+        }
+        else if (next == 0xff)
+        {
+            pos += 1;
+        }
+        else
+        {
+            return pos;
+        }
+    }
+    return size;
+}
+
+/**
+ * @brief Checks an MJPEG frame and describes it as a standards-compliant JPEG
+ * without copying it. The frame's marker segments are walked from the SOI, its
+ * entropy-coded data is scanned up to the EOI, anything after the EOI is left out,
+ * and the standard Huffman tables are spliced in before the first SOS if the frame
+ * carries no DHT segment.
+ *
+ * @param buffer a buffer holding an MJPEG frame, buffer->bytes_used bytes long.
+ * @param jpeg filled with the iovecs making up the JPEG. They point into @param buffer
+ * and into static memory, so they are valid as long as the buffer's contents are.
+ * @return exit status. 0 on success, ENODATA if the frame ends before its EOI
+ * (truncated), EBADMSG if its structure is corrupt.
+ */
+int acam_mjpeg_prepare(const acam_buffer_t *buffer, acam_mjpeg_t *jpeg)
+{
+    assert(buffer && jpeg);
+    const uint8_t *data = (const uint8_t *)buffer->buf;
+    size_t size = buffer->bytes_used;
+    memset(jpeg, 0, sizeof(*jpeg));
+
+    if (size < 4 || data[0] != 0xff || data[1] != M_SOI)
+    {
+        DEBUG_PRINT(stderr, "MJPEG frame does not start with SOI.\n");
+        return size < 2 ? ENODATA : EBADMSG;
+    }
+
+    size_t pos = 2;
+    size_t first_sos = 0;
+    int have_dht = 0, have_sof = 0;
+    for (;;)
+    {
+        // marker segments: FF, any fill bytes, the marker, then a length unless standalone
+        while (pos < size && data[pos] == 0xff && pos + 1 < size && data[pos + 1] == 0xff)
+        {
+            pos++;
+        }
+        if (pos + 2 > size)
+        {
+            DEBUG_PRINT(stderr, "MJPEG frame is truncated at byte %zu of the header.\n", pos);
+            return ENODATA;
+        }
+        if (data[pos] != 0xff)
+        {
+            DEBUG_PRINT(stderr, "MJPEG frame has no marker at byte %zu.\n", pos);
+            return EBADMSG;
+        }
+        uint8_t marker = data[pos + 1];
+        if (marker == M_EOI)
+        {
+            pos += 2;
+            break;
+        }
+        if (marker == M_SOI || marker == 0x00)
+        {
+            DEBUG_PRINT(stderr, "MJPEG frame has a misplaced marker 0x%02x at byte %zu.\n", marker, pos);
+            return EBADMSG;
+        }
+        if (marker == M_TEM || (marker >= M_RST0 && marker <= M_RST7))
+        {
+            pos += 2;
+            continue;
+        }
+        if (pos + 4 > size)
+        {
+            return ENODATA;
+        }
+        size_t length = (size_t)data[pos + 2] << 8 | data[pos + 3];
+        if (length < 2)
+        {
+            DEBUG_PRINT(stderr, "MJPEG segment 0x%02x at byte %zu has an invalid length.\n", marker, pos);
+            return EBADMSG;
+        }
+        if (pos + 2 + length > size)
+        {
+            DEBUG_PRINT(stderr, "MJPEG frame is truncated inside segment 0x%02x.\n", marker);
+            return ENODATA;
+        }
+
+        if (marker == M_DHT && first_sos == 0)
+        {
+            have_dht = 1; // tables defined after the first scan do not help it
+        }
+        else if (is_sof(marker))
+        {
+            if (length < 8)
+            {
+                return EBADMSG;
+            }
+            have_sof = 1;
+            jpeg->height = data[pos + 5] << 8 | data[pos + 6];
+            jpeg->width = data[pos + 7] << 8 | data[pos + 8];
+        }
+        else if (marker == M_SOS)
+        {
+            if (!have_sof)
+            {
+                DEBUG_PRINT(stderr, "MJPEG frame has a scan before its frame header.\n");
+                return EBADMSG;
+            }
+            if (first_sos == 0)
+            {
+                first_sos = pos;
+            }
+            pos = find_marker(data, pos + 2 + length, size);
+            if (pos == size)
+            {
+                DEBUG_PRINT(stderr, "MJPEG frame is truncated: no EOI after %zu bytes.\n", size);
+                return ENODATA;
+            }
+            continue;
+        }
+        pos += 2 + length;
+    }
+
+    if (first_sos == 0)
+    {
+        DEBUG_PRINT(stderr, "MJPEG frame has no scan.\n");
+        return EBADMSG;
+    }
+
+    if (have_dht)
+    {
+        jpeg->iov[0].iov_base = (void *)data;
+        jpeg->iov[0].iov_len = pos;
+        jpeg->iovcnt = 1;
+    }
+    else
+    {
+        pthread_once(&std_dht_once, build_std_dht);
+        jpeg->iov[0].iov_base = (void *)data;
+        jpeg->iov[0].iov_len = first_sos;
+        jpeg->iov[1].iov_base = std_dht;
+        jpeg->iov[1].iov_len = DHT_SIZE;
+        jpeg->iov[2].iov_base = (void *)(data + first_sos);
+        jpeg->iov[2].iov_len = pos - first_sos;
+        jpeg->iovcnt = 3;
+        jpeg->flags |= ACAM_MJPEG_DHT_INSERTED;
+    }
+    if (pos < size)
+    {
+        jpeg->flags |= ACAM_MJPEG_TRIMMED;
+    }
+    jpeg->size = pos + (have_dht ? 0 : DHT_SIZE);
+    return 0;
+}
+
+/**
+ * @brief Writes a JPEG described by acam_mjpeg_prepare to a file descriptor with
+ * writev, retrying until every byte is written.
+ *
+ * @param fd the file descriptor to write to.
+ * @param jpeg a JPEG filled by acam_mjpeg_prepare.
+ * @return exit status. 0 on success, errno on write failure.
+ */
+int acam_mjpeg_writev(int fd, const acam_mjpeg_t *jpeg)
+{
+    assert(jpeg);
+    struct iovec iov[ACAM_MJPEG_MAX_IOV];
+    memcpy(iov, jpeg->iov, sizeof(iov));
+    struct iovec *next = iov;
+    int count = jpeg->iovcnt;
+    while (count > 0)
+    {
+        ssize_t written = writev(fd, next, count);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            DEBUG_PERROR("Writing JPEG");
+            return errno;
+        }
+        // skip what was written; a short write resumes in the middle of an iovec
+        while (count > 0 && (size_t)written >= next->iov_len)
+        {
+            written -= next->iov_len;
+            next++;
+            count--;
+        }
+        if (count > 0)
+        {
+            next->iov_base = (char *)next->iov_base + written;
+            next->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes an MJPEG frame to a file as a standards-compliant JPEG: the frame is
+ * checked, padding after the EOI is left out and the standard Huffman tables are
+ * added if the frame has none. Nothing is written for a truncated or corrupt frame.
+ *
+ * @param file_name the file to create or replace.
+ * @param buffer a buffer holding an MJPEG frame.
+ * @return exit status. 0 on success, ENODATA or EBADMSG as acam_mjpeg_prepare,
+ * errno on failure to open or write the file.
+ */
+int acam_write_mjpeg_to_file(const char *file_name, const acam_buffer_t *buffer)
+{
+    assert(file_name && buffer);
+    acam_mjpeg_t jpeg;
+    int ret = acam_mjpeg_prepare(buffer, &jpeg);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    int outfd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (outfd == -1)
+    {
+        DEBUG_PRINT(stderr, "Problem opening file %s: %s\n", file_name, strerror(errno));
+        return errno;
+    }
+    ret = acam_mjpeg_writev(outfd, &jpeg);
+    if (close(outfd) == -1 && ret == 0)
+    {
+        DEBUG_PRINT(stderr, "Problem closing file %s: %s\n", file_name, strerror(errno));
+        ret = errno;
+    }
+    return ret;
+}
+
+/*
+ * DC-only decoding. acam_mjpeg_decode_dc reads the frame header, quantization and
+ * Huffman tables and entropy-decodes every block of every scan, but keeps only the
+ * DC coefficient: the block's mean, and so one pixel of a 1/8-scale image. The AC
+ * coefficients still have to be decoded to find where the next block starts, but
+ * only their lengths matter, so a lookup table gives the bits to skip for a code
+ * and its value together, and no dequantization, IDCT or color conversion is done.
+ */
+
+#define HUFF_FAST_BITS 10
+#define SKIP_EOB 64 //step of an end-of-block code: past the last coefficient
+#define SKIP_NONZERO 0x8000 //the code carries a non-zero coefficient
+
+/**
+ * @brief A Huffman table ready for decoding.
+ *
+ */
+typedef struct
+{
+    uint16_t fast[1 << HUFF_FAST_BITS]; //(length << 8) | symbol of the code the next bits start with, 0 if longer
+    uint16_t skip[1 << HUFF_FAST_BITS]; //AC: bits of code and value | (coefficients stepped over << 8) | SKIP_NONZERO, 0 if longer
+    int32_t maxcode[17]; //largest code of each length, -1 if none
+    int32_t valoffset[17]; //vals index of a code of each length, minus the code
+    uint8_t vals[256];
+} huff_table_t;
+
+typedef struct
+{
+    const uint8_t *p, *end;
+    uint64_t bits; //left-aligned
+    int count; //bits held
+    int zeros; //bits fed past the end of the entropy-coded data
+    int stopped; //p is at a marker or the end
+} bit_reader_t;
+
+typedef struct
+{
+    uint8_t id;
+    uint8_t h, v; //sampling factors
+    uint8_t tq; //quantization table
+    unsigned int blocks_x, blocks_y; //blocks holding image data
+    const huff_table_t *dc, *ac; //of the current scan
+    int pred; //DC predictor
+} dc_component_t;
+
+typedef struct
+{
+    unsigned int width, height;
+    unsigned int count; //components
+    dc_component_t comp[3];
+    unsigned int hmax, vmax;
+    uint16_t dc_quant[4]; //the DC entry of each quantization table, 0 if undefined
+    const huff_table_t *dc[4], *ac[4];
+    unsigned int restart_interval;
+    uint64_t luma_blocks, luma_nonzero; //for acam_mjpeg_dc_t.detail
+    acam_mjpeg_dc_t *result;
+    huff_table_t defined[8]; //tables from DHT segments: DC 0..3, then AC 0..3; last, as only they are not cleared
+} dc_decoder_t;
+
+static huff_table_t std_huff[4]; //DC luma, DC chroma, AC luma, AC chroma
+static pthread_once_t std_huff_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Builds a decoding table from the 16 code-length counts and the symbols of a
+ * DHT segment.
+ *
+ * @return 0 on success, EBADMSG if the counts describe more codes than fit.
+ */
+static int build_huffman(huff_table_t *t, const uint8_t *bits, const uint8_t *vals, int ac)
+{
+    memset(t->fast, 0, sizeof(t->fast));
+    memset(t->skip, 0, sizeof(t->skip));
+    uint32_t code = 0;
+    unsigned int k = 0;
+    for (int len = 1; len <= 16; len++)
+    {
+        t->valoffset[len] = (int32_t)k - (int32_t)code;
+        for (unsigned int i = 0; i < bits[len - 1]; i++, k++, code++)
+        {
+            if (k >= 256 || code >= (1u << len))
+            {
+                return EBADMSG; // more codes than the lengths have room for: the tables below would overflow
+            }
+            t->vals[k] = vals[k];
+            if (len > HUFF_FAST_BITS)
+            {
+                continue;
+            }
+            uint8_t sym = vals[k];
+            unsigned int r = sym >> 4, s = sym & 15;
+            uint16_t skip = 0;
+            if (ac && (unsigned int)len + s <= HUFF_FAST_BITS)
+            {
+                unsigned int step = s ? r + 1 : r == 15 ? 16 : SKIP_EOB;
+                skip = (uint16_t)((len + s) | step << 8 | (s ? SKIP_NONZERO : 0));
+            }
+            unsigned int shift = HUFF_FAST_BITS - len;
+            for (uint32_t suffix = 0; suffix < (1u << shift); suffix++)
+            {
+                t->fast[code << shift | suffix] = (uint16_t)(len << 8 | sym);
+                t->skip[code << shift | suffix] = skip;
+            }
+        }
+        t->maxcode[len] = bits[len - 1] ? (int32_t)code - 1 : -1;
+        code <<= 1;
+    }
+    return 0;
+}
+
+static void build_std_huffman(void)
+{
+    build_huffman(&std_huff[0], acam_std_dc_luma_bits, acam_std_dc_luma_vals, 0);
+    build_huffman(&std_huff[1], acam_std_dc_chroma_bits, acam_std_dc_chroma_vals, 0);
+    build_huffman(&std_huff[2], acam_std_ac_luma_bits, acam_std_ac_luma_vals, 1);
+    build_huffman(&std_huff[3], acam_std_ac_chroma_bits, acam_std_ac_chroma_vals, 1);
+}
+
+/**
+ * @brief Tops the reader up to at least 57 bits, undoing byte stuffing. At a marker
+ * or the end of the frame it feeds zeros and counts them.
+ */
+static inline void fill_bits(bit_reader_t *br)
+{
+    while (br->count <= 56)
+    {
+        uint64_t byte = 0;
+        if (!br->stopped)
+        {
+            if (br->p < br->end && *br->p != 0xff)
+            {
+                byte = *br->p++;
+            }
+            else if (br->p + 1 < br->end && br->p[1] == 0x00)
+            {
+                byte = 0xff;
+                br->p += 2;
+            }
+            else
+            {
+                br->stopped = 1;
+            }
+        }
+        if (br->stopped)
+        {
+            br->zeros += 8;
+        }
+        br->bits |= byte << (56 - br->count);
+        br->count += 8;
+    }
+}
+
+static inline void skip_bits(bit_reader_t *br, int n)
+{
+    br->bits <<= n;
+    br->count -= n;
+}
+
+static inline uint32_t get_bits(bit_reader_t *br, int n)
+{
+    uint32_t v = (uint32_t)(br->bits >> (64 - n));
+    skip_bits(br, n);
+    return v;
+}
+
+/**
+ * @brief Decodes one Huffman symbol. The reader must hold at least 16 bits.
+ *
+ * @return the symbol, or -1 if the bits are no code of the table.
+ */
+static inline int decode_symbol(bit_reader_t *br, const huff_table_t *t)
+{
+    uint16_t e = t->fast[br->bits >> (64 - HUFF_FAST_BITS)];
+    if (e != 0)
+    {
+        skip_bits(br, e >> 8);
+        return e & 0xff;
+    }
+    uint32_t peek = (uint32_t)(br->bits >> 48);
+    for (int len = HUFF_FAST_BITS + 1; len <= 16; len++)
+    {
+        int32_t code = peek >> (16 - len);
+        if (code <= t->maxcode[len])
+        {
+            skip_bits(br, len);
+            return t->vals[(code + t->valoffset[len]) & 0xff];
+        }
+    }
+    return -1;
+}
+
+static inline int extend(uint32_t v, int s)
+{
+    return v < (1u << (s - 1)) ? (int)v - (1 << s) + 1 : (int)v;
+}
+
+/**
+ * @brief Decodes one block: updates the component's DC predictor and skips the AC
+ * coefficients, counting the non-zero ones.
+ *
+ * @return 0 on success, EBADMSG on an invalid code.
+ */
+static int decode_block(bit_reader_t *br, dc_component_t *c, unsigned int *nonzero)
+{
+    fill_bits(br);
+    int s = decode_symbol(br, c->dc);
+    if (s < 0 || s > 11)
+    {
+        return EBADMSG;
+    }
+    if (s)
+    {
+        c->pred += extend(get_bits(br, s), s);
+    }
+
+    const huff_table_t *ac = c->ac;
+    for (unsigned int k = 1; k < 64;)
+    {
+        if (br->count < 32)
+        {
+            fill_bits(br);
+        }
+        uint16_t e = ac->skip[br->bits >> (64 - HUFF_FAST_BITS)];
+        if (e != 0)
+        {
+            skip_bits(br, e & 0xff);
+            k += (e >> 8) & 0x7f;
+            *nonzero += e >> 15;
+            continue;
+        }
+        int sym = decode_symbol(br, ac);
+        if (sym < 0)
+        {
+            return EBADMSG;
+        }
+        unsigned int r = sym >> 4, size = sym & 15;
+        if (size)
+        {
+            skip_bits(br, size);
+            k += r + 1;
+            (*nonzero)++;
+        }
+        else if (r == 15)
+        {
+            k += 16;
+        }
+        else
+        {
+            break;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes a decoded DC coefficient as the pixel of its block if the block
+ * holds image data.
+ */
+static inline void put_dc(const dc_decoder_t *d, unsigned int index, unsigned int bx, unsigned int by)
+{
+    const dc_component_t *c = &d->comp[index];
+    if (bx < c->blocks_x && by < c->blocks_y)
+    {
+        // the DC coefficient is 8 times the block's mean, less 128
+        int64_t level = 128 + (((int64_t)c->pred * d->dc_quant[c->tq] + 4) >> 3);
+        d->result->planes[index][by * c->blocks_x + bx] = level < 0 ? 0 : level > 255 ? 255 : (uint8_t)level;
+    }
+}
+
+/**
+ * @brief Parses a DQT segment, keeping the DC entry of every table.
+ */
+static int parse_dqt(dc_decoder_t *d, const uint8_t *p, size_t length)
+{
+    size_t pos = 0;
+    while (pos < length)
+    {
+        unsigned int precision = p[pos] >> 4, id = p[pos] & 15;
+        size_t size = 1 + 64 * (precision ? 2 : 1);
+        if (id > 3 || precision > 1 || pos + size > length)
+        {
+            return EBADMSG;
+        }
+        d->dc_quant[id] = precision ? (uint16_t)(p[pos + 1] << 8 | p[pos + 2]) : p[pos + 1];
+        pos += size;
+    }
+    return 0;
+}
+
+/**
+ * @brief Parses a DHT segment, building every table it defines.
+ */
+static int parse_dht(dc_decoder_t *d, const uint8_t *p, size_t length)
+{
+    size_t pos = 0;
+    while (pos + 17 <= length)
+    {
+        unsigned int ac = p[pos] >> 4, id = p[pos] & 15;
+        size_t count = 0;
+        for (int i = 0; i < 16; i++)
+        {
+            count += p[pos + 1 + i];
+        }
+        if (ac > 1 || id > 3 || count > 256 || pos + 17 + count > length)
+        {
+            return EBADMSG;
+        }
+        huff_table_t *t = &d->defined[ac * 4 + id];
+        int ret = build_huffman(t, p + pos + 1, p + pos + 17, ac);
+        if (ret != 0)
+        {
+            return ret;
+        }
+        if (ac)
+        {
+            d->ac[id] = t;
+        }
+        else
+        {
+            d->dc[id] = t;
+        }
+        pos += 17 + count;
+    }
+    return pos == length ? 0 : EBADMSG;
+}
+
+/**
+ * @brief Parses a baseline or extended sequential frame header and lays the planes
+ * out in @param dst.
+ *
+ * @return 0 on success, ENOTSUP for precisions other than 8 bits or component counts
+ * other than 1 and 3, ENOBUFS if @param dst_size is too small, EBADMSG if the header
+ * is corrupt.
+ */
+static int parse_sof(dc_decoder_t *d, const uint8_t *p, size_t length, uint8_t *dst, size_t dst_size)
+{
+    if (length < 6)
+    {
+        return EBADMSG;
+    }
+    unsigned int count = p[5];
+    d->height = p[1] << 8 | p[2];
+    d->width = p[3] << 8 | p[4];
+    if (p[0] != 8 || (count != 1 && count != 3))
+    {
+        DEBUG_PRINT(stderr, "MJPEG frame with %u-bit samples and %u components is not supported.\n", p[0], count);
+        return ENOTSUP;
+    }
+    if (length < 6 + 3 * (size_t)count || d->width == 0 || d->height == 0 || d->count != 0)
+    {
+        return EBADMSG;
+    }
+    d->count = count;
+    d->hmax = d->vmax = 1;
+    for (unsigned int i = 0; i < count; i++)
+    {
+        dc_component_t *c = &d->comp[i];
+        c->id = p[6 + 3 * i];
+        c->h = p[7 + 3 * i] >> 4;
+        c->v = p[7 + 3 * i] & 15;
+        c->tq = p[8 + 3 * i];
+        if (c->h < 1 || c->h > 4 || c->v < 1 || c->v > 4 || c->tq > 3)
+        {
+            return EBADMSG;
+        }
+        d->hmax = c->h > d->hmax ? c->h : d->hmax;
+        d->vmax = c->v > d->vmax ? c->v : d->vmax;
+    }
+
+    acam_mjpeg_dc_t *r = d->result;
+    r->width = d->width;
+    r->height = d->height;
+    r->components = count;
+    size_t size = 0;
+    for (unsigned int i = 0; i < count; i++)
+    {
+        dc_component_t *c = &d->comp[i];
+        unsigned int samples_x = (d->width * c->h + d->hmax - 1) / d->hmax;
+        unsigned int samples_y = (d->height * c->v + d->vmax - 1) / d->vmax;
+        c->blocks_x = r->plane_width[i] = (samples_x + 7) / 8;
+        c->blocks_y = r->plane_height[i] = (samples_y + 7) / 8;
+        size += (size_t)c->blocks_x * c->blocks_y;
+    }
+    r->size = size;
+    if (dst == NULL || dst_size < size)
+    {
+        DEBUG_PRINT(stderr, "DC image of %zu bytes does not fit in %zu.\n", size, dst_size);
+        return ENOBUFS;
+    }
+    memset(dst, 128, size); // components a scan leaves out stay neutral
+    for (unsigned int i = 0; i < count; i++)
+    {
+        r->planes[i] = dst;
+        dst += (size_t)d->comp[i].blocks_x * d->comp[i].blocks_y;
+    }
+    return 0;
+}
+
+/**
+ * @brief Moves the reader past the restart marker that ends an interval and resets
+ * the predictors.
+ *
+ * @return 0 on success, ENODATA if the frame ends first, EBADMSG if another marker
+ * comes first.
+ */
+static int restart(dc_decoder_t *d, bit_reader_t *br)
+{
+    if (br->zeros > br->count)
+    {
+        return ENODATA;
+    }
+    const uint8_t *p = br->p;
+    while (p + 1 < br->end && !(p[0] == 0xff && p[1] != 0x00 && p[1] != 0xff))
+    {
+        p++;
+    }
+    if (p + 1 >= br->end)
+    {
+        return ENODATA;
+    }
+    if (p[1] < M_RST0 || p[1] > M_RST7)
+    {
+        DEBUG_PRINT(stderr, "MJPEG frame has marker 0x%02x where a restart marker belongs.\n", p[1]);
+        return EBADMSG;
+    }
+    br->p = p + 2;
+    br->bits = 0;
+    br->count = br->zeros = br->stopped = 0;
+    for (unsigned int i = 0; i < d->count; i++)
+    {
+        d->comp[i].pred = 0;
+    }
+    return 0;
+}
+
+/**
+ * @brief Parses a scan header at @param pos and decodes the scan's blocks.
+ *
+ * @param end set to where the entropy-coded data stopped being read.
+ * @return 0 on success, ENODATA if the frame ends inside the scan, ENOTSUP for
+ * progressive scans, EBADMSG if it is corrupt.
+ */
+static int decode_scan(dc_decoder_t *d, const uint8_t *data, size_t pos, size_t size, size_t *end)
+{
+    *end = pos;
+    size_t length = (size_t)data[pos + 2] << 8 | data[pos + 3];
+    const uint8_t *p = data + pos + 4;
+    unsigned int count = length >= 3 ? p[0] : 0;
+    if (count < 1 || count > d->count || length != 6 + 2 * (size_t)count)
+    {
+        return EBADMSG;
+    }
+    unsigned int order[3];
+    for (unsigned int i = 0; i < count; i++)
+    {
+        unsigned int j = 0;
+        while (j < d->count && d->comp[j].id != p[1 + 2 * i])
+        {
+            j++;
+        }
+        unsigned int td = p[2 + 2 * i] >> 4, ta = p[2 + 2 * i] & 15;
+        if (j == d->count || td > 3 || ta > 3 || d->dc[td] == NULL || d->ac[ta] == NULL || d->dc_quant[d->comp[j].tq] == 0)
+        {
+            DEBUG_PRINT(stderr, "MJPEG scan refers to an unknown component or table.\n");
+            return EBADMSG;
+        }
+        d->comp[j].dc = d->dc[td];
+        d->comp[j].ac = d->ac[ta];
+        d->comp[j].pred = 0;
+        order[i] = j;
+    }
+    const uint8_t *spectral = p + 1 + 2 * count;
+    if (spectral[0] != 0 || spectral[1] != 63 || spectral[2] != 0)
+    {
+        DEBUG_PRINT(stderr, "Progressive MJPEG scans are not supported.\n");
+        return ENOTSUP;
+    }
+
+    bit_reader_t br = {data + pos + 2 + length, data + size, 0, 0, 0, 0};
+    unsigned int mcus_x, mcus_y;
+    if (count == 1)
+    {
+        // a single component is not interleaved: its blocks come one by one
+        const dc_component_t *c = &d->comp[order[0]];
+        mcus_x = (((d->width * c->h + d->hmax - 1) / d->hmax) + 7) / 8;
+        mcus_y = (((d->height * c->v + d->vmax - 1) / d->vmax) + 7) / 8;
+    }
+    else
+    {
+        mcus_x = (d->width + 8 * d->hmax - 1) / (8 * d->hmax);
+        mcus_y = (d->height + 8 * d->vmax - 1) / (8 * d->vmax);
+    }
+
+    int ret = 0;
+    uint64_t mcu = 0;
+    for (unsigned int my = 0; my < mcus_y && ret == 0; my++)
+    {
+        for (unsigned int mx = 0; mx < mcus_x && ret == 0; mx++, mcu++)
+        {
+            if (d->restart_interval && mcu && mcu % d->restart_interval == 0 && (ret = restart(d, &br)) != 0)
+            {
+                break;
+            }
+            for (unsigned int i = 0; i < count && ret == 0; i++)
+            {
+                dc_component_t *c = &d->comp[order[i]];
+                unsigned int h = count == 1 ? 1 : c->h, v = count == 1 ? 1 : c->v;
+                for (unsigned int by = 0; by < v && ret == 0; by++)
+                {
+                    for (unsigned int bx = 0; bx < h && ret == 0; bx++)
+                    {
+                        unsigned int nonzero = 0;
+                        ret = decode_block(&br, c, &nonzero);
+                        put_dc(d, order[i], mx * h + bx, my * v + by);
+                        if (order[i] == 0)
+                        {
+                            d->luma_blocks++;
+                            d->luma_nonzero += nonzero;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    if (ret == 0 && br.zeros > br.count)
+    {
+        DEBUG_PRINT(stderr, "MJPEG frame is truncated inside a scan.\n");
+        ret = ENODATA;
+    }
+    // bytes the reader holds were not used yet; step back over them
+    size_t held = (size_t)(br.count - br.zeros > 0 ? br.count - br.zeros : 0) / 8;
+    *end = (size_t)(br.p - data) > held ? (size_t)(br.p - data) - held : 0;
+    return ret;
+}
+
+/**
+ * @brief Decodes the DC coefficients of a baseline MJPEG frame into an image at
+ * 1/8 of its size, one pixel per 8x8 block, and measures the luma of that image.
+ * Skipping the inverse DCT and color conversion makes this a small part of the cost
+ * of a full decode, enough for previews, metering and picking frames. Frames without
+ * Huffman tables use the standard ones, as UVC cameras expect.
+ *
+ * @param buffer a buffer holding an MJPEG frame, as acam_capture_image returns it.
+ * @param dst where the planes are written: the Y plane, then Cb and Cr.
+ * @param dst_size the size of @param dst in bytes. The size needed is in
+ * result->size once the frame header has been read, also when this fails with
+ * ENOBUFS, so @param dst may be NULL to ask for it.
+ * @param result set to the planes, their sizes and the luma statistics.
+ * @return exit status. 0 on success, ENOBUFS if @param dst is too small, ENODATA if
+ * the frame is truncated (the planes hold what was decoded), ENOTSUP for progressive,
+ * arithmetic-coded, 12-bit or CMYK frames, EBADMSG if the frame is corrupt.
+ */
+int acam_mjpeg_decode_dc(const acam_buffer_t *buffer, uint8_t *dst, size_t dst_size, acam_mjpeg_dc_t *result)
+{
+    assert(buffer && result);
+    const uint8_t *data = (const uint8_t *)buffer->buf;
+    size_t size = buffer->bytes_used;
+    memset(result, 0, sizeof(*result));
+    if (size < 4 || data[0] != 0xff || data[1] != M_SOI)
+    {
+        DEBUG_PRINT(stderr, "MJPEG frame does not start with SOI.\n");
+        return size < 2 ? ENODATA : EBADMSG;
+    }
+
+    dc_decoder_t *d = malloc(sizeof(dc_decoder_t));
+    if (d == NULL)
+    {
+        return ENOMEM;
+    }
+    memset(d, 0, offsetof(dc_decoder_t, defined));
+    d->result = result;
+    pthread_once(&std_huff_once, build_std_huffman);
+    d->dc[0] = &std_huff[0];
+    d->dc[1] = &std_huff[1];
+    d->ac[0] = &std_huff[2];
+    d->ac[1] = &std_huff[3];
+
+    int ret = 0, scans = 0;
+    size_t pos = 2;
+    while (ret == 0)
+    {
+        while (pos + 1 < size && data[pos] == 0xff && data[pos + 1] == 0xff)
+        {
+            pos++;
+        }
+        if (pos + 2 > size)
+        {
+            ret = scans ? 0 : ENODATA; // a frame cut after its last scan still decoded
+            break;
+        }
+        if (data[pos] != 0xff)
+        {
+            ret = EBADMSG;
+            break;
+        }
+        uint8_t marker = data[pos + 1];
+        if (marker == M_EOI)
+        {
+            break;
+        }
+        if (marker == M_TEM || (marker >= M_RST0 && marker <= M_RST7))
+        {
+            pos += 2;
+            continue;
+        }
+        if (pos + 4 > size)
+        {
+            ret = ENODATA;
+            break;
+        }
+        size_t length = (size_t)data[pos + 2] << 8 | data[pos + 3];
+        if (length < 2 || pos + 2 + length > size)
+        {
+            ret = length < 2 ? EBADMSG : ENODATA;
+            break;
+        }
+        const uint8_t *body = data + pos + 4;
+        if (marker == 0xdb)
+        {
+            ret = parse_dqt(d, body, length - 2);
+        }
+        else if (marker == M_DHT)
+        {
+            ret = parse_dht(d, body, length - 2);
+        }
+        else if (marker == 0xdd)
+        {
+            d->restart_interval = length >= 4 ? (unsigned int)(body[0] << 8 | body[1]) : 0;
+        }
+        else if (marker == 0xc0 || marker == 0xc1)
+        {
+            ret = parse_sof(d, body, length - 2, dst, dst_size);
+        }
+        else if (is_sof(marker))
+        {
+            DEBUG_PRINT(stderr, "MJPEG frame type 0x%02x is not supported.\n", marker);
+            ret = ENOTSUP;
+        }
+        else if (marker == M_SOS)
+        {
+            if (d->count == 0)
+            {
+                ret = EBADMSG;
+                break;
+            }
+            size_t end;
+            ret = decode_scan(d, data, pos, size, &end);
+            if (ret != 0)
+            {
+                break;
+            }
+            scans++;
+            pos = find_marker(data, end, size);
+            continue;
+        }
+        pos += 2 + length;
+    }
+
+    if (d->count == 0 && ret == 0)
+    {
+        ret = EBADMSG; // no frame header
+    }
+    if (result->planes[0] != NULL)
+    {
+        const uint8_t *y = result->planes[0];
+        size_t n = (size_t)result->plane_width[0] * result->plane_height[0];
+        uint64_t sum = 0, squares = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            result->histogram[y[i]]++;
+            sum += y[i];
+            squares += y[i] * y[i];
+        }
+        result->mean = (double)sum / n;
+        result->variance = (double)squares / n - result->mean * result->mean;
+        if (result->variance < 0)
+        {
+            result->variance = 0;
+        }
+        result->detail = d->luma_blocks ? (double)d->luma_nonzero / d->luma_blocks : 0;
+    }
+    free(d);
+    return ret;
+}
+
+typedef struct
+{
+    acam_mjpeg_dc_job_t *jobs;
+    unsigned int count;
+    unsigned int next; //the next job to take, shared by the threads
+} dc_burst_t;
+
+static void *dc_burst_main(void *arg)
+{
+    dc_burst_t *burst = arg;
+    unsigned int i;
+    while ((i = __atomic_fetch_add(&burst->next, 1, __ATOMIC_RELAXED)) < burst->count)
+    {
+        acam_mjpeg_dc_job_t *job = &burst->jobs[i];
+        job->error = acam_mjpeg_decode_dc(job->buffer, job->dst, job->dst_size, &job->result);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Runs acam_mjpeg_decode_dc on a burst of frames, spread over several
+ * threads. Each thread takes the next frame when it finishes one, so frames of
+ * different sizes balance out.
+ *
+ * @param jobs the frames, their memory, and where each result and exit status goes.
+ * @param count the number of frames.
+ * @param threads the number of threads, the calling thread included. 0 uses one per
+ * online CPU; threads that cannot be started leave their share to the others.
+ * @return exit status. 0 if every frame was decoded, otherwise the exit status of
+ * the first frame that failed.
+ */
+int acam_mjpeg_decode_dc_burst(acam_mjpeg_dc_job_t *jobs, unsigned int count, unsigned int threads)
+{
+    assert(jobs || count == 0);
+    if (threads == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (unsigned int)cpus : 1;
+    }
+    threads = threads > count ? count : threads;
+
+    dc_burst_t burst = {jobs, count, 0};
+    pthread_t *helpers = threads > 1 ? calloc(threads - 1, sizeof(pthread_t)) : NULL;
+    unsigned int started = 0;
+    while (helpers != NULL && started + 1 < threads && pthread_create(&helpers[started], NULL, dc_burst_main, &burst) == 0)
+    {
+        started++;
+    }
+    dc_burst_main(&burst);
+    for (unsigned int i = 0; i < started; i++)
+    {
+        pthread_join(helpers[i], NULL);
+    }
+    free(helpers);
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        if (jobs[i].error != 0)
+        {
+            return jobs[i].error;
+        }
+    }
+    return 0;
+}
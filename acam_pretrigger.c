@@ -0,0 +1,496 @@
+#define _GNU_SOURCE
+#include "acam_control.h"
+
+#include <pthread.h>
+#include <limits.h>
+
+#ifndef NDEBUG
+#define DEBUG_PRINT fprintf
+#define DEBUG_PERROR perror
+#else
+#define DEBUG_PRINT
+#define DEBUG_PERROR
+#endif
+
+/**
+ * @brief Pre-trigger recording. Every frame pushed is copied into a fixed arena that
+ * is mapped and faulted in once, with its size, format, timestamp and sequence kept
+ * in a fixed array of slots, so pushing a frame never allocates. Frames are placed
+ * back to back; one that does not fit before the end of the arena starts again at
+ * its beginning, and the oldest frames are evicted to make room. While armed, frames
+ * older than pre_ms before the newest one are evicted as well, so the ring holds the
+ * last pre_ms of capture or as much of it as fits.
+ *
+ * acam_pretrigger_trigger hands the ring to a background thread that appends it to an
+ * indexed recording (acam_recorder_open), followed by every frame pushed until
+ * post_ms after the trigger. Frames waiting to be written are never evicted: if the
+ * disk falls behind and the ring fills up with them, new frames are refused with
+ * ENOBUFS and counted as dropped, so memory stays bounded by the arena.
+ *
+ * Positions in the arena are logical byte offsets that only grow; a frame at
+ * position pos lives at pos % size. Slots are numbered the same way. The thread
+ * pushing frames reserves room under the lock and copies outside of it; the writer
+ * thread only reads slots that have been committed.
+ *
+ */
+
+#define PRETRIGGER_ALIGN 64 //frames start on a cache line
+#define EVENT_OPEN UINT64_MAX //event_end while frames are still being added to the event
+#define END_UNSET INT64_MIN //end_us of a trigger that came before any frame
+
+typedef struct
+{
+    uint64_t pos; //logical position of the frame in the arena
+    uint32_t size;
+    acam_fmt_t fmt;
+    struct timeval timestamp;
+    int64_t timestamp_us;
+    uint32_t sequence;
+} pretrigger_slot_t;
+
+struct acam_pretrigger
+{
+    acam_pretrigger_config_t config;
+    char *arena;
+    size_t arena_size;
+    pretrigger_slot_t *slots; //config.max_frames slots, slot n at n % max_frames
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t work; //signalled when the writer thread has frames to write or should stop
+    pthread_cond_t done; //signalled when an event is completely written
+
+    uint64_t head; //next slot number to fill
+    uint64_t tail; //oldest slot still in the ring
+    uint64_t write_pos; //logical end of the newest frame
+    int64_t newest_us; //timestamp of the newest frame
+    int have_newest;
+
+    int recording; //an event is being written
+    uint64_t event_end; //first slot not part of the event, EVENT_OPEN while it grows
+    int64_t end_us; //frames up to this time belong to the event
+    char dir[PATH_MAX]; //where the event is recorded
+    int event_error; //first errno of the current or last event
+    int stop;
+
+    acam_pretrigger_stats_t stats;
+};
+
+static int64_t timeval_us(const struct timeval *tv)
+{
+    return (int64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+static pretrigger_slot_t *slot(acam_pretrigger_t *pt, uint64_t n)
+{
+    return &pt->slots[n % pt->config.max_frames];
+}
+
+/**
+ * @brief Whether slot n still has to be written. Called with the lock held.
+ */
+static int pending(const acam_pretrigger_t *pt, uint64_t n)
+{
+    return pt->recording && n < pt->event_end;
+}
+
+/**
+ * @brief Writer thread: appends the frames of each event to its recording, releasing
+ * every slot once its frame is written.
+ */
+static void *pretrigger_main(void *arg)
+{
+    acam_pretrigger_t *pt = arg;
+    acam_recorder_t *rec = NULL;
+
+    pthread_mutex_lock(&pt->lock);
+    for (;;)
+    {
+        uint64_t limit = pt->head < pt->event_end ? pt->head : pt->event_end;
+        while (!pt->stop && !(pt->recording && (pt->tail < limit || pt->tail == pt->event_end)))
+        {
+            pthread_cond_wait(&pt->work, &pt->lock);
+            limit = pt->head < pt->event_end ? pt->head : pt->event_end;
+        }
+        if (!pt->recording)
+        {
+            break; // stopping, and nothing is left to write
+        }
+
+        if (pt->tail == pt->event_end)
+        {
+            pthread_mutex_unlock(&pt->lock);
+            int ret = rec ? acam_recorder_close(rec) : 0;
+            rec = NULL;
+            pthread_mutex_lock(&pt->lock);
+            if (ret != 0 && pt->event_error == 0)
+            {
+                pt->event_error = ret;
+            }
+            if (pt->event_error != 0)
+            {
+                pt->stats.error = pt->event_error;
+            }
+            pt->recording = 0;
+            pt->event_end = EVENT_OPEN;
+            pthread_cond_broadcast(&pt->done);
+            continue;
+        }
+        pretrigger_slot_t frame = *slot(pt, pt->tail);
+        int open = rec == NULL && pt->event_error == 0;
+        pthread_mutex_unlock(&pt->lock);
+
+        int ret = 0;
+        if (open)
+        {
+            rec = acam_recorder_open(pt->dir, pt->config.segment_size, &ret);
+            if (rec == NULL)
+            {
+                DEBUG_PRINT(stderr, "Opening recording %s: %s\n", pt->dir, strerror(ret));
+            }
+        }
+        if (rec != NULL)
+        {
+            acam_buffer_t buffer = {0};
+            buffer.buf = pt->arena + frame.pos % pt->arena_size;
+            buffer.bytes_used = frame.size;
+            buffer.length = frame.size;
+            ret = acam_recorder_append(rec, &buffer, frame.fmt, &frame.timestamp, frame.sequence);
+        }
+        else if (ret == 0)
+        {
+            ret = ECANCELED; // the event's recording could not be opened
+        }
+
+        pthread_mutex_lock(&pt->lock);
+        pt->tail++;
+        if (ret == 0)
+        {
+            pt->stats.written++;
+        }
+        else
+        {
+            pt->stats.failed++;
+            if (pt->event_error == 0)
+                pt->event_error = ret;
+        }
+    }
+    pthread_mutex_unlock(&pt->lock);
+
+    return NULL;
+}
+
+/**
+ * @brief Creates a pre-trigger ring and starts its writer thread. All of the ring's
+ * memory is allocated and faulted in here.
+ *
+ * @param config the ring's size, history and post-trigger time. ring_bytes is required.
+ * @param error keeps track of error code on failure.
+ * @return the ring on success, NULL on failure.
+ */
+acam_pretrigger_t *acam_pretrigger_create(const acam_pretrigger_config_t *config, int *error)
+{
+    assert(config && error);
+    if (config->ring_bytes == 0)
+    {
+        *error = EINVAL;
+        return NULL;
+    }
+    acam_pretrigger_t *pt = calloc(1, sizeof(acam_pretrigger_t));
+    if (pt == NULL)
+    {
+        *error = ENOMEM;
+        return NULL;
+    }
+    pt->config = *config;
+    if (pt->config.max_frames == 0)
+    {
+        pt->config.max_frames = ACAM_PRETRIGGER_DEFAULT_FRAMES;
+    }
+    pt->event_end = EVENT_OPEN;
+
+    long page = sysconf(_SC_PAGESIZE);
+    pt->arena_size = (config->ring_bytes + page - 1) & ~(size_t)(page - 1);
+    pt->arena = mmap(NULL, pt->arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (pt->arena == MAP_FAILED)
+    {
+        *error = errno;
+        DEBUG_PERROR("Mapping pre-trigger ring");
+        free(pt);
+        return NULL;
+    }
+    if ((pt->config.flags & ACAM_PRETRIGGER_MLOCK) && mlock(pt->arena, pt->arena_size) == -1)
+    {
+        *error = errno;
+        DEBUG_PERROR("Locking pre-trigger ring");
+        munmap(pt->arena, pt->arena_size);
+        free(pt);
+        return NULL;
+    }
+
+    pt->slots = calloc(pt->config.max_frames, sizeof(pretrigger_slot_t));
+    if (pt->slots == NULL)
+    {
+        munmap(pt->arena, pt->arena_size);
+        free(pt);
+        *error = ENOMEM;
+        return NULL;
+    }
+
+    pthread_mutex_init(&pt->lock, NULL);
+    pthread_cond_init(&pt->work, NULL);
+    pthread_cond_init(&pt->done, NULL);
+    int ret = pthread_create(&pt->thread, NULL, pretrigger_main, pt);
+    if (ret != 0)
+    {
+        DEBUG_PRINT(stderr, "Starting pre-trigger writer: %s\n", strerror(ret));
+        pthread_mutex_destroy(&pt->lock);
+        pthread_cond_destroy(&pt->work);
+        pthread_cond_destroy(&pt->done);
+        free(pt->slots);
+        munmap(pt->arena, pt->arena_size);
+        free(pt);
+        *error = ret;
+        return NULL;
+    }
+
+    return pt;
+}
+
+/**
+ * @brief Copies a frame into the ring, evicting the oldest frames to make room and,
+ * while no event is being recorded, frames older than the configured history. Never
+ * allocates and never waits for the disk. Frames must be pushed from one thread at a
+ * time, in capture order.
+ *
+ * @param pt the ring
+ * @param buffer the frame, buffer->bytes_used bytes.
+ * @param fmt the frame's format.
+ * @param timestamp when the frame was captured.
+ * @param sequence the frame's sequence number.
+ * @return exit status. 0 on success, ENOBUFS if the ring is full of frames still
+ * waiting to be written (the frame is dropped), EMSGSIZE if the frame is larger than
+ * the ring, EINVAL if @param fmt is invalid.
+ */
+int acam_pretrigger_push(acam_pretrigger_t *pt, const acam_buffer_t *buffer, acam_fmt_t fmt, const struct timeval *timestamp, uint32_t sequence)
+{
+    assert(pt && buffer && timestamp);
+    if (fmt >= __ACAM_FMT_COUNT)
+    {
+        return EINVAL;
+    }
+    if (buffer->bytes_used > pt->arena_size)
+    {
+        return EMSGSIZE;
+    }
+    int64_t timestamp_us = timeval_us(timestamp);
+
+    pthread_mutex_lock(&pt->lock);
+    if (pt->recording && pt->event_end == EVENT_OPEN)
+    {
+        if (pt->end_us == END_UNSET)
+        {
+            pt->end_us = timestamp_us + (int64_t)pt->config.post_ms * 1000;
+        }
+        else if (timestamp_us > pt->end_us)
+        {
+            pt->event_end = pt->head; // this frame is the first after the event
+            pthread_cond_signal(&pt->work);
+        }
+    }
+
+    // place the frame after the newest one, or at the start of the arena if it does not fit before the end
+    uint64_t pos = (pt->write_pos + PRETRIGGER_ALIGN - 1) & ~(uint64_t)(PRETRIGGER_ALIGN - 1);
+    if (pos % pt->arena_size + buffer->bytes_used > pt->arena_size)
+    {
+        pos += pt->arena_size - pos % pt->arena_size;
+    }
+    int64_t oldest_us = timestamp_us - (int64_t)pt->config.pre_ms * 1000;
+    while (pt->tail < pt->head)
+    {
+        pretrigger_slot_t *oldest = slot(pt, pt->tail);
+        int full = pt->head - pt->tail == pt->config.max_frames || pos + buffer->bytes_used - oldest->pos > pt->arena_size;
+        int aged = pt->config.pre_ms > 0 && oldest->timestamp_us < oldest_us;
+        if (!full && !aged)
+        {
+            break;
+        }
+        if (pending(pt, pt->tail))
+        {
+            if (!full)
+            {
+                break;
+            }
+            pt->stats.dropped++;
+            pthread_mutex_unlock(&pt->lock);
+            return ENOBUFS;
+        }
+        pt->tail++;
+        pt->stats.evicted++;
+    }
+
+    pretrigger_slot_t *frame = slot(pt, pt->head);
+    frame->pos = pos;
+    frame->size = buffer->bytes_used;
+    frame->fmt = fmt;
+    frame->timestamp = *timestamp;
+    frame->timestamp_us = timestamp_us;
+    frame->sequence = sequence;
+    pthread_mutex_unlock(&pt->lock);
+
+    // the reserved room is past every committed frame, so the writer thread never reads it
+    memcpy(pt->arena + pos % pt->arena_size, buffer->buf, buffer->bytes_used);
+
+    pthread_mutex_lock(&pt->lock);
+    pt->head++;
+    pt->write_pos = pos + buffer->bytes_used;
+    pt->newest_us = timestamp_us;
+    pt->have_newest = 1;
+    pt->stats.pushed++;
+    if (pt->recording)
+    {
+        pthread_cond_signal(&pt->work);
+    }
+    pthread_mutex_unlock(&pt->lock);
+    return 0;
+}
+
+/**
+ * @brief Copies a streaming frame into the ring with its own format, timestamp and
+ * sequence number. The caller keeps its hold on the frame.
+ *
+ * @param pt the ring
+ * @param frame a frame the caller holds.
+ * @return exit status, as acam_pretrigger_push.
+ */
+int acam_pretrigger_push_frame(acam_pretrigger_t *pt, const acam_frame_t *frame)
+{
+    assert(pt && frame);
+    acam_buffer_t buffer = *frame->buffer;
+    buffer.bytes_used = frame->bytes_used;
+    return acam_pretrigger_push(pt, &buffer, frame->fmt, &frame->timestamp, frame->sequence);
+}
+
+/**
+ * @brief Starts recording an event: the frames in the ring and every frame pushed up
+ * to post_ms after the newest one are appended to a recording in @param dir by the
+ * writer thread. A trigger while an event is still taking frames extends it instead.
+ *
+ * @param pt the ring
+ * @param dir the directory of the event's recording, see acam_recorder_open.
+ * @return exit status. 0 on success, EBUSY if the previous event has ended but is
+ * still being written, ENAMETOOLONG, ECANCELED if the ring is being destroyed.
+ */
+int acam_pretrigger_trigger(acam_pretrigger_t *pt, const char *dir)
+{
+    assert(pt && dir);
+    if (strlen(dir) >= sizeof(pt->dir))
+    {
+        return ENAMETOOLONG;
+    }
+    int ret = 0;
+    pthread_mutex_lock(&pt->lock);
+    int64_t end_us = pt->have_newest ? pt->newest_us + (int64_t)pt->config.post_ms * 1000 : END_UNSET;
+    if (pt->stop)
+    {
+        ret = ECANCELED;
+    }
+    else if (pt->recording && pt->event_end == EVENT_OPEN)
+    {
+        if (end_us > pt->end_us)
+            pt->end_us = end_us;
+    }
+    else if (pt->recording)
+    {
+        ret = EBUSY;
+    }
+    else
+    {
+        strcpy(pt->dir, dir);
+        pt->recording = 1;
+        pt->event_end = EVENT_OPEN;
+        pt->end_us = end_us;
+        pt->event_error = 0;
+        pt->stats.events++;
+        pthread_cond_signal(&pt->work);
+    }
+    pthread_mutex_unlock(&pt->lock);
+    return ret;
+}
+
+/**
+ * @brief Ends the current event at the newest frame, without waiting for the rest of
+ * its post-trigger time, and waits until it is written.
+ *
+ * @param pt the ring
+ * @return exit status. 0 if the event was written completely or there was none,
+ * otherwise the first errno that failed one of its frames.
+ */
+int acam_pretrigger_flush(acam_pretrigger_t *pt)
+{
+    assert(pt);
+    pthread_mutex_lock(&pt->lock);
+    if (pt->recording && pt->event_end == EVENT_OPEN)
+    {
+        pt->event_end = pt->head;
+        pthread_cond_signal(&pt->work);
+    }
+    while (pt->recording)
+    {
+        pthread_cond_wait(&pt->done, &pt->lock);
+    }
+    int ret = pt->event_error;
+    pthread_mutex_unlock(&pt->lock);
+    return ret;
+}
+
+/**
+ * @brief Reads the ring's counters.
+ *
+ * @param pt the ring
+ * @param stats filled with a snapshot of the counters.
+ */
+void acam_pretrigger_get_stats(acam_pretrigger_t *pt, acam_pretrigger_stats_t *stats)
+{
+    assert(pt && stats);
+    pthread_mutex_lock(&pt->lock);
+    *stats = pt->stats;
+    stats->ring_frames = (unsigned int)(pt->head - pt->tail);
+    stats->ring_used = pt->head > pt->tail ? pt->write_pos - slot(pt, pt->tail)->pos : 0;
+    pthread_mutex_unlock(&pt->lock);
+}
+
+/**
+ * @brief Ends the current event at the newest frame, stops the writer thread once the
+ * event is written and frees the ring.
+ *
+ * @param pt the ring to destroy
+ * @return exit status. 0 on success, errno on failure to join the thread.
+ */
+int acam_pretrigger_destroy(acam_pretrigger_t *pt)
+{
+    assert(pt);
+    pthread_mutex_lock(&pt->lock);
+    pt->stop = 1;
+    if (pt->recording && pt->event_end == EVENT_OPEN)
+    {
+        pt->event_end = pt->head;
+    }
+    pthread_cond_signal(&pt->work);
+    pthread_mutex_unlock(&pt->lock);
+
+    int ret = pthread_join(pt->thread, NULL);
+    if (ret != 0)
+    {
+        DEBUG_PRINT(stderr, "Joining pre-trigger writer: %s\n", strerror(ret));
+        return ret;
+    }
+
+    pthread_mutex_destroy(&pt->lock);
+    pthread_cond_destroy(&pt->work);
+    pthread_cond_destroy(&pt->done);
+    free(pt->slots);
+    munmap(pt->arena, pt->arena_size);
+    free(pt);
+    return 0;
+}
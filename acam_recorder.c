@@ -0,0 +1,690 @@
+#define _GNU_SOURCE
+#include "acam_control.h"
+
+#include <limits.h>
+
+#ifndef NDEBUG
+#define DEBUG_PRINT fprintf
+#define DEBUG_PERROR perror
+#else
+#define DEBUG_PRINT
+#define DEBUG_PERROR
+#endif
+
+/**
+ * @brief Indexed append-only recordings. A recording is a directory holding large
+ * segment files and one index file:
+ *
+ * - NNNNNN.seg: frames appended back to back, each behind a small header with its
+ *   size, format, timestamp and sequence, padded to 8 bytes. A new segment is started
+ *   when the current one would grow past the recording's segment size.
+ * - index: a header followed by one fixed-size record per frame giving the segment,
+ *   offset, size, format, timestamp and sequence. The recorder writes it through a
+ *   shared mapping and bumps the frame count last, so a reader never sees a record
+ *   whose frame is not complete.
+ *
+ * Frame n is found with one array access into the mapped index and read straight from
+ * the mapped segment, so readers never copy frames. Timestamps only grow, so a frame
+ * is found by time with a binary search over the index.
+ *
+ */
+
+#define INDEX_MAGIC 0x58494341u   //"ACIX"
+#define SEGMENT_MAGIC 0x52464341u //"ACFR", starts every frame header in a segment
+#define INDEX_VERSION 1
+#define INDEX_GROW 65536 //records added to the index file whenever it fills up
+#define FRAME_ALIGN 8
+
+/**
+ * @brief Start of the index file.
+ *
+ */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t reserved;
+    uint64_t count; //frames whose records and data are complete
+    uint64_t segment_size;
+    uint8_t pad[32];
+} index_header_t;
+
+/**
+ * @brief One frame in the index file.
+ *
+ */
+typedef struct
+{
+    uint64_t offset; //where the frame's data starts in its segment, after the frame header
+    int64_t timestamp_us;
+    uint32_t segment;
+    uint32_t size;
+    uint32_t sequence;
+    uint16_t fmt;
+    uint16_t flags;
+} index_record_t;
+
+/**
+ * @brief Header in front of every frame in a segment. Duplicates the index record so a
+ * segment can be recovered without its index.
+ *
+ */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t size;
+    int64_t timestamp_us;
+    uint32_t sequence;
+    uint16_t fmt;
+    uint16_t flags;
+} frame_header_t;
+
+struct acam_recorder
+{
+    char dir[PATH_MAX - 16];
+    int index_fd;
+    index_header_t *index; //the mapped index file
+    size_t index_capacity; //records the mapping has room for
+    int segment_fd;
+    uint32_t segment; //number of the segment being appended to
+    uint64_t segment_pos; //its size
+    uint64_t segment_size;
+};
+
+typedef struct
+{
+    char *map;
+    size_t size; //bytes mapped, possibly past the end of the file
+    uint64_t file_size; //bytes of the file known to be there
+} reader_segment_t;
+
+struct acam_reader
+{
+    char dir[PATH_MAX - 16];
+    int index_fd;
+    index_header_t *index;
+    size_t index_size; //bytes mapped
+    uint64_t count; //frames visible to the reader, see acam_reader_refresh
+    reader_segment_t *segments;
+    uint32_t segment_count;
+};
+
+static index_record_t *records(index_header_t *index)
+{
+    return (index_record_t *)(index + 1);
+}
+
+static size_t index_bytes(size_t records)
+{
+    return sizeof(index_header_t) + records * sizeof(index_record_t);
+}
+
+static void segment_path(char *path, size_t size, const char *dir, uint32_t segment)
+{
+    snprintf(path, size, "%s/%06u.seg", dir, segment);
+}
+
+static int64_t timeval_us(const struct timeval *tv)
+{
+    return (int64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+/**
+ * @brief Opens a segment for appending and cuts off a partly written frame at its end.
+ *
+ */
+static int open_segment(acam_recorder_t *rec, uint32_t segment, uint64_t end)
+{
+    char path[PATH_MAX];
+    segment_path(path, sizeof(path), rec->dir, segment);
+    int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        DEBUG_PRINT(stderr, "Problem opening segment %s: %s\n", path, strerror(errno));
+        return errno;
+    }
+    // data past the last indexed frame never made it into the index
+    if (ftruncate(fd, end) == -1)
+    {
+        int err = errno;
+        close(fd);
+        return err;
+    }
+    if (rec->segment_fd != -1)
+    {
+        close(rec->segment_fd);
+    }
+    rec->segment_fd = fd;
+    rec->segment = segment;
+    rec->segment_pos = end;
+    return 0;
+}
+
+static int grow_index(acam_recorder_t *rec)
+{
+    size_t capacity = rec->index_capacity + INDEX_GROW;
+    if (ftruncate(rec->index_fd, index_bytes(capacity)) == -1)
+    {
+        DEBUG_PERROR("Growing recording index");
+        return errno;
+    }
+    void *map = mremap(rec->index, index_bytes(rec->index_capacity), index_bytes(capacity), MREMAP_MAYMOVE);
+    if (map == MAP_FAILED)
+    {
+        DEBUG_PERROR("Remapping recording index");
+        return errno;
+    }
+    rec->index = map;
+    rec->index_capacity = capacity;
+    return 0;
+}
+
+/**
+ * @brief Opens a recording for appending. An existing recording in @param dir is
+ * continued after its last complete frame; otherwise a new one is created.
+ *
+ * @param dir the recording's directory. Created if it does not exist.
+ * @param segment_size the size at which a new segment file is started. 0 selects
+ * ACAM_RECORDER_DEFAULT_SEGMENT. Ignored when continuing a recording.
+ * @param error keeps track of error code on failure.
+ * @return the recorder on success, NULL on failure.
+ */
+acam_recorder_t *acam_recorder_open(const char *dir, uint64_t segment_size, int *error)
+{
+    assert(dir && error);
+    if (strlen(dir) >= sizeof(((acam_recorder_t *)0)->dir))
+    {
+        *error = ENAMETOOLONG;
+        return NULL;
+    }
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+    {
+        DEBUG_PRINT(stderr, "Problem creating recording %s: %s\n", dir, strerror(errno));
+        *error = errno;
+        return NULL;
+    }
+
+    acam_recorder_t *rec = calloc(1, sizeof(acam_recorder_t));
+    if (rec == NULL)
+    {
+        *error = ENOMEM;
+        return NULL;
+    }
+    strcpy(rec->dir, dir);
+    rec->segment_fd = -1;
+    rec->index = MAP_FAILED;
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/index", dir);
+    rec->index_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (rec->index_fd == -1)
+    {
+        DEBUG_PRINT(stderr, "Problem opening index %s: %s\n", path, strerror(errno));
+        *error = errno;
+        free(rec);
+        return NULL;
+    }
+
+    struct stat st;
+    int ret = fstat(rec->index_fd, &st) == -1 ? errno : 0;
+    int fresh = ret == 0 && (size_t)st.st_size < sizeof(index_header_t);
+    if (ret == 0 && fresh && ftruncate(rec->index_fd, index_bytes(INDEX_GROW)) == -1)
+    {
+        ret = errno;
+    }
+    if (ret == 0)
+    {
+        rec->index_capacity = fresh ? INDEX_GROW : (st.st_size - sizeof(index_header_t)) / sizeof(index_record_t);
+        rec->index = mmap(NULL, index_bytes(rec->index_capacity), PROT_READ | PROT_WRITE, MAP_SHARED, rec->index_fd, 0);
+        ret = rec->index == MAP_FAILED ? errno : 0;
+    }
+    if (ret != 0)
+    {
+        goto fail;
+    }
+
+    index_header_t *index = rec->index;
+    if (fresh)
+    {
+        index->magic = INDEX_MAGIC;
+        index->version = INDEX_VERSION;
+        index->record_size = sizeof(index_record_t);
+        index->segment_size = segment_size ? segment_size : ACAM_RECORDER_DEFAULT_SEGMENT;
+    }
+    else if (index->magic != INDEX_MAGIC || index->version != INDEX_VERSION || index->record_size != sizeof(index_record_t) ||
+             index->count > rec->index_capacity)
+    {
+        DEBUG_PRINT(stderr, "%s is not a recording index.\n", path);
+        ret = EBADMSG;
+        goto fail;
+    }
+    rec->segment_size = index->segment_size;
+
+    // continue after the last complete frame
+    uint32_t segment = 0;
+    uint64_t end = 0;
+    if (index->count > 0)
+    {
+        const index_record_t *last = &records(index)[index->count - 1];
+        segment = last->segment;
+        end = (last->offset + last->size + FRAME_ALIGN - 1) & ~(uint64_t)(FRAME_ALIGN - 1);
+    }
+    ret = open_segment(rec, segment, end);
+    if (ret != 0)
+    {
+        goto fail;
+    }
+
+    return rec;
+
+fail:
+    if (rec->index != MAP_FAILED)
+        munmap(rec->index, index_bytes(rec->index_capacity));
+    close(rec->index_fd);
+    free(rec);
+    *error = ret;
+    return NULL;
+}
+
+/**
+ * @brief Appends a frame to the recording. The frame is written to the current
+ * segment with one writev (header, data and padding) and then made visible in the
+ * index.
+ *
+ * @param rec the recorder
+ * @param buffer the frame, buffer->bytes_used bytes.
+ * @param fmt the frame's format.
+ * @param timestamp when the frame was captured. Must not be earlier than the previous frame's.
+ * @param sequence the frame's sequence number.
+ * @return exit status. 0 on success, errno on write failure, EINVAL if @param fmt is
+ * invalid or @param timestamp goes back in time.
+ */
+int acam_recorder_append(acam_recorder_t *rec, const acam_buffer_t *buffer, acam_fmt_t fmt, const struct timeval *timestamp, uint32_t sequence)
+{
+    assert(rec && buffer && timestamp);
+    index_header_t *index = rec->index;
+    int64_t timestamp_us = timeval_us(timestamp);
+    if (fmt >= __ACAM_FMT_COUNT || (index->count > 0 && timestamp_us < records(index)[index->count - 1].timestamp_us))
+    {
+        return EINVAL;
+    }
+
+    int ret;
+    if (index->count == rec->index_capacity && (ret = grow_index(rec)) != 0)
+    {
+        return ret;
+    }
+    index = rec->index;
+
+    size_t padded = (buffer->bytes_used + FRAME_ALIGN - 1) & ~(size_t)(FRAME_ALIGN - 1);
+    uint64_t frame_bytes = sizeof(frame_header_t) + padded;
+    if (rec->segment_pos > 0 && rec->segment_pos + frame_bytes > rec->segment_size)
+    {
+        ret = open_segment(rec, rec->segment + 1, 0);
+        if (ret != 0)
+        {
+            return ret;
+        }
+    }
+
+    frame_header_t header = {SEGMENT_MAGIC, buffer->bytes_used, timestamp_us, sequence, (uint16_t)fmt, 0};
+    static const char zeros[FRAME_ALIGN];
+    struct iovec iov[3] = {
+        {&header, sizeof(header)},
+        {buffer->buf, buffer->bytes_used},
+        {(void *)zeros, padded - buffer->bytes_used},
+    };
+    uint64_t pos = rec->segment_pos;
+    size_t done = 0;
+    while (done < frame_bytes)
+    {
+        ssize_t written = pwritev(rec->segment_fd, iov, 3, pos + done);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            DEBUG_PERROR("Appending frame");
+            return errno;
+        }
+        done += written;
+        // skip what a short write got out
+        for (int i = 0; i < 3; i++)
+        {
+            size_t skip = (size_t)written < iov[i].iov_len ? (size_t)written : iov[i].iov_len;
+            iov[i].iov_base = (char *)iov[i].iov_base + skip;
+            iov[i].iov_len -= skip;
+            written -= skip;
+        }
+    }
+    rec->segment_pos += frame_bytes;
+
+    index_record_t *record = &records(index)[index->count];
+    record->offset = pos + sizeof(frame_header_t);
+    record->timestamp_us = timestamp_us;
+    record->segment = rec->segment;
+    record->size = buffer->bytes_used;
+    record->sequence = sequence;
+    record->fmt = fmt;
+    record->flags = 0;
+    // the count goes up only once the record is complete
+    __atomic_store_n(&index->count, index->count + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/**
+ * @brief Appends a streaming frame to the recording with its own format, timestamp
+ * and sequence number.
+ *
+ * @param rec the recorder
+ * @param frame a frame the caller holds.
+ * @return exit status, as acam_recorder_append.
+ */
+int acam_recorder_append_frame(acam_recorder_t *rec, const acam_frame_t *frame)
+{
+    assert(rec && frame);
+    acam_buffer_t buffer = *frame->buffer;
+    buffer.bytes_used = frame->bytes_used;
+    return acam_recorder_append(rec, &buffer, frame->fmt, &frame->timestamp, frame->sequence);
+}
+
+/**
+ * @brief Flushes the current segment and the index to the disk.
+ *
+ * @param rec the recorder
+ * @return exit status. 0 on success, errno on failure.
+ */
+int acam_recorder_sync(acam_recorder_t *rec)
+{
+    assert(rec);
+    if (fdatasync(rec->segment_fd) == -1)
+    {
+        return errno;
+    }
+    if (msync(rec->index, index_bytes(rec->index_capacity), MS_SYNC) == -1)
+    {
+        return errno;
+    }
+    return 0;
+}
+
+/**
+ * @brief Closes a recording. Frames appended so far stay readable.
+ *
+ * @param rec the recorder to close
+ * @return exit status. 0 on success, errno on failure to unmap or close a file.
+ */
+int acam_recorder_close(acam_recorder_t *rec)
+{
+    assert(rec);
+    int ret = 0;
+    if (munmap(rec->index, index_bytes(rec->index_capacity)) == -1)
+        ret = errno;
+    if (close(rec->index_fd) == -1 && ret == 0)
+        ret = errno;
+    if (close(rec->segment_fd) == -1 && ret == 0)
+        ret = errno;
+    free(rec);
+    return ret;
+}
+
+/**
+ * @brief Opens a recording for reading. Frames appended later become visible with
+ * acam_reader_refresh.
+ *
+ * @param dir the recording's directory.
+ * @param error keeps track of error code on failure.
+ * @return the reader on success, NULL on failure.
+ */
+acam_reader_t *acam_reader_open(const char *dir, int *error)
+{
+    assert(dir && error);
+    if (strlen(dir) >= sizeof(((acam_reader_t *)0)->dir))
+    {
+        *error = ENAMETOOLONG;
+        return NULL;
+    }
+    acam_reader_t *reader = calloc(1, sizeof(acam_reader_t));
+    if (reader == NULL)
+    {
+        *error = ENOMEM;
+        return NULL;
+    }
+    strcpy(reader->dir, dir);
+    reader->index = MAP_FAILED;
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/index", dir);
+    reader->index_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (reader->index_fd == -1)
+    {
+        DEBUG_PRINT(stderr, "Problem opening index %s: %s\n", path, strerror(errno));
+        *error = errno;
+        free(reader);
+        return NULL;
+    }
+
+    int ret = acam_reader_refresh(reader);
+    if (ret == 0 && (reader->index->magic != INDEX_MAGIC || reader->index->version != INDEX_VERSION ||
+                     reader->index->record_size != sizeof(index_record_t)))
+    {
+        DEBUG_PRINT(stderr, "%s is not a recording index.\n", path);
+        ret = EBADMSG;
+    }
+    if (ret != 0)
+    {
+        acam_reader_close(reader);
+        *error = ret;
+        return NULL;
+    }
+    return reader;
+}
+
+/**
+ * @brief Picks up frames appended to the recording since the reader was opened or
+ * last refreshed.
+ *
+ * @param reader the reader
+ * @return exit status. 0 on success, errno on failure to map the index, EBADMSG if
+ * the index is damaged.
+ */
+int acam_reader_refresh(acam_reader_t *reader)
+{
+    assert(reader);
+    struct stat st;
+    if (fstat(reader->index_fd, &st) == -1)
+    {
+        return errno;
+    }
+    if ((size_t)st.st_size < sizeof(index_header_t))
+    {
+        return EBADMSG;
+    }
+    if ((size_t)st.st_size != reader->index_size)
+    {
+        void *map = reader->index == MAP_FAILED
+                        ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, reader->index_fd, 0)
+                        : mremap(reader->index, reader->index_size, st.st_size, MREMAP_MAYMOVE);
+        if (map == MAP_FAILED)
+        {
+            DEBUG_PERROR("Mapping recording index");
+            return errno;
+        }
+        reader->index = map;
+        reader->index_size = st.st_size;
+    }
+    uint64_t count = __atomic_load_n(&reader->index->count, __ATOMIC_ACQUIRE);
+    if (index_bytes(count) > reader->index_size)
+    {
+        return EBADMSG;
+    }
+    reader->count = count;
+    return 0;
+}
+
+/**
+ * @brief Gets the number of frames in the recording.
+ *
+ * @param reader the reader
+ * @return the number of frames as of the last open or refresh.
+ */
+uint64_t acam_reader_count(const acam_reader_t *reader)
+{
+    assert(reader);
+    return reader->count;
+}
+
+/**
+ * @brief Maps a segment once, at the recording's segment size or the file's size if
+ * larger. A segment never grows past that (only a first frame larger than the segment
+ * size goes beyond it, alone), so a live segment needs no remapping and frames
+ * returned from it stay valid. Pages past the end of the file are never touched.
+ *
+ */
+static int map_segment(acam_reader_t *reader, uint32_t segment, uint64_t end)
+{
+    if (segment >= reader->segment_count)
+    {
+        reader_segment_t *segments = realloc(reader->segments, (segment + 1) * sizeof(reader_segment_t));
+        if (segments == NULL)
+        {
+            return ENOMEM;
+        }
+        memset(segments + reader->segment_count, 0, (segment + 1 - reader->segment_count) * sizeof(reader_segment_t));
+        reader->segments = segments;
+        reader->segment_count = segment + 1;
+    }
+    reader_segment_t *seg = &reader->segments[segment];
+    if (end <= seg->file_size)
+    {
+        return 0;
+    }
+
+    char path[PATH_MAX];
+    segment_path(path, sizeof(path), reader->dir, segment);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        DEBUG_PRINT(stderr, "Problem opening segment %s: %s\n", path, strerror(errno));
+        return errno;
+    }
+    struct stat st;
+    int ret = fstat(fd, &st) == -1 ? errno : 0;
+    if (ret == 0 && ((uint64_t)st.st_size < end || (seg->map != NULL && end > seg->size)))
+    {
+        ret = EBADMSG; // the index points past the end of the segment
+    }
+    if (ret == 0 && seg->map == NULL)
+    {
+        size_t size = (uint64_t)st.st_size > reader->index->segment_size ? (size_t)st.st_size : (size_t)reader->index->segment_size;
+        void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED)
+        {
+            ret = errno;
+        }
+        else
+        {
+            seg->map = map;
+            seg->size = size;
+        }
+    }
+    close(fd);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    seg->file_size = st.st_size;
+    return 0;
+}
+
+/**
+ * @brief Gets a frame of the recording by its position. The frame is not copied:
+ * @param record points into the mapped segment.
+ *
+ * @param reader the reader
+ * @param n the frame's position, from 0 to acam_reader_count - 1.
+ * @param record filled with the frame. record->data stays valid until the reader is closed.
+ * @return exit status. 0 on success, ERANGE if there is no frame @param n, errno on
+ * failure to map its segment, EBADMSG if the recording is damaged.
+ */
+int acam_reader_get(acam_reader_t *reader, uint64_t n, acam_record_t *record)
+{
+    assert(reader && record);
+    if (n >= reader->count)
+    {
+        return ERANGE;
+    }
+    const index_record_t *entry = &records(reader->index)[n];
+    int ret = map_segment(reader, entry->segment, entry->offset + entry->size);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    const char *data = reader->segments[entry->segment].map + entry->offset;
+    const frame_header_t *header = (const frame_header_t *)(data - sizeof(frame_header_t));
+    if (header->magic != SEGMENT_MAGIC || header->size != entry->size)
+    {
+        return EBADMSG;
+    }
+
+    record->data = data;
+    record->size = entry->size;
+    record->fmt = entry->fmt < __ACAM_FMT_COUNT ? (acam_fmt_t)entry->fmt : __ACAM_FMT_INVALID;
+    record->timestamp.tv_sec = entry->timestamp_us / 1000000;
+    record->timestamp.tv_usec = entry->timestamp_us % 1000000;
+    record->sequence = entry->sequence;
+    return 0;
+}
+
+/**
+ * @brief Finds the first frame captured at or after a point in time.
+ *
+ * @param reader the reader
+ * @param timestamp the point in time, on the clock of the recorded frames.
+ * @param n set to the frame's position.
+ * @return exit status. 0 on success, ERANGE if every frame is older.
+ */
+int acam_reader_find_time(const acam_reader_t *reader, const struct timeval *timestamp, uint64_t *n)
+{
+    assert(reader && timestamp && n);
+    const index_record_t *entries = records(reader->index);
+    int64_t target = timeval_us(timestamp);
+    uint64_t lo = 0, hi = reader->count;
+    while (lo < hi)
+    {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (entries[mid].timestamp_us < target)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == reader->count)
+    {
+        return ERANGE;
+    }
+    *n = lo;
+    return 0;
+}
+
+/**
+ * @brief Closes a reader and unmaps the recording. Records obtained from it become invalid.
+ *
+ * @param reader the reader to close
+ * @return exit status. 0 on success, errno on failure to close the index.
+ */
+int acam_reader_close(acam_reader_t *reader)
+{
+    assert(reader);
+    for (uint32_t i = 0; i < reader->segment_count; i++)
+    {
+        if (reader->segments[i].map != NULL)
+            munmap(reader->segments[i].map, reader->segments[i].size);
+    }
+    free(reader->segments);
+    if (reader->index != MAP_FAILED)
+        munmap(reader->index, reader->index_size);
+    int ret = close(reader->index_fd) == -1 ? errno : 0;
+    free(reader);
+    return ret;
+}
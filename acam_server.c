@@ -0,0 +1,996 @@
+#define _GNU_SOURCE
+#include "acam_control.h"
+
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#ifndef NDEBUG
+#define DEBUG_PRINT fprintf
+#define DEBUG_PERROR perror
+#else
+#define DEBUG_PRINT
+#define DEBUG_PERROR
+#endif
+
+/**
+ * @brief Frame server: one process owns a camera and serves it to any number of
+ * local clients, which would otherwise fight over S_FMT and REQBUFS.
+ *
+ * The server thread streams the camera into a shared-memory publisher (acam_shm.c)
+ * and hands the ring's memfd to every client once, with SCM_RIGHTS, when it
+ * connects. From then on frames never touch the socket: each one is copied once into
+ * the ring, whatever the number of clients, and clients read it in place and wake on
+ * the ring's futex. A client that falls behind only loses frames of its own.
+ *
+ * The socket carries control and format requests, one fixed-size message each way on
+ * a SOCK_SEQPACKET connection, all answered by the server thread in turn. Any client
+ * may change a control or the mode, unless one has taken the lock with
+ * acam_client_lock: then only that client may, until it unlocks or disconnects, and
+ * the others get EBUSY. Reads are always answered. A mode change stops and restarts
+ * the stream, so every client sees the new mode from the next frame on.
+ *
+ */
+
+#define SERVER_VERSION 1
+#define SERVER_EV_LISTEN UINT32_MAX
+#define SERVER_EV_WAKE (UINT32_MAX - 1)
+#define SERVER_EV_CAMERA (UINT32_MAX - 2)
+
+typedef enum
+{
+    SERVER_HELLO = 1, //server to client on connect, carries the ring's memfd
+    SERVER_GET_CTRL,
+    SERVER_SET_CTRL,
+    SERVER_GET_MODE,
+    SERVER_SET_MODE,
+    SERVER_LOCK,
+    SERVER_UNLOCK,
+
+} server_msg_type_t;
+
+/**
+ * @brief A request, and the server's reply of the same type. Mode fields describe the
+ * mode asked for, or the one being served.
+ *
+ */
+typedef struct
+{
+    uint32_t type;
+    int32_t error; //0, or the errno of a failed request
+    int32_t ctrl;
+    int32_t value; //control value; SERVER_VERSION in SERVER_HELLO
+    uint32_t fourcc;
+    uint32_t width;
+    uint32_t height;
+    uint32_t numerator;
+    uint32_t denominator;
+    uint32_t bytesperline;
+    uint32_t sizeimage;
+    int32_t compressed;
+    int32_t fmt;
+} server_msg_t;
+
+struct acam_server
+{
+    acam_camera_t *cam;
+    acam_publisher_t *pub;
+    acam_mode_t mode; //the mode being served
+    unsigned int buffers;
+    size_t slot_size;
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+    int listen_fd;
+    int epoll_fd;
+    int wake_fd; //eventfd that interrupts the server thread on stop
+    int *clients; //socket of each client slot, -1 when free
+    unsigned int max_clients;
+    int owner; //slot of the client holding the lock, -1 if none
+    int streaming;
+
+    pthread_t thread;
+    int stop;
+    acam_server_stats_t stats; //updated by the server thread, read with atomics
+};
+
+struct acam_client
+{
+    int fd;
+    acam_subscriber_t *sub;
+};
+
+static void mode_to_msg(server_msg_t *msg, const acam_mode_t *mode)
+{
+    msg->fourcc = mode->fourcc;
+    msg->width = mode->width;
+    msg->height = mode->height;
+    msg->numerator = mode->interval.numerator;
+    msg->denominator = mode->interval.denominator;
+    msg->bytesperline = mode->bytesperline;
+    msg->sizeimage = mode->sizeimage;
+    msg->compressed = mode->compressed;
+    msg->fmt = mode->fmt;
+}
+
+/**
+ * @brief Turns streaming on and watches the camera's fd.
+ */
+static int start_stream(acam_server_t *server)
+{
+    int ret = acam_stream_start(server->cam, server->buffers);
+    if (ret == 0)
+    {
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN;
+        ev.data.u32 = SERVER_EV_CAMERA;
+        if (-1 == epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, acam_get_fd(server->cam), &ev))
+        {
+            ret = errno;
+            acam_stream_stop(server->cam);
+        }
+    }
+    server->streaming = ret == 0;
+    __atomic_store_n(&server->stats.error, ret, __ATOMIC_RELAXED);
+    return ret;
+}
+
+static void stop_stream(acam_server_t *server)
+{
+    if (server->streaming)
+    {
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, acam_get_fd(server->cam), NULL);
+        acam_stream_stop(server->cam);
+        server->streaming = 0;
+    }
+}
+
+/**
+ * @brief Publishes every frame the driver has ready and hands the buffers straight
+ * back. A failing stream is stopped and its error kept for acam_server_get_stats;
+ * a mode change starts it again.
+ */
+static void drain_camera(acam_server_t *server)
+{
+    for (;;)
+    {
+        acam_frame_t *frame;
+        int ret = acam_stream_try_dequeue_frame(server->cam, &frame);
+        if (ret == EAGAIN)
+        {
+            return;
+        }
+        if (ret != 0)
+        {
+            DEBUG_PRINT(stderr, "Frame server stream failed: %s\n", strerror(ret));
+            stop_stream(server);
+            __atomic_store_n(&server->stats.error, ret, __ATOMIC_RELAXED);
+            return;
+        }
+        if (acam_publisher_push_frame(server->pub, frame) == 0)
+        {
+            __atomic_add_fetch(&server->stats.frames, 1, __ATOMIC_RELAXED);
+        }
+        acam_frame_release(frame);
+    }
+}
+
+/**
+ * @brief Sends a message, with @param fd attached as SCM_RIGHTS unless it is -1.
+ * Never blocks: a client whose socket is full is not reading its replies.
+ *
+ * @return exit status. 0 on success, errno on failure.
+ */
+static int send_msg(int sock, const server_msg_t *msg, int fd, int flags)
+{
+    struct iovec iov = {(void *)msg, sizeof(server_msg_t)};
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr hdr = {0};
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    if (fd != -1)
+    {
+        memset(&control, 0, sizeof(control));
+        hdr.msg_control = control.buf;
+        hdr.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    ssize_t sent = sendmsg(sock, &hdr, MSG_NOSIGNAL | flags);
+    if (sent == -1)
+    {
+        return errno;
+    }
+    return sent == sizeof(server_msg_t) ? 0 : EPROTO;
+}
+
+static void drop_client(acam_server_t *server, unsigned int slot)
+{
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, server->clients[slot], NULL);
+    close(server->clients[slot]);
+    server->clients[slot] = -1;
+    if (server->owner == (int)slot)
+    {
+        server->owner = -1;
+    }
+    __atomic_sub_fetch(&server->stats.clients, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Accepts every pending connection and greets it with the ring's memfd.
+ * Connections beyond max_clients are closed at once.
+ */
+static void accept_clients(acam_server_t *server)
+{
+    for (;;)
+    {
+        int sock = accept4(server->listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+        if (sock == -1)
+        {
+            if (errno != EAGAIN && errno != EINTR)
+            {
+                DEBUG_PERROR("Accepting frame client");
+            }
+            return;
+        }
+
+        unsigned int slot = 0;
+        while (slot < server->max_clients && server->clients[slot] != -1)
+        {
+            slot++;
+        }
+        server_msg_t hello = {0};
+        hello.type = SERVER_HELLO;
+        hello.value = SERVER_VERSION;
+        mode_to_msg(&hello, &server->mode);
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN;
+        ev.data.u32 = slot;
+        if (slot == server->max_clients || send_msg(sock, &hello, acam_publisher_get_fd(server->pub), MSG_DONTWAIT) != 0 ||
+            -1 == epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, sock, &ev))
+        {
+            close(sock);
+            __atomic_add_fetch(&server->stats.refused, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        server->clients[slot] = sock;
+        __atomic_add_fetch(&server->stats.accepted, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&server->stats.clients, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief Switches the stream to another mode of the camera's table: the stream is
+ * stopped, the mode set and the stream started again, in the old mode if the new one
+ * was refused or the driver's frames for it would not fit in the ring's slots.
+ *
+ * @return exit status. 0 on success, EINVAL if the camera has no such mode,
+ * EMSGSIZE if its frames do not fit in the ring's slots, errno on failure to set it.
+ */
+static int change_mode(acam_server_t *server, const server_msg_t *msg)
+{
+    struct v4l2_fract interval = {msg->numerator, msg->denominator};
+    const acam_mode_t *mode = acam_find_mode(server->cam, msg->fourcc, msg->width, msg->height,
+                                             interval.numerator != 0 ? &interval : NULL);
+    if (mode == NULL)
+    {
+        return EINVAL;
+    }
+    if (mode->sizeimage > server->slot_size)
+    {
+        return EMSGSIZE;
+    }
+
+    stop_stream(server);
+    acam_mode_t previous = server->mode;
+    int ret = acam_set_mode(server->cam, mode);
+    acam_get_mode(server->cam, &server->mode);
+    if (ret == 0 && server->mode.sizeimage > server->slot_size)
+    {
+        // the table only estimates sizeimage; the driver's buffers are what the slots must hold
+        ret = EMSGSIZE;
+        acam_set_mode(server->cam, &previous);
+        acam_get_mode(server->cam, &server->mode);
+    }
+    int restart = start_stream(server);
+    return ret != 0 ? ret : restart;
+}
+
+/**
+ * @brief Answers one request. Changes are refused with EBUSY while another client
+ * holds the lock.
+ */
+static void answer(acam_server_t *server, unsigned int slot, server_msg_t *msg)
+{
+    int locked_out = server->owner != -1 && server->owner != (int)slot;
+    int ret = 0;
+    switch (msg->type)
+    {
+    case SERVER_GET_CTRL:
+    case SERVER_SET_CTRL:
+        if (msg->ctrl < 0 || msg->ctrl >= __ACAM_CTRL_COUNT || (msg->type == SERVER_SET_CTRL && msg->ctrl == ACAM_FORMAT))
+        {
+            ret = EINVAL; // the format changes with SERVER_SET_MODE, which restarts the stream
+        }
+        else if (msg->type == SERVER_GET_CTRL)
+        {
+            ret = acam_get_ctrl(server->cam, msg->ctrl, &msg->value);
+        }
+        else
+        {
+            ret = locked_out ? EBUSY : acam_set_ctrl(server->cam, msg->ctrl, msg->value);
+        }
+        break;
+    case SERVER_GET_MODE:
+        break;
+    case SERVER_SET_MODE:
+        ret = locked_out ? EBUSY : change_mode(server, msg);
+        break;
+    case SERVER_LOCK:
+        if (locked_out)
+        {
+            ret = EBUSY;
+        }
+        else
+        {
+            server->owner = slot;
+        }
+        break;
+    case SERVER_UNLOCK:
+        if (locked_out)
+        {
+            ret = EPERM;
+        }
+        else
+        {
+            server->owner = -1;
+        }
+        break;
+    default:
+        ret = EINVAL;
+        break;
+    }
+    if (ret == EBUSY && locked_out)
+    {
+        __atomic_add_fetch(&server->stats.busy, 1, __ATOMIC_RELAXED);
+    }
+    if (msg->type == SERVER_GET_MODE || msg->type == SERVER_SET_MODE)
+    {
+        mode_to_msg(msg, &server->mode);
+    }
+    msg->error = ret;
+}
+
+/**
+ * @brief Answers every request a client has sent, and drops it once it has hung up
+ * or misbehaves.
+ */
+static void serve_client(acam_server_t *server, unsigned int slot)
+{
+    for (;;)
+    {
+        server_msg_t msg;
+        ssize_t got = recv(server->clients[slot], &msg, sizeof(msg), MSG_DONTWAIT);
+        if (got == -1 && (errno == EAGAIN || errno == EINTR))
+        {
+            return;
+        }
+        if (got != sizeof(msg))
+        {
+            drop_client(server, slot); // hung up, or not speaking the protocol
+            return;
+        }
+        answer(server, slot, &msg);
+        __atomic_add_fetch(&server->stats.requests, 1, __ATOMIC_RELAXED);
+        if (send_msg(server->clients[slot], &msg, -1, MSG_DONTWAIT) != 0)
+        {
+            drop_client(server, slot);
+            return;
+        }
+    }
+}
+
+static void *server_main(void *arg)
+{
+    acam_server_t *server = arg;
+    struct epoll_event events[64];
+
+    while (!__atomic_load_n(&server->stop, __ATOMIC_ACQUIRE))
+    {
+        int n = epoll_wait(server->epoll_fd, events, 64, -1);
+        if (n == -1 && errno != EINTR)
+        {
+            DEBUG_PERROR("Waiting for frame clients");
+            break;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            uint32_t id = events[i].data.u32;
+            if (id == SERVER_EV_CAMERA)
+            {
+                if (server->streaming)
+                {
+                    drain_camera(server);
+                }
+            }
+            else if (id == SERVER_EV_LISTEN)
+            {
+                accept_clients(server);
+            }
+            else if (id < server->max_clients && server->clients[id] != -1)
+            {
+                serve_client(server, id);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Binds the listening socket, taking over the path of a server that is gone.
+ *
+ * @return exit status. 0 on success, EADDRINUSE if a server is listening on the path,
+ * errno on other failures.
+ */
+static int bind_socket(acam_server_t *server)
+{
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, server->path, sizeof(addr.sun_path));
+
+    server->listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (server->listen_fd == -1)
+    {
+        return errno;
+    }
+    if (-1 == bind(server->listen_fd, (struct sockaddr *)&addr, sizeof(addr)))
+    {
+        if (errno != EADDRINUSE)
+        {
+            return errno;
+        }
+        // a socket file is left over: only take it if nobody answers on it
+        int probe = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        int alive = probe != -1 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        int refused = !alive && errno == ECONNREFUSED;
+        if (probe != -1)
+            close(probe);
+        if (!refused)
+        {
+            return EADDRINUSE;
+        }
+        unlink(server->path);
+        if (-1 == bind(server->listen_fd, (struct sockaddr *)&addr, sizeof(addr)))
+        {
+            return errno;
+        }
+    }
+    if (-1 == listen(server->listen_fd, SOMAXCONN))
+    {
+        int ret = errno;
+        unlink(server->path);
+        return ret;
+    }
+    return 0;
+}
+
+/**
+ * @brief Closes whatever of a server is open and frees it.
+ */
+static void free_server(acam_server_t *server)
+{
+    if (server->clients != NULL)
+    {
+        for (unsigned int i = 0; i < server->max_clients; i++)
+        {
+            if (server->clients[i] != -1)
+                close(server->clients[i]);
+        }
+    }
+    if (server->listen_fd != -1)
+    {
+        close(server->listen_fd);
+        unlink(server->path);
+    }
+    if (server->epoll_fd != -1)
+        close(server->epoll_fd);
+    if (server->wake_fd != -1)
+        close(server->wake_fd);
+    free(server->clients);
+    free(server);
+}
+
+/**
+ * @brief Starts serving a camera on a Unix socket. The camera is streamed in its
+ * current mode on a thread of the server, which owns it until acam_server_stop:
+ * change its controls and mode through a client meanwhile.
+ *
+ * Every client gets the ring's memfd open for writing, as subscribers need it to
+ * count themselves as waiters on the control page. A client can therefore overwrite
+ * the frames every other client reads; serve only processes trusted with the stream.
+ * The server never takes the ring's geometry or frame count from the shared page.
+ *
+ * @param cam the camera, open and not streaming.
+ * @param socket_path where to listen. A socket file left by a server that is gone is
+ * replaced.
+ * @param config the server's settings, NULL for the defaults.
+ * @param error set to the error code on failure. EADDRINUSE if another server listens
+ * on @param socket_path, EMSGSIZE if the current mode's frames are larger than
+ * config->slot_size.
+ * @return the server on success, NULL on failure.
+ */
+acam_server_t *acam_server_start(acam_camera_t *cam, const char *socket_path, const acam_server_config_t *config,
+                                 int *error)
+{
+    assert(cam && socket_path && error);
+    acam_server_config_t defaults = {0};
+    if (config == NULL)
+    {
+        config = &defaults;
+    }
+
+    acam_server_t *server = calloc(1, sizeof(acam_server_t));
+    if (server == NULL)
+    {
+        *error = ENOMEM;
+        return NULL;
+    }
+    server->listen_fd = -1;
+    server->epoll_fd = -1;
+    server->wake_fd = -1;
+    server->owner = -1;
+    server->cam = cam;
+    server->buffers = config->buffers;
+    server->max_clients = config->max_clients ? config->max_clients : ACAM_SERVER_DEFAULT_CLIENTS;
+    int ret = 0;
+    if (strlen(socket_path) >= sizeof(server->path))
+    {
+        ret = ENAMETOOLONG;
+        goto fail;
+    }
+    strcpy(server->path, socket_path);
+    ret = acam_get_mode(cam, &server->mode);
+    if (ret != 0)
+    {
+        goto fail;
+    }
+
+    // slots fit the largest mode, so clients can switch to any of them
+    server->slot_size = config->slot_size;
+    if (server->slot_size == 0)
+    {
+        const acam_mode_t *modes;
+        unsigned int mode_count = acam_get_modes(cam, &modes);
+        server->slot_size = server->mode.sizeimage;
+        for (unsigned int i = 0; i < mode_count; i++)
+        {
+            if (modes[i].sizeimage > server->slot_size)
+                server->slot_size = modes[i].sizeimage;
+        }
+        if (server->slot_size == 0)
+            server->slot_size = ACAM_SHM_DEFAULT_SLOT_SIZE;
+    }
+    if (server->mode.sizeimage > server->slot_size)
+    {
+        ret = EMSGSIZE;
+        goto fail;
+    }
+
+    server->clients = malloc(server->max_clients * sizeof(int));
+    if (server->clients == NULL)
+    {
+        ret = ENOMEM;
+        goto fail;
+    }
+    for (unsigned int i = 0; i < server->max_clients; i++)
+    {
+        server->clients[i] = -1;
+    }
+    server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    server->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (server->epoll_fd == -1 || server->wake_fd == -1)
+    {
+        DEBUG_PERROR("Creating frame server event loop");
+        ret = errno;
+        goto fail;
+    }
+    ret = bind_socket(server);
+    if (ret != 0)
+    {
+        DEBUG_PRINT(stderr, "Listening on %s: %s\n", socket_path, strerror(ret));
+        goto fail;
+    }
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.u32 = SERVER_EV_WAKE;
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->wake_fd, &ev);
+    ev.data.u32 = SERVER_EV_LISTEN;
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->listen_fd, &ev);
+
+    server->pub = acam_publisher_create(config->slots, server->slot_size, &ret);
+    if (server->pub == NULL)
+    {
+        goto fail;
+    }
+    ret = start_stream(server);
+    if (ret == 0)
+    {
+        ret = pthread_create(&server->thread, NULL, server_main, server);
+        if (ret != 0)
+        {
+            stop_stream(server);
+        }
+    }
+    if (ret != 0)
+    {
+        acam_publisher_destroy(server->pub);
+        goto fail;
+    }
+    return server;
+
+fail:
+    free_server(server);
+    *error = ret;
+    return NULL;
+}
+
+/**
+ * @brief Reads the server's counters. Safe to call while it serves.
+ *
+ * @param server the server
+ * @param stats filled with a snapshot of the counters.
+ */
+void acam_server_get_stats(const acam_server_t *server, acam_server_stats_t *stats)
+{
+    assert(server && stats);
+    stats->frames = __atomic_load_n(&server->stats.frames, __ATOMIC_RELAXED);
+    stats->accepted = __atomic_load_n(&server->stats.accepted, __ATOMIC_RELAXED);
+    stats->refused = __atomic_load_n(&server->stats.refused, __ATOMIC_RELAXED);
+    stats->requests = __atomic_load_n(&server->stats.requests, __ATOMIC_RELAXED);
+    stats->busy = __atomic_load_n(&server->stats.busy, __ATOMIC_RELAXED);
+    stats->clients = __atomic_load_n(&server->stats.clients, __ATOMIC_RELAXED);
+    stats->error = __atomic_load_n(&server->stats.error, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Stops serving: the thread ends, every client is disconnected, the stream is
+ * turned off and the socket file removed. Clients read the frames left in the ring,
+ * then get EPIPE. The camera stays open, in whatever mode it was last set to.
+ *
+ * @param server the server
+ * @return exit status. 0 on success, errno on failure to join the thread.
+ */
+int acam_server_stop(acam_server_t *server)
+{
+    assert(server);
+    __atomic_store_n(&server->stop, 1, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    if (-1 == write(server->wake_fd, &one, sizeof(one)))
+    {
+        DEBUG_PERROR("Waking frame server");
+    }
+    int ret = pthread_join(server->thread, NULL);
+
+    stop_stream(server);
+    acam_publisher_destroy(server->pub);
+    free_server(server);
+    return ret;
+}
+
+/**
+ * @brief Sends a request and waits for its answer.
+ *
+ * @return exit status. The server's answer, EPIPE if it has gone away.
+ */
+static int request(acam_client_t *client, server_msg_t *msg)
+{
+    int ret = send_msg(client->fd, msg, -1, 0);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    uint32_t type = msg->type;
+    ssize_t got;
+    do
+    {
+        got = recv(client->fd, msg, sizeof(server_msg_t), 0);
+    } while (got == -1 && errno == EINTR);
+    if (got == -1)
+    {
+        return errno;
+    }
+    if (got != sizeof(server_msg_t) || msg->type != type)
+    {
+        return got == 0 ? EPIPE : EPROTO;
+    }
+    return msg->error;
+}
+
+/**
+ * @brief Connects to a frame server and maps its frame ring. Only frames published
+ * from now on are received.
+ *
+ * @param socket_path the path the server listens on.
+ * @param error set to the error code on failure. ECONNREFUSED or ENOENT if no server
+ * listens there, EAGAIN if it already serves its max_clients, EPROTO if it does not
+ * speak this library version.
+ * @return the client on success, NULL on failure.
+ */
+acam_client_t *acam_client_connect(const char *socket_path, int *error)
+{
+    assert(socket_path && error);
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        *error = ENAMETOOLONG;
+        return NULL;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    acam_client_t *client = calloc(1, sizeof(acam_client_t));
+    if (client == NULL)
+    {
+        *error = ENOMEM;
+        return NULL;
+    }
+    client->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (client->fd == -1 || -1 == connect(client->fd, (struct sockaddr *)&addr, sizeof(addr)))
+    {
+        *error = errno;
+        if (client->fd != -1)
+            close(client->fd);
+        free(client);
+        return NULL;
+    }
+
+    server_msg_t hello = {0};
+    struct iovec iov = {&hello, sizeof(hello)};
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr hdr = {0};
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control.buf;
+    hdr.msg_controllen = sizeof(control.buf);
+    ssize_t got;
+    do
+    {
+        got = recvmsg(client->fd, &hdr, MSG_CMSG_CLOEXEC);
+    } while (got == -1 && errno == EINTR);
+
+    int ring = -1;
+    struct cmsghdr *cmsg = got > 0 ? CMSG_FIRSTHDR(&hdr) : NULL;
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+    {
+        memcpy(&ring, CMSG_DATA(cmsg), sizeof(int));
+    }
+    int ret = 0;
+    if (got == -1)
+    {
+        ret = errno;
+    }
+    else if (got == 0)
+    {
+        ret = EAGAIN; // the server is full and closed the connection
+    }
+    else if (got != sizeof(hello) || hello.type != SERVER_HELLO || hello.value != SERVER_VERSION || ring == -1)
+    {
+        ret = EPROTO;
+    }
+    else
+    {
+        client->sub = acam_subscriber_open(ring, &ret);
+    }
+    if (ring != -1)
+    {
+        close(ring);
+    }
+    if (client->sub == NULL)
+    {
+        close(client->fd);
+        free(client);
+        *error = ret;
+        return NULL;
+    }
+    return client;
+}
+
+/**
+ * @brief Gets the next frame from the server's ring, see acam_subscriber_next.
+ *
+ * @param client the client
+ * @param frame filled with the frame's data pointer and metadata.
+ * @param timeout_ms how long to wait for a frame. Negative waits forever, 0 does not wait.
+ * @return exit status, as acam_subscriber_next. EPIPE once the server has stopped.
+ */
+int acam_client_next(acam_client_t *client, acam_shm_frame_t *frame, int timeout_ms)
+{
+    assert(client);
+    return acam_subscriber_next(client->sub, frame, timeout_ms);
+}
+
+/**
+ * @brief Gets the client's view of the frame ring, to check frames with
+ * acam_subscriber_check and read its counters. Owned by the client.
+ *
+ * @param client the client
+ * @return the subscriber.
+ */
+acam_subscriber_t *acam_client_get_subscriber(const acam_client_t *client)
+{
+    assert(client);
+    return client->sub;
+}
+
+/**
+ * @brief Gets the value of a control of the served camera from the server's shadow
+ * cache, see acam_get_ctrl.
+ *
+ * @param client the client
+ * @param ctrl the acam_ctrl_tag ENUM
+ * @param value set to the control's value.
+ * @return exit status. 0 on success, the server's errno on failure, EPIPE if it has
+ * stopped.
+ */
+int acam_client_get_ctrl(acam_client_t *client, acam_ctrl_tag_t ctrl, int *value)
+{
+    assert(client && value);
+    server_msg_t msg = {0};
+    msg.type = SERVER_GET_CTRL;
+    msg.ctrl = ctrl;
+    int ret = request(client, &msg);
+    if (ret == 0)
+    {
+        *value = msg.value;
+    }
+    return ret;
+}
+
+/**
+ * @brief Sets a control of the served camera, for every client.
+ *
+ * @param client the client
+ * @param ctrl the acam_ctrl_tag ENUM. ACAM_FORMAT is changed with acam_client_set_mode.
+ * @param value the new value.
+ * @return exit status. 0 on success, EBUSY if another client holds the lock, EINVAL
+ * for ACAM_FORMAT, the server's errno on failure, EPIPE if it has stopped.
+ */
+int acam_client_set_ctrl(acam_client_t *client, acam_ctrl_tag_t ctrl, int value)
+{
+    assert(client);
+    server_msg_t msg = {0};
+    msg.type = SERVER_SET_CTRL;
+    msg.ctrl = ctrl;
+    msg.value = value;
+    return request(client, &msg);
+}
+
+static void msg_to_mode(const server_msg_t *msg, acam_mode_t *mode)
+{
+    mode->fourcc = msg->fourcc;
+    mode->width = msg->width;
+    mode->height = msg->height;
+    mode->interval.numerator = msg->numerator;
+    mode->interval.denominator = msg->denominator;
+    mode->bytesperline = msg->bytesperline;
+    mode->sizeimage = msg->sizeimage;
+    mode->compressed = msg->compressed;
+    mode->fmt = msg->fmt;
+}
+
+/**
+ * @brief Describes the mode being served, to interpret frames whose fmt is
+ * __ACAM_FMT_INVALID.
+ *
+ * @param client the client
+ * @param mode filled with the mode, see acam_get_mode.
+ * @return exit status. 0 on success, EPIPE if the server has stopped.
+ */
+int acam_client_get_mode(acam_client_t *client, acam_mode_t *mode)
+{
+    assert(client && mode);
+    server_msg_t msg = {0};
+    msg.type = SERVER_GET_MODE;
+    int ret = request(client, &msg);
+    if (ret == 0)
+    {
+        msg_to_mode(&msg, mode);
+    }
+    return ret;
+}
+
+/**
+ * @brief Switches the served camera to another mode of its table, see acam_find_mode.
+ * The server restarts the stream, so every client receives frames of the new mode
+ * from then on.
+ *
+ * @param client the client
+ * @param fourcc the V4L2_PIX_FMT code
+ * @param width the frame width
+ * @param height the frame height
+ * @param interval the frame interval, or NULL for the fastest rate of the size.
+ * @return exit status. 0 on success, EBUSY if another client holds the lock, EINVAL
+ * if the camera has no such mode, EMSGSIZE if its frames do not fit the server's ring,
+ * the server's errno on failure, EPIPE if it has stopped.
+ */
+int acam_client_set_mode(acam_client_t *client, uint32_t fourcc, uint32_t width, uint32_t height,
+                         const struct v4l2_fract *interval)
+{
+    assert(client);
+    server_msg_t msg = {0};
+    msg.type = SERVER_SET_MODE;
+    msg.fourcc = fourcc;
+    msg.width = width;
+    msg.height = height;
+    if (interval != NULL)
+    {
+        msg.numerator = interval->numerator;
+        msg.denominator = interval->denominator;
+    }
+    return request(client, &msg);
+}
+
+/**
+ * @brief Reserves control and format changes to this client until it unlocks or
+ * disconnects. Other clients can still read controls and receive frames.
+ *
+ * @param client the client
+ * @return exit status. 0 on success, also if the client holds the lock already,
+ * EBUSY if another client holds it, EPIPE if the server has stopped.
+ */
+int acam_client_lock(acam_client_t *client)
+{
+    assert(client);
+    server_msg_t msg = {0};
+    msg.type = SERVER_LOCK;
+    return request(client, &msg);
+}
+
+/**
+ * @brief Gives up the lock taken with acam_client_lock.
+ *
+ * @param client the client
+ * @return exit status. 0 on success, also if nobody holds the lock, EPERM if another
+ * client holds it, EPIPE if the server has stopped.
+ */
+int acam_client_unlock(acam_client_t *client)
+{
+    assert(client);
+    server_msg_t msg = {0};
+    msg.type = SERVER_UNLOCK;
+    return request(client, &msg);
+}
+
+/**
+ * @brief Disconnects from the server, giving up the lock if the client holds it,
+ * unmaps the ring and frees the client.
+ *
+ * @param client the client
+ * @return exit status. 0 on success, errno on failure to unmap or close.
+ */
+int acam_client_close(acam_client_t *client)
+{
+    assert(client);
+    int ret = acam_subscriber_close(client->sub);
+    if (close(client->fd) == -1 && ret == 0)
+    {
+        ret = errno;
+    }
+    free(client);
+    return ret;
+}
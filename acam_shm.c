@@ -0,0 +1,513 @@
+#define _GNU_SOURCE
+#include "acam_control.h"
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#ifndef NDEBUG
+#define DEBUG_PRINT fprintf
+#define DEBUG_PERROR perror
+#else
+#define DEBUG_PRINT
+#define DEBUG_PERROR
+#endif
+
+/**
+ * @brief Shared-memory frame fan-out. A publisher copies every frame it is given into
+ * a ring of fixed-size slots in a sealed memfd; any number of subscribers, in any
+ * process that gets hold of the fd, map the ring read-only and read frames straight
+ * out of it. The producer never waits for a subscriber: it overwrites the oldest slot,
+ * and a subscriber that falls behind skips ahead and counts the frames it missed.
+ *
+ * Each slot carries a sequence word that is odd while the publisher writes frame n
+ * into it (2n + 1) and even once the frame is complete (2n + 2), so a subscriber can
+ * tell whether the frame it was handed has been overwritten since, see
+ * acam_subscriber_check. The number of frames published is kept in the first page;
+ * subscribers with nothing to read sleep on its low 32 bits with FUTEX_WAIT, and the
+ * publisher only makes the FUTEX_WAKE call while one of them is asleep.
+ *
+ * Layout of the memfd: a control page, the slot table, then the frame data, each
+ * part starting on a page. Subscribers map the control page writable, to count
+ * themselves as waiters, and everything else read-only. The publisher keeps its own
+ * copy of the geometry and head and never reads them back from the shared page.
+ *
+ */
+
+#define SHM_MAGIC "ACAMSHM"
+#define SHM_VERSION 1
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t slot_count;
+    uint64_t slot_size; //bytes of frame data per slot, a multiple of the page size
+    uint64_t slots_offset;
+    uint64_t data_offset;
+    uint64_t total_size;
+
+    uint64_t head __attribute__((aligned(64))); //frames published; frame n lives in slot n % slot_count
+    uint32_t futex; //low 32 bits of head, what subscribers sleep on
+    uint32_t closed; //set when the publisher is destroyed
+
+    uint32_t waiters __attribute__((aligned(64))); //subscribers in FUTEX_WAIT, the only field they write
+} shm_header_t;
+
+typedef struct
+{
+    uint64_t seq; //2n + 1 while frame n is written, 2n + 2 once it is complete, 0 before the first frame
+    uint32_t bytes_used;
+    int32_t fmt;
+    int64_t tv_sec;
+    int64_t tv_usec;
+    uint32_t sequence;
+    uint32_t field;
+    uint32_t flags;
+} __attribute__((aligned(64))) shm_slot_t;
+
+struct acam_publisher
+{
+    int fd;
+    char *map;
+    size_t size;
+    shm_header_t *header;
+    shm_slot_t *slots;
+    char *data;
+    unsigned int slot_count; //geometry and head of the ring, kept here because subscribers can write the control page
+    size_t slot_size;
+    uint64_t head;
+    acam_publisher_stats_t stats;
+};
+
+struct acam_subscriber
+{
+    const char *map; //the whole ring, read-only
+    size_t size;
+    shm_header_t *control; //the control page, writable
+    const shm_header_t *header;
+    const shm_slot_t *slots;
+    const char *data;
+    uint32_t slot_count; //geometry of the ring, copied at open so a misbehaving publisher cannot move reads out of the mapping
+    uint64_t slot_size;
+    uint64_t next; //frame number to read next
+    acam_subscriber_stats_t stats;
+};
+
+static size_t page_round(size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (size + page - 1) & ~(page - 1);
+}
+
+static int64_t monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Creates a publisher with a ring of @param slots frames of up to
+ * @param slot_size bytes each. The memfd is sized and sealed against resizing, so a
+ * subscriber never faults on a shrunken file, and is faulted in up front so
+ * publishing never does.
+ *
+ * @param slots the number of frames kept; 0 selects ACAM_SHM_DEFAULT_SLOTS.
+ * @param slot_size the largest frame that can be published; 0 selects
+ * ACAM_SHM_DEFAULT_SLOT_SIZE. Rounded up to a page.
+ * @param error set to the error code on failure.
+ * @return the publisher on success, NULL on failure.
+ */
+acam_publisher_t *acam_publisher_create(unsigned int slots, size_t slot_size, int *error)
+{
+    assert(error);
+    if (slots == 0)
+    {
+        slots = ACAM_SHM_DEFAULT_SLOTS;
+    }
+    if (slot_size == 0)
+    {
+        slot_size = ACAM_SHM_DEFAULT_SLOT_SIZE;
+    }
+    slot_size = page_round(slot_size);
+    size_t slots_offset = page_round(sizeof(shm_header_t));
+    size_t data_offset = slots_offset + page_round(slots * sizeof(shm_slot_t));
+    if (slot_size > (SIZE_MAX - data_offset) / slots)
+    {
+        *error = EINVAL;
+        return NULL;
+    }
+
+    acam_publisher_t *pub = calloc(1, sizeof(acam_publisher_t));
+    if (pub == NULL)
+    {
+        *error = ENOMEM;
+        return NULL;
+    }
+    pub->size = data_offset + slots * slot_size;
+    pub->fd = memfd_create("acam_frames", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (pub->fd == -1 || ftruncate(pub->fd, pub->size) == -1 ||
+        fcntl(pub->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1)
+    {
+        *error = errno;
+        DEBUG_PERROR("Creating frame ring");
+        if (pub->fd != -1)
+            close(pub->fd);
+        free(pub);
+        return NULL;
+    }
+    pub->map = mmap(NULL, pub->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, pub->fd, 0);
+    if (pub->map == MAP_FAILED)
+    {
+        *error = errno;
+        DEBUG_PERROR("Mapping frame ring");
+        close(pub->fd);
+        free(pub);
+        return NULL;
+    }
+
+    pub->header = (shm_header_t *)pub->map;
+    pub->slots = (shm_slot_t *)(pub->map + slots_offset);
+    pub->data = pub->map + data_offset;
+    pub->slot_count = slots;
+    pub->slot_size = slot_size;
+    pub->header->version = SHM_VERSION;
+    pub->header->slot_count = slots;
+    pub->header->slot_size = slot_size;
+    pub->header->slots_offset = slots_offset;
+    pub->header->data_offset = data_offset;
+    pub->header->total_size = pub->size;
+    memcpy(pub->header->magic, SHM_MAGIC, sizeof(SHM_MAGIC));
+    return pub;
+}
+
+/**
+ * @brief Gets the memfd holding the ring, to hand to subscribers: inherited across
+ * fork, passed with SCM_RIGHTS, or opened by another process of the same user as
+ * /proc/<pid>/fd/<fd> with O_RDWR.
+ *
+ * @param pub the publisher
+ * @return the fd, owned by the publisher.
+ */
+int acam_publisher_get_fd(const acam_publisher_t *pub)
+{
+    assert(pub);
+    return pub->fd;
+}
+
+/**
+ * @brief Copies a frame into the next slot of the ring, overwriting the oldest frame,
+ * and wakes the subscribers waiting for it. Never blocks. Frames must be published
+ * from one thread at a time.
+ *
+ * @param pub the publisher
+ * @param buffer the frame, with its timestamp, sequence number, field and flags.
+ * @param fmt the frame's format, handed to subscribers unchanged.
+ * @return exit status. 0 on success, EMSGSIZE if the frame is larger than a slot.
+ */
+int acam_publisher_push(acam_publisher_t *pub, const acam_buffer_t *buffer, acam_fmt_t fmt)
+{
+    assert(pub && buffer);
+    shm_header_t *header = pub->header;
+    if (buffer->bytes_used > pub->slot_size)
+    {
+        pub->stats.oversized++;
+        return EMSGSIZE;
+    }
+
+    uint64_t n = pub->head;
+    unsigned int index = n % pub->slot_count;
+    shm_slot_t *slot = &pub->slots[index];
+    __atomic_store_n(&slot->seq, 2 * n + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE); // the odd sequence is visible before any byte changes
+
+    memcpy(pub->data + (size_t)index * pub->slot_size, buffer->buf, buffer->bytes_used);
+    slot->bytes_used = buffer->bytes_used;
+    slot->fmt = fmt;
+    slot->tv_sec = buffer->timestamp.tv_sec;
+    slot->tv_usec = buffer->timestamp.tv_usec;
+    slot->sequence = buffer->sequence;
+    slot->field = buffer->field;
+    slot->flags = buffer->flags;
+    __atomic_store_n(&slot->seq, 2 * n + 2, __ATOMIC_RELEASE);
+
+    pub->head = n + 1;
+    __atomic_store_n(&header->head, n + 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&header->futex, (uint32_t)(n + 1), __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&header->waiters, __ATOMIC_SEQ_CST) != 0)
+    {
+        syscall(SYS_futex, &header->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+    pub->stats.published++;
+    return 0;
+}
+
+/**
+ * @brief Publishes a streaming frame with its own format and metadata. The caller
+ * keeps its hold on the frame.
+ *
+ * @param pub the publisher
+ * @param frame a frame the caller holds.
+ * @return exit status, as acam_publisher_push.
+ */
+int acam_publisher_push_frame(acam_publisher_t *pub, const acam_frame_t *frame)
+{
+    assert(pub && frame);
+    acam_buffer_t buffer = *frame->buffer;
+    buffer.bytes_used = frame->bytes_used;
+    buffer.timestamp = frame->timestamp;
+    buffer.sequence = frame->sequence;
+    buffer.field = frame->field;
+    buffer.flags = frame->flags;
+    return acam_publisher_push(pub, &buffer, frame->fmt);
+}
+
+/**
+ * @brief Reads the publisher's counters.
+ *
+ * @param pub the publisher
+ * @param stats filled with the counters.
+ */
+void acam_publisher_get_stats(const acam_publisher_t *pub, acam_publisher_stats_t *stats)
+{
+    assert(pub && stats);
+    *stats = pub->stats;
+}
+
+/**
+ * @brief Marks the ring closed, wakes every waiting subscriber and frees the
+ * publisher. Subscribers keep their mapping: they read the frames still in the ring,
+ * then get EPIPE.
+ *
+ * @param pub the publisher
+ * @return exit status. 0 on success, errno if the fd could not be closed.
+ */
+int acam_publisher_destroy(acam_publisher_t *pub)
+{
+    assert(pub);
+    __atomic_store_n(&pub->header->closed, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&pub->header->futex, 1, __ATOMIC_SEQ_CST); // so sleepers see a change
+    syscall(SYS_futex, &pub->header->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+
+    munmap(pub->map, pub->size);
+    int ret = close(pub->fd) == -1 ? errno : 0;
+    free(pub);
+    return ret;
+}
+
+/**
+ * @brief Attaches to a publisher's ring. Only frames published from now on are
+ * received.
+ *
+ * @param fd the ring's memfd, see acam_publisher_get_fd, open for reading and
+ * writing. The subscriber does not keep it: the caller may close it afterwards.
+ * @param error set to the error code on failure.
+ * @return the subscriber on success, NULL on failure. EPROTO if @param fd does not
+ * hold a frame ring of this library version.
+ */
+acam_subscriber_t *acam_subscriber_open(int fd, int *error)
+{
+    assert(error);
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+    {
+        *error = errno;
+        return NULL;
+    }
+    size_t control_size = page_round(sizeof(shm_header_t));
+    if ((size_t)st.st_size < control_size)
+    {
+        *error = EPROTO;
+        return NULL;
+    }
+
+    acam_subscriber_t *sub = calloc(1, sizeof(acam_subscriber_t));
+    if (sub == NULL)
+    {
+        *error = ENOMEM;
+        return NULL;
+    }
+    sub->size = st.st_size;
+    sub->map = mmap(NULL, sub->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (sub->map == MAP_FAILED)
+    {
+        *error = errno;
+        free(sub);
+        return NULL;
+    }
+    sub->control = mmap(NULL, control_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (sub->control == MAP_FAILED)
+    {
+        *error = errno;
+        munmap((void *)sub->map, sub->size);
+        free(sub);
+        return NULL;
+    }
+
+    const shm_header_t *header = (const shm_header_t *)sub->map;
+    shm_header_t geometry = *header;
+    int valid = memcmp(geometry.magic, SHM_MAGIC, sizeof(SHM_MAGIC)) == 0 && geometry.version == SHM_VERSION &&
+                geometry.total_size == sub->size && geometry.slot_count > 0 && geometry.slots_offset >= control_size &&
+                geometry.data_offset >= geometry.slots_offset + geometry.slot_count * sizeof(shm_slot_t) &&
+                geometry.slot_size <= (sub->size - geometry.data_offset) / geometry.slot_count;
+    if (!valid || geometry.data_offset > sub->size)
+    {
+        acam_subscriber_close(sub);
+        *error = EPROTO;
+        return NULL;
+    }
+    sub->header = header;
+    sub->slot_count = geometry.slot_count;
+    sub->slot_size = geometry.slot_size;
+    sub->slots = (const shm_slot_t *)(sub->map + geometry.slots_offset);
+    sub->data = sub->map + geometry.data_offset;
+    sub->next = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+    return sub;
+}
+
+/**
+ * @brief Sleeps until the publisher has moved past @param head, the ring is closed,
+ * or @param timeout_ms has passed.
+ */
+static void wait_for_publish(acam_subscriber_t *sub, uint64_t head, int timeout_ms)
+{
+    __atomic_add_fetch(&sub->control->waiters, 1, __ATOMIC_SEQ_CST);
+    uint32_t word = __atomic_load_n(&sub->control->futex, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sub->header->head, __ATOMIC_SEQ_CST) == head &&
+        !__atomic_load_n(&sub->header->closed, __ATOMIC_SEQ_CST))
+    {
+        struct timespec timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+        syscall(SYS_futex, &sub->control->futex, FUTEX_WAIT, word, timeout_ms < 0 ? NULL : &timeout, NULL, 0);
+    }
+    __atomic_sub_fetch(&sub->control->waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief Gets the next frame of the ring. The frame's data is read in place: it stays
+ * valid until the publisher wraps around to its slot, which acam_subscriber_check
+ * detects. A subscriber that has fallen more than the ring behind skips to the oldest
+ * frame still there; the frames it skipped, and any overwritten while it looked at
+ * them, are counted as dropped.
+ *
+ * @param sub the subscriber
+ * @param frame filled with the frame's data pointer and metadata.
+ * @param timeout_ms how long to wait for a frame. Negative waits forever, 0 does not wait.
+ * @return exit status. 0 on success, EAGAIN if @param timeout_ms is 0 and no frame is
+ * ready, ETIMEDOUT if none was published in time, EPIPE once the publisher is gone
+ * and every frame left in the ring has been read.
+ */
+int acam_subscriber_next(acam_subscriber_t *sub, acam_shm_frame_t *frame, int timeout_ms)
+{
+    assert(sub && frame);
+    const shm_header_t *header = sub->header;
+    int64_t deadline = timeout_ms > 0 ? monotonic_ms() + timeout_ms : 0;
+    for (;;)
+    {
+        uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+        if (head - sub->next > sub->slot_count)
+        {
+            uint64_t oldest = head - sub->slot_count + 1; // the oldest slot is the next one overwritten
+            sub->stats.dropped += oldest - sub->next;
+            sub->next = oldest;
+        }
+        if (sub->next < head)
+        {
+            uint64_t n = sub->next++;
+            unsigned int index = n % sub->slot_count;
+            const shm_slot_t *slot = &sub->slots[index];
+            uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+            frame->bytes_used = slot->bytes_used;
+            frame->fmt = slot->fmt;
+            frame->timestamp.tv_sec = slot->tv_sec;
+            frame->timestamp.tv_usec = slot->tv_usec;
+            frame->sequence = slot->sequence;
+            frame->field = slot->field;
+            frame->flags = slot->flags;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (seq != 2 * n + 2 || __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq ||
+                frame->bytes_used > sub->slot_size)
+            {
+                sub->stats.dropped++; // overwritten since head was read
+                continue;
+            }
+            frame->data = sub->data + (size_t)index * sub->slot_size;
+            frame->index = n;
+            sub->stats.received++;
+            return 0;
+        }
+
+        if (__atomic_load_n(&header->closed, __ATOMIC_ACQUIRE))
+        {
+            return EPIPE;
+        }
+        if (timeout_ms == 0)
+        {
+            return EAGAIN;
+        }
+        int remaining = -1;
+        if (timeout_ms > 0)
+        {
+            int64_t left = deadline - monotonic_ms();
+            if (left <= 0)
+            {
+                return ETIMEDOUT;
+            }
+            remaining = (int)left;
+        }
+        wait_for_publish(sub, head, remaining);
+    }
+}
+
+/**
+ * @brief Checks that a frame from acam_subscriber_next has not been overwritten.
+ * Call it after using the frame's data, or after copying out what is needed: if it
+ * succeeds, everything read from the frame before the call was intact.
+ *
+ * @param sub the subscriber
+ * @param frame the frame
+ * @return exit status. 0 if the frame is intact, ESTALE if the publisher has reused
+ * its slot, in which case the data read may be torn.
+ */
+int acam_subscriber_check(acam_subscriber_t *sub, const acam_shm_frame_t *frame)
+{
+    assert(sub && frame);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    const shm_slot_t *slot = &sub->slots[frame->index % sub->slot_count];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != 2 * frame->index + 2)
+    {
+        sub->stats.stale++;
+        return ESTALE;
+    }
+    return 0;
+}
+
+/**
+ * @brief Reads the subscriber's counters.
+ *
+ * @param sub the subscriber
+ * @param stats filled with the counters.
+ */
+void acam_subscriber_get_stats(const acam_subscriber_t *sub, acam_subscriber_stats_t *stats)
+{
+    assert(sub && stats);
+    *stats = sub->stats;
+}
+
+/**
+ * @brief Unmaps the ring and frees the subscriber.
+ *
+ * @param sub the subscriber
+ * @return exit status. 0 on success, errno on failure to unmap.
+ */
+int acam_subscriber_close(acam_subscriber_t *sub)
+{
+    assert(sub);
+    int ret = 0;
+    if (munmap(sub->control, page_round(sizeof(shm_header_t))) == -1 || munmap((void *)sub->map, sub->size) == -1)
+    {
+        ret = errno;
+    }
+    free(sub);
+    return ret;
+}
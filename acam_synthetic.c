@@ -0,0 +1,1200 @@
+#define _GNU_SOURCE
+#include "acam_control.h"
+#include "acam_jpeg_tables.h"
+
+#include <pthread.h>
+#include <time.h>
+#include <sys/timerfd.h>
+
+/**
+ * @brief In-process stand-in for an Arducam UB0212, used through acam_synthetic_backend.
+ * It answers the V4L2 ioctls the library issues, hands out memfd-backed buffers
+ * and produces YUYV or MJPEG frames on a monotonic schedule. The fd it returns is
+ * a timerfd which becomes readable when a frame is due, so it can be waited on
+ * with poll/select/epoll like a real video node.
+ *
+ * Device paths have the form "synthetic[:key=value,...]" with the keys
+ * fps (highest frame rate, default 30), jitter_us (maximum random delivery delay per frame,
+ * default 0), seed (jitter random seed) and fail_after (frames dequeued before VIDIOC_DQBUF
+ * fails with ENODEV like an unplugged camera, default 0 for never).
+ *
+ */
+
+#define SYN_MAX_BUFFERS VIDEO_MAX_FRAME
+#define SYN_DEFAULT_FPS 30
+
+/**
+ * @brief Control ranges reported by a UB0212 through uvcvideo.
+ *
+ */
+typedef struct
+{
+    uint32_t id;
+    const char *name;
+    uint32_t type;
+    int min_value;
+    int max_value;
+    int default_val;
+} syn_ctrl_info_t;
+
+static const syn_ctrl_info_t syn_ctrls[] = {
+    {V4L2_CID_BRIGHTNESS, "Brightness", V4L2_CTRL_TYPE_INTEGER, -64, 64, 0},
+    {V4L2_CID_CONTRAST, "Contrast", V4L2_CTRL_TYPE_INTEGER, 0, 64, 32},
+    {V4L2_CID_SATURATION, "Saturation", V4L2_CTRL_TYPE_INTEGER, 0, 128, 64},
+    {V4L2_CID_HUE, "Hue", V4L2_CTRL_TYPE_INTEGER, -40, 40, 0},
+    {V4L2_CID_AUTO_WHITE_BALANCE, "White Balance Temperature, Auto", V4L2_CTRL_TYPE_BOOLEAN, 0, 1, 1},
+    {V4L2_CID_GAMMA, "Gamma", V4L2_CTRL_TYPE_INTEGER, 72, 500, 100},
+    {V4L2_CID_GAIN, "Gain", V4L2_CTRL_TYPE_INTEGER, 0, 100, 0},
+    {V4L2_CID_POWER_LINE_FREQUENCY, "Power Line Frequency", V4L2_CTRL_TYPE_MENU, 0, 2, 1},
+    {V4L2_CID_WHITE_BALANCE_TEMPERATURE, "White Balance Temperature", V4L2_CTRL_TYPE_INTEGER, 2800, 6500, 4600},
+    {V4L2_CID_SHARPNESS, "Sharpness", V4L2_CTRL_TYPE_INTEGER, 0, 6, 3},
+    {V4L2_CID_BACKLIGHT_COMPENSATION, "Backlight Compensation", V4L2_CTRL_TYPE_INTEGER, 0, 2, 1},
+    {V4L2_CID_EXPOSURE_AUTO, "Exposure, Auto", V4L2_CTRL_TYPE_MENU, 0, 3, 3},
+    {V4L2_CID_EXPOSURE_ABSOLUTE, "Exposure (Absolute)", V4L2_CTRL_TYPE_INTEGER, 1, 5000, 157},
+    {V4L2_CID_EXPOSURE_AUTO_PRIORITY, "Exposure, Auto Priority", V4L2_CTRL_TYPE_BOOLEAN, 0, 1, 0},
+};
+#define SYN_CTRL_COUNT (sizeof(syn_ctrls) / sizeof(syn_ctrls[0]))
+
+static const struct
+{
+    uint32_t pixelformat;
+    const char *description;
+    uint32_t flags;
+} syn_pix[] = {
+    {V4L2_PIX_FMT_MJPEG, "Motion-JPEG", V4L2_FMT_FLAG_COMPRESSED},
+    {V4L2_PIX_FMT_YUYV, "YUYV 4:2:2", 0},
+};
+#define SYN_PIX_COUNT (sizeof(syn_pix) / sizeof(syn_pix[0]))
+
+static const struct
+{
+    uint32_t width;
+    uint32_t height;
+} syn_sizes[] = {
+    {1920, 1080},
+    {1280, 1024},
+    {1280, 720},
+    {800, 600},
+    {640, 480},
+    {320, 240},
+};
+#define SYN_SIZE_COUNT (sizeof(syn_sizes) / sizeof(syn_sizes[0]))
+
+// frame rates offered below the configured one, like the fixed list of a UVC descriptor
+static const unsigned int syn_rates[] = {60, 30, 15, 5};
+#define SYN_RATE_COUNT (sizeof(syn_rates) / sizeof(syn_rates[0]))
+
+typedef struct
+{
+    int memfd; //-1 for USERPTR buffers
+    void *map; //the fake's own view of the buffer; the caller's memory for USERPTR
+    size_t length;
+    int queued;
+    int done;
+    uint32_t bytesused;
+    uint32_t sequence;
+    struct timeval timestamp;
+} syn_buf_t;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    int fd; //timerfd handed to the library as the camera's fd
+    char bus_info[32]; //the device path, so fakes with different options have their own capability cache entry
+
+    unsigned int fps;     //current frame rate, see VIDIOC_S_PARM
+    unsigned int max_fps; //the rate from the device path
+    unsigned int jitter_us;
+    uint32_t rng;
+    unsigned long fail_after; //frames dequeued before DQBUF fails with ENODEV, 0 for never
+    unsigned long dequeued;
+
+    uint32_t pixelformat;
+    uint32_t width;
+    uint32_t height;
+    int ctrl_values[SYN_CTRL_COUNT];
+
+    syn_buf_t bufs[SYN_MAX_BUFFERS];
+    unsigned int count;
+    uint32_t memory; //V4L2_MEMORY_MMAP or V4L2_MEMORY_USERPTR, as last requested
+    unsigned int queue[SYN_MAX_BUFFERS]; //empty buffers in QBUF order
+    unsigned int queue_head;
+    unsigned int queue_len;
+    unsigned int done[SYN_MAX_BUFFERS]; //filled buffers in capture order
+    unsigned int done_head;
+    unsigned int done_len;
+
+    int streaming;
+    uint32_t sequence;
+    uint64_t frame_no;
+    uint64_t nominal_ns; //jitter-free delivery time of the next frame
+    uint64_t due_ns;     //actual delivery time of the next frame
+
+    uint8_t *line; //precomputed YUYV test pattern row, see fill_yuyv
+    size_t line_len;
+
+    uint16_t dc_code[2][16];
+    uint8_t dc_size[2][16];
+    uint16_t ac_code[2][256];
+    uint8_t ac_size[2][256];
+} syn_cam_t;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint32_t next_random(syn_cam_t *syn)
+{
+    // xorshift32, good enough for delivery jitter
+    uint32_t x = syn->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    syn->rng = x;
+    return x;
+}
+
+static uint32_t sizeimage(const syn_cam_t *syn)
+{
+    return syn->width * syn->height * 2;
+}
+
+static const syn_ctrl_info_t *find_ctrl(uint32_t id, int *index)
+{
+    for (unsigned int i = 0; i < SYN_CTRL_COUNT; i++)
+    {
+        if (syn_ctrls[i].id == id)
+        {
+            *index = i;
+            return &syn_ctrls[i];
+        }
+    }
+    return NULL;
+}
+
+static int ctrl_value(const syn_cam_t *syn, uint32_t id, int *value)
+{
+    int index;
+    if (find_ctrl(id, &index) == NULL)
+        return EINVAL;
+    *value = syn->ctrl_values[index];
+    return 0;
+}
+
+/**
+ * @brief Whether a control is currently overridden by its automatic counterpart.
+ */
+static int ctrl_inactive(const syn_cam_t *syn, uint32_t id)
+{
+    int value;
+    if (id == V4L2_CID_WHITE_BALANCE_TEMPERATURE)
+        return ctrl_value(syn, V4L2_CID_AUTO_WHITE_BALANCE, &value) == 0 && value == 1;
+    if (id == V4L2_CID_EXPOSURE_ABSOLUTE)
+        return ctrl_value(syn, V4L2_CID_EXPOSURE_AUTO, &value) == 0 && value == V4L2_EXPOSURE_APERTURE_PRIORITY;
+    return 0;
+}
+
+/**
+ * @brief Builds the Huffman code table for one DHT-layout table (ITU-T T.81 Annex C).
+ */
+static void build_codes(const uint8_t bits[16], const uint8_t *vals, uint16_t *code, uint8_t *size)
+{
+    unsigned int k = 0;
+    uint16_t c = 0;
+    for (int l = 1; l <= 16; l++)
+    {
+        for (int i = 0; i < bits[l - 1]; i++)
+        {
+            code[vals[k]] = c++;
+            size[vals[k]] = l;
+            k++;
+        }
+        c <<= 1;
+    }
+}
+
+/**
+ * @brief Fills a buffer with a moving diagonal YUYV gradient. Every row is a
+ * window into one precomputed row, so a frame costs a memcpy per row.
+ */
+static uint32_t fill_yuyv(syn_cam_t *syn, uint8_t *dst, size_t cap)
+{
+    size_t row = syn->width * 2;
+    size_t line_len = row + 64 * 4; // the pattern repeats every 64 pixel pairs
+    if (syn->line_len != line_len)
+    {
+        free(syn->line);
+        syn->line = malloc(line_len);
+        if (syn->line == NULL)
+        {
+            syn->line_len = 0;
+            return 0;
+        }
+        syn->line_len = line_len;
+        for (size_t p = 0; p < line_len / 4; p++)
+        {
+            syn->line[p * 4 + 0] = (p * 4) & 0xff;
+            syn->line[p * 4 + 1] = 128 + 40;
+            syn->line[p * 4 + 2] = (p * 4 + 2) & 0xff;
+            syn->line[p * 4 + 3] = 128 - 40;
+        }
+    }
+    if (cap < row * syn->height)
+    {
+        return 0;
+    }
+
+    for (uint32_t y = 0; y < syn->height; y++)
+    {
+        size_t shift = (y + syn->frame_no * 2) % 64;
+        memcpy(dst + y * row, syn->line + shift * 4, row);
+    }
+    return row * syn->height;
+}
+
+typedef struct
+{
+    uint8_t *p;
+    size_t pos;
+    size_t cap;
+    uint32_t acc;
+    int nbits;
+} syn_bits_t;
+
+static void put_byte(syn_bits_t *b, uint8_t byte)
+{
+    if (b->pos < b->cap)
+    {
+        b->p[b->pos] = byte;
+    }
+    b->pos++;
+}
+
+static void put_bits(syn_bits_t *b, uint32_t code, int len)
+{
+    b->acc = (b->acc << len) | (code & ((1u << len) - 1));
+    b->nbits += len;
+    while (b->nbits >= 8)
+    {
+        uint8_t byte = b->acc >> (b->nbits - 8);
+        b->nbits -= 8;
+        put_byte(b, byte);
+        if (byte == 0xff)
+        {
+            put_byte(b, 0x00); // byte stuffing
+        }
+    }
+}
+
+static void put_marker(syn_bits_t *b, uint8_t marker, uint16_t length)
+{
+    put_byte(b, 0xff);
+    put_byte(b, marker);
+    if (length)
+    {
+        put_byte(b, length >> 8);
+        put_byte(b, length & 0xff);
+    }
+}
+
+static void put_dc(syn_cam_t *syn, syn_bits_t *b, int table, int diff)
+{
+    int magnitude = diff < 0 ? -diff : diff;
+    int cat = 0;
+    while (magnitude >> cat)
+    {
+        cat++;
+    }
+    put_bits(b, syn->dc_code[table][cat], syn->dc_size[table][cat]);
+    if (cat)
+    {
+        put_bits(b, diff < 0 ? diff + (1 << cat) - 1 : diff, cat);
+    }
+    put_bits(b, syn->ac_code[table][0x00], syn->ac_size[table][0x00]); // EOB: no AC energy
+}
+
+/**
+ * @brief Encodes a baseline 4:2:2 JPEG whose blocks only carry DC energy: a moving
+ * diagonal luma gradient in 8x8 steps. Like most UVC cameras it leaves out the DHT
+ * segment and relies on the standard Huffman tables.
+ */
+static uint32_t fill_mjpeg(syn_cam_t *syn, uint8_t *dst, size_t cap)
+{
+    syn_bits_t b = {dst, 0, cap, 0, 0};
+
+    put_marker(&b, 0xd8, 0); // SOI
+
+    put_marker(&b, 0xdb, 2 + 2 * 65); // DQT
+    put_byte(&b, 0x00);
+    for (int i = 0; i < 64; i++)
+        put_byte(&b, acam_std_quant_luma[acam_jpeg_zigzag[i]]);
+    put_byte(&b, 0x01);
+    for (int i = 0; i < 64; i++)
+        put_byte(&b, acam_std_quant_chroma[acam_jpeg_zigzag[i]]);
+
+    put_marker(&b, 0xc0, 17); // SOF0
+    put_byte(&b, 8);
+    put_byte(&b, syn->height >> 8);
+    put_byte(&b, syn->height & 0xff);
+    put_byte(&b, syn->width >> 8);
+    put_byte(&b, syn->width & 0xff);
+    put_byte(&b, 3);
+    put_byte(&b, 1), put_byte(&b, 0x21), put_byte(&b, 0);
+    put_byte(&b, 2), put_byte(&b, 0x11), put_byte(&b, 1);
+    put_byte(&b, 3), put_byte(&b, 0x11), put_byte(&b, 1);
+
+    put_marker(&b, 0xda, 12); // SOS
+    put_byte(&b, 3);
+    put_byte(&b, 1), put_byte(&b, 0x00);
+    put_byte(&b, 2), put_byte(&b, 0x11);
+    put_byte(&b, 3), put_byte(&b, 0x11);
+    put_byte(&b, 0), put_byte(&b, 63), put_byte(&b, 0);
+
+    uint32_t mcu_cols = (syn->width + 15) / 16;
+    uint32_t mcu_rows = (syn->height + 7) / 8;
+    int pred = 0;
+    for (uint32_t my = 0; my < mcu_rows; my++)
+    {
+        for (uint32_t mx = 0; mx < mcu_cols; mx++)
+        {
+            for (uint32_t k = 0; k < 2; k++)
+            {
+                int level = ((mx * 2 + k + my + syn->frame_no) * 8) & 0xff;
+                int dc = (level - 128) * 8 / acam_std_quant_luma[0];
+                put_dc(syn, &b, 0, dc - pred);
+                pred = dc;
+            }
+            put_dc(syn, &b, 1, 0); // Cb and Cr stay neutral
+            put_dc(syn, &b, 1, 0);
+        }
+    }
+    if (b.nbits)
+    {
+        put_bits(&b, 0x7f, 8 - b.nbits); // pad the last byte with 1-bits
+    }
+    put_marker(&b, 0xd9, 0); // EOI
+
+    return b.pos <= cap ? b.pos : 0;
+}
+
+static void arm_timer(syn_cam_t *syn, uint64_t abs_ns)
+{
+    struct itimerspec its = {0};
+    its.it_value.tv_sec = abs_ns / 1000000000ull;
+    its.it_value.tv_nsec = abs_ns % 1000000000ull;
+    timerfd_settime(syn->fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/**
+ * @brief Moves the fake's clock forward: every frame that became due since the
+ * last call is captured into the next queued buffer, or dropped when no buffer is
+ * queued (leaving a gap in the sequence numbers, as a real device does).
+ * Rearms the timerfd so the fd is readable exactly while a frame is waiting.
+ */
+static void advance(syn_cam_t *syn)
+{
+    uint64_t expirations;
+    while (read(syn->fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+    {
+    }
+    if (!syn->streaming)
+    {
+        return;
+    }
+
+    uint64_t period = 1000000000ull / syn->fps;
+    uint64_t now = now_ns();
+    if (now > syn->nominal_ns + 64 * period)
+    {
+        // we were not polled for a long time: account for the frames we missed in one step
+        uint64_t missed = (now - syn->nominal_ns) / period - 1;
+        syn->nominal_ns += missed * period;
+        syn->due_ns = syn->nominal_ns;
+        syn->sequence += missed;
+        syn->frame_no += missed;
+    }
+
+    while (syn->due_ns <= now)
+    {
+        if (syn->queue_len > 0)
+        {
+            unsigned int index = syn->queue[syn->queue_head];
+            syn->queue_head = (syn->queue_head + 1) % SYN_MAX_BUFFERS;
+            syn->queue_len--;
+
+            syn_buf_t *buf = &syn->bufs[index];
+            if (syn->pixelformat == V4L2_PIX_FMT_YUYV)
+                buf->bytesused = fill_yuyv(syn, buf->map, buf->length);
+            else
+                buf->bytesused = fill_mjpeg(syn, buf->map, buf->length);
+            buf->sequence = syn->sequence;
+            buf->timestamp.tv_sec = syn->due_ns / 1000000000ull;
+            buf->timestamp.tv_usec = (syn->due_ns % 1000000000ull) / 1000;
+            buf->queued = 0;
+            buf->done = 1;
+
+            syn->done[(syn->done_head + syn->done_len) % SYN_MAX_BUFFERS] = index;
+            syn->done_len++;
+        }
+        syn->sequence++;
+        syn->frame_no++;
+        syn->nominal_ns += period;
+        syn->due_ns = syn->nominal_ns;
+        if (syn->jitter_us)
+        {
+            syn->due_ns += (next_random(syn) % (syn->jitter_us + 1)) * 1000ull;
+        }
+    }
+
+    arm_timer(syn, syn->done_len > 0 ? 1 : syn->due_ns);
+}
+
+static void free_buffers(syn_cam_t *syn)
+{
+    for (unsigned int i = 0; i < syn->count; i++)
+    {
+        if (syn->bufs[i].memfd != -1)
+        {
+            munmap(syn->bufs[i].map, syn->bufs[i].length);
+            close(syn->bufs[i].memfd);
+        }
+    }
+    memset(syn->bufs, 0, sizeof(syn->bufs));
+    syn->count = 0;
+    syn->queue_len = 0;
+    syn->done_len = 0;
+}
+
+static int alloc_buffers(syn_cam_t *syn, unsigned int count)
+{
+    for (unsigned int i = 0; i < count; i++)
+    {
+        syn_buf_t *buf = &syn->bufs[i];
+        buf->length = sizeimage(syn);
+        if (syn->memory == V4L2_MEMORY_USERPTR)
+        {
+            // the memory arrives with each QBUF
+            buf->memfd = -1;
+            syn->count = i + 1;
+            continue;
+        }
+        buf->memfd = memfd_create("acam-synthetic", MFD_CLOEXEC);
+        if (buf->memfd == -1)
+        {
+            free_buffers(syn);
+            return -1;
+        }
+        syn->count = i + 1;
+        if (-1 == ftruncate(buf->memfd, buf->length))
+        {
+            free_buffers(syn);
+            return -1;
+        }
+        buf->map = mmap(NULL, buf->length, PROT_READ | PROT_WRITE, MAP_SHARED, buf->memfd, 0);
+        if (buf->map == MAP_FAILED)
+        {
+            buf->map = NULL;
+            free_buffers(syn);
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void fill_pix_format(const syn_cam_t *syn, struct v4l2_pix_format *pix)
+{
+    pix->width = syn->width;
+    pix->height = syn->height;
+    pix->pixelformat = syn->pixelformat;
+    pix->field = V4L2_FIELD_NONE;
+    pix->bytesperline = syn->pixelformat == V4L2_PIX_FMT_YUYV ? syn->width * 2 : 0;
+    pix->sizeimage = sizeimage(syn);
+    pix->colorspace = syn->pixelformat == V4L2_PIX_FMT_YUYV ? V4L2_COLORSPACE_SRGB : V4L2_COLORSPACE_JPEG;
+}
+
+/**
+ * @brief Snaps a requested format to the closest mode the fake supports, the way
+ * uvcvideo does for S_FMT and TRY_FMT.
+ */
+static void try_format(const struct v4l2_pix_format *pix, syn_cam_t *out)
+{
+    out->pixelformat = V4L2_PIX_FMT_MJPEG;
+    for (unsigned int i = 0; i < SYN_PIX_COUNT; i++)
+    {
+        if (syn_pix[i].pixelformat == pix->pixelformat)
+            out->pixelformat = pix->pixelformat;
+    }
+
+    unsigned int best = 0;
+    long best_diff = -1;
+    for (unsigned int i = 0; i < SYN_SIZE_COUNT; i++)
+    {
+        long dw = (long)syn_sizes[i].width - pix->width;
+        long dh = (long)syn_sizes[i].height - pix->height;
+        long diff = labs(dw) + labs(dh);
+        if (best_diff < 0 || diff < best_diff)
+        {
+            best = i;
+            best_diff = diff;
+        }
+    }
+    out->width = syn_sizes[best].width;
+    out->height = syn_sizes[best].height;
+}
+
+/**
+ * @brief Gets the @param index th frame rate the fake offers, fastest first: the
+ * configured rate followed by the slower entries of syn_rates.
+ *
+ * @return the rate, 0 past the end of the list.
+ */
+static unsigned int frame_rate(const syn_cam_t *syn, unsigned int index)
+{
+    if (index == 0)
+        return syn->max_fps;
+    for (unsigned int i = 0; i < SYN_RATE_COUNT; i++)
+    {
+        if (syn_rates[i] < syn->max_fps && --index == 0)
+            return syn_rates[i];
+    }
+    return 0;
+}
+
+static int valid_pixelformat(uint32_t pixelformat)
+{
+    for (unsigned int i = 0; i < SYN_PIX_COUNT; i++)
+    {
+        if (syn_pix[i].pixelformat == pixelformat)
+            return 1;
+    }
+    return 0;
+}
+
+static int valid_size(uint32_t width, uint32_t height)
+{
+    for (unsigned int i = 0; i < SYN_SIZE_COUNT; i++)
+    {
+        if (syn_sizes[i].width == width && syn_sizes[i].height == height)
+            return 1;
+    }
+    return 0;
+}
+
+static int syn_enum_framesizes(struct v4l2_frmsizeenum *size)
+{
+    if (!valid_pixelformat(size->pixel_format) || size->index >= SYN_SIZE_COUNT)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    size->type = V4L2_FRMSIZE_TYPE_DISCRETE;
+    size->discrete.width = syn_sizes[size->index].width;
+    size->discrete.height = syn_sizes[size->index].height;
+    return 0;
+}
+
+static int syn_enum_frameintervals(syn_cam_t *syn, struct v4l2_frmivalenum *ival)
+{
+    unsigned int rate = frame_rate(syn, ival->index);
+    if (!valid_pixelformat(ival->pixel_format) || !valid_size(ival->width, ival->height) || rate == 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    ival->type = V4L2_FRMIVAL_TYPE_DISCRETE;
+    ival->discrete.numerator = 1;
+    ival->discrete.denominator = rate;
+    return 0;
+}
+
+/**
+ * @brief Answers G_PARM and S_PARM. S_PARM snaps the requested interval to the
+ * closest offered rate, as uvcvideo does, and reports the rate it selected.
+ */
+static int syn_parm(syn_cam_t *syn, unsigned long request, struct v4l2_streamparm *parm)
+{
+    if (parm->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (request == VIDIOC_S_PARM)
+    {
+        const struct v4l2_fract *tpf = &parm->parm.capture.timeperframe;
+        if (tpf->numerator == 0 || tpf->denominator == 0)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        // distances to the wanted rate, scaled by the numerator to stay in integers
+        unsigned int best = syn->max_fps;
+        long long best_diff = llabs((long long)best * tpf->numerator - tpf->denominator);
+        for (unsigned int i = 1, rate; (rate = frame_rate(syn, i)) != 0; i++)
+        {
+            long long diff = llabs((long long)rate * tpf->numerator - tpf->denominator);
+            if (diff < best_diff)
+            {
+                best = rate;
+                best_diff = diff;
+            }
+        }
+        syn->fps = best;
+    }
+    memset(&parm->parm.capture, 0, sizeof(parm->parm.capture));
+    parm->parm.capture.capability = V4L2_CAP_TIMEPERFRAME;
+    parm->parm.capture.timeperframe.numerator = 1;
+    parm->parm.capture.timeperframe.denominator = syn->fps;
+    parm->parm.capture.readbuffers = 0;
+    return 0;
+}
+
+static int syn_querycap(syn_cam_t *syn, struct v4l2_capability *cap)
+{
+    memset(cap, 0, sizeof(*cap));
+    strcpy((char *)cap->driver, "acam_synthetic");
+    strcpy((char *)cap->card, "Arducam UB0212 (synthetic)");
+    snprintf((char *)cap->bus_info, sizeof(cap->bus_info), "%s", syn->bus_info);
+    cap->version = 0x00060100;
+    cap->device_caps = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING;
+    cap->capabilities = cap->device_caps | V4L2_CAP_DEVICE_CAPS;
+    return 0;
+}
+
+static int syn_queryctrl(syn_cam_t *syn, struct v4l2_queryctrl *query)
+{
+    const syn_ctrl_info_t *info = NULL;
+    int index;
+    if (query->id & V4L2_CTRL_FLAG_NEXT_CTRL)
+    {
+        uint32_t after = query->id & ~V4L2_CTRL_FLAG_NEXT_CTRL;
+        for (unsigned int i = 0; i < SYN_CTRL_COUNT; i++)
+        {
+            if (syn_ctrls[i].id > after && (info == NULL || syn_ctrls[i].id < info->id))
+            {
+                info = &syn_ctrls[i];
+            }
+        }
+    }
+    else
+    {
+        info = find_ctrl(query->id, &index);
+    }
+    if (info == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(query, 0, sizeof(*query));
+    query->id = info->id;
+    query->type = info->type;
+    strncpy((char *)query->name, info->name, sizeof(query->name) - 1);
+    query->minimum = info->min_value;
+    query->maximum = info->max_value;
+    query->step = 1;
+    query->default_value = info->default_val;
+    if (ctrl_inactive(syn, info->id))
+        query->flags |= V4L2_CTRL_FLAG_INACTIVE;
+    return 0;
+}
+
+static int syn_g_ctrl(syn_cam_t *syn, struct v4l2_control *control)
+{
+    int index;
+    if (find_ctrl(control->id, &index) == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    control->value = syn->ctrl_values[index];
+    return 0;
+}
+
+static int syn_s_ctrl(syn_cam_t *syn, struct v4l2_control *control)
+{
+    int index;
+    const syn_ctrl_info_t *info = find_ctrl(control->id, &index);
+    if (info == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (ctrl_inactive(syn, info->id))
+    {
+        errno = EACCES; // the device refuses manual values while the auto mode owns them
+        return -1;
+    }
+    int value = control->value;
+    if (value < info->min_value)
+        value = info->min_value;
+    if (value > info->max_value)
+        value = info->max_value;
+    syn->ctrl_values[index] = value;
+    return 0;
+}
+
+/**
+ * @brief Handles G/S/TRY_EXT_CTRLS. Like uvcvideo, a write is applied as one
+ * transaction: the controls are set in order, and the values saved beforehand are
+ * put back if any of them fails, or after a TRY.
+ */
+static int syn_ext_ctrls(syn_cam_t *syn, unsigned long request, struct v4l2_ext_controls *batch)
+{
+    if (batch->which != V4L2_CTRL_WHICH_CUR_VAL && batch->which != V4L2_CTRL_CLASS_USER &&
+        batch->which != V4L2_CTRL_CLASS_CAMERA)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int saved[SYN_CTRL_COUNT];
+    memcpy(saved, syn->ctrl_values, sizeof(saved));
+
+    int ret = 0;
+    for (unsigned int i = 0; i < batch->count; i++)
+    {
+        struct v4l2_control control = {batch->controls[i].id, batch->controls[i].value};
+        ret = request == VIDIOC_G_EXT_CTRLS ? syn_g_ctrl(syn, &control) : syn_s_ctrl(syn, &control);
+        if (ret != 0)
+        {
+            batch->error_idx = i;
+            break;
+        }
+        if (request == VIDIOC_G_EXT_CTRLS)
+        {
+            batch->controls[i].value = control.value;
+        }
+    }
+    if (ret != 0 || request == VIDIOC_TRY_EXT_CTRLS)
+    {
+        memcpy(syn->ctrl_values, saved, sizeof(saved));
+    }
+
+    return ret;
+}
+
+static int syn_format(syn_cam_t *syn, unsigned long request, struct v4l2_format *fmt)
+{
+    if (fmt->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (request == VIDIOC_G_FMT)
+    {
+        fill_pix_format(syn, &fmt->fmt.pix);
+        return 0;
+    }
+
+    syn_cam_t snapped = *syn;
+    try_format(&fmt->fmt.pix, &snapped);
+    if (request == VIDIOC_S_FMT)
+    {
+        if (syn->count > 0 && (snapped.width != syn->width || snapped.height != syn->height ||
+                               snapped.pixelformat != syn->pixelformat))
+        {
+            errno = EBUSY; // buffers are allocated for the current format
+            return -1;
+        }
+        syn->width = snapped.width;
+        syn->height = snapped.height;
+        syn->pixelformat = snapped.pixelformat;
+    }
+    fill_pix_format(&snapped, &fmt->fmt.pix);
+    return 0;
+}
+
+static int syn_reqbufs(syn_cam_t *syn, struct v4l2_requestbuffers *req)
+{
+    if (req->type != V4L2_BUF_TYPE_VIDEO_CAPTURE || (req->memory != V4L2_MEMORY_MMAP && req->memory != V4L2_MEMORY_USERPTR))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (syn->streaming)
+    {
+        errno = EBUSY;
+        return -1;
+    }
+    free_buffers(syn);
+    syn->memory = req->memory;
+    if (req->count > SYN_MAX_BUFFERS)
+    {
+        req->count = SYN_MAX_BUFFERS;
+    }
+    if (req->count == 0)
+    {
+        return 0;
+    }
+    return alloc_buffers(syn, req->count);
+}
+
+static void fill_v4l2_buffer(const syn_cam_t *syn, unsigned int index, struct v4l2_buffer *buf)
+{
+    const syn_buf_t *sb = &syn->bufs[index];
+    buf->index = index;
+    buf->length = sb->length;
+    buf->memory = syn->memory;
+    if (syn->memory == V4L2_MEMORY_USERPTR)
+        buf->m.userptr = (unsigned long)sb->map;
+    else
+        buf->m.offset = index * getpagesize();
+    buf->bytesused = sb->bytesused;
+    buf->sequence = sb->sequence;
+    buf->timestamp = sb->timestamp;
+    buf->field = V4L2_FIELD_NONE;
+    buf->flags = V4L2_BUF_FLAG_MAPPED | V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+    if (sb->queued)
+        buf->flags |= V4L2_BUF_FLAG_QUEUED;
+    if (sb->done)
+        buf->flags |= V4L2_BUF_FLAG_DONE;
+}
+
+static int syn_querybuf(syn_cam_t *syn, struct v4l2_buffer *buf)
+{
+    if (buf->index >= syn->count)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    fill_v4l2_buffer(syn, buf->index, buf);
+    return 0;
+}
+
+static int syn_qbuf(syn_cam_t *syn, struct v4l2_buffer *buf)
+{
+    if (buf->index >= syn->count || syn->bufs[buf->index].queued || syn->bufs[buf->index].done || buf->memory != syn->memory)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (syn->memory == V4L2_MEMORY_USERPTR)
+    {
+        // like the kernel, reject user memory that cannot hold a frame
+        if (buf->m.userptr == 0 || buf->length < sizeimage(syn))
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        syn->bufs[buf->index].map = (void *)buf->m.userptr;
+        syn->bufs[buf->index].length = buf->length;
+    }
+    syn->bufs[buf->index].queued = 1;
+    syn->bufs[buf->index].bytesused = 0;
+    syn->queue[(syn->queue_head + syn->queue_len) % SYN_MAX_BUFFERS] = buf->index;
+    syn->queue_len++;
+    fill_v4l2_buffer(syn, buf->index, buf);
+    return 0;
+}
+
+/**
+ * @brief Exports a buffer. The fake's buffers are memfds, which behave like a
+ * DMABUF for every consumer that maps them or passes them between processes.
+ */
+static int syn_expbuf(syn_cam_t *syn, struct v4l2_exportbuffer *expbuf)
+{
+    if (expbuf->index >= syn->count || syn->memory != V4L2_MEMORY_MMAP)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    int fd = fcntl(syn->bufs[expbuf->index].memfd, (expbuf->flags & O_CLOEXEC) ? F_DUPFD_CLOEXEC : F_DUPFD, 0);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    expbuf->fd = fd;
+    return 0;
+}
+
+static int syn_dqbuf(syn_cam_t *syn, struct v4l2_buffer *buf)
+{
+    if (!syn->streaming)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (syn->fail_after != 0 && syn->dequeued >= syn->fail_after)
+    {
+        errno = ENODEV;
+        return -1;
+    }
+    advance(syn);
+    if (syn->done_len == 0)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    unsigned int index = syn->done[syn->done_head];
+    syn->done_head = (syn->done_head + 1) % SYN_MAX_BUFFERS;
+    syn->done_len--;
+    syn->dequeued++;
+    syn->bufs[index].done = 0;
+    fill_v4l2_buffer(syn, index, buf);
+    advance(syn);
+    return 0;
+}
+
+static int syn_streamon(syn_cam_t *syn)
+{
+    if (syn->count == 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!syn->streaming)
+    {
+        syn->streaming = 1;
+        syn->nominal_ns = now_ns() + 1000000000ull / syn->fps;
+        syn->due_ns = syn->nominal_ns;
+        advance(syn);
+    }
+    return 0;
+}
+
+static int syn_streamoff(syn_cam_t *syn)
+{
+    syn->streaming = 0;
+    for (unsigned int i = 0; i < syn->count; i++)
+    {
+        syn->bufs[i].queued = 0;
+        syn->bufs[i].done = 0;
+    }
+    syn->queue_len = 0;
+    syn->done_len = 0;
+    arm_timer(syn, 0);
+    return 0;
+}
+
+static int syn_ioctl(void *ctx, int fd, unsigned long request, void *arg)
+{
+    syn_cam_t *syn = ctx;
+    (void)fd;
+    int ret;
+
+    pthread_mutex_lock(&syn->lock);
+    switch (request)
+    {
+    case VIDIOC_QUERYCAP:
+        ret = syn_querycap(syn, arg);
+        break;
+    case VIDIOC_QUERYCTRL:
+        ret = syn_queryctrl(syn, arg);
+        break;
+    case VIDIOC_G_CTRL:
+        ret = syn_g_ctrl(syn, arg);
+        break;
+    case VIDIOC_S_CTRL:
+        ret = syn_s_ctrl(syn, arg);
+        break;
+    case VIDIOC_G_EXT_CTRLS:
+    case VIDIOC_S_EXT_CTRLS:
+    case VIDIOC_TRY_EXT_CTRLS:
+        ret = syn_ext_ctrls(syn, request, arg);
+        break;
+    case VIDIOC_G_FMT:
+    case VIDIOC_S_FMT:
+    case VIDIOC_TRY_FMT:
+        ret = syn_format(syn, request, arg);
+        break;
+    case VIDIOC_ENUM_FMT:
+    {
+        struct v4l2_fmtdesc *desc = arg;
+        if (desc->index >= SYN_PIX_COUNT)
+        {
+            errno = EINVAL;
+            ret = -1;
+            break;
+        }
+        desc->pixelformat = syn_pix[desc->index].pixelformat;
+        desc->flags = syn_pix[desc->index].flags;
+        strncpy((char *)desc->description, syn_pix[desc->index].description, sizeof(desc->description) - 1);
+        ret = 0;
+        break;
+    }
+    case VIDIOC_ENUM_FRAMESIZES:
+        ret = syn_enum_framesizes(arg);
+        break;
+    case VIDIOC_ENUM_FRAMEINTERVALS:
+        ret = syn_enum_frameintervals(syn, arg);
+        break;
+    case VIDIOC_G_PARM:
+    case VIDIOC_S_PARM:
+        ret = syn_parm(syn, request, arg);
+        break;
+    case VIDIOC_CROPCAP:
+    {
+        struct v4l2_cropcap *cropcap = arg;
+        cropcap->bounds.left = cropcap->bounds.top = 0;
+        cropcap->bounds.width = syn->width;
+        cropcap->bounds.height = syn->height;
+        cropcap->defrect = cropcap->bounds;
+        cropcap->pixelaspect.numerator = 1;
+        cropcap->pixelaspect.denominator = 1;
+        ret = 0;
+        break;
+    }
+    case VIDIOC_REQBUFS:
+        ret = syn_reqbufs(syn, arg);
+        break;
+    case VIDIOC_QUERYBUF:
+        ret = syn_querybuf(syn, arg);
+        break;
+    case VIDIOC_QBUF:
+        ret = syn_qbuf(syn, arg);
+        break;
+    case VIDIOC_DQBUF:
+        ret = syn_dqbuf(syn, arg);
+        break;
+    case VIDIOC_EXPBUF:
+        ret = syn_expbuf(syn, arg);
+        break;
+    case VIDIOC_STREAMON:
+        ret = syn_streamon(syn);
+        break;
+    case VIDIOC_STREAMOFF:
+        ret = syn_streamoff(syn);
+        break;
+    default:
+        errno = ENOTTY;
+        ret = -1;
+        break;
+    }
+    pthread_mutex_unlock(&syn->lock);
+
+    return ret;
+}
+
+/**
+ * @brief Parses the "key=value,..." options following ACAM_SYNTHETIC_PREFIX.
+ */
+static int parse_options(syn_cam_t *syn, const char *cam_file)
+{
+    const char *opts = strchr(cam_file, ':');
+    while (opts != NULL && *opts != '\0')
+    {
+        opts++;
+        char key[32] = {0};
+        unsigned long value;
+        int consumed = 0;
+        if (sscanf(opts, "%31[^=]=%lu%n", key, &value, &consumed) != 2)
+        {
+            return -1;
+        }
+        if (strcmp(key, "fps") == 0 && value > 0)
+            syn->max_fps = value;
+        else if (strcmp(key, "jitter_us") == 0)
+            syn->jitter_us = value;
+        else if (strcmp(key, "seed") == 0 && value != 0)
+            syn->rng = value;
+        else if (strcmp(key, "fail_after") == 0)
+            syn->fail_after = value;
+        else
+            return -1;
+        opts += consumed;
+        if (*opts != ',' && *opts != '\0')
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int syn_open(const char *cam_file, int flags, void **ctx)
+{
+    (void)flags;
+    syn_cam_t *syn = calloc(1, sizeof(syn_cam_t));
+    if (syn == NULL)
+    {
+        return -1;
+    }
+    syn->max_fps = SYN_DEFAULT_FPS;
+    syn->memory = V4L2_MEMORY_MMAP;
+    syn->rng = 0x2545f491;
+    if (parse_options(syn, cam_file) != 0)
+    {
+        free(syn);
+        errno = EINVAL;
+        return -1;
+    }
+    syn->fps = syn->max_fps;
+    snprintf(syn->bus_info, sizeof(syn->bus_info), "%s", cam_file);
+
+    syn->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (syn->fd == -1)
+    {
+        free(syn);
+        return -1;
+    }
+    pthread_mutex_init(&syn->lock, NULL);
+
+    syn->pixelformat = V4L2_PIX_FMT_MJPEG;
+    syn->width = syn_sizes[0].width;
+    syn->height = syn_sizes[0].height;
+    for (unsigned int i = 0; i < SYN_CTRL_COUNT; i++)
+    {
+        syn->ctrl_values[i] = syn_ctrls[i].default_val;
+    }
+    build_codes(acam_std_dc_luma_bits, acam_std_dc_luma_vals, syn->dc_code[0], syn->dc_size[0]);
+    build_codes(acam_std_dc_chroma_bits, acam_std_dc_chroma_vals, syn->dc_code[1], syn->dc_size[1]);
+    build_codes(acam_std_ac_luma_bits, acam_std_ac_luma_vals, syn->ac_code[0], syn->ac_size[0]);
+    build_codes(acam_std_ac_chroma_bits, acam_std_ac_chroma_vals, syn->ac_code[1], syn->ac_size[1]);
+
+    *ctx = syn;
+    return syn->fd;
+}
+
+static int syn_close(void *ctx, int fd)
+{
+    syn_cam_t *syn = ctx;
+    (void)fd;
+    free_buffers(syn);
+    free(syn->line);
+    pthread_mutex_destroy(&syn->lock);
+    int ret = close(syn->fd);
+    free(syn);
+    return ret;
+}
+
+static void *syn_mmap(void *ctx, int fd, size_t length, int prot, int flags, off_t offset)
+{
+    syn_cam_t *syn = ctx;
+    (void)fd;
+    void *mem = MAP_FAILED;
+
+    pthread_mutex_lock(&syn->lock);
+    unsigned int index = offset / getpagesize();
+    if (index < syn->count && syn->memory == V4L2_MEMORY_MMAP && length <= syn->bufs[index].length)
+    {
+        mem = mmap(NULL, length, prot, flags, syn->bufs[index].memfd, 0);
+    }
+    else
+    {
+        errno = EINVAL;
+    }
+    pthread_mutex_unlock(&syn->lock);
+
+    return mem;
+}
+
+static int syn_poll(void *ctx, int fd, int timeout_ms)
+{
+    (void)ctx;
+    struct pollfd pfd = {0};
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, timeout_ms);
+}
+
+const acam_backend_t acam_synthetic_backend = {
+    "synthetic",
+    syn_open,
+    syn_close,
+    syn_ioctl,
+    syn_mmap,
+    syn_poll,
+};
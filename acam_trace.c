@@ -0,0 +1,294 @@
+#include "acam_trace.h"
+
+/**
+ * @brief Device call instrumentation. While ACAM_TRACE_COUNTERS is set, every ioctl,
+ * mmap and poll the library makes is timed on CLOCK_MONOTONIC and added to the counters
+ * of its request code: calls, failures, EINTR restarts, total and maximum time and a
+ * power-of-two latency histogram. The counters are a static table indexed by the
+ * ioctl number and updated with relaxed atomic adds, so any number of cameras and
+ * threads can be traced at once without locks. While ACAM_TRACE_EVENTS is set, every
+ * call is also handed to a user callback.
+ *
+ * The table has one entry per ioctl number of the V4L2 ('V') type, one shared by every
+ * other ioctl (UVC extension units and such), one for mmap and one for poll.
+ *
+ */
+
+#define TRACE_OTHER 256
+#define TRACE_MMAP 257
+#define TRACE_POLL 258
+
+int acam_trace_flags;
+
+typedef struct
+{
+    unsigned long request;
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t retries;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t histogram[ACAM_TRACE_BUCKETS];
+} trace_counters_t;
+
+static trace_counters_t counters[ACAM_TRACE_MAX_ENTRIES];
+static acam_trace_cb_t trace_callback;
+static void *trace_user;
+
+/**
+ * @brief Names of the requests the library makes, for snapshots.
+ *
+ */
+static const struct
+{
+    unsigned long request;
+    const char *name;
+} request_names[] = {
+    {VIDIOC_QUERYCAP, "VIDIOC_QUERYCAP"},
+    {VIDIOC_ENUM_FMT, "VIDIOC_ENUM_FMT"},
+    {VIDIOC_G_FMT, "VIDIOC_G_FMT"},
+    {VIDIOC_S_FMT, "VIDIOC_S_FMT"},
+    {VIDIOC_REQBUFS, "VIDIOC_REQBUFS"},
+    {VIDIOC_QUERYBUF, "VIDIOC_QUERYBUF"},
+    {VIDIOC_QBUF, "VIDIOC_QBUF"},
+    {VIDIOC_EXPBUF, "VIDIOC_EXPBUF"},
+    {VIDIOC_DQBUF, "VIDIOC_DQBUF"},
+    {VIDIOC_STREAMON, "VIDIOC_STREAMON"},
+    {VIDIOC_STREAMOFF, "VIDIOC_STREAMOFF"},
+    {VIDIOC_G_PARM, "VIDIOC_G_PARM"},
+    {VIDIOC_S_PARM, "VIDIOC_S_PARM"},
+    {VIDIOC_G_CTRL, "VIDIOC_G_CTRL"},
+    {VIDIOC_S_CTRL, "VIDIOC_S_CTRL"},
+    {VIDIOC_QUERYCTRL, "VIDIOC_QUERYCTRL"},
+    {VIDIOC_QUERYMENU, "VIDIOC_QUERYMENU"},
+    {VIDIOC_CROPCAP, "VIDIOC_CROPCAP"},
+    {VIDIOC_G_EXT_CTRLS, "VIDIOC_G_EXT_CTRLS"},
+    {VIDIOC_S_EXT_CTRLS, "VIDIOC_S_EXT_CTRLS"},
+    {VIDIOC_ENUM_FRAMESIZES, "VIDIOC_ENUM_FRAMESIZES"},
+    {VIDIOC_ENUM_FRAMEINTERVALS, "VIDIOC_ENUM_FRAMEINTERVALS"},
+    {VIDIOC_QUERY_EXT_CTRL, "VIDIOC_QUERY_EXT_CTRL"},
+};
+#define REQUEST_NAME_COUNT (sizeof(request_names) / sizeof(request_names[0]))
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static unsigned int entry_index(unsigned long request)
+{
+    return _IOC_TYPE(request) == 'V' ? _IOC_NR(request) : TRACE_OTHER;
+}
+
+/**
+ * @brief Adds a finished call to the counters and hands it to the callback.
+ */
+static void record(unsigned int index, acam_trace_kind_t kind, unsigned long request, const acam_camera_t *cam, int result,
+                   int error, unsigned int retries, uint64_t start_ns)
+{
+    uint64_t duration_ns = monotonic_ns() - start_ns;
+    int flags = __atomic_load_n(&acam_trace_flags, __ATOMIC_RELAXED);
+
+    if (flags & ACAM_TRACE_COUNTERS)
+    {
+        trace_counters_t *c = &counters[index];
+        __atomic_store_n(&c->request, request, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&c->calls, 1, __ATOMIC_RELAXED);
+        if (error != 0)
+            __atomic_add_fetch(&c->errors, 1, __ATOMIC_RELAXED);
+        if (retries != 0)
+            __atomic_add_fetch(&c->retries, retries, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&c->total_ns, duration_ns, __ATOMIC_RELAXED);
+
+        uint64_t max = __atomic_load_n(&c->max_ns, __ATOMIC_RELAXED);
+        while (duration_ns > max &&
+               !__atomic_compare_exchange_n(&c->max_ns, &max, duration_ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            ;
+
+        uint64_t us = duration_ns / 1000;
+        unsigned int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+        if (bucket >= ACAM_TRACE_BUCKETS)
+            bucket = ACAM_TRACE_BUCKETS - 1;
+        __atomic_add_fetch(&c->histogram[bucket], 1, __ATOMIC_RELAXED);
+    }
+
+    if (flags & ACAM_TRACE_EVENTS)
+    {
+        acam_trace_cb_t callback = __atomic_load_n(&trace_callback, __ATOMIC_ACQUIRE);
+        if (callback != NULL)
+        {
+            acam_trace_event_t event = {kind, request, cam, result, error, retries, start_ns, duration_ns};
+            callback(&event, trace_user);
+        }
+    }
+}
+
+/**
+ * @brief The instrumented version of xioctl: performs an ioctl through the camera's
+ * backend until definitive success or failure, and records it.
+ *
+ * @return 0 on success, -1 on failure with errno set by the ioctl.
+ */
+int acam_trace_ioctl(const acam_camera_t *cam, unsigned long request, void *arg)
+{
+    uint64_t start_ns = monotonic_ns();
+    unsigned int retries = 0;
+    int r;
+    while (-1 == (r = cam->backend->ioctl(cam->backend_ctx, cam->fd, request, arg)) && EINTR == errno)
+    {
+        retries++;
+    }
+    int error = r == -1 ? errno : 0;
+
+    record(entry_index(request), ACAM_TRACE_IOCTL, request, cam, r, error, retries, start_ns);
+    errno = error;
+    return r;
+}
+
+/**
+ * @brief Maps a buffer of the camera through its backend and records the call.
+ *
+ * @return the mapping, MAP_FAILED on failure with errno set.
+ */
+void *acam_trace_mmap(const acam_camera_t *cam, size_t length, int prot, int flags, off_t offset)
+{
+    uint64_t start_ns = monotonic_ns();
+    void *mem = cam->backend->mmap(cam->backend_ctx, cam->fd, length, prot, flags, offset);
+    int error = mem == MAP_FAILED ? errno : 0;
+
+    record(TRACE_MMAP, ACAM_TRACE_MMAP, 0, cam, mem == MAP_FAILED ? -1 : 0, error, 0, start_ns);
+    errno = error;
+    return mem;
+}
+
+/**
+ * @brief The instrumented version of wait_for_frame: waits for a filled buffer through
+ * the camera's backend, restarting on EINTR, and records the wait.
+ *
+ * @return >0 when a frame is ready, 0 on timeout, -1 on failure with errno set.
+ */
+int acam_trace_poll(const acam_camera_t *cam, int timeout_ms)
+{
+    uint64_t start_ns = monotonic_ns();
+    unsigned int retries = 0;
+    int r;
+    while (-1 == (r = cam->backend->poll(cam->backend_ctx, cam->fd, timeout_ms)) && EINTR == errno)
+    {
+        retries++;
+    }
+    int error = r == -1 ? errno : 0;
+
+    record(TRACE_POLL, ACAM_TRACE_POLL, 0, cam, r, error, retries, start_ns);
+    errno = error;
+    return r;
+}
+
+/**
+ * @brief Turns the instrumentation of ioctl, mmap and poll calls on or off, for every
+ * camera of the process. Counters keep their values while it is off.
+ *
+ * @param flags ACAM_TRACE_COUNTERS and/or ACAM_TRACE_EVENTS, 0 to turn it off.
+ * @return exit status. 0 on success, EINVAL for unknown flags, ENOTSUP if the library
+ * was built with ACAM_NO_TRACE.
+ */
+int acam_trace_set_flags(int flags)
+{
+#ifdef ACAM_NO_TRACE
+    return flags == 0 ? 0 : ENOTSUP;
+#else
+    if (flags & ~(ACAM_TRACE_COUNTERS | ACAM_TRACE_EVENTS))
+    {
+        return EINVAL;
+    }
+    __atomic_store_n(&acam_trace_flags, flags, __ATOMIC_RELEASE);
+    return 0;
+#endif
+}
+
+/**
+ * @brief Sets the function that receives every traced call while ACAM_TRACE_EVENTS is
+ * set. It runs on the thread that made the call, right after it, so it must be quick.
+ *
+ * @param callback the function, NULL for none.
+ * @param user passed to @param callback unchanged.
+ * @return exit status. 0 on success, EBUSY if ACAM_TRACE_EVENTS is set: the callback
+ * can only be changed while events are off.
+ */
+int acam_trace_set_callback(acam_trace_cb_t callback, void *user)
+{
+    if (__atomic_load_n(&acam_trace_flags, __ATOMIC_ACQUIRE) & ACAM_TRACE_EVENTS)
+    {
+        return EBUSY;
+    }
+    trace_user = user;
+    __atomic_store_n(&trace_callback, callback, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * @brief Copies the counters of every request code, mmap and poll that has been called
+ * since the counters were last reset. Each counter is read atomically, but calls that
+ * finish during the snapshot may be counted in some fields and not yet in others.
+ *
+ * @param entries filled with up to @param max entries, in order of ioctl number, then
+ * other ioctls, mmap and poll. ACAM_TRACE_MAX_ENTRIES entries always suffice.
+ * @param max the number of entries @param entries has room for.
+ * @return the number of entries filled.
+ */
+unsigned int acam_trace_snapshot(acam_trace_entry_t *entries, unsigned int max)
+{
+    assert(entries || max == 0);
+    unsigned int count = 0;
+    for (unsigned int i = 0; i < ACAM_TRACE_MAX_ENTRIES && count < max; i++)
+    {
+        trace_counters_t *c = &counters[i];
+        uint64_t calls = __atomic_load_n(&c->calls, __ATOMIC_RELAXED);
+        if (calls == 0)
+        {
+            continue;
+        }
+
+        acam_trace_entry_t *e = &entries[count++];
+        e->kind = i == TRACE_MMAP ? ACAM_TRACE_MMAP : i == TRACE_POLL ? ACAM_TRACE_POLL : ACAM_TRACE_IOCTL;
+        e->request = __atomic_load_n(&c->request, __ATOMIC_RELAXED);
+        e->name = i == TRACE_MMAP ? "mmap" : i == TRACE_POLL ? "poll" : "ioctl";
+        for (unsigned int n = 0; e->kind == ACAM_TRACE_IOCTL && i != TRACE_OTHER && n < REQUEST_NAME_COUNT; n++)
+        {
+            if (request_names[n].request == e->request)
+                e->name = request_names[n].name;
+        }
+        e->calls = calls;
+        e->errors = __atomic_load_n(&c->errors, __ATOMIC_RELAXED);
+        e->retries = __atomic_load_n(&c->retries, __ATOMIC_RELAXED);
+        e->total_ns = __atomic_load_n(&c->total_ns, __ATOMIC_RELAXED);
+        e->max_ns = __atomic_load_n(&c->max_ns, __ATOMIC_RELAXED);
+        for (unsigned int b = 0; b < ACAM_TRACE_BUCKETS; b++)
+        {
+            e->histogram[b] = __atomic_load_n(&c->histogram[b], __ATOMIC_RELAXED);
+        }
+    }
+    return count;
+}
+
+/**
+ * @brief Zeroes every instrumentation counter. Calls in flight may still be added to
+ * the counters being cleared.
+ */
+void acam_trace_reset(void)
+{
+    for (unsigned int i = 0; i < ACAM_TRACE_MAX_ENTRIES; i++)
+    {
+        trace_counters_t *c = &counters[i];
+        __atomic_store_n(&c->calls, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&c->errors, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&c->retries, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&c->total_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&c->max_ns, 0, __ATOMIC_RELAXED);
+        for (unsigned int b = 0; b < ACAM_TRACE_BUCKETS; b++)
+        {
+            __atomic_store_n(&c->histogram[b], 0, __ATOMIC_RELAXED);
+        }
+    }
+}
@@ -0,0 +1,27 @@
+#ifndef ACAM_TRACE
+#define ACAM_TRACE
+
+/**
+ * @brief Private header with the hooks through which acam_control.c reports device
+ * calls to the instrumentation in acam_trace.c. The call sites test acam_trace_flags
+ * once and only call into the traced versions while instrumentation is on, so the
+ * cost when it is off is one predictable branch. Building with ACAM_NO_TRACE removes
+ * the hooks altogether.
+ *
+ */
+
+#include "acam_control.h"
+
+extern int acam_trace_flags; //ACAM_TRACE_* flags in effect, 0 when instrumentation is off
+
+#ifndef ACAM_NO_TRACE
+#define ACAM_TRACING() __builtin_expect(__atomic_load_n(&acam_trace_flags, __ATOMIC_RELAXED) != 0, 0)
+#else
+#define ACAM_TRACING() 0
+#endif
+
+int acam_trace_ioctl(const acam_camera_t *cam, unsigned long request, void *arg); //xioctl with instrumentation
+void *acam_trace_mmap(const acam_camera_t *cam, size_t length, int prot, int flags, off_t offset); //backend mmap with instrumentation
+int acam_trace_poll(const acam_camera_t *cam, int timeout_ms); //wait_for_frame with instrumentation
+
+#endif
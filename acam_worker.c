@@ -0,0 +1,393 @@
+#define _GNU_SOURCE
+#include "acam_control.h"
+
+#include <pthread.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#ifndef NDEBUG
+#define DEBUG_PRINT fprintf
+#define DEBUG_PERROR perror
+#else
+#define DEBUG_PRINT
+#define DEBUG_PERROR
+#endif
+
+/**
+ * @brief Background capture worker. One thread per camera keeps dequeuing frames
+ * from the streaming ring and publishes them to consumers without locks:
+ *
+ * - ACAM_WORKER_KEEP_LATEST: a single-slot mailbox. The worker swaps each new frame
+ *   in with an atomic exchange and releases the frame it displaced, so a consumer
+ *   always takes the freshest frame and stale ones go straight back to the driver.
+ * - ACAM_WORKER_KEEP_ALL: a single-producer/single-consumer ring that holds every
+ *   frame in capture order. The ring has a slot for every buffer of the stream, so
+ *   it can never overflow; a slow consumer holds the buffers instead, the driver runs
+ *   out of buffers to fill and drops frames at the source (backpressure).
+ *
+ * Consumers only enter the kernel when there is nothing to take: they sleep on a
+ * futex that the worker bumps for every published frame.
+ *
+ */
+
+#define WORKER_POLL_MS 100 //how often the worker checks for a stop request while no frames arrive
+
+struct acam_worker
+{
+    acam_camera_t *cam;
+    acam_worker_policy_t policy;
+    pthread_t thread;
+    int started_stream; //1 if acam_worker_start turned streaming on and stop must turn it off
+    int stop;
+    int error; //errno that ended the worker thread, 0 while it runs
+
+    acam_frame_t *latest; //KEEP_LATEST mailbox, NULL when empty
+
+    acam_frame_t **queue; //KEEP_ALL ring, queue_mask + 1 slots
+    unsigned int queue_mask;
+    unsigned int head; //next slot the worker writes, only written by the worker
+    unsigned int tail; //next slot the consumer reads, only written by the consumer
+
+    int published; //futex word, bumped for every published frame
+    int waiters;   //consumers sleeping on published
+    int callers;   //consumers inside acam_worker_get_frame, waited for by acam_worker_stop
+
+    uint32_t last_sequence;
+    int have_sequence;
+    acam_worker_stats_t stats;
+};
+
+static int64_t monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void futex_wait(int *word, int expected, int timeout_ms)
+{
+    struct timespec ts, *tsp = NULL;
+    if (timeout_ms >= 0)
+    {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long)(timeout_ms % 1000) * 1000000;
+        tsp = &ts;
+    }
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, tsp, NULL, 0);
+}
+
+static void futex_wake_all(int *word)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/**
+ * @brief Makes a frame visible to consumers according to the worker's policy.
+ *
+ * @param worker the worker
+ * @param frame a frame the worker holds. Ownership passes to the mailbox or ring.
+ */
+static void publish(acam_worker_t *worker, acam_frame_t *frame)
+{
+    if (worker->policy == ACAM_WORKER_KEEP_LATEST)
+    {
+        acam_frame_t *stale = __atomic_exchange_n(&worker->latest, frame, __ATOMIC_ACQ_REL);
+        if (stale != NULL)
+        {
+            // nobody took the previous frame in time: hand its buffer back to the driver
+            __atomic_add_fetch(&worker->stats.dropped_stale, 1, __ATOMIC_RELAXED);
+            acam_frame_release(stale);
+        }
+    }
+    else
+    {
+        unsigned int head = worker->head;
+        worker->queue[head & worker->queue_mask] = frame;
+        __atomic_store_n(&worker->head, head + 1, __ATOMIC_RELEASE);
+
+        unsigned int depth = head + 1 - __atomic_load_n(&worker->tail, __ATOMIC_ACQUIRE);
+        if (depth > worker->stats.queue_high_water)
+        {
+            __atomic_store_n(&worker->stats.queue_high_water, depth, __ATOMIC_RELAXED);
+        }
+    }
+
+    __atomic_add_fetch(&worker->published, 1, __ATOMIC_RELEASE);
+    if (__atomic_load_n(&worker->waiters, __ATOMIC_ACQUIRE) > 0)
+    {
+        futex_wake_all(&worker->published);
+    }
+}
+
+/**
+ * @brief Takes a published frame without waiting.
+ *
+ * @param worker the worker
+ * @return the frame, NULL if none is waiting.
+ */
+static acam_frame_t *take(acam_worker_t *worker)
+{
+    if (worker->policy == ACAM_WORKER_KEEP_LATEST)
+    {
+        return __atomic_exchange_n(&worker->latest, NULL, __ATOMIC_ACQ_REL);
+    }
+
+    unsigned int tail = worker->tail;
+    if (tail == __atomic_load_n(&worker->head, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+    acam_frame_t *frame = worker->queue[tail & worker->queue_mask];
+    __atomic_store_n(&worker->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return frame;
+}
+
+static void *worker_main(void *arg)
+{
+    acam_worker_t *worker = arg;
+
+    while (!__atomic_load_n(&worker->stop, __ATOMIC_ACQUIRE))
+    {
+        acam_frame_t *frame;
+        int ret = acam_stream_dequeue_frame(worker->cam, &frame, WORKER_POLL_MS);
+        if (ret == ETIMEDOUT)
+        {
+            continue;
+        }
+        if (ret != 0)
+        {
+            DEBUG_PRINT(stderr, "Capture worker stopped: %s\n", strerror(ret));
+            __atomic_store_n(&worker->error, ret, __ATOMIC_RELEASE);
+            break;
+        }
+
+        // gaps in the driver's sequence numbers are frames it had no free buffer for
+        if (worker->have_sequence && frame->sequence > worker->last_sequence + 1)
+        {
+            __atomic_add_fetch(&worker->stats.dropped_device, frame->sequence - worker->last_sequence - 1, __ATOMIC_RELAXED);
+        }
+        worker->last_sequence = frame->sequence;
+        worker->have_sequence = 1;
+        __atomic_add_fetch(&worker->stats.captured, 1, __ATOMIC_RELAXED);
+
+        publish(worker, frame);
+    }
+
+    // wake consumers so they see the error or the stop
+    __atomic_add_fetch(&worker->published, 1, __ATOMIC_RELEASE);
+    futex_wake_all(&worker->published);
+
+    return NULL;
+}
+
+/**
+ * @brief Starts a background thread that keeps dequeuing frames from the camera and
+ * publishes them according to @param policy. Streaming is turned on with @param count
+ * mmap buffers if it is not on already.
+ *
+ * @param cam pointer to the cam struct. Only the worker may dequeue from it while the
+ * worker runs.
+ * @param policy ACAM_WORKER_KEEP_LATEST to only keep the newest frame, ACAM_WORKER_KEEP_ALL
+ * to keep every frame until the consumer takes it.
+ * @param count the number of buffers for acam_stream_start. 0 selects ACAM_STREAM_DEFAULT_BUFFERS.
+ * @param error keeps track of error code on failure.
+ * @return the worker on success, NULL on failure.
+ */
+acam_worker_t *acam_worker_start(acam_camera_t *cam, acam_worker_policy_t policy, unsigned int count, int *error)
+{
+    assert(cam && error);
+    if (policy != ACAM_WORKER_KEEP_LATEST && policy != ACAM_WORKER_KEEP_ALL)
+    {
+        *error = EINVAL;
+        return NULL;
+    }
+
+    acam_worker_t *worker = calloc(1, sizeof(acam_worker_t));
+    if (worker == NULL)
+    {
+        *error = ENOMEM;
+        return NULL;
+    }
+    worker->cam = cam;
+    worker->policy = policy;
+
+    if (!cam->streaming)
+    {
+        int ret = acam_stream_start(cam, count);
+        if (ret != 0)
+        {
+            *error = ret;
+            free(worker);
+            return NULL;
+        }
+        worker->started_stream = 1;
+    }
+
+    if (policy == ACAM_WORKER_KEEP_ALL)
+    {
+        // a slot for every buffer of the ring, rounded up to a power of two
+        unsigned int slots = 1;
+        while (slots < cam->ring_count)
+        {
+            slots <<= 1;
+        }
+        worker->queue = calloc(slots, sizeof(acam_frame_t *));
+        worker->queue_mask = slots - 1;
+        if (worker->queue == NULL)
+        {
+            *error = ENOMEM;
+            goto fail;
+        }
+    }
+
+    int ret = pthread_create(&worker->thread, NULL, worker_main, worker);
+    if (ret != 0)
+    {
+        DEBUG_PRINT(stderr, "Starting capture worker: %s\n", strerror(ret));
+        *error = ret;
+        goto fail;
+    }
+
+    return worker;
+
+fail:
+    if (worker->started_stream)
+    {
+        acam_stream_stop(cam);
+    }
+    free(worker->queue);
+    free(worker);
+    return NULL;
+}
+
+/**
+ * @brief Waits for a published frame and takes it, see acam_worker_get_frame.
+ */
+static int wait_frame(acam_worker_t *worker, acam_frame_t **frame, int timeout_ms)
+{
+    int64_t deadline_ms = timeout_ms > 0 ? monotonic_ms() + timeout_ms : 0;
+
+    for (;;)
+    {
+        int seen = __atomic_load_n(&worker->published, __ATOMIC_ACQUIRE);
+        acam_frame_t *taken = take(worker);
+        if (taken != NULL)
+        {
+            __atomic_add_fetch(&worker->stats.delivered, 1, __ATOMIC_RELAXED);
+            *frame = taken;
+            return 0;
+        }
+        int error = __atomic_load_n(&worker->error, __ATOMIC_ACQUIRE);
+        if (error != 0)
+        {
+            return error;
+        }
+        if (__atomic_load_n(&worker->stop, __ATOMIC_ACQUIRE))
+        {
+            return ECANCELED;
+        }
+
+        int remaining = timeout_ms;
+        if (timeout_ms > 0)
+        {
+            remaining = deadline_ms - monotonic_ms();
+            if (remaining < 0)
+            {
+                remaining = 0;
+            }
+        }
+        if (remaining == 0)
+        {
+            return ETIMEDOUT;
+        }
+
+        __atomic_add_fetch(&worker->waiters, 1, __ATOMIC_ACQ_REL);
+        futex_wait(&worker->published, seen, remaining);
+        __atomic_sub_fetch(&worker->waiters, 1, __ATOMIC_ACQ_REL);
+    }
+}
+
+/**
+ * @brief Takes the next frame from a worker: the newest frame for ACAM_WORKER_KEEP_LATEST,
+ * the oldest waiting frame for ACAM_WORKER_KEEP_ALL. The caller holds the returned frame
+ * and must call acam_frame_release on it. With ACAM_WORKER_KEEP_ALL only one thread may
+ * take frames at a time. A call blocked when acam_worker_stop runs returns ECANCELED;
+ * no call may start once acam_worker_stop has been called.
+ *
+ * @param worker the worker
+ * @param frame set to the taken frame.
+ * @param timeout_ms how long to wait for a frame. Negative waits forever, 0 does not wait.
+ * @return exit status. 0 on success, ETIMEDOUT if no frame arrived in time, the errno
+ * that ended the worker if it failed, ECANCELED if the worker is stopping.
+ */
+int acam_worker_get_frame(acam_worker_t *worker, acam_frame_t **frame, int timeout_ms)
+{
+    assert(worker && frame);
+    __atomic_add_fetch(&worker->callers, 1, __ATOMIC_ACQ_REL);
+    int ret = wait_frame(worker, frame, timeout_ms);
+    __atomic_sub_fetch(&worker->callers, 1, __ATOMIC_RELEASE); // the last access: stop may free the worker now
+    return ret;
+}
+
+/**
+ * @brief Reads the worker's counters. Use them to size the ring: steady dropped_device
+ * counts with ACAM_WORKER_KEEP_ALL mean the consumer needs more buffers to ride out
+ * its stalls.
+ *
+ * @param worker the worker
+ * @param stats filled with a snapshot of the counters.
+ */
+void acam_worker_get_stats(const acam_worker_t *worker, acam_worker_stats_t *stats)
+{
+    assert(worker && stats);
+    stats->captured = __atomic_load_n(&worker->stats.captured, __ATOMIC_RELAXED);
+    stats->delivered = __atomic_load_n(&worker->stats.delivered, __ATOMIC_RELAXED);
+    stats->dropped_stale = __atomic_load_n(&worker->stats.dropped_stale, __ATOMIC_RELAXED);
+    stats->dropped_device = __atomic_load_n(&worker->stats.dropped_device, __ATOMIC_RELAXED);
+    stats->queue_high_water = __atomic_load_n(&worker->stats.queue_high_water, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Stops the worker thread, releases the frames nobody took and turns streaming
+ * off if acam_worker_start turned it on. Consumers blocked in acam_worker_get_frame are
+ * woken with ECANCELED, and the worker is only freed once they have returned. Every
+ * frame taken from the worker must be released first.
+ *
+ * @param worker the worker to stop and free
+ * @return exit status. 0 on success, errno on failure to join the thread or stop the stream.
+ */
+int acam_worker_stop(acam_worker_t *worker)
+{
+    assert(worker);
+    __atomic_store_n(&worker->stop, 1, __ATOMIC_RELEASE);
+    int ret = pthread_join(worker->thread, NULL);
+    if (ret != 0)
+    {
+        DEBUG_PRINT(stderr, "Joining capture worker: %s\n", strerror(ret));
+        return ret;
+    }
+
+    // the thread's exit woke the blocked consumers; wait until they have left
+    while (__atomic_load_n(&worker->callers, __ATOMIC_ACQUIRE) > 0)
+    {
+        futex_wake_all(&worker->published);
+        sched_yield();
+    }
+
+    acam_frame_t *frame;
+    while ((frame = take(worker)) != NULL)
+    {
+        acam_frame_release(frame);
+    }
+
+    if (worker->started_stream)
+    {
+        ret = acam_stream_stop(worker->cam);
+    }
+    free(worker->queue);
+    free(worker);
+
+    return ret;
+}
@@ -0,0 +1,722 @@
+#define _GNU_SOURCE
+#include "acam_control.h"
+
+#include <pthread.h>
+#include <limits.h>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+
+#ifndef NDEBUG
+#define DEBUG_PRINT fprintf
+#define DEBUG_PERROR perror
+#else
+#define DEBUG_PRINT
+#define DEBUG_PERROR
+#endif
+
+/**
+ * @brief Asynchronous frame writer. Callers submit (file name, frame) jobs into a
+ * bounded queue and return at once; a background thread takes every job that is
+ * waiting as one batch, opens the files, and hands all of their writes, chained with
+ * their fsyncs, to the kernel in a single io_uring_enter. Where io_uring is not
+ * available the same batch is written with pwrite and synced from the thread.
+ *
+ * A full queue rejects a job with EAGAIN instead of blocking, so a stalled disk costs
+ * frames, never capture latency. Each queue slot owns a staging buffer that is kept
+ * for reuse, so the queue's memory is bounded by depth times the largest frame and
+ * steady-state submissions allocate nothing.
+ *
+ * With ACAM_WRITER_DIRECT files are opened with O_DIRECT; staging buffers are page
+ * aligned and padded to a whole page, the padding is cut off again with ftruncate.
+ *
+ */
+
+#define WRITER_ALIGN 4096 //alignment and size granularity of O_DIRECT writes
+
+typedef struct
+{
+    char path[PATH_MAX];
+    const char *data; //what is written: the staging buffer or the frame's mapping
+    size_t size;
+    char *staging; //WRITER_ALIGN-aligned copy of submitted buffers, kept across jobs
+    size_t staging_cap;
+    acam_frame_t *frame; //held until the frame is on disk, NULL for copied buffers
+    acam_writer_cb_t callback;
+    void *user;
+
+    int fd;
+    int direct; //opened with O_DIRECT; the write is padded to WRITER_ALIGN
+    int error;
+    int synced;
+} writer_job_t;
+
+/**
+ * @brief The parts of an io_uring instance the writer uses, set up with raw syscalls.
+ *
+ */
+typedef struct
+{
+    int fd;
+    unsigned int entries;
+    unsigned int *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+} writer_uring_t;
+
+struct acam_writer
+{
+    acam_writer_config_t config;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t work; //signalled when a job is queued or the writer stops
+    pthread_cond_t done; //signalled when a batch completes
+
+    writer_job_t *jobs; //config.depth slots, used in submission order
+    unsigned int head;  //next slot a submitter fills
+    unsigned int started; //next slot the thread takes
+    unsigned int tail;  //oldest slot not completed yet
+    int stop;
+
+    int use_uring;
+    writer_uring_t uring;
+
+    acam_writer_stats_t stats;
+};
+
+static int uring_setup(writer_uring_t *ring, unsigned int entries)
+{
+    struct io_uring_params params = {0};
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd == -1)
+    {
+        return errno;
+    }
+
+    ring->fd = fd;
+    ring->entries = params.sq_entries;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = 0;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+    {
+        goto fail;
+    }
+    ring->cq_ring = ring->sq_ring;
+    if (ring->cq_ring_size)
+    {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED)
+        {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+            goto fail;
+        }
+    }
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        if (ring->cq_ring_size)
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        goto fail;
+    }
+
+    char *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+
+fail:
+    {
+        int err = errno;
+        close(fd);
+        return err;
+    }
+}
+
+static void uring_teardown(writer_uring_t *ring)
+{
+    munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->cq_ring_size)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    close(ring->fd);
+}
+
+//queues a zeroed sqe; only the writer thread touches the submission ring
+static struct io_uring_sqe *uring_get_sqe(writer_uring_t *ring, unsigned int *tail)
+{
+    unsigned int index = *tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    (*tail)++;
+    return sqe;
+}
+
+static int write_all(int fd, const char *data, size_t size, off_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t written = pwrite(fd, data, size, offset);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        data += written;
+        size -= written;
+        offset += written;
+    }
+    return 0;
+}
+
+static int sync_file(int fd, acam_writer_sync_t sync)
+{
+    int ret = 0;
+    if (sync == ACAM_WRITER_FDATASYNC)
+        ret = fdatasync(fd);
+    else if (sync == ACAM_WRITER_FSYNC)
+        ret = fsync(fd);
+    return ret == -1 ? errno : 0;
+}
+
+static size_t write_size(const writer_job_t *job)
+{
+    return job->direct ? (job->size + WRITER_ALIGN - 1) & ~(size_t)(WRITER_ALIGN - 1) : job->size;
+}
+
+/**
+ * @brief Opens a job's file and makes sure its data can be written with O_DIRECT.
+ *
+ */
+static void open_job(acam_writer_t *writer, writer_job_t *job)
+{
+    job->error = 0;
+    job->synced = 0;
+    job->direct = 0;
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    job->fd = -1;
+    if (writer->config.flags & ACAM_WRITER_DIRECT)
+    {
+        job->fd = open(job->path, flags | O_DIRECT, 0644);
+        // filesystems such as tmpfs refuse O_DIRECT: write those files normally
+        job->direct = job->fd != -1;
+    }
+    if (job->fd == -1)
+    {
+        job->fd = open(job->path, flags, 0644);
+    }
+    if (job->fd == -1)
+    {
+        job->error = errno;
+        DEBUG_PRINT(stderr, "Problem opening file %s: %s\n", job->path, strerror(errno));
+        return;
+    }
+
+    // a frame is written from its own buffer: O_DIRECT needs it aligned and the padded write inside it
+    if (job->direct && job->frame != NULL &&
+        ((uintptr_t)job->data % WRITER_ALIGN != 0 || write_size(job) > job->frame->buffer->length))
+    {
+        int flags_now = fcntl(job->fd, F_GETFL);
+        fcntl(job->fd, F_SETFL, flags_now & ~O_DIRECT);
+        job->direct = 0;
+    }
+}
+
+static void write_batch_uring(acam_writer_t *writer, unsigned int first, unsigned int count)
+{
+    writer_uring_t *ring = &writer->uring;
+    unsigned int depth = writer->config.depth;
+    unsigned int start = *ring->sq_tail;
+    unsigned int tail = start;
+    unsigned int queued = 0;
+    struct iovec iov[count];
+    unsigned int pending[count]; //sqes of each job the kernel has not completed
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        writer_job_t *job = &writer->jobs[(first + i) % depth];
+        pending[i] = 0;
+        if (job->error)
+            continue;
+        iov[i].iov_base = (void *)job->data;
+        iov[i].iov_len = write_size(job);
+
+        struct io_uring_sqe *sqe = uring_get_sqe(ring, &tail);
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = job->fd;
+        sqe->addr = (uintptr_t)&iov[i];
+        sqe->len = 1;
+        sqe->user_data = (uint64_t)i << 1;
+        queued++;
+        pending[i]++;
+
+        // O_DIRECT files are trimmed with ftruncate first, so they are synced afterwards
+        if (writer->config.sync != ACAM_WRITER_NO_SYNC && !job->direct)
+        {
+            sqe->flags |= IOSQE_IO_LINK; // the fsync only runs if the whole write succeeded
+            sqe = uring_get_sqe(ring, &tail);
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->fd = job->fd;
+            sqe->fsync_flags = writer->config.sync == ACAM_WRITER_FDATASYNC ? IORING_FSYNC_DATASYNC : 0;
+            sqe->user_data = (uint64_t)i << 1 | 1;
+            queued++;
+            pending[i]++;
+        }
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    unsigned int submitted = 0, completed = 0;
+    while (completed < queued)
+    {
+        int ret = syscall(__NR_io_uring_enter, ring->fd, queued - submitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            DEBUG_PERROR("Submitting writes");
+            int err = errno;
+            if (submitted < queued)
+            {
+                // take back the sqes the kernel has not seen and fail their jobs, then keep
+                // reaping: the submitted writes still read the buffers and use the fds
+                for (unsigned int k = start + submitted; k != tail; k++)
+                {
+                    unsigned int i = ring->sqes[k & *ring->sq_mask].user_data >> 1;
+                    writer_job_t *job = &writer->jobs[(first + i) % depth];
+                    pending[i]--;
+                    if (!job->error)
+                        job->error = err;
+                }
+                tail = start + submitted;
+                __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+                queued = submitted;
+                continue;
+            }
+            // not even waiting works: the ring is unusable. Closing it cancels what is in
+            // flight; the writer carries on with pwrite.
+            for (unsigned int i = 0; i < count; i++)
+            {
+                writer_job_t *job = &writer->jobs[(first + i) % depth];
+                if (pending[i] > 0 && !job->error)
+                    job->error = err;
+            }
+            uring_teardown(ring);
+            writer->use_uring = 0;
+            return;
+        }
+        submitted += ret;
+
+        unsigned int head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            unsigned int i = cqe->user_data >> 1;
+            writer_job_t *job = &writer->jobs[(first + i) % depth];
+            pending[i]--;
+            if (cqe->user_data & 1)
+            {
+                // a canceled fsync follows a short or failed write and is redone below
+                if (cqe->res == 0)
+                    job->synced = 1;
+                else if (cqe->res != -ECANCELED && !job->error)
+                    job->error = -cqe->res;
+            }
+            else if (cqe->res < 0)
+            {
+                job->error = -cqe->res;
+            }
+            else if ((size_t)cqe->res < write_size(job))
+            {
+                // O_DIRECT needs an aligned offset: resume from the start of the page the write stopped in
+                size_t done = job->direct ? (size_t)cqe->res & ~(size_t)(WRITER_ALIGN - 1) : (size_t)cqe->res;
+                job->error = write_all(job->fd, job->data + done, write_size(job) - done, done);
+            }
+            head++;
+            completed++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+static void write_batch_sync(acam_writer_t *writer, unsigned int first, unsigned int count)
+{
+    for (unsigned int i = 0; i < count; i++)
+    {
+        writer_job_t *job = &writer->jobs[(first + i) % writer->config.depth];
+        if (!job->error)
+            job->error = write_all(job->fd, job->data, write_size(job), 0);
+    }
+}
+
+/**
+ * @brief Writes a batch of queued jobs and closes their files. Callbacks are run
+ * by the caller once the batch is done.
+ *
+ */
+static void write_batch(acam_writer_t *writer, unsigned int first, unsigned int count)
+{
+    unsigned int depth = writer->config.depth;
+    for (unsigned int i = 0; i < count; i++)
+    {
+        open_job(writer, &writer->jobs[(first + i) % depth]);
+    }
+
+    if (writer->use_uring)
+        write_batch_uring(writer, first, count);
+    else
+        write_batch_sync(writer, first, count);
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        writer_job_t *job = &writer->jobs[(first + i) % depth];
+        if (job->fd == -1)
+            continue;
+        if (!job->error && job->direct && write_size(job) != job->size && ftruncate(job->fd, job->size) == -1)
+            job->error = errno;
+        if (!job->error && !job->synced)
+            job->error = sync_file(job->fd, writer->config.sync);
+        if (close(job->fd) == -1 && !job->error)
+            job->error = errno;
+        if (job->error)
+            DEBUG_PRINT(stderr, "Problem writing file %s: %s\n", job->path, strerror(job->error));
+    }
+}
+
+static void *writer_main(void *arg)
+{
+    acam_writer_t *writer = arg;
+    unsigned int depth = writer->config.depth;
+
+    pthread_mutex_lock(&writer->lock);
+    for (;;)
+    {
+        while (writer->started == writer->head && !writer->stop)
+        {
+            pthread_cond_wait(&writer->work, &writer->lock);
+        }
+        if (writer->started == writer->head)
+        {
+            break; // stopping and nothing left to write
+        }
+        // everything waiting goes out as one batch
+        unsigned int first = writer->started;
+        unsigned int count = writer->head - writer->started;
+        writer->started = writer->head;
+        pthread_mutex_unlock(&writer->lock);
+
+        write_batch(writer, first, count);
+
+        uint64_t bytes = 0, failed = 0;
+        for (unsigned int i = 0; i < count; i++)
+        {
+            writer_job_t *job = &writer->jobs[(first + i) % depth];
+            if (job->callback != NULL)
+                job->callback(job->path, job->error, job->user);
+            if (job->frame != NULL)
+            {
+                acam_frame_release(job->frame);
+                job->frame = NULL;
+            }
+            if (job->error)
+                failed++;
+            else
+                bytes += job->size;
+        }
+
+        pthread_mutex_lock(&writer->lock);
+        writer->tail += count;
+        writer->stats.written += count - failed;
+        writer->stats.failed += failed;
+        writer->stats.bytes += bytes;
+        pthread_cond_broadcast(&writer->done);
+    }
+    pthread_mutex_unlock(&writer->lock);
+
+    return NULL;
+}
+
+/**
+ * @brief Creates an asynchronous writer and starts its thread.
+ *
+ * @param config the queue depth, sync policy and flags. NULL selects the defaults:
+ * ACAM_WRITER_DEFAULT_DEPTH jobs, no syncing, io_uring if available.
+ * @param error keeps track of error code on failure.
+ * @return the writer on success, NULL on failure.
+ */
+acam_writer_t *acam_writer_create(const acam_writer_config_t *config, int *error)
+{
+    assert(error);
+    acam_writer_t *writer = calloc(1, sizeof(acam_writer_t));
+    if (writer == NULL)
+    {
+        *error = ENOMEM;
+        return NULL;
+    }
+    if (config != NULL)
+    {
+        writer->config = *config;
+    }
+    if (writer->config.depth == 0)
+    {
+        writer->config.depth = ACAM_WRITER_DEFAULT_DEPTH;
+    }
+    if (writer->config.sync > ACAM_WRITER_FSYNC)
+    {
+        free(writer);
+        *error = EINVAL;
+        return NULL;
+    }
+
+    writer->jobs = calloc(writer->config.depth, sizeof(writer_job_t));
+    if (writer->jobs == NULL)
+    {
+        free(writer);
+        *error = ENOMEM;
+        return NULL;
+    }
+
+    if (!(writer->config.flags & ACAM_WRITER_NO_URING))
+    {
+        // room for a write and an fsync per queued job
+        int ret = uring_setup(&writer->uring, writer->config.depth * 2);
+        writer->use_uring = ret == 0;
+        if (ret != 0)
+        {
+            DEBUG_PRINT(stderr, "io_uring unavailable (%s), writing with pwrite.\n", strerror(ret));
+        }
+    }
+
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->work, NULL);
+    pthread_cond_init(&writer->done, NULL);
+    int ret = pthread_create(&writer->thread, NULL, writer_main, writer);
+    if (ret != 0)
+    {
+        DEBUG_PRINT(stderr, "Starting frame writer: %s\n", strerror(ret));
+        if (writer->use_uring)
+            uring_teardown(&writer->uring);
+        pthread_mutex_destroy(&writer->lock);
+        pthread_cond_destroy(&writer->work);
+        pthread_cond_destroy(&writer->done);
+        free(writer->jobs);
+        free(writer);
+        *error = ret;
+        return NULL;
+    }
+
+    return writer;
+}
+
+/**
+ * @brief Reserves the next queue slot. Called with the lock held.
+ *
+ * @return the slot, NULL if the queue is full or the writer is stopping.
+ */
+static writer_job_t *reserve(acam_writer_t *writer, const char *file_name, int *error)
+{
+    if (strlen(file_name) >= PATH_MAX)
+    {
+        *error = ENAMETOOLONG;
+        return NULL;
+    }
+    if (writer->stop)
+    {
+        *error = ECANCELED;
+        return NULL;
+    }
+    unsigned int waiting = writer->head - writer->tail;
+    if (waiting == writer->config.depth)
+    {
+        writer->stats.rejected++;
+        *error = EAGAIN;
+        return NULL;
+    }
+    if (waiting + 1 > writer->stats.queue_high_water)
+    {
+        writer->stats.queue_high_water = waiting + 1;
+    }
+    writer_job_t *job = &writer->jobs[writer->head % writer->config.depth];
+    strcpy(job->path, file_name);
+    return job;
+}
+
+static void queue(acam_writer_t *writer, writer_job_t *job, acam_writer_cb_t callback, void *user)
+{
+    job->callback = callback;
+    job->user = user;
+    writer->head++;
+    writer->stats.submitted++;
+    pthread_cond_signal(&writer->work);
+}
+
+/**
+ * @brief Queues the contents of a buffer to be written to a file. The data is copied
+ * into the job's staging buffer, so @param buffer can be reused as soon as this returns.
+ * Never waits for the disk.
+ *
+ * @param writer the writer
+ * @param file_name the file to create or replace.
+ * @param buffer the buffer whose bytes_used bytes are written.
+ * @param callback called on the writer thread once the file is written and closed, may be NULL.
+ * @param user passed to @param callback unchanged.
+ * @return exit status. 0 on success, EAGAIN if the queue is full, ENOMEM if the staging
+ * buffer cannot grow, ENAMETOOLONG, ECANCELED if the writer is being destroyed.
+ */
+int acam_writer_submit(acam_writer_t *writer, const char *file_name, const acam_buffer_t *buffer, acam_writer_cb_t callback, void *user)
+{
+    assert(writer && file_name && buffer);
+    int ret = 0;
+    pthread_mutex_lock(&writer->lock);
+    writer_job_t *job = reserve(writer, file_name, &ret);
+    if (job == NULL)
+    {
+        pthread_mutex_unlock(&writer->lock);
+        return ret;
+    }
+
+    // the staging buffer only grows, and is padded for O_DIRECT writes
+    size_t needed = ((size_t)buffer->bytes_used + WRITER_ALIGN - 1) & ~(size_t)(WRITER_ALIGN - 1);
+    if (needed > job->staging_cap)
+    {
+        void *staging;
+        if (posix_memalign(&staging, WRITER_ALIGN, needed) != 0)
+        {
+            pthread_mutex_unlock(&writer->lock);
+            return ENOMEM;
+        }
+        free(job->staging);
+        job->staging = staging;
+        job->staging_cap = needed;
+    }
+    memcpy(job->staging, buffer->buf, buffer->bytes_used);
+    memset(job->staging + buffer->bytes_used, 0, needed - buffer->bytes_used);
+    job->data = job->staging;
+    job->size = buffer->bytes_used;
+    job->frame = NULL;
+
+    queue(writer, job, callback, user);
+    pthread_mutex_unlock(&writer->lock);
+    return 0;
+}
+
+/**
+ * @brief Queues a frame to be written to a file without copying it. The writer holds
+ * the frame (acam_frame_ref) until it is written, so its buffer only goes back to the
+ * driver afterwards.
+ *
+ * @param writer the writer
+ * @param file_name the file to create or replace.
+ * @param frame a frame the caller holds. The caller keeps its own hold.
+ * @param callback called on the writer thread once the file is written and closed, may be NULL.
+ * @param user passed to @param callback unchanged.
+ * @return exit status. 0 on success, EAGAIN if the queue is full, ENAMETOOLONG,
+ * ECANCELED if the writer is being destroyed.
+ */
+int acam_writer_submit_frame(acam_writer_t *writer, const char *file_name, acam_frame_t *frame, acam_writer_cb_t callback, void *user)
+{
+    assert(writer && file_name && frame);
+    int ret = 0;
+    pthread_mutex_lock(&writer->lock);
+    writer_job_t *job = reserve(writer, file_name, &ret);
+    if (job == NULL)
+    {
+        pthread_mutex_unlock(&writer->lock);
+        return ret;
+    }
+
+    acam_frame_ref(frame);
+    job->frame = frame;
+    job->data = frame->buffer->buf;
+    job->size = frame->bytes_used;
+
+    queue(writer, job, callback, user);
+    pthread_mutex_unlock(&writer->lock);
+    return 0;
+}
+
+/**
+ * @brief Waits until every job submitted so far is written and its callback has run.
+ *
+ * @param writer the writer
+ * @return 0.
+ */
+int acam_writer_flush(acam_writer_t *writer)
+{
+    assert(writer);
+    pthread_mutex_lock(&writer->lock);
+    unsigned int target = writer->head;
+    while ((int)(writer->tail - target) < 0)
+    {
+        pthread_cond_wait(&writer->done, &writer->lock);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return 0;
+}
+
+/**
+ * @brief Reads the writer's counters.
+ *
+ * @param writer the writer
+ * @param stats filled with a snapshot of the counters.
+ */
+void acam_writer_get_stats(acam_writer_t *writer, acam_writer_stats_t *stats)
+{
+    assert(writer && stats);
+    pthread_mutex_lock(&writer->lock);
+    *stats = writer->stats;
+    pthread_mutex_unlock(&writer->lock);
+}
+
+/**
+ * @brief Writes every queued job, stops the writer thread and frees the writer.
+ *
+ * @param writer the writer to destroy
+ * @return exit status. 0 on success, errno on failure to join the thread.
+ */
+int acam_writer_destroy(acam_writer_t *writer)
+{
+    assert(writer);
+    pthread_mutex_lock(&writer->lock);
+    writer->stop = 1;
+    pthread_cond_signal(&writer->work);
+    pthread_mutex_unlock(&writer->lock);
+
+    int ret = pthread_join(writer->thread, NULL);
+    if (ret != 0)
+    {
+        DEBUG_PRINT(stderr, "Joining frame writer: %s\n", strerror(ret));
+        return ret;
+    }
+
+    if (writer->use_uring)
+        uring_teardown(&writer->uring);
+    for (unsigned int i = 0; i < writer->config.depth; i++)
+    {
+        free(writer->jobs[i].staging);
+    }
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->work);
+    pthread_cond_destroy(&writer->done);
+    free(writer->jobs);
+    free(writer);
+
+    return 0;
+}
@@ -0,0 +1,1345 @@
+#include "acam_control.h"
+
+#include <dirent.h>
+#include <time.h>
+#include <sys/wait.h>
+
+/**
+ * @brief Capture-path latency benchmark. Prints its results as JSON with
+ * percentiles, so runs from different builds can be compared. It covers:
+ *  - acam_open without the capability cache, cold and warm, with the ioctls each makes
+ *  - set_fmt, every stage of acam_capture_image and acam_write_to_file for each
+ *    acam_fmt_t, and acam_write_mjpeg_to_file for the MJPEG formats
+ *  - how long acam_writer_submit keeps the caller, acam_recorder_append and
+ *    acam_pretrigger_push
+ *  - the frame accounting (acam_get_stream_stats) and per-ioctl counters
+ *    (acam_trace_snapshot) of a stream
+ *  - the mode table (acam_get_modes) and acam_set_mode
+ *  - DC decoding of 1080p MJPEG frames, singly and in bursts, and of frames with
+ *    damaged Huffman tables (acam_mjpeg_decode_dc)
+ *  - a shared-memory stream to a subscriber in a child process and a stalled one
+ *    (acam_publisher_push)
+ *  - a frame server (acam_server_start) feeding several client processes while
+ *    other clients change its controls and mode
+ *
+ * The stages of acam_capture_image are timed by wrapping the camera's backend:
+ * every ioctl and poll the library issues during a capture is attributed to its
+ * stage, so the library itself carries no timing code.
+ *
+ * Usage: acam_bench [--device PATH] [--iterations N] [--opens N] [--output FILE] [--label NAME]
+ * PATH is a /dev/videoN node or a synthetic camera ("synthetic:fps=120").
+ *
+ */
+
+typedef enum
+{
+    STAGE_QUERYBUF = 0,
+    STAGE_QBUF,
+    STAGE_STREAMON,
+    STAGE_WAIT,
+    STAGE_DQBUF,
+    STAGE_STREAMOFF,
+
+    __STAGE_COUNT
+} stage_t;
+
+static const char *stage_names[__STAGE_COUNT] = {"querybuf", "qbuf", "streamon", "wait", "dqbuf", "streamoff"};
+
+static const char *fmt_names[__ACAM_FMT_COUNT] = {
+    "MJPEG_1920_1080", "MJPEG_1280_1024", "MJPEG_1280_720", "MJPEG_800_600", "MJPEG_640_480", "MJPEG_320_240",
+    "YUYV_1920_1080", "YUYV_1280_1024", "YUYV_1280_720", "YUYV_800_600", "YUYV_640_480", "YUYV_320_240"};
+
+/**
+ * @brief A growable list of latency samples in microseconds.
+ *
+ */
+typedef struct
+{
+    double *us;
+    size_t count;
+    size_t cap;
+} samples_t;
+
+static void samples_add(samples_t *s, double us)
+{
+    if (s->count == s->cap)
+    {
+        s->cap = s->cap ? s->cap * 2 : 64;
+        s->us = realloc(s->us, s->cap * sizeof(double));
+        if (s->us == NULL)
+        {
+            perror("Growing sample list");
+            exit(1);
+        }
+    }
+    s->us[s->count++] = us;
+}
+
+static void samples_reset(samples_t *s)
+{
+    s->count = 0;
+}
+
+static void samples_free(samples_t *s)
+{
+    free(s->us);
+    s->us = NULL;
+    s->count = s->cap = 0;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const samples_t *s, double p)
+{
+    // nearest-rank on sorted samples
+    size_t rank = (size_t)(p / 100.0 * s->count + 0.5);
+    if (rank < 1)
+    {
+        rank = 1;
+    }
+    if (rank > s->count)
+    {
+        rank = s->count;
+    }
+    return s->us[rank - 1];
+}
+
+static void print_stats(FILE *out, const char *name, samples_t *s, int last)
+{
+    fprintf(out, "\"%s\": {\"count\": %zu", name, s->count);
+    if (s->count > 0)
+    {
+        qsort(s->us, s->count, sizeof(double), compare_double);
+        double sum = 0;
+        for (size_t i = 0; i < s->count; i++)
+        {
+            sum += s->us[i];
+        }
+        fprintf(out, ", \"min_us\": %.3f, \"mean_us\": %.3f, \"p50_us\": %.3f, \"p90_us\": %.3f, \"p99_us\": %.3f, \"max_us\": %.3f",
+                s->us[0], sum / s->count, percentile(s, 50), percentile(s, 90), percentile(s, 99), s->us[s->count - 1]);
+    }
+    fprintf(out, "}%s", last ? "" : ", ");
+}
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// Backend wrapper that attributes the time of each ioctl/poll to a capture stage.
+typedef struct
+{
+    const acam_backend_t *inner;
+    void *inner_ctx;
+} timed_ctx_t;
+
+static int timing_enabled;
+static samples_t stage_samples[__STAGE_COUNT];
+
+static void record(unsigned long request, double us)
+{
+    if (!timing_enabled)
+    {
+        return;
+    }
+    switch (request)
+    {
+    case VIDIOC_QUERYBUF:
+        samples_add(&stage_samples[STAGE_QUERYBUF], us);
+        break;
+    case VIDIOC_QBUF:
+        samples_add(&stage_samples[STAGE_QBUF], us);
+        break;
+    case VIDIOC_STREAMON:
+        samples_add(&stage_samples[STAGE_STREAMON], us);
+        break;
+    case VIDIOC_DQBUF:
+        samples_add(&stage_samples[STAGE_DQBUF], us);
+        break;
+    case VIDIOC_STREAMOFF:
+        samples_add(&stage_samples[STAGE_STREAMOFF], us);
+        break;
+    default:
+        break;
+    }
+}
+
+static int timed_open(const char *cam_file, int flags, void **ctx)
+{
+    timed_ctx_t *t = malloc(sizeof(timed_ctx_t));
+    if (t == NULL)
+    {
+        return -1;
+    }
+    t->inner = strncmp(cam_file, ACAM_SYNTHETIC_PREFIX, strlen(ACAM_SYNTHETIC_PREFIX)) == 0 ? &acam_synthetic_backend : &acam_v4l2_backend;
+    int fd = t->inner->open(cam_file, flags, &t->inner_ctx);
+    if (fd == -1)
+    {
+        free(t);
+        return -1;
+    }
+    *ctx = t;
+    return fd;
+}
+
+static int timed_close(void *ctx, int fd)
+{
+    timed_ctx_t *t = ctx;
+    int ret = t->inner->close(t->inner_ctx, fd);
+    free(t);
+    return ret;
+}
+
+static unsigned long ioctl_calls; //every ioctl through the timed backend
+
+static int timed_ioctl(void *ctx, int fd, unsigned long request, void *arg)
+{
+    timed_ctx_t *t = ctx;
+    ioctl_calls++;
+    double start = now_us();
+    int ret = t->inner->ioctl(t->inner_ctx, fd, request, arg);
+    record(request, now_us() - start);
+    return ret;
+}
+
+static void *timed_mmap(void *ctx, int fd, size_t length, int prot, int flags, off_t offset)
+{
+    timed_ctx_t *t = ctx;
+    return t->inner->mmap(t->inner_ctx, fd, length, prot, flags, offset);
+}
+
+static int timed_poll(void *ctx, int fd, int timeout_ms)
+{
+    timed_ctx_t *t = ctx;
+    double start = now_us();
+    int ret = t->inner->poll(t->inner_ctx, fd, timeout_ms);
+    if (timing_enabled)
+    {
+        samples_add(&stage_samples[STAGE_WAIT], now_us() - start);
+    }
+    return ret;
+}
+
+static const acam_backend_t timed_backend = {
+    "timed",
+    timed_open,
+    timed_close,
+    timed_ioctl,
+    timed_mmap,
+    timed_poll,
+};
+
+/**
+ * @brief Reads a recording back and checks it holds the frames that were appended.
+ *
+ * @return 0 if it does, 1 otherwise.
+ */
+static int check_recording(const char *dir, uint64_t appended, const struct timeval *first, uint32_t last_size)
+{
+    int error = 0;
+    acam_reader_t *reader = acam_reader_open(dir, &error);
+    if (reader == NULL)
+    {
+        fprintf(stderr, "acam_reader_open failed: %s\n", strerror(error));
+        return 1;
+    }
+    int status = 0;
+    uint64_t n = 1;
+    acam_record_t record;
+    if (acam_reader_count(reader) != appended)
+    {
+        fprintf(stderr, "Recording holds %llu frames, %llu were appended\n", (unsigned long long)acam_reader_count(reader),
+                (unsigned long long)appended);
+        status = 1;
+    }
+    else if (appended > 0 && (acam_reader_find_time(reader, first, &n) != 0 || n != 0 ||
+                              acam_reader_get(reader, appended - 1, &record) != 0 || record.size != last_size))
+    {
+        fprintf(stderr, "Recording does not read back\n");
+        status = 1;
+    }
+    acam_reader_close(reader);
+    return status;
+}
+
+static void remove_recording(const char *dir)
+{
+    char path[256];
+    for (unsigned int i = 0;; i++)
+    {
+        snprintf(path, sizeof(path), "%s/%06u.seg", dir, i);
+        if (unlink(path) == -1)
+        {
+            break;
+        }
+    }
+    snprintf(path, sizeof(path), "%s/index", dir);
+    unlink(path);
+    rmdir(dir);
+}
+
+static void remove_cache(const char *dir)
+{
+    DIR *d = opendir(dir);
+    if (d == NULL)
+    {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL)
+    {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        if (entry->d_name[0] != '.')
+        {
+            unlink(path);
+        }
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+/**
+ * @brief Opens and closes the camera @param opens times.
+ *
+ * @param calls set to the number of ioctls the last open made.
+ * @return 0 on success, 1 if an open failed.
+ */
+static int time_opens(const char *device, int opens, samples_t *samples, unsigned long *calls)
+{
+    for (int i = 0; i < opens; i++)
+    {
+        int error;
+        unsigned long before = ioctl_calls;
+        double start = now_us();
+        acam_camera_t *cam = acam_open_backend(device, &timed_backend, &error);
+        double elapsed = now_us() - start;
+        if (cam == NULL)
+        {
+            fprintf(stderr, "acam_open %s failed: %s\n", device, strerror(error));
+            return 1;
+        }
+        *calls = ioctl_calls - before;
+        samples_add(samples, elapsed);
+        acam_close(cam);
+    }
+    return 0;
+}
+
+static void count_event(const acam_trace_event_t *event, void *user)
+{
+    (void)event;
+    (*(uint64_t *)user)++;
+}
+
+/**
+ * @brief Prints the instrumentation counters as a JSON array.
+ *
+ * @return the number of calls counted.
+ */
+static uint64_t print_trace(FILE *out)
+{
+    static acam_trace_entry_t entries[ACAM_TRACE_MAX_ENTRIES];
+    unsigned int count = acam_trace_snapshot(entries, ACAM_TRACE_MAX_ENTRIES);
+    uint64_t calls = 0;
+    fprintf(out, ", \"calls\": [");
+    for (unsigned int i = 0; i < count; i++)
+    {
+        calls += entries[i].calls;
+        fprintf(out, "%s{\"name\": \"%s\", \"calls\": %llu, \"errors\": %llu, \"retries\": %llu, \"mean_us\": %.3f, \"max_us\": %.3f}",
+                i ? ", " : "", entries[i].name, (unsigned long long)entries[i].calls, (unsigned long long)entries[i].errors,
+                (unsigned long long)entries[i].retries, entries[i].total_ns / 1e3 / entries[i].calls, entries[i].max_ns / 1e3);
+    }
+    fprintf(out, "]");
+    return calls;
+}
+
+/**
+ * @brief Streams @param frames frames with the device call instrumentation on and
+ * prints the camera's frame accounting and the instrumentation counters for them.
+ *
+ * @return 0 if every frame and every call was accounted and a frame rate was
+ * measured, 1 otherwise.
+ */
+static int stream_stats(FILE *out, acam_camera_t *cam, int frames)
+{
+    uint64_t events = 0;
+    acam_reset_stream_stats(cam);
+    acam_trace_reset();
+    acam_trace_set_callback(count_event, &events);
+    int traced = acam_trace_set_flags(ACAM_TRACE_COUNTERS | ACAM_TRACE_EVENTS) == 0; // ENOTSUP when built without the hooks
+    int ret = acam_stream_start(cam, 0);
+    for (int i = 0; i < frames + 1 && ret == 0; i++)
+    {
+        acam_buffer_t *buffer;
+        ret = acam_stream_dequeue(cam, &buffer, 1000);
+        if (ret == 0)
+        {
+            ret = acam_stream_requeue(cam, buffer);
+        }
+    }
+    acam_stream_stop(cam);
+    acam_trace_set_flags(0);
+    acam_trace_set_callback(NULL, NULL);
+    if (ret != 0)
+    {
+        fprintf(stderr, "Streaming failed: %s\n", strerror(ret));
+        return 1;
+    }
+
+    acam_stream_stats_t stats;
+    acam_get_stream_stats(cam, &stats);
+    fprintf(out, ", \"stream\": {\"frames\": %llu, \"fps\": %.2f, \"dropped\": %llu, \"errors\": %llu, \"jitter\": [",
+            (unsigned long long)stats.frames, stats.fps, (unsigned long long)stats.dropped, (unsigned long long)stats.errors);
+    for (int i = 0; i < ACAM_JITTER_BUCKETS; i++)
+    {
+        fprintf(out, "%llu%s", (unsigned long long)stats.jitter[i], i + 1 < ACAM_JITTER_BUCKETS ? ", " : "");
+    }
+    fprintf(out, "], \"max_jitter_us\": %u, \"mean_latency_us\": %u, \"max_latency_us\": %u", stats.max_jitter_us,
+            stats.mean_latency_us, stats.max_latency_us);
+    uint64_t calls = print_trace(out);
+    fprintf(out, "}");
+    if (stats.frames != (uint64_t)frames + 1 || stats.fps <= 0)
+    {
+        fprintf(stderr, "Streaming accounted %llu of %d frames\n", (unsigned long long)stats.frames, frames + 1);
+        return 1;
+    }
+    if (traced && (calls == 0 || calls != events))
+    {
+        fprintf(stderr, "Instrumentation counted %llu calls but saw %llu\n", (unsigned long long)calls, (unsigned long long)events);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Looks every entry of the camera's mode table up again, then switches to the
+ * slowest and back to the fastest frame interval of the first frame size.
+ *
+ * @return 0 if every lookup found its own entry and the driver kept the intervals
+ * asked for, 1 otherwise.
+ */
+static int mode_table(FILE *out, acam_camera_t *cam)
+{
+    const acam_mode_t *modes;
+    unsigned int count = acam_get_modes(cam, &modes);
+    fprintf(out, ", \"modes\": {\"count\": %u", count);
+    for (unsigned int i = 0; i < count; i++)
+    {
+        const acam_mode_t *m = &modes[i];
+        const acam_mode_t *fastest = acam_find_mode(cam, m->fourcc, m->width, m->height, NULL);
+        if (acam_find_mode(cam, m->fourcc, m->width, m->height, &m->interval) != m || fastest == NULL ||
+            (uint64_t)fastest->interval.numerator * m->interval.denominator >
+                (uint64_t)m->interval.numerator * fastest->interval.denominator)
+        {
+            fprintf(stderr, "Mode %u (%ux%u, %u/%u) is not found again\n", i, m->width, m->height,
+                    m->interval.numerator, m->interval.denominator);
+            fprintf(out, "}");
+            return 1;
+        }
+    }
+    if (count == 0)
+    {
+        fprintf(out, "}");
+        return 0; // the driver does not enumerate its modes
+    }
+
+    const acam_mode_t *slowest = &modes[0];
+    while (slowest + 1 < modes + count && slowest[1].fourcc == modes[0].fourcc && slowest[1].width == modes[0].width &&
+           slowest[1].height == modes[0].height)
+    {
+        slowest++; // intervals of a size are sorted fastest first
+    }
+    const acam_mode_t *targets[2] = {slowest, &modes[0]};
+    double elapsed = 0;
+    int ret = 0;
+    for (int i = 0; i < 2 && ret == 0; i++)
+    {
+        struct v4l2_fract interval = {0};
+        double start = now_us();
+        ret = acam_set_mode(cam, targets[i]);
+        elapsed += now_us() - start;
+        if (ret == 0 && targets[i]->interval.numerator != 0 && acam_get_frame_interval(cam, &interval) == 0 &&
+            (uint64_t)interval.numerator * targets[i]->interval.denominator !=
+                (uint64_t)targets[i]->interval.numerator * interval.denominator)
+        {
+            fprintf(stderr, "The driver selected %u/%u instead of %u/%u\n", interval.numerator, interval.denominator,
+                    targets[i]->interval.numerator, targets[i]->interval.denominator);
+            ret = EINVAL;
+        }
+    }
+    fprintf(out, ", \"set_mode_us\": %.2f}", elapsed / 2);
+    if (ret != 0)
+    {
+        fprintf(stderr, "acam_set_mode failed: %s\n", strerror(ret));
+        return 1;
+    }
+    return 0;
+}
+
+#define MJPEG_CORRUPT_FRAMES 64 //damaged copies decoded by mjpeg_dc_corrupt
+
+/**
+ * @brief Feeds acam_mjpeg_decode_dc copies of an MJPEG frame with a damaged DHT
+ * segment spliced in after the SOI: more 1-bit codes than exist, more symbols than a
+ * table holds, a segment cut off by the end of the frame, and random code counts.
+ * The decoder must refuse the first three and survive all of them.
+ *
+ * @param refused set to the number of damaged frames refused.
+ * @return the number of the first three that were decoded as if valid.
+ */
+static int mjpeg_dc_corrupt(const acam_buffer_t *frame, uint8_t *dst, size_t dst_size, unsigned int *refused)
+{
+    uint8_t *buf = malloc(frame->bytes_used + 23 + 16 * 255);
+    if (buf == NULL)
+    {
+        return 1;
+    }
+    uint32_t rng = 0x2545f491;
+    int accepted = 0;
+    *refused = 0;
+    for (int c = 0; c < MJPEG_CORRUPT_FRAMES; c++)
+    {
+        uint8_t counts[16] = {0};
+        if (c == 0)
+        {
+            counts[0] = 3;
+        }
+        else if (c == 1)
+        {
+            counts[9] = counts[10] = 255;
+        }
+        for (int i = 0; c >= 2 && i < 16; i++)
+        {
+            rng ^= rng << 13;
+            rng ^= rng >> 17;
+            rng ^= rng << 5;
+            counts[i] = rng % 4;
+        }
+        size_t symbols = 0;
+        for (int i = 0; i < 16; i++)
+        {
+            symbols += counts[i];
+        }
+
+        // SOI, then DHT for DC table 0 with its counts and symbols, then the frame after its SOI
+        size_t length = 2 + 17 + symbols;
+        uint8_t header[7] = {0xff, 0xd8, 0xff, 0xc4, (uint8_t)(length >> 8), (uint8_t)length, 0x00};
+        memcpy(buf, header, sizeof(header));
+        memcpy(buf + 7, counts, 16);
+        for (size_t i = 0; i < symbols; i++)
+        {
+            buf[23 + i] = (uint8_t)(rng >> (i % 4 * 8));
+        }
+        memcpy(buf + 23 + symbols, frame->buf + 2, frame->bytes_used - 2);
+
+        acam_buffer_t copy = *frame;
+        copy.buf = (char *)buf;
+        copy.bytes_used = c == 2 ? 23 + symbols / 2 : 23 + symbols + frame->bytes_used - 2;
+        acam_mjpeg_dc_t dc;
+        if (acam_mjpeg_decode_dc(&copy, dst, dst_size, &dc) != 0)
+        {
+            (*refused)++;
+        }
+        else if (c < 3)
+        {
+            accepted++;
+        }
+    }
+    free(buf);
+    return accepted;
+}
+
+/**
+ * @brief Captures @param frames 1920x1080 MJPEG frames and decodes the DC
+ * coefficients of each one by one (acam_mjpeg_decode_dc) and then all at once on
+ * four threads (acam_mjpeg_decode_dc_burst). On the synthetic camera, whose frames
+ * are gradients of flat blocks, the 1/8-scale luma plane is checked block by block.
+ * Then decodes copies of the first frame with damaged Huffman tables, see
+ * mjpeg_dc_corrupt.
+ *
+ * @return 0 if every frame decoded and matches its gradient and the damaged copies
+ * were refused, 1 otherwise.
+ */
+static int mjpeg_dc(FILE *out, acam_camera_t *cam, int frames, int synthetic)
+{
+    int fmt = ACAM_MJPEG_1920_1080;
+    acam_get_ctrl(cam, ACAM_FORMAT, &fmt);
+    int ret = acam_set_ctrl(cam, ACAM_FORMAT, ACAM_MJPEG_1920_1080);
+    acam_buffer_t **buffers = calloc(frames, sizeof(*buffers));
+    acam_mjpeg_dc_job_t *jobs = calloc(frames, sizeof(*jobs));
+    size_t plane_size = 0;
+    samples_t decode_samples = {0};
+    double burst_us = 0;
+    int bad = 0, accepted = 0;
+    unsigned int refused = 0;
+
+    for (int i = 0; i < frames && ret == 0 && buffers != NULL && jobs != NULL; i++)
+    {
+        buffers[i] = acam_create_buffer(cam, &ret);
+        if (buffers[i] != NULL)
+        {
+            ret = acam_capture_image(cam, buffers[i]);
+        }
+        if (ret == 0 && plane_size == 0)
+        {
+            acam_mjpeg_dc_t dc;
+            ret = acam_mjpeg_decode_dc(buffers[i], NULL, 0, &dc);
+            plane_size = dc.size;
+            ret = ret == ENOBUFS ? 0 : ret == 0 ? EINVAL : ret;
+        }
+        if (ret == 0)
+        {
+            jobs[i].buffer = buffers[i];
+            jobs[i].dst_size = plane_size;
+            jobs[i].dst = malloc(plane_size);
+            if (jobs[i].dst == NULL)
+            {
+                ret = ENOMEM;
+            }
+        }
+    }
+    for (int i = 0; i < frames && ret == 0; i++)
+    {
+        double start = now_us();
+        ret = acam_mjpeg_decode_dc(jobs[i].buffer, jobs[i].dst, jobs[i].dst_size, &jobs[i].result);
+        samples_add(&decode_samples, now_us() - start);
+
+        const acam_mjpeg_dc_t *dc = &jobs[i].result;
+        for (unsigned int y = 0; ret == 0 && synthetic && y < dc->plane_height[0]; y++)
+        {
+            for (unsigned int x = 0; x < dc->plane_width[0]; x++)
+            {
+                if ((uint8_t)(dc->planes[0][y * dc->plane_width[0] + x] - dc->planes[0][0]) != (uint8_t)((x + y) * 8))
+                {
+                    bad++;
+                }
+            }
+        }
+        for (unsigned int c = 1; ret == 0 && synthetic && c < dc->components; c++)
+        {
+            for (size_t p = 0; p < (size_t)dc->plane_width[c] * dc->plane_height[c]; p++)
+            {
+                if (dc->planes[c][p] != 128)
+                {
+                    bad++;
+                }
+            }
+        }
+    }
+    if (ret == 0 && frames > 0)
+    {
+        double start = now_us();
+        ret = acam_mjpeg_decode_dc_burst(jobs, frames, 4);
+        burst_us = (now_us() - start) / frames;
+        accepted = mjpeg_dc_corrupt(jobs[0].buffer, jobs[0].dst, jobs[0].dst_size, &refused);
+    }
+
+    fprintf(out, ", \"mjpeg_dc\": {");
+    if (ret == 0 && frames > 0)
+    {
+        fprintf(out, "\"width\": %u, \"height\": %u, \"detail\": %.3f, ", jobs[0].result.plane_width[0],
+                jobs[0].result.plane_height[0], jobs[0].result.detail);
+    }
+    print_stats(out, "decode_dc", &decode_samples, 0);
+    fprintf(out, "\"burst_4_threads_us_per_frame\": %.3f, \"damaged_dht_refused\": %u, \"damaged_dht_frames\": %d}", burst_us,
+            refused, MJPEG_CORRUPT_FRAMES);
+    for (int i = 0; buffers != NULL && jobs != NULL && i < frames; i++)
+    {
+        if (buffers[i] != NULL)
+        {
+            acam_destroy_buffer(buffers[i]);
+        }
+        free(jobs[i].dst);
+    }
+    free(buffers);
+    free(jobs);
+    samples_free(&decode_samples);
+    acam_set_ctrl(cam, ACAM_FORMAT, fmt);
+
+    if (ret != 0)
+    {
+        fprintf(stderr, "Decoding the DC coefficients failed: %s\n", strerror(ret));
+        return 1;
+    }
+    if (bad != 0)
+    {
+        fprintf(stderr, "%d DC blocks do not match the synthetic gradient\n", bad);
+        return 1;
+    }
+    if (accepted != 0)
+    {
+        fprintf(stderr, "%d frames with damaged Huffman tables were decoded\n", accepted);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Streams @param frames frames into a shared-memory publisher read by a
+ * subscriber in a child process, which reads as fast as it can, and by one in this
+ * process that only reads once the stream is over.
+ *
+ * @return 0 if both subscribers account for every frame published as received or
+ * dropped and the stalled one dropped frames, 1 otherwise.
+ */
+static int shm_fanout(FILE *out, acam_camera_t *cam, int frames)
+{
+    int error;
+    acam_publisher_t *pub = acam_publisher_create(4, 0, &error);
+    if (pub == NULL)
+    {
+        fprintf(stderr, "acam_publisher_create failed: %s\n", strerror(error));
+        return 1;
+    }
+    int ready[2], results[2];
+    if (pipe(ready) == -1 || pipe(results) == -1)
+    {
+        perror("Creating pipes");
+        return 1;
+    }
+    pid_t child = fork();
+    if (child == 0)
+    {
+        acam_subscriber_stats_t stats = {0};
+        acam_subscriber_t *sub = acam_subscriber_open(acam_publisher_get_fd(pub), &error);
+        if (write(ready[1], "r", 1) != 1 || sub == NULL)
+        {
+            _exit(1);
+        }
+        acam_shm_frame_t frame;
+        volatile uint8_t sink;
+        while (acam_subscriber_next(sub, &frame, 1000) == 0)
+        {
+            sink = ((const uint8_t *)frame.data)[frame.bytes_used / 2]; // touch the frame in place
+            acam_subscriber_check(sub, &frame);
+        }
+        (void)sink;
+        acam_subscriber_get_stats(sub, &stats);
+        _exit(write(results[1], &stats, sizeof(stats)) == sizeof(stats) ? 0 : 1);
+    }
+    char byte;
+    acam_subscriber_t *stalled = acam_subscriber_open(acam_publisher_get_fd(pub), &error);
+    if (child == -1 || read(ready[0], &byte, 1) != 1 || stalled == NULL)
+    {
+        fprintf(stderr, "Starting the subscribers failed\n");
+        return 1;
+    }
+
+    int fmt = ACAM_MJPEG_1920_1080;
+    acam_get_ctrl(cam, ACAM_FORMAT, &fmt);
+    samples_t push_samples = {0};
+    int ret = acam_stream_start(cam, 0);
+    for (int i = 0; i < frames && ret == 0; i++)
+    {
+        acam_buffer_t *buffer;
+        ret = acam_stream_dequeue(cam, &buffer, 1000);
+        if (ret != 0)
+        {
+            break;
+        }
+        double start = now_us();
+        ret = acam_publisher_push(pub, buffer, fmt);
+        samples_add(&push_samples, now_us() - start);
+        if (ret == 0)
+        {
+            ret = acam_stream_requeue(cam, buffer);
+        }
+    }
+    acam_stream_stop(cam);
+    acam_publisher_stats_t published;
+    acam_publisher_get_stats(pub, &published);
+    acam_publisher_destroy(pub);
+
+    acam_subscriber_stats_t reader = {0}, late = {0};
+    int child_status = 0;
+    int got = read(results[0], &reader, sizeof(reader)) == sizeof(reader);
+    waitpid(child, &child_status, 0);
+    acam_shm_frame_t frame;
+    while (acam_subscriber_next(stalled, &frame, 0) == 0)
+    {
+        ;
+    }
+    acam_subscriber_get_stats(stalled, &late);
+    acam_subscriber_close(stalled);
+    close(ready[0]);
+    close(ready[1]);
+    close(results[0]);
+    close(results[1]);
+
+    fprintf(out, ", \"shm\": {\"published\": %llu, ", (unsigned long long)published.published);
+    fprintf(out, "\"subscriber\": {\"received\": %llu, \"dropped\": %llu, \"stale\": %llu}, ",
+            (unsigned long long)reader.received, (unsigned long long)reader.dropped, (unsigned long long)reader.stale);
+    fprintf(out, "\"stalled_subscriber\": {\"received\": %llu, \"dropped\": %llu}, ", (unsigned long long)late.received,
+            (unsigned long long)late.dropped);
+    print_stats(out, "publisher_push", &push_samples, 1);
+    samples_free(&push_samples);
+    fprintf(out, "}");
+    if (ret != 0)
+    {
+        fprintf(stderr, "Publishing failed: %s\n", strerror(ret));
+        return 1;
+    }
+    if (!got || !WIFEXITED(child_status) || WEXITSTATUS(child_status) != 0 ||
+        reader.received + reader.dropped != published.published || late.received + late.dropped != published.published ||
+        (published.published > 4 && late.dropped == 0))
+    {
+        fprintf(stderr, "The subscribers do not account for the %llu frames published\n",
+                (unsigned long long)published.published);
+        return 1;
+    }
+    return 0;
+}
+
+#define BENCH_SERVER_CLIENTS 4
+
+/**
+ * @brief Serves the camera on @param socket_path to BENCH_SERVER_CLIENTS client
+ * processes that read every frame they can, while two clients in this process take
+ * turns changing controls and the mode under the server's lock, until @param frames
+ * frames are published.
+ *
+ * @return 0 if the lock kept the second client out, the mode change reached the
+ * other client, and every reader received frames in order, accounting for no more
+ * than were published; 1 otherwise.
+ */
+static int server_fanout(FILE *out, acam_camera_t *cam, const char *socket_path, int frames)
+{
+    int go[2], ready[2], results[2];
+    if (pipe(go) == -1 || pipe(ready) == -1 || pipe(results) == -1)
+    {
+        perror("Creating pipes");
+        return 1;
+    }
+    // the readers are forked before the server thread exists
+    pid_t children[BENCH_SERVER_CLIENTS];
+    for (int c = 0; c < BENCH_SERVER_CLIENTS; c++)
+    {
+        children[c] = fork();
+        if (children[c] != 0)
+        {
+            continue;
+        }
+        char byte;
+        int error;
+        acam_client_t *client = read(go[0], &byte, 1) == 1 ? acam_client_connect(socket_path, &error) : NULL;
+        if (write(ready[1], "r", 1) != 1 || client == NULL)
+        {
+            _exit(1);
+        }
+        acam_subscriber_stats_t stats = {0};
+        acam_shm_frame_t frame;
+        uint64_t last = 0;
+        int in_order = 1;
+        volatile uint8_t sink;
+        while (acam_client_next(client, &frame, 1000) == 0)
+        {
+            sink = ((const uint8_t *)frame.data)[frame.bytes_used / 2]; // touch the frame in place
+            in_order &= stats.received == 0 || frame.index > last;
+            last = frame.index;
+            acam_subscriber_check(acam_client_get_subscriber(client), &frame);
+            acam_subscriber_get_stats(acam_client_get_subscriber(client), &stats);
+        }
+        (void)sink;
+        acam_client_close(client);
+        if (!in_order)
+        {
+            stats.received = 0;
+        }
+        _exit(write(results[1], &stats, sizeof(stats)) == sizeof(stats) ? 0 : 1);
+    }
+
+    int error = 0;
+    int ret = 0;
+    acam_server_t *server = acam_server_start(cam, socket_path, NULL, &error);
+    if (server == NULL)
+    {
+        fprintf(stderr, "acam_server_start failed: %s\n", strerror(error));
+    }
+    char bytes[BENCH_SERVER_CLIENTS];
+    memset(bytes, 'g', sizeof(bytes));
+    if (server == NULL || write(go[1], bytes, BENCH_SERVER_CLIENTS) != BENCH_SERVER_CLIENTS)
+    {
+        ret = 1;
+    }
+    for (int c = 0; c < BENCH_SERVER_CLIENTS && ret == 0; c++)
+    {
+        if (read(ready[0], bytes, 1) != 1)
+        {
+            ret = 1;
+        }
+    }
+    acam_client_t *owner = server ? acam_client_connect(socket_path, &error) : NULL;
+    acam_client_t *other = server ? acam_client_connect(socket_path, &error) : NULL;
+    if (owner == NULL || other == NULL)
+    {
+        fprintf(stderr, "acam_client_connect failed: %s\n", strerror(error));
+        ret = 1;
+    }
+
+    // arbitration: the lock keeps the other client's changes out, reads still work
+    acam_mode_t original = {0}, seen = {0};
+    const acam_mode_t *modes;
+    unsigned int mode_count = acam_get_modes(cam, &modes);
+    const acam_mode_t *target = NULL;
+    double set_mode_us = 0;
+    int value = 0;
+    if (ret == 0 && (acam_client_get_mode(owner, &original) != 0 || acam_client_lock(owner) != 0 ||
+                     acam_client_get_ctrl(other, ACAM_BRIGHTNESS, &value) != 0 ||
+                     acam_client_set_ctrl(other, ACAM_BRIGHTNESS, value) != EBUSY || acam_client_lock(other) != EBUSY))
+    {
+        fprintf(stderr, "The server's lock did not keep the second client out\n");
+        ret = 1;
+    }
+    for (unsigned int i = 0; i < mode_count && target == NULL; i++)
+    {
+        if (modes[i].fourcc == original.fourcc && (modes[i].width != original.width || modes[i].height != original.height))
+        {
+            target = &modes[i];
+        }
+    }
+    if (ret == 0 && target != NULL)
+    {
+        double start = now_us();
+        int r = acam_client_set_mode(owner, target->fourcc, target->width, target->height, NULL);
+        set_mode_us = now_us() - start;
+        if (r != 0 || acam_client_get_mode(other, &seen) != 0 || seen.width != target->width ||
+            seen.height != target->height)
+        {
+            fprintf(stderr, "The mode change did not reach the other client: %s\n", strerror(r));
+            ret = 1;
+        }
+    }
+    if (ret == 0 && (acam_client_unlock(owner) != 0 || acam_client_set_ctrl(other, ACAM_BRIGHTNESS, value) != 0))
+    {
+        fprintf(stderr, "The second client could not make changes after the unlock\n");
+        ret = 1;
+    }
+
+    acam_server_stats_t stats = {0};
+    double start = now_us();
+    while (ret == 0)
+    {
+        acam_server_get_stats(server, &stats);
+        if (stats.frames >= (uint64_t)frames || stats.error != 0 || now_us() - start > 10e6)
+        {
+            break;
+        }
+        usleep(1000);
+    }
+    double elapsed = now_us() - start;
+    if (ret == 0 && target != NULL)
+    {
+        acam_client_set_mode(owner, original.fourcc, original.width, original.height, &original.interval);
+    }
+    if (owner != NULL)
+    {
+        acam_client_close(owner);
+    }
+    if (other != NULL)
+    {
+        acam_client_close(other);
+    }
+    if (server != NULL)
+    {
+        acam_server_get_stats(server, &stats);
+        acam_server_stop(server);
+    }
+    close(go[1]); // readers still waiting to connect give up
+
+    acam_subscriber_stats_t readers[BENCH_SERVER_CLIENTS] = {{0}};
+    int failed = 0;
+    for (int c = 0; c < BENCH_SERVER_CLIENTS; c++)
+    {
+        int child_status = 0;
+        if (children[c] == -1 || read(results[0], &readers[c], sizeof(readers[c])) != sizeof(readers[c]))
+        {
+            failed = 1;
+        }
+        if (children[c] != -1)
+        {
+            waitpid(children[c], &child_status, 0);
+        }
+        failed |= !WIFEXITED(child_status) || WEXITSTATUS(child_status) != 0;
+    }
+    close(go[0]);
+    close(ready[0]);
+    close(ready[1]);
+    close(results[0]);
+    close(results[1]);
+
+    fprintf(out, ", \"server\": {\"clients\": %d, \"published\": %llu, \"requests\": %llu, \"busy\": %llu, ",
+            BENCH_SERVER_CLIENTS + 2, (unsigned long long)stats.frames, (unsigned long long)stats.requests,
+            (unsigned long long)stats.busy);
+    fprintf(out, "\"fps\": %.1f, \"client_set_mode_us\": %.2f, \"received\": [",
+            elapsed > 0 ? stats.frames * 1e6 / elapsed : 0.0, set_mode_us);
+    for (int c = 0; c < BENCH_SERVER_CLIENTS; c++)
+    {
+        fprintf(out, "%s%llu", c ? ", " : "", (unsigned long long)readers[c].received);
+        if (readers[c].received == 0 || readers[c].received + readers[c].dropped > stats.frames)
+        {
+            failed = 1;
+        }
+    }
+    fprintf(out, "]}");
+    if (ret == 0 && failed)
+    {
+        fprintf(stderr, "The server's clients do not account for the %llu frames published\n",
+                (unsigned long long)stats.frames);
+    }
+    return ret || failed;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [--device PATH] [--iterations N] [--opens N] [--output FILE] [--label NAME]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    const char *device = "synthetic:fps=120";
+    const char *output = NULL;
+    const char *label = "";
+    int iterations = 20;
+    int opens = 10;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 < argc && strcmp(argv[i], "--device") == 0)
+        {
+            device = argv[++i];
+        }
+        else if (i + 1 < argc && strcmp(argv[i], "--iterations") == 0)
+        {
+            iterations = atoi(argv[++i]);
+        }
+        else if (i + 1 < argc && strcmp(argv[i], "--opens") == 0)
+        {
+            opens = atoi(argv[++i]);
+        }
+        else if (i + 1 < argc && strcmp(argv[i], "--output") == 0)
+        {
+            output = argv[++i];
+        }
+        else if (i + 1 < argc && strcmp(argv[i], "--label") == 0)
+        {
+            label = argv[++i];
+        }
+        else
+        {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (iterations < 1 || opens < 1)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    char dir[] = "/tmp/acam_bench_XXXXXX";
+    if (mkdtemp(dir) == NULL)
+    {
+        perror("Creating scratch directory");
+        return 1;
+    }
+    char file_name[sizeof(dir) + 32];
+    snprintf(file_name, sizeof(file_name), "%s/frame", dir);
+    char async_name[sizeof(dir) + 32];
+    snprintf(async_name, sizeof(async_name), "%s/async", dir);
+    char recording[sizeof(dir) + 32];
+    snprintf(recording, sizeof(recording), "%s/recording", dir);
+    char event[sizeof(dir) + 32];
+    snprintf(event, sizeof(event), "%s/event", dir);
+    char cache[sizeof(dir) + 32];
+    snprintf(cache, sizeof(cache), "%s/cache", dir);
+    char server_path[sizeof(dir) + 32];
+    snprintf(server_path, sizeof(server_path), "%s/server", dir);
+
+    FILE *out = stdout;
+    if (output != NULL && (out = fopen(output, "w")) == NULL)
+    {
+        perror("Opening output file");
+        return 1;
+    }
+
+    int error = 0;
+    samples_t open_samples = {0};
+    samples_t cold_samples = {0};
+    samples_t warm_samples = {0};
+    unsigned long open_calls = 0;
+    unsigned long cold_calls = 0;
+    unsigned long warm_calls = 0;
+    if (time_opens(device, opens, &open_samples, &open_calls) != 0)
+    {
+        return 1;
+    }
+    // through the capability cache: the first open fills it, the others read it
+    if ((error = acam_set_cache_dir(cache)) != 0)
+    {
+        fprintf(stderr, "acam_set_cache_dir failed: %s\n", strerror(error));
+        return 1;
+    }
+    if (time_opens(device, 1, &cold_samples, &cold_calls) != 0 || time_opens(device, opens, &warm_samples, &warm_calls) != 0)
+    {
+        return 1;
+    }
+    acam_set_cache_dir(NULL);
+
+    acam_camera_t *cam = acam_open_backend(device, &timed_backend, &error);
+    if (cam == NULL)
+    {
+        fprintf(stderr, "acam_open %s failed: %s\n", device, strerror(error));
+        return 1;
+    }
+
+    fprintf(out, "{\"label\": \"%s\", \"device\": \"%s\", \"iterations\": %d, ", label, device, iterations);
+    print_stats(out, "acam_open", &open_samples, 0);
+    print_stats(out, "acam_open_cold", &cold_samples, 0);
+    print_stats(out, "acam_open_warm", &warm_samples, 0);
+    samples_free(&open_samples);
+    samples_free(&cold_samples);
+    samples_free(&warm_samples);
+    fprintf(out, "\"open_ioctls\": {\"uncached\": %lu, \"cold\": %lu, \"warm\": %lu}, ", open_calls, cold_calls, warm_calls);
+    fprintf(out, "\"formats\": [");
+
+    acam_writer_t *writer = acam_writer_create(NULL, &error);
+    if (writer == NULL)
+    {
+        fprintf(stderr, "acam_writer_create failed: %s\n", strerror(error));
+        return 1;
+    }
+
+    // small segments, so the benchmark also crosses into new segment files
+    acam_recorder_t *recorder = acam_recorder_open(recording, 8 * 1024 * 1024, &error);
+    if (recorder == NULL)
+    {
+        fprintf(stderr, "acam_recorder_open failed: %s\n", strerror(error));
+        return 1;
+    }
+    // an event triggered halfway through and kept open until the end
+    acam_pretrigger_config_t pretrigger_config = {0};
+    pretrigger_config.ring_bytes = 32 * 1024 * 1024;
+    pretrigger_config.post_ms = 60 * 1000;
+    pretrigger_config.segment_size = 8 * 1024 * 1024;
+    acam_pretrigger_t *pretrigger = acam_pretrigger_create(&pretrigger_config, &error);
+    if (pretrigger == NULL)
+    {
+        fprintf(stderr, "acam_pretrigger_create failed: %s\n", strerror(error));
+        return 1;
+    }
+    uint64_t appended = 0;
+    uint32_t last_size = 0;
+    struct timeval first_timestamp = {0};
+
+    int status = 0;
+    samples_t set_fmt_samples = {0}, capture_samples = {0}, write_samples = {0}, mjpeg_samples = {0}, submit_samples = {0};
+    samples_t append_samples = {0}, push_samples = {0};
+    for (int f = 0; f < __ACAM_FMT_COUNT && status == 0; f++)
+    {
+        samples_reset(&set_fmt_samples);
+        samples_reset(&capture_samples);
+        samples_reset(&write_samples);
+        samples_reset(&mjpeg_samples);
+        samples_reset(&submit_samples);
+        samples_reset(&append_samples);
+        samples_reset(&push_samples);
+        for (int s = 0; s < __STAGE_COUNT; s++)
+        {
+            samples_reset(&stage_samples[s]);
+        }
+
+        double start = now_us();
+        int ret = acam_set_ctrl(cam, ACAM_FORMAT, f);
+        samples_add(&set_fmt_samples, now_us() - start);
+
+        acam_buffer_t *buffer = ret == 0 ? acam_create_buffer(cam, &ret) : NULL;
+        if (buffer == NULL)
+        {
+            fprintf(stderr, "Preparing %s failed: %s\n", fmt_names[f], strerror(ret));
+            status = 1;
+            break;
+        }
+
+        for (int i = 0; i < iterations; i++)
+        {
+            timing_enabled = 1;
+            start = now_us();
+            ret = acam_capture_image(cam, buffer);
+            samples_add(&capture_samples, now_us() - start);
+            timing_enabled = 0;
+            if (ret != 0)
+            {
+                fprintf(stderr, "Capturing %s failed: %s\n", fmt_names[f], strerror(ret));
+                status = 1;
+                break;
+            }
+
+            start = now_us();
+            ret = acam_write_to_file(file_name, buffer);
+            samples_add(&write_samples, now_us() - start);
+            if (ret != 0)
+            {
+                fprintf(stderr, "Writing %s failed: %s\n", fmt_names[f], strerror(ret));
+                status = 1;
+                break;
+            }
+
+            start = now_us();
+            ret = acam_writer_submit(writer, async_name, buffer, NULL, NULL);
+            samples_add(&submit_samples, now_us() - start);
+            if (ret != 0 && ret != EAGAIN) // a full queue drops the frame, which is not a failure
+            {
+                fprintf(stderr, "Submitting %s failed: %s\n", fmt_names[f], strerror(ret));
+                status = 1;
+                break;
+            }
+
+            struct timeval timestamp;
+            gettimeofday(&timestamp, NULL);
+            if (appended == 0)
+            {
+                first_timestamp = timestamp;
+            }
+            start = now_us();
+            ret = acam_recorder_append(recorder, buffer, f, &timestamp, (uint32_t)appended);
+            samples_add(&append_samples, now_us() - start);
+            if (ret != 0)
+            {
+                fprintf(stderr, "Recording %s failed: %s\n", fmt_names[f], strerror(ret));
+                status = 1;
+                break;
+            }
+            appended++;
+            last_size = buffer->bytes_used;
+
+            if (f == __ACAM_FMT_COUNT / 2 && i == 0 && (ret = acam_pretrigger_trigger(pretrigger, event)) != 0)
+            {
+                fprintf(stderr, "Triggering the pre-trigger ring failed: %s\n", strerror(ret));
+                status = 1;
+                break;
+            }
+            start = now_us();
+            ret = acam_pretrigger_push(pretrigger, buffer, f, &timestamp, (uint32_t)appended);
+            samples_add(&push_samples, now_us() - start);
+            if (ret != 0 && ret != ENOBUFS) // a ring full of frames waiting for the disk drops the frame
+            {
+                fprintf(stderr, "Pushing %s failed: %s\n", fmt_names[f], strerror(ret));
+                status = 1;
+                break;
+            }
+
+            if (f <= ACAM_MJPEG_320_240)
+            {
+                start = now_us();
+                ret = acam_write_mjpeg_to_file(file_name, buffer);
+                samples_add(&mjpeg_samples, now_us() - start);
+                if (ret != 0)
+                {
+                    fprintf(stderr, "Writing %s as JPEG failed: %s\n", fmt_names[f], strerror(ret));
+                    status = 1;
+                    break;
+                }
+            }
+        }
+        uint32_t bytes_used = buffer->bytes_used;
+        acam_destroy_buffer(buffer);
+
+        fprintf(out, "%s{\"format\": \"%s\", \"bytes_used\": %u, ", f ? ", " : "", fmt_names[f], bytes_used);
+        print_stats(out, "set_fmt", &set_fmt_samples, 0);
+        fprintf(out, "\"capture\": {");
+        for (int s = 0; s < __STAGE_COUNT; s++)
+        {
+            print_stats(out, stage_names[s], &stage_samples[s], 0);
+        }
+        print_stats(out, "total", &capture_samples, 1);
+        fprintf(out, "}, ");
+        print_stats(out, "write_to_file", &write_samples, 0);
+        print_stats(out, "write_mjpeg_to_file", &mjpeg_samples, 0);
+        print_stats(out, "writer_submit", &submit_samples, 0);
+        print_stats(out, "recorder_append", &append_samples, 0);
+        print_stats(out, "pretrigger_push", &push_samples, 1);
+        fprintf(out, "}");
+    }
+    acam_writer_stats_t writer_stats;
+    acam_writer_flush(writer);
+    acam_writer_get_stats(writer, &writer_stats);
+    acam_writer_destroy(writer);
+    if (writer_stats.failed > 0)
+    {
+        fprintf(stderr, "The writer failed to write %llu files\n", (unsigned long long)writer_stats.failed);
+        status = 1;
+    }
+    fprintf(out, "], \"writer\": {\"written\": %llu, \"failed\": %llu, \"rejected\": %llu, \"queue_high_water\": %u}",
+            (unsigned long long)writer_stats.written, (unsigned long long)writer_stats.failed,
+            (unsigned long long)writer_stats.rejected, writer_stats.queue_high_water);
+    acam_recorder_close(recorder);
+    status |= check_recording(recording, appended, &first_timestamp, last_size);
+
+    acam_pretrigger_stats_t pretrigger_stats;
+    int event_error = acam_pretrigger_flush(pretrigger);
+    acam_pretrigger_get_stats(pretrigger, &pretrigger_stats);
+    acam_pretrigger_destroy(pretrigger);
+    if (event_error != 0 || pretrigger_stats.written == 0)
+    {
+        fprintf(stderr, "The pre-trigger event was not recorded: %s\n", strerror(event_error));
+        status = 1;
+    }
+    acam_reader_t *reader = acam_reader_open(event, &error);
+    if (reader == NULL || acam_reader_count(reader) != pretrigger_stats.written)
+    {
+        fprintf(stderr, "The pre-trigger recording does not hold the %llu frames written\n",
+                (unsigned long long)pretrigger_stats.written);
+        status = 1;
+    }
+    if (reader != NULL)
+    {
+        acam_reader_close(reader);
+    }
+    fprintf(out, ", \"pretrigger\": {\"written\": %llu, \"evicted\": %llu, \"dropped\": %llu}",
+            (unsigned long long)pretrigger_stats.written, (unsigned long long)pretrigger_stats.evicted,
+            (unsigned long long)pretrigger_stats.dropped);
+
+    if (warm_calls >= open_calls)
+    {
+        fprintf(stderr, "An open through the capability cache made %lu ioctls, %lu without it\n", warm_calls, open_calls);
+        status = 1;
+    }
+    status |= stream_stats(out, cam, iterations);
+    status |= mode_table(out, cam);
+    status |= mjpeg_dc(out, cam, iterations, strncmp(device, ACAM_SYNTHETIC_PREFIX, strlen(ACAM_SYNTHETIC_PREFIX)) == 0);
+    status |= shm_fanout(out, cam, 4 * iterations);
+    status |= server_fanout(out, cam, server_path, 4 * iterations);
+    fprintf(out, ", \"status\": %d}\n", status);
+
+    samples_free(&set_fmt_samples);
+    samples_free(&capture_samples);
+    samples_free(&write_samples);
+    samples_free(&mjpeg_samples);
+    samples_free(&submit_samples);
+    samples_free(&append_samples);
+    samples_free(&push_samples);
+    for (int s = 0; s < __STAGE_COUNT; s++)
+    {
+        samples_free(&stage_samples[s]);
+    }
+    acam_close(cam);
+    unlink(file_name);
+    unlink(async_name);
+    remove_recording(recording);
+    remove_recording(event);
+    remove_cache(cache);
+    rmdir(dir);
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+
+    return status;
+}
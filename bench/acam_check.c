@@ -0,0 +1,1267 @@
+#include "acam_control.h"
+#include "acam_jpeg_tables.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+
+/**
+ * @brief Functional checks of the library against the synthetic camera, for the
+ * paths the benchmarks do not reach. Prints what each check observed as JSON and
+ * exits non-zero if any of them fails. It covers:
+ *  - acam_get_ctrl_batch and acam_set_ctrl_batch, with and without extended-control
+ *    support, counting the control writes that reach the driver (acam_trace_snapshot)
+ *  - acam_load_struct of the same struct twice, the second time without any write
+ *  - frame handles: their DMABUF fds (VIDIOC_EXPBUF) and acam_frame_ref/acam_frame_release
+ *  - capture into pools from acam_pool_create and acam_pool_wrap, and the memory
+ *    acam_pool_wrap and acam_stream_start_userptr refuse
+ *  - acam_stream_try_dequeue and acam_stream_try_dequeue_frame around polling acam_get_fd
+ *  - capture workers with stalling consumers under both policies, and stopping a worker
+ *    while a consumer is blocked in acam_worker_get_frame
+ *  - a camera group with a camera that fails while the others keep delivering
+ *  - acam_mjpeg_prepare of frames without Huffman tables, padded, truncated and corrupt
+ *    frames, and the files acam_write_mjpeg_to_file writes for them
+ *  - files written by acam_writer_submit and acam_writer_submit_frame through every
+ *    writer configuration, read back byte for byte
+ *  - publishing into a frame ring whose control page a subscriber has overwritten
+ *
+ * Cameras without extended controls are simulated by wrapping the synthetic camera's
+ * backend and refusing VIDIOC_G_EXT_CTRLS, VIDIOC_S_EXT_CTRLS and VIDIOC_TRY_EXT_CTRLS.
+ *
+ * Usage: acam_check [--device PATH] [--output FILE]
+ * PATH is a synthetic camera ("synthetic:fps=240").
+ *
+ */
+
+static unsigned int failures;
+
+/**
+ * @brief Reports a failed expectation on stderr and counts it.
+ *
+ * @return ok, so a check can be chained into its caller's condition
+ */
+static int expect(int ok, const char *fmt, ...)
+{
+    if (!ok)
+    {
+        va_list args;
+        va_start(args, fmt);
+        fprintf(stderr, "FAIL: ");
+        vfprintf(stderr, fmt, args);
+        fprintf(stderr, "\n");
+        va_end(args);
+        failures++;
+    }
+    return ok;
+}
+
+/**
+ * @brief The calls the library made to one ioctl since the counters were last reset.
+ *
+ */
+static uint64_t trace_calls(const char *name)
+{
+    static acam_trace_entry_t entries[ACAM_TRACE_MAX_ENTRIES];
+    unsigned int count = acam_trace_snapshot(entries, ACAM_TRACE_MAX_ENTRIES);
+    for (unsigned int i = 0; i < count; i++)
+    {
+        if (entries[i].kind == ACAM_TRACE_IOCTL && strcmp(entries[i].name, name) == 0)
+        {
+            return entries[i].calls;
+        }
+    }
+    return 0;
+}
+
+static int plain_open(const char *cam_file, int flags, void **ctx)
+{
+    return acam_synthetic_backend.open(cam_file, flags, ctx);
+}
+
+static int plain_close(void *ctx, int fd)
+{
+    return acam_synthetic_backend.close(ctx, fd);
+}
+
+static int no_ext_ioctl(void *ctx, int fd, unsigned long request, void *arg)
+{
+    if (request == VIDIOC_G_EXT_CTRLS || request == VIDIOC_S_EXT_CTRLS || request == VIDIOC_TRY_EXT_CTRLS)
+    {
+        errno = ENOTTY;
+        return -1;
+    }
+    return acam_synthetic_backend.ioctl(ctx, fd, request, arg);
+}
+
+static void *plain_mmap(void *ctx, int fd, size_t length, int prot, int flags, off_t offset)
+{
+    return acam_synthetic_backend.mmap(ctx, fd, length, prot, flags, offset);
+}
+
+static int plain_poll(void *ctx, int fd, int timeout_ms)
+{
+    return acam_synthetic_backend.poll(ctx, fd, timeout_ms);
+}
+
+static const acam_backend_t no_ext_backend = {
+    "synthetic without extended controls",
+    plain_open,
+    plain_close,
+    no_ext_ioctl,
+    plain_mmap,
+    plain_poll,
+};
+
+/**
+ * @brief Reads every control with acam_get_ctrl_batch and compares it with the device,
+ * then changes one control with acam_set_ctrl_batch and applies the same values again.
+ * The first call must write exactly the changed control, the second nothing.
+ *
+ */
+static void check_ctrl_batch(FILE *out, const char *device, const acam_backend_t *backend)
+{
+    int error = 0;
+    acam_camera_t *cam = acam_open_backend(device, backend, &error);
+    if (!expect(cam != NULL, "%s: acam_open_backend: %s", backend->name, strerror(error)))
+    {
+        fprintf(out, "null");
+        return;
+    }
+
+    acam_ctrls_struct ctrls;
+    int ret = acam_get_ctrl_batch(cam, &ctrls);
+    expect(ret == 0, "%s: acam_get_ctrl_batch: %s", backend->name, strerror(ret));
+    unsigned int mismatched = 0;
+    for (int i = 0; i < ACAM_FORMAT; i++)
+    {
+        int value;
+        if (acam_read_ctrl(cam, i, &value) == 0 && value != ctrls.value[i])
+        {
+            mismatched++;
+        }
+    }
+    expect(mismatched == 0, "%s: acam_get_ctrl_batch differs from the device for %u controls", backend->name, mismatched);
+
+    ctrls.value[ACAM_BRIGHTNESS] += 10;
+    acam_trace_reset();
+    acam_trace_set_flags(ACAM_TRACE_COUNTERS);
+    ret = acam_set_ctrl_batch(cam, &ctrls);
+    acam_trace_set_flags(0);
+    uint64_t ext_writes = trace_calls("VIDIOC_S_EXT_CTRLS");
+    uint64_t single_writes = trace_calls("VIDIOC_S_CTRL");
+    expect(ret == 0, "%s: acam_set_ctrl_batch: %s", backend->name, strerror(ret));
+    expect(ext_writes == 1, "%s: %llu S_EXT_CTRLS calls for one changed control", backend->name, (unsigned long long)ext_writes);
+    expect(single_writes == (backend == &no_ext_backend ? 1u : 0u), "%s: %llu S_CTRL calls for one changed control",
+           backend->name, (unsigned long long)single_writes);
+    int brightness = 0;
+    acam_read_ctrl(cam, ACAM_BRIGHTNESS, &brightness);
+    expect(brightness == ctrls.value[ACAM_BRIGHTNESS], "%s: brightness is %d after setting %d", backend->name,
+           brightness, ctrls.value[ACAM_BRIGHTNESS]);
+
+    acam_trace_reset();
+    acam_trace_set_flags(ACAM_TRACE_COUNTERS);
+    ret = acam_set_ctrl_batch(cam, &ctrls);
+    acam_trace_set_flags(0);
+    uint64_t repeat_writes = trace_calls("VIDIOC_S_EXT_CTRLS") + trace_calls("VIDIOC_S_CTRL");
+    expect(ret == 0 && repeat_writes == 0, "%s: %llu control writes for unchanged values", backend->name,
+           (unsigned long long)repeat_writes);
+
+    fprintf(out, "{\"mismatched\": %u, \"ext_writes\": %llu, \"single_writes\": %llu, \"repeat_writes\": %llu}",
+            mismatched, (unsigned long long)ext_writes, (unsigned long long)single_writes, (unsigned long long)repeat_writes);
+    acam_close(cam);
+}
+
+/**
+ * @brief Loads a struct that changes controls, a manual white balance and the format,
+ * checks the device took it, then loads the same struct again: the second load must
+ * not write a single control or format.
+ *
+ */
+static void check_load_struct(FILE *out, const char *device, const acam_backend_t *backend)
+{
+    int error = 0;
+    acam_camera_t *cam = acam_open_backend(device, backend, &error);
+    if (!expect(cam != NULL, "%s: acam_open_backend: %s", backend->name, strerror(error)))
+    {
+        fprintf(out, "null");
+        return;
+    }
+
+    acam_ctrls_struct ctrls;
+    acam_save_default_struct(cam, &ctrls);
+    ctrls.value[ACAM_CONTRAST] = 40;
+    ctrls.value[ACAM_GAIN] = 50;
+    ctrls.value[ACAM_AUTO_WHITE_BALANCE] = 0;
+    ctrls.value[ACAM_WHITE_BALANCE_TEMPERATURE] = 3200;
+    ctrls.value[ACAM_FORMAT] = ACAM_YUYV_640_480;
+
+    acam_trace_reset();
+    acam_trace_set_flags(ACAM_TRACE_COUNTERS);
+    int ret = acam_load_struct(cam, &ctrls);
+    acam_trace_set_flags(0);
+    uint64_t first_writes = trace_calls("VIDIOC_S_CTRL") + trace_calls("VIDIOC_S_EXT_CTRLS") + trace_calls("VIDIOC_S_FMT");
+    expect(ret == 0, "%s: acam_load_struct: %s", backend->name, strerror(ret));
+    const acam_ctrl_tag_t changed[] = {ACAM_CONTRAST, ACAM_GAIN, ACAM_AUTO_WHITE_BALANCE, ACAM_WHITE_BALANCE_TEMPERATURE};
+    for (unsigned int i = 0; i < sizeof(changed) / sizeof(changed[0]); i++)
+    {
+        int value = 0;
+        acam_read_ctrl(cam, changed[i], &value);
+        expect(value == ctrls.value[changed[i]], "%s: control %d is %d after loading %d", backend->name, changed[i], value,
+               ctrls.value[changed[i]]);
+    }
+    acam_mode_t mode;
+    expect(acam_get_mode(cam, &mode) == 0 && mode.fmt == ACAM_YUYV_640_480,
+           "%s: the format was not loaded", backend->name);
+
+    acam_trace_reset();
+    acam_trace_set_flags(ACAM_TRACE_COUNTERS);
+    ret = acam_load_struct(cam, &ctrls);
+    acam_trace_set_flags(0);
+    uint64_t ctrl_writes = trace_calls("VIDIOC_S_CTRL") + trace_calls("VIDIOC_S_EXT_CTRLS");
+    uint64_t fmt_writes = trace_calls("VIDIOC_S_FMT");
+    expect(ret == 0 && ctrl_writes == 0 && fmt_writes == 0, "%s: reloading the same struct wrote %llu controls and %llu formats",
+           backend->name, (unsigned long long)ctrl_writes, (unsigned long long)fmt_writes);
+
+    fprintf(out, "{\"first_writes\": %llu, \"repeat_ctrl_writes\": %llu, \"repeat_fmt_writes\": %llu}",
+            (unsigned long long)first_writes, (unsigned long long)ctrl_writes, (unsigned long long)fmt_writes);
+    acam_close(cam);
+}
+
+/**
+ * @brief Dequeues frame handles from a stream and checks their DMABUF fds show the
+ * mapped bytes, and that the buffer goes back to the driver only when the last of
+ * several holders releases it.
+ *
+ */
+static void check_frame_refs(FILE *out, const char *device)
+{
+    int error = 0;
+    acam_camera_t *cam = acam_open_backend(device, &acam_synthetic_backend, &error);
+    if (!expect(cam != NULL, "frame refs: acam_open_backend: %s", strerror(error)))
+    {
+        fprintf(out, "null");
+        return;
+    }
+    int ret = acam_stream_start(cam, 4);
+    if (!expect(ret == 0, "frame refs: acam_stream_start: %s", strerror(ret)))
+    {
+        fprintf(out, "null");
+        acam_close(cam);
+        return;
+    }
+
+    unsigned int exported = 0;
+    unsigned int early_requeues = 0;
+    unsigned int final_requeues = 0;
+    for (int n = 0; n < 8; n++)
+    {
+        acam_frame_t *frame;
+        ret = acam_stream_dequeue_frame(cam, &frame, 1000);
+        if (!expect(ret == 0, "frame refs: acam_stream_dequeue_frame: %s", strerror(ret)))
+        {
+            break;
+        }
+        if (expect(frame->fd != -1, "frame refs: buffer %u was not exported", frame->buffer->index))
+        {
+            void *view = mmap(NULL, frame->bytes_used, PROT_READ, MAP_SHARED, frame->fd, 0);
+            if (expect(view != MAP_FAILED, "frame refs: mapping the DMABUF fd: %s", strerror(errno)))
+            {
+                exported += memcmp(view, frame->buffer->buf, frame->bytes_used) == 0;
+                munmap(view, frame->bytes_used);
+            }
+        }
+
+        acam_frame_ref(frame);
+        acam_frame_ref(frame);
+        acam_trace_reset();
+        acam_trace_set_flags(ACAM_TRACE_COUNTERS);
+        expect(acam_frame_release(frame) == 0 && acam_frame_release(frame) == 0, "frame refs: releasing a shared frame failed");
+        early_requeues += trace_calls("VIDIOC_QBUF");
+        ret = acam_frame_release(frame);
+        acam_trace_set_flags(0);
+        expect(ret == 0, "frame refs: releasing the last holder: %s", strerror(ret));
+        final_requeues += trace_calls("VIDIOC_QBUF");
+    }
+    expect(exported == 8, "frame refs: %u of 8 DMABUF fds showed the frame", exported);
+    expect(early_requeues == 0, "frame refs: %u buffers requeued while held", early_requeues);
+    expect(final_requeues == 8, "frame refs: %u of 8 buffers requeued by their last holder", final_requeues);
+
+    fprintf(out, "{\"exported\": %u, \"early_requeues\": %u, \"final_requeues\": %u}", exported, early_requeues,
+            final_requeues);
+    acam_stream_stop(cam);
+    acam_close(cam);
+}
+
+/**
+ * @brief Streams a few frames into a pool and checks each one landed inside the pool's
+ * arena.
+ *
+ * @return the number of frames captured into the pool
+ */
+static unsigned int stream_into_pool(acam_camera_t *cam, acam_pool_t *pool, const char *what)
+{
+    int ret = acam_stream_start_userptr(cam, pool);
+    if (!expect(ret == 0, "%s: acam_stream_start_userptr: %s", what, strerror(ret)))
+    {
+        return 0;
+    }
+    unsigned int captured = 0;
+    for (int n = 0; n < 6; n++)
+    {
+        acam_frame_t *frame;
+        ret = acam_stream_dequeue_frame(cam, &frame, 1000);
+        if (!expect(ret == 0, "%s: acam_stream_dequeue_frame: %s", what, strerror(ret)))
+        {
+            break;
+        }
+        char *buf = frame->buffer->buf;
+        captured += buf >= pool->base && buf + frame->bytes_used <= pool->base + pool->size && frame->bytes_used > 0 &&
+                    (buf - pool->base) % pool->buffer_size == 0 && frame->fd == -1;
+        acam_frame_release(frame);
+    }
+    acam_stream_stop(cam);
+    expect(captured == 6, "%s: %u of 6 frames were captured into the pool", what, captured);
+    return captured;
+}
+
+/**
+ * @brief The error acam_pool_wrap reports for some memory, 0 if it accepts it.
+ *
+ */
+static int wrap_error(void *mem, size_t buffer_size, unsigned int count)
+{
+    int error = 0;
+    acam_pool_t *pool = acam_pool_wrap(mem, buffer_size, count, &error);
+    if (pool != NULL)
+    {
+        acam_pool_destroy(pool);
+        return 0;
+    }
+    return error;
+}
+
+/**
+ * @brief Captures into pools from acam_pool_create and acam_pool_wrap, and checks that
+ * misaligned, partial-page and undersized memory is refused with EINVAL.
+ *
+ */
+static void check_pools(FILE *out, const char *device)
+{
+    int error = 0;
+    acam_camera_t *cam = acam_open_backend(device, &acam_synthetic_backend, &error);
+    if (!expect(cam != NULL, "pools: acam_open_backend: %s", strerror(error)))
+    {
+        fprintf(out, "null");
+        return;
+    }
+    acam_set_ctrl(cam, ACAM_FORMAT, ACAM_YUYV_640_480);
+
+    unsigned int created = 0;
+    acam_pool_t *pool = acam_pool_create(cam, 4, 0, &error);
+    if (expect(pool != NULL, "pools: acam_pool_create: %s", strerror(error)))
+    {
+        expect(pool->count == 4 && pool->owned && pool->buffer_size >= 640 * 480 * 2 &&
+                   pool->buffer_size % getpagesize() == 0 && pool->size == pool->count * pool->buffer_size,
+               "pools: acam_pool_create laid out %u buffers of %zu bytes", pool->count, pool->buffer_size);
+        created = stream_into_pool(cam, pool, "created pool");
+        acam_pool_destroy(pool);
+    }
+
+    size_t page = getpagesize();
+    size_t buffer_size = (640 * 480 * 2 + page - 1) / page * page;
+    char *mem = mmap(NULL, 4 * buffer_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (!expect(mem != MAP_FAILED, "pools: allocating caller memory: %s", strerror(errno)))
+    {
+        fprintf(out, "null");
+        acam_close(cam);
+        return;
+    }
+    unsigned int wrapped = 0;
+    pool = acam_pool_wrap(mem, buffer_size, 4, &error);
+    if (expect(pool != NULL, "pools: acam_pool_wrap: %s", strerror(error)))
+    {
+        expect(pool->base == mem && !pool->owned, "pools: acam_pool_wrap does not describe the caller's memory");
+        wrapped = stream_into_pool(cam, pool, "wrapped pool");
+        acam_pool_destroy(pool);
+    }
+
+    int misaligned = wrap_error(mem + 64, buffer_size, 4);
+    expect(misaligned == EINVAL, "pools: wrapping misaligned memory gave %s", strerror(misaligned));
+    int partial_page = wrap_error(mem, buffer_size - 64, 4);
+    expect(partial_page == EINVAL, "pools: wrapping buffers of part of a page gave %s", strerror(partial_page));
+    int undersized = 0;
+    pool = acam_pool_wrap(mem, page, 4, &error);
+    if (expect(pool != NULL, "pools: acam_pool_wrap of one page per buffer: %s", strerror(error)))
+    {
+        undersized = acam_stream_start_userptr(cam, pool);
+        expect(undersized == EINVAL, "pools: streaming into undersized buffers gave %s", strerror(undersized));
+        if (undersized == 0)
+        {
+            acam_stream_stop(cam);
+        }
+        acam_pool_destroy(pool);
+    }
+    munmap(mem, 4 * buffer_size);
+
+    fprintf(out, "{\"created\": %u, \"wrapped\": %u, \"misaligned\": \"%s\", \"partial_page\": \"%s\", \"undersized\": \"%s\"}",
+            created, wrapped, strerror(misaligned), strerror(partial_page), strerror(undersized));
+    acam_close(cam);
+}
+
+/**
+ * @brief Polls the camera's fd like an event loop would: acam_stream_try_dequeue and
+ * acam_stream_try_dequeue_frame must return EAGAIN until it reports a frame, and a
+ * frame once it has. The camera runs at 5 fps so a frame is never ready by accident.
+ *
+ */
+static void check_try_dequeue(FILE *out)
+{
+    int error = 0;
+    acam_camera_t *cam = acam_open_backend(ACAM_SYNTHETIC_PREFIX ":fps=5", &acam_synthetic_backend, &error);
+    if (!expect(cam != NULL, "try dequeue: acam_open_backend: %s", strerror(error)))
+    {
+        fprintf(out, "null");
+        return;
+    }
+    int ret = acam_stream_start(cam, 4);
+    if (!expect(ret == 0, "try dequeue: acam_stream_start: %s", strerror(ret)))
+    {
+        fprintf(out, "null");
+        acam_close(cam);
+        return;
+    }
+
+    struct pollfd pfd = {0};
+    pfd.fd = acam_get_fd(cam);
+    pfd.events = POLLIN;
+    unsigned int early = 0;
+    unsigned int ready = 0;
+    for (int n = 0; n < 3; n++)
+    {
+        acam_buffer_t *buffer;
+        acam_frame_t *frame;
+        int before = acam_stream_try_dequeue(cam, &buffer);
+        int before_frame = acam_stream_try_dequeue_frame(cam, &frame);
+        early += before == EAGAIN && before_frame == EAGAIN;
+        expect(before == EAGAIN && before_frame == EAGAIN, "try dequeue: %s and %s before the fd was readable",
+               strerror(before), strerror(before_frame));
+        if (!expect(poll(&pfd, 1, 2000) == 1 && (pfd.revents & POLLIN), "try dequeue: the fd never became readable"))
+        {
+            break;
+        }
+        if (n % 2 == 0)
+        {
+            ret = acam_stream_try_dequeue(cam, &buffer);
+            if (expect(ret == 0, "try dequeue: acam_stream_try_dequeue after POLLIN: %s", strerror(ret)))
+            {
+                ready += buffer->bytes_used > 0;
+                acam_stream_requeue(cam, buffer);
+            }
+        }
+        else
+        {
+            ret = acam_stream_try_dequeue_frame(cam, &frame);
+            if (expect(ret == 0, "try dequeue: acam_stream_try_dequeue_frame after POLLIN: %s", strerror(ret)))
+            {
+                ready += frame->bytes_used > 0;
+                acam_frame_release(frame);
+            }
+        }
+    }
+    expect(early == 3 && ready == 3, "try dequeue: %u of 3 early tries refused, %u of 3 frames taken", early, ready);
+
+    fprintf(out, "{\"early_eagain\": %u, \"ready\": %u}", early, ready);
+    acam_stream_stop(cam);
+    acam_close(cam);
+}
+
+/**
+ * @brief Opens a synthetic camera producing small YUYV frames, for the checks that
+ * run a worker or a group and only care about frame delivery.
+ *
+ */
+static acam_camera_t *open_small(const char *device, const char *what)
+{
+    int error = 0;
+    acam_camera_t *cam = acam_open_backend(device, &acam_synthetic_backend, &error);
+    if (!expect(cam != NULL, "%s: acam_open_backend: %s", what, strerror(error)))
+    {
+        return NULL;
+    }
+    acam_set_ctrl(cam, ACAM_FORMAT, ACAM_YUYV_320_240);
+    return cam;
+}
+
+static void sleep_ms(int ms)
+{
+    struct timespec ts = {ms / 1000, (long)(ms % 1000) * 1000000};
+    nanosleep(&ts, NULL);
+}
+
+/**
+ * @brief Takes frames from a worker until it has none left, checking their order.
+ *
+ * @return the number of frames taken, 0 if they were out of order
+ */
+static unsigned int drain_in_order(acam_worker_t *worker, uint32_t *last_sequence, int *have_sequence)
+{
+    unsigned int taken = 0;
+    int in_order = 1;
+    acam_frame_t *frame;
+    while (acam_worker_get_frame(worker, &frame, 0) == 0)
+    {
+        in_order &= !*have_sequence || frame->sequence > *last_sequence;
+        *last_sequence = frame->sequence;
+        *have_sequence = 1;
+        taken++;
+        acam_frame_release(frame);
+    }
+    return in_order ? taken : 0;
+}
+
+typedef struct
+{
+    acam_worker_t *worker;
+    int entered;
+    int ret;
+} blocked_consumer_t;
+
+static void *blocked_consumer(void *arg)
+{
+    blocked_consumer_t *consumer = arg;
+    acam_frame_t *frame;
+    __atomic_store_n(&consumer->entered, 1, __ATOMIC_RELEASE);
+    consumer->ret = acam_worker_get_frame(consumer->worker, &frame, -1);
+    if (consumer->ret == 0)
+    {
+        acam_frame_release(frame);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Runs capture workers against consumers that stall:
+ *  - KEEP_LATEST must drop the frames nobody took as stale and hand out newer ones
+ *  - KEEP_ALL must deliver every frame in order, queue up to its ring while the consumer
+ *    stalls and leave the rest to the driver, which drops them
+ *  - stopping a worker must wake a consumer blocked waiting for a frame with ECANCELED
+ *
+ */
+static void check_worker(FILE *out, const char *device)
+{
+    int error = 0;
+    acam_worker_stats_t latest = {0};
+    acam_camera_t *cam = open_small(device, "worker");
+    if (cam == NULL)
+    {
+        fprintf(out, "null");
+        return;
+    }
+    acam_worker_t *worker = acam_worker_start(cam, ACAM_WORKER_KEEP_LATEST, 4, &error);
+    if (expect(worker != NULL, "worker: acam_worker_start(KEEP_LATEST): %s", strerror(error)))
+    {
+        uint32_t last_sequence = 0;
+        int newer = 1;
+        for (int n = 0; n < 3; n++)
+        {
+            sleep_ms(100);
+            acam_frame_t *frame;
+            int ret = acam_worker_get_frame(worker, &frame, 1000);
+            if (!expect(ret == 0, "worker: KEEP_LATEST get_frame: %s", strerror(ret)))
+            {
+                break;
+            }
+            newer &= n == 0 || frame->sequence > last_sequence + 1;
+            last_sequence = frame->sequence;
+            acam_frame_release(frame);
+        }
+        acam_worker_get_stats(worker, &latest);
+        expect(newer, "worker: KEEP_LATEST handed out a frame that was not the newest");
+        expect(latest.dropped_stale > 0 && latest.delivered == 3 && latest.captured >= latest.dropped_stale + latest.delivered,
+               "worker: KEEP_LATEST captured %llu, delivered %llu, dropped %llu as stale", (unsigned long long)latest.captured,
+               (unsigned long long)latest.delivered, (unsigned long long)latest.dropped_stale);
+        acam_worker_stop(worker);
+    }
+
+    acam_worker_stats_t all = {0};
+    unsigned int taken = 0;
+    worker = acam_worker_start(cam, ACAM_WORKER_KEEP_ALL, 4, &error);
+    if (expect(worker != NULL, "worker: acam_worker_start(KEEP_ALL): %s", strerror(error)))
+    {
+        uint32_t last_sequence = 0;
+        int have_sequence = 0;
+        int in_order = 1;
+        for (int n = 0; n < 10; n++)
+        {
+            acam_frame_t *frame;
+            int ret = acam_worker_get_frame(worker, &frame, 1000);
+            if (!expect(ret == 0, "worker: KEEP_ALL get_frame: %s", strerror(ret)))
+            {
+                break;
+            }
+            in_order &= !have_sequence || frame->sequence > last_sequence;
+            last_sequence = frame->sequence;
+            have_sequence = 1;
+            taken++;
+            acam_frame_release(frame);
+        }
+        sleep_ms(200); // the consumer stalls for about 48 frames
+        unsigned int drained = drain_in_order(worker, &last_sequence, &have_sequence);
+        taken += drained;
+        // the first frame after the stall shows the gap the driver left
+        acam_frame_t *frame;
+        if (expect(acam_worker_get_frame(worker, &frame, 1000) == 0, "worker: KEEP_ALL no frame after the stall"))
+        {
+            in_order &= frame->sequence > last_sequence;
+            taken++;
+            acam_frame_release(frame);
+        }
+        acam_worker_get_stats(worker, &all);
+        expect(in_order && drained > 0, "worker: KEEP_ALL delivered frames out of order");
+        expect(all.queue_high_water >= 3 && all.queue_high_water <= 4, "worker: KEEP_ALL queued %u of 4 buffers during the stall",
+               all.queue_high_water);
+        expect(all.dropped_device > 0 && all.dropped_stale == 0, "worker: KEEP_ALL stall dropped %llu frames at the device, %llu as stale",
+               (unsigned long long)all.dropped_device, (unsigned long long)all.dropped_stale);
+        expect(all.delivered == taken, "worker: KEEP_ALL counted %llu deliveries for %u frames taken", (unsigned long long)all.delivered, taken);
+        acam_worker_stop(worker);
+    }
+    acam_close(cam);
+
+    // at 1 fps the consumer is still waiting for its first frame when the worker stops
+    int blocked = -1;
+    cam = open_small(ACAM_SYNTHETIC_PREFIX ":fps=1", "worker");
+    worker = cam ? acam_worker_start(cam, ACAM_WORKER_KEEP_ALL, 4, &error) : NULL;
+    if (cam != NULL && expect(worker != NULL, "worker: acam_worker_start at 1 fps: %s", strerror(error)))
+    {
+        blocked_consumer_t consumer = {worker, 0, -1};
+        pthread_t thread;
+        if (expect(pthread_create(&thread, NULL, blocked_consumer, &consumer) == 0, "worker: starting a consumer thread"))
+        {
+            while (!__atomic_load_n(&consumer.entered, __ATOMIC_ACQUIRE))
+            {
+                sleep_ms(1);
+            }
+            sleep_ms(50);
+            expect(acam_worker_stop(worker) == 0, "worker: stopping with a blocked consumer failed");
+            pthread_join(thread, NULL);
+            blocked = consumer.ret;
+            expect(blocked == ECANCELED, "worker: the blocked consumer got %s", strerror(blocked));
+        }
+        else
+        {
+            acam_worker_stop(worker);
+        }
+    }
+    if (cam != NULL)
+    {
+        acam_close(cam);
+    }
+
+    fprintf(out, "{\"latest\": {\"captured\": %llu, \"delivered\": %llu, \"dropped_stale\": %llu}, ",
+            (unsigned long long)latest.captured, (unsigned long long)latest.delivered, (unsigned long long)latest.dropped_stale);
+    fprintf(out, "\"all\": {\"captured\": %llu, \"delivered\": %llu, \"dropped_device\": %llu, \"queue_high_water\": %u}, ",
+            (unsigned long long)all.captured, (unsigned long long)all.delivered, (unsigned long long)all.dropped_device,
+            all.queue_high_water);
+    fprintf(out, "\"blocked_consumer\": \"%s\"}", blocked == -1 ? "not run" : strerror(blocked));
+}
+
+#define GROUP_CAMERAS 3
+
+typedef struct
+{
+    acam_group_t *group;
+    uint64_t frames[GROUP_CAMERAS];
+    uint64_t misrouted;
+} group_count_t;
+
+static void count_group_frame(acam_frame_t *frame, unsigned int camera, void *user)
+{
+    group_count_t *count = user;
+    if (camera >= GROUP_CAMERAS || frame->cam != acam_group_get_camera(count->group, camera))
+    {
+        __atomic_add_fetch(&count->misrouted, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    __atomic_add_fetch(&count->frames[camera], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Runs a group of cameras on two workers, one of which fails after a few frames.
+ * The failed camera must leave the event loop with its error while the others keep
+ * delivering, and every dequeued frame must reach the callback of its own camera.
+ *
+ */
+static void check_group(FILE *out)
+{
+    const char *const cam_files[GROUP_CAMERAS] = {ACAM_SYNTHETIC_PREFIX ":fps=240", ACAM_SYNTHETIC_PREFIX ":fps=120",
+                                                  ACAM_SYNTHETIC_PREFIX ":fps=240,fail_after=5"};
+    int error = 0;
+    acam_group_t *group = acam_group_open(cam_files, GROUP_CAMERAS, 2, &error);
+    if (!expect(group != NULL, "group: acam_group_open: %s", strerror(error)))
+    {
+        fprintf(out, "null");
+        return;
+    }
+    for (unsigned int i = 0; i < GROUP_CAMERAS; i++)
+    {
+        acam_set_ctrl(acam_group_get_camera(group, i), ACAM_FORMAT, ACAM_YUYV_320_240);
+    }
+
+    group_count_t count = {0};
+    count.group = group;
+    int ret = acam_group_start(group, 4, count_group_frame, &count);
+    if (!expect(ret == 0, "group: acam_group_start: %s", strerror(ret)))
+    {
+        fprintf(out, "null");
+        acam_group_close(group);
+        return;
+    }
+    sleep_ms(300);
+    ret = acam_group_stop(group);
+    expect(ret == 0, "group: acam_group_stop: %s", strerror(ret));
+
+    acam_group_stats_t stats[GROUP_CAMERAS] = {{0}};
+    for (unsigned int i = 0; i < GROUP_CAMERAS; i++)
+    {
+        acam_group_get_stats(group, i, &stats[i]);
+        expect(stats[i].processed == stats[i].frames && count.frames[i] == stats[i].frames,
+               "group: camera %u dequeued %llu frames, processed %llu, the callback saw %llu", i,
+               (unsigned long long)stats[i].frames, (unsigned long long)stats[i].processed, (unsigned long long)count.frames[i]);
+    }
+    expect(count.misrouted == 0, "group: %llu frames reached the callback of another camera", (unsigned long long)count.misrouted);
+    expect(stats[2].error == ENODEV && stats[2].frames == 5, "group: the failing camera delivered %llu frames and reported %s",
+           (unsigned long long)stats[2].frames, strerror(stats[2].error));
+    for (unsigned int i = 0; i < 2; i++)
+    {
+        expect(stats[i].error == 0 && stats[i].frames > 20 && stats[i].fps > 0, "group: camera %u delivered %llu frames at %.1f fps (%s)",
+               i, (unsigned long long)stats[i].frames, stats[i].fps, strerror(stats[i].error));
+    }
+    expect(acam_group_close(group) == 0, "group: acam_group_close failed");
+
+    fprintf(out, "[");
+    for (unsigned int i = 0; i < GROUP_CAMERAS; i++)
+    {
+        fprintf(out, "{\"frames\": %llu, \"processed\": %llu, \"fps\": %.1f, \"error\": \"%s\"}%s",
+                (unsigned long long)stats[i].frames, (unsigned long long)stats[i].processed, stats[i].fps,
+                stats[i].error ? strerror(stats[i].error) : "", i + 1 < GROUP_CAMERAS ? ", " : "]");
+    }
+}
+
+/**
+ * @brief Builds the DHT segment with the standard Huffman tables of ITU T.81 Annex K.3,
+ * as acam_mjpeg_prepare should splice it in.
+ *
+ * @return the size of the segment
+ */
+static size_t build_std_dht(uint8_t *p)
+{
+    const struct
+    {
+        uint8_t class_id;
+        const uint8_t *bits;
+        const uint8_t *vals;
+        size_t count;
+    } tables[] = {
+        {0x00, acam_std_dc_luma_bits, acam_std_dc_luma_vals, sizeof(acam_std_dc_luma_vals)},
+        {0x10, acam_std_ac_luma_bits, acam_std_ac_luma_vals, sizeof(acam_std_ac_luma_vals)},
+        {0x01, acam_std_dc_chroma_bits, acam_std_dc_chroma_vals, sizeof(acam_std_dc_chroma_vals)},
+        {0x11, acam_std_ac_chroma_bits, acam_std_ac_chroma_vals, sizeof(acam_std_ac_chroma_vals)},
+    };
+    size_t pos = 4;
+    for (unsigned int i = 0; i < 4; i++)
+    {
+        p[pos] = tables[i].class_id;
+        memcpy(p + pos + 1, tables[i].bits, 16);
+        memcpy(p + pos + 17, tables[i].vals, tables[i].count);
+        pos += 17 + tables[i].count;
+    }
+    p[0] = 0xff;
+    p[1] = 0xc4;
+    p[2] = (pos - 2) >> 8;
+    p[3] = (pos - 2) & 0xff;
+    return pos;
+}
+
+/**
+ * @brief What acam_mjpeg_prepare says about the first bytes_used bytes of some memory.
+ *
+ */
+static int prepare(uint8_t *data, size_t bytes_used, acam_mjpeg_t *jpeg)
+{
+    acam_buffer_t buffer = {0};
+    buffer.buf = (char *)data;
+    buffer.bytes_used = bytes_used;
+    buffer.length = bytes_used;
+    return acam_mjpeg_prepare(&buffer, jpeg);
+}
+
+/**
+ * @brief Writes some memory with acam_write_mjpeg_to_file and reads the file back.
+ *
+ * @return 1 if the file holds exactly the expected bytes
+ */
+static int writes_as(const char *file_name, uint8_t *data, size_t bytes_used, const uint8_t *expected, size_t size)
+{
+    acam_buffer_t buffer = {0};
+    buffer.buf = (char *)data;
+    buffer.bytes_used = bytes_used;
+    buffer.length = bytes_used;
+    if (acam_write_mjpeg_to_file(file_name, &buffer) != 0)
+    {
+        return 0;
+    }
+    FILE *file = fopen(file_name, "rb");
+    if (file == NULL)
+    {
+        return 0;
+    }
+    uint8_t *read_back = malloc(size + 1);
+    size_t got = read_back ? fread(read_back, 1, size + 1, file) : 0;
+    fclose(file);
+    int same = got == size && memcmp(read_back, expected, size) == 0;
+    free(read_back);
+    return same;
+}
+
+/**
+ * @brief Prepares an MJPEG frame of the synthetic camera, which like a UVC camera
+ * carries no Huffman tables, and damaged, padded and complete copies of it. The files
+ * acam_write_mjpeg_to_file writes are read back and compared with the frame with the
+ * standard tables spliced in before its first scan.
+ *
+ */
+static void check_mjpeg(FILE *out, const char *device)
+{
+    int error = 0;
+    acam_camera_t *cam = acam_open_backend(device, &acam_synthetic_backend, &error);
+    if (!expect(cam != NULL, "mjpeg: acam_open_backend: %s", strerror(error)))
+    {
+        fprintf(out, "null");
+        return;
+    }
+    acam_set_ctrl(cam, ACAM_FORMAT, ACAM_MJPEG_320_240);
+    int ret = acam_stream_start(cam, 2);
+    acam_buffer_t *captured = NULL;
+    if (ret == 0)
+    {
+        ret = acam_stream_dequeue(cam, &captured, 1000);
+    }
+    if (!expect(ret == 0, "mjpeg: capturing a frame: %s", strerror(ret)))
+    {
+        fprintf(out, "null");
+        acam_close(cam);
+        return;
+    }
+
+    // the frame, then room for the DHT and padding
+    size_t size = captured->bytes_used;
+    uint8_t *frame = malloc(size + 64);
+    uint8_t *expected = malloc(size + 1024);
+    uint8_t *damaged = malloc(size);
+    if (frame == NULL || expected == NULL || damaged == NULL)
+    {
+        perror("Allocating MJPEG frames");
+        exit(1);
+    }
+    memcpy(frame, captured->buf, size);
+    acam_stream_requeue(cam, captured);
+    acam_stream_stop(cam);
+    acam_close(cam);
+
+    size_t sos = 2;
+    while (sos + 1 < size && !(frame[sos] == 0xff && frame[sos + 1] == 0xda))
+    {
+        sos++;
+    }
+    memcpy(expected, frame, sos);
+    size_t dht_size = build_std_dht(expected + sos);
+    memcpy(expected + sos + dht_size, frame + sos, size - sos);
+    size_t expected_size = size + dht_size;
+
+    char dir[] = "/tmp/acam_check_XXXXXX";
+    if (mkdtemp(dir) == NULL)
+    {
+        perror("Creating scratch directory");
+        exit(1);
+    }
+    char file_name[sizeof(dir) + 32];
+    snprintf(file_name, sizeof(file_name), "%s/frame.jpg", dir);
+
+    acam_mjpeg_t jpeg;
+    ret = prepare(frame, size, &jpeg);
+    int spliced = ret == 0 && jpeg.flags == ACAM_MJPEG_DHT_INSERTED && jpeg.size == expected_size && jpeg.width == 320 &&
+                  jpeg.height == 240 && writes_as(file_name, frame, size, expected, expected_size);
+    expect(spliced, "mjpeg: a frame without DHT was not written with the standard tables (%s, flags 0x%x)", strerror(ret), jpeg.flags);
+
+    memset(frame + size, 0, 64);
+    ret = prepare(frame, size + 64, &jpeg);
+    int trimmed = ret == 0 && jpeg.flags == (ACAM_MJPEG_DHT_INSERTED | ACAM_MJPEG_TRIMMED) && jpeg.size == expected_size &&
+                  writes_as(file_name, frame, size + 64, expected, expected_size);
+    expect(trimmed, "mjpeg: padding after the EOI was not trimmed (%s, flags 0x%x)", strerror(ret), jpeg.flags);
+
+    ret = prepare(expected, expected_size, &jpeg);
+    int complete = ret == 0 && jpeg.flags == 0 && jpeg.iovcnt == 1 && jpeg.size == expected_size &&
+                   writes_as(file_name, expected, expected_size, expected, expected_size);
+    expect(complete, "mjpeg: a complete JPEG was not written unchanged (%s, flags 0x%x)", strerror(ret), jpeg.flags);
+
+    int truncated_header = prepare(frame, 10, &jpeg);
+    int truncated_scan = prepare(frame, sos + (size - sos) / 2, &jpeg);
+    expect(truncated_header == ENODATA && truncated_scan == ENODATA, "mjpeg: truncated frames gave %s and %s",
+           strerror(truncated_header), strerror(truncated_scan));
+
+    memcpy(damaged, frame, size);
+    damaged[2] = 0x00; // the first marker after the SOI
+    int no_marker = prepare(damaged, size, &jpeg);
+    memcpy(damaged, frame, size);
+    damaged[4] = 0x00; // the first segment's length
+    damaged[5] = 0x01;
+    int bad_length = prepare(damaged, size, &jpeg);
+    expect(no_marker == EBADMSG && bad_length == EBADMSG, "mjpeg: corrupt frames gave %s and %s", strerror(no_marker),
+           strerror(bad_length));
+
+    unlink(file_name);
+    acam_buffer_t buffer = {0};
+    buffer.buf = (char *)damaged;
+    buffer.bytes_used = size;
+    ret = acam_write_mjpeg_to_file(file_name, &buffer);
+    expect(ret == EBADMSG && access(file_name, F_OK) != 0, "mjpeg: a corrupt frame was written (%s)", strerror(ret));
+
+    unlink(file_name);
+    rmdir(dir);
+    free(frame);
+    free(expected);
+    free(damaged);
+
+    fprintf(out, "{\"frame_bytes\": %zu, \"spliced\": %d, \"trimmed\": %d, \"complete\": %d, ", size, spliced, trimmed, complete);
+    fprintf(out, "\"truncated\": [\"%s\", \"%s\"], ", strerror(truncated_header), strerror(truncated_scan));
+    fprintf(out, "\"corrupt\": [\"%s\", \"%s\"]}", strerror(no_marker), strerror(bad_length));
+}
+
+#define WRITER_BUFFERS 4
+#define WRITER_FRAMES 2
+
+typedef struct
+{
+    unsigned int calls;
+    unsigned int errors;
+} writer_calls_t;
+
+static void count_written(const char *file_name, int error, void *user)
+{
+    (void)file_name;
+    writer_calls_t *calls = user;
+    calls->calls++;
+    calls->errors += error != 0;
+}
+
+/**
+ * @return 1 if a file holds exactly the expected bytes
+ */
+static int file_holds(const char *file_name, const uint8_t *expected, size_t size)
+{
+    FILE *file = fopen(file_name, "rb");
+    if (file == NULL)
+    {
+        return 0;
+    }
+    uint8_t *read_back = malloc(size + 1);
+    size_t got = read_back ? fread(read_back, 1, size + 1, file) : 0;
+    fclose(file);
+    int same = got == size && memcmp(read_back, expected, size) == 0;
+    free(read_back);
+    return same;
+}
+
+/**
+ * @brief Writes copied buffers of awkward sizes and frames of a stream through every
+ * writer configuration (io_uring or pwrite, with or without O_DIRECT, each sync policy)
+ * and reads the files back byte for byte. Every job must run its callback and count as
+ * written.
+ *
+ */
+static void check_writer(FILE *out, const char *device)
+{
+    int error = 0;
+    acam_camera_t *cam = acam_open_backend(device, &acam_synthetic_backend, &error);
+    if (!expect(cam != NULL, "writer: acam_open_backend: %s", strerror(error)))
+    {
+        fprintf(out, "null");
+        return;
+    }
+    // whole pages per frame, so frames can be written from their own buffers with O_DIRECT
+    acam_set_ctrl(cam, ACAM_FORMAT, ACAM_YUYV_640_480);
+    int ret = acam_stream_start(cam, 4);
+    if (!expect(ret == 0, "writer: acam_stream_start: %s", strerror(ret)))
+    {
+        fprintf(out, "null");
+        acam_close(cam);
+        return;
+    }
+
+    const size_t sizes[WRITER_BUFFERS] = {1, 4096, 10007, 614400};
+    uint8_t *data[WRITER_BUFFERS + WRITER_FRAMES];
+    size_t data_size[WRITER_BUFFERS + WRITER_FRAMES];
+    uint32_t seed = 0x9e3779b9;
+    for (unsigned int i = 0; i < WRITER_BUFFERS + WRITER_FRAMES; i++)
+    {
+        data_size[i] = i < WRITER_BUFFERS ? sizes[i] : 640 * 480 * 2;
+        data[i] = malloc(data_size[i]);
+        if (data[i] == NULL)
+        {
+            perror("Allocating writer data");
+            exit(1);
+        }
+        for (size_t b = 0; b < data_size[i]; b++)
+        {
+            seed = seed * 1664525 + 1013904223;
+            data[i][b] = seed >> 24;
+        }
+    }
+
+    char dir[] = "/tmp/acam_check_XXXXXX";
+    if (mkdtemp(dir) == NULL)
+    {
+        perror("Creating scratch directory");
+        exit(1);
+    }
+    char file_name[sizeof(dir) + 32];
+
+    const int flags[] = {0, ACAM_WRITER_DIRECT, ACAM_WRITER_NO_URING, ACAM_WRITER_NO_URING | ACAM_WRITER_DIRECT};
+    const acam_writer_sync_t syncs[] = {ACAM_WRITER_NO_SYNC, ACAM_WRITER_FDATASYNC, ACAM_WRITER_FSYNC};
+    fprintf(out, "[");
+    for (unsigned int f = 0; f < sizeof(flags) / sizeof(flags[0]); f++)
+    {
+        for (unsigned int y = 0; y < sizeof(syncs) / sizeof(syncs[0]); y++)
+        {
+            acam_writer_config_t config = {8, syncs[y], flags[f]};
+            acam_writer_t *writer = acam_writer_create(&config, &error);
+            if (!expect(writer != NULL, "writer: acam_writer_create(flags 0x%x, sync %d): %s", flags[f], syncs[y], strerror(error)))
+            {
+                continue;
+            }
+
+            writer_calls_t calls = {0};
+            uint64_t bytes = 0;
+            for (unsigned int i = 0; i < WRITER_BUFFERS + WRITER_FRAMES; i++)
+            {
+                snprintf(file_name, sizeof(file_name), "%s/%u", dir, i);
+                if (i < WRITER_BUFFERS)
+                {
+                    acam_buffer_t buffer = {0};
+                    buffer.buf = (char *)data[i];
+                    buffer.bytes_used = data_size[i];
+                    buffer.length = data_size[i];
+                    ret = acam_writer_submit(writer, file_name, &buffer, count_written, &calls);
+                }
+                else
+                {
+                    acam_frame_t *frame;
+                    ret = acam_stream_dequeue_frame(cam, &frame, 1000);
+                    if (ret == 0)
+                    {
+                        data_size[i] = frame->bytes_used;
+                        memcpy(data[i], frame->buffer->buf, frame->bytes_used);
+                        ret = acam_writer_submit_frame(writer, file_name, frame, count_written, &calls);
+                        acam_frame_release(frame);
+                    }
+                }
+                expect(ret == 0, "writer: submitting file %u: %s", i, strerror(ret));
+                bytes += data_size[i];
+            }
+            acam_writer_flush(writer);
+
+            unsigned int matched = 0;
+            for (unsigned int i = 0; i < WRITER_BUFFERS + WRITER_FRAMES; i++)
+            {
+                snprintf(file_name, sizeof(file_name), "%s/%u", dir, i);
+                matched += file_holds(file_name, data[i], data_size[i]);
+                unlink(file_name);
+            }
+            acam_writer_stats_t stats;
+            acam_writer_get_stats(writer, &stats);
+            expect(matched == WRITER_BUFFERS + WRITER_FRAMES, "writer: flags 0x%x, sync %d: %u of %u files hold what was submitted",
+                   flags[f], syncs[y], matched, WRITER_BUFFERS + WRITER_FRAMES);
+            expect(calls.calls == WRITER_BUFFERS + WRITER_FRAMES && calls.errors == 0,
+                   "writer: flags 0x%x, sync %d: %u callbacks, %u with an error", flags[f], syncs[y], calls.calls, calls.errors);
+            expect(stats.written == WRITER_BUFFERS + WRITER_FRAMES && stats.failed == 0 && stats.bytes == bytes,
+                   "writer: flags 0x%x, sync %d: counted %llu written, %llu failed, %llu bytes", flags[f], syncs[y],
+                   (unsigned long long)stats.written, (unsigned long long)stats.failed, (unsigned long long)stats.bytes);
+            acam_writer_destroy(writer);
+
+            fprintf(out, "%s{\"flags\": %d, \"sync\": %d, \"matched\": %u, \"callbacks\": %u}", f + y ? ", " : "", flags[f],
+                    syncs[y], matched, calls.calls);
+        }
+    }
+    fprintf(out, "]");
+
+    rmdir(dir);
+    for (unsigned int i = 0; i < WRITER_BUFFERS + WRITER_FRAMES; i++)
+    {
+        free(data[i]);
+    }
+    acam_stream_stop(cam);
+    acam_close(cam);
+}
+
+#define SHM_SLOTS 4
+#define SHM_SLOT_SIZE 4096
+#define SHM_PUSHES 6
+
+/**
+ * @brief The fields at the start of a frame ring's control page, as acam_shm.c lays
+ * them out, and the offset of the published frame count.
+ *
+ */
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t slot_count;
+    uint64_t slot_size;
+} shm_control_t;
+#define SHM_HEAD_OFFSET 64
+
+/**
+ * @brief Publishes into a frame ring after a subscriber has overwritten the ring's
+ * geometry and frame count on the control page it maps writable. The publisher must
+ * keep to its own geometry: frames up to the slot size are published, larger ones are
+ * refused, and a subscriber attached before the damage reads the newest frames intact.
+ *
+ */
+static void check_shm(FILE *out)
+{
+    int error = 0;
+    acam_publisher_t *pub = acam_publisher_create(SHM_SLOTS, SHM_SLOT_SIZE, &error);
+    if (!expect(pub != NULL, "shm: acam_publisher_create: %s", strerror(error)))
+    {
+        fprintf(out, "null");
+        return;
+    }
+    acam_subscriber_t *sub = acam_subscriber_open(acam_publisher_get_fd(pub), &error);
+    char *control = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ | PROT_WRITE, MAP_SHARED, acam_publisher_get_fd(pub), 0);
+    if (!expect(sub != NULL, "shm: acam_subscriber_open: %s", strerror(error)) ||
+        !expect(control != MAP_FAILED, "shm: mapping the control page: %s", strerror(errno)))
+    {
+        fprintf(out, "null");
+        if (sub != NULL)
+        {
+            acam_subscriber_close(sub);
+        }
+        acam_publisher_destroy(pub);
+        return;
+    }
+
+    shm_control_t *geometry = (shm_control_t *)control;
+    geometry->slot_count = 0;
+    geometry->slot_size = UINT64_MAX;
+    uint64_t head = UINT64_MAX / 2;
+    memcpy(control + SHM_HEAD_OFFSET, &head, sizeof(head));
+
+    char data[SHM_SLOT_SIZE + 1];
+    acam_buffer_t buffer = {0};
+    buffer.buf = data;
+    buffer.length = sizeof(data);
+    unsigned int pushed = 0;
+    for (unsigned int i = 0; i < SHM_PUSHES; i++)
+    {
+        memset(data, 'a' + i, SHM_SLOT_SIZE);
+        buffer.bytes_used = SHM_SLOT_SIZE;
+        buffer.sequence = i;
+        int ret = acam_publisher_push(pub, &buffer, ACAM_YUYV_320_240);
+        pushed += expect(ret == 0, "shm: pushing frame %u: %s", i, strerror(ret));
+    }
+    buffer.bytes_used = SHM_SLOT_SIZE + 1;
+    int oversized = acam_publisher_push(pub, &buffer, ACAM_YUYV_320_240);
+    expect(oversized == EMSGSIZE, "shm: a frame larger than a slot was pushed with %s", strerror(oversized));
+
+    unsigned int intact = 0;
+    acam_shm_frame_t frame;
+    while (acam_subscriber_next(sub, &frame, 0) == 0)
+    {
+        const char *bytes = frame.data;
+        int same = frame.bytes_used == SHM_SLOT_SIZE && frame.sequence == frame.index;
+        for (uint32_t b = 0; same && b < frame.bytes_used; b++)
+        {
+            same = bytes[b] == (char)('a' + frame.index);
+        }
+        intact += expect(same, "shm: frame %llu does not hold what was pushed", (unsigned long long)frame.index);
+    }
+    expect(intact == SHM_SLOTS - 1, "shm: read %u intact frames of the %u still in the ring", intact, SHM_SLOTS - 1);
+
+    fprintf(out, "{\"pushed\": %u, \"oversized\": \"%s\", \"intact\": %u}", pushed, strerror(oversized), intact);
+    munmap(control, sysconf(_SC_PAGESIZE));
+    acam_subscriber_close(sub);
+    acam_publisher_destroy(pub);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [--device PATH] [--output FILE]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    const char *device = "synthetic:fps=240";
+    const char *output = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 < argc && strcmp(argv[i], "--device") == 0)
+        {
+            device = argv[++i];
+        }
+        else if (i + 1 < argc && strcmp(argv[i], "--output") == 0)
+        {
+            output = argv[++i];
+        }
+        else
+        {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (strncmp(device, ACAM_SYNTHETIC_PREFIX, strlen(ACAM_SYNTHETIC_PREFIX)) != 0)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    FILE *out = stdout;
+    if (output != NULL && (out = fopen(output, "w")) == NULL)
+    {
+        perror("Opening output file");
+        return 1;
+    }
+
+    fprintf(out, "{\n  \"device\": \"%s\",\n", device);
+    fprintf(out, "  \"ctrl_batch\": ");
+    check_ctrl_batch(out, device, &acam_synthetic_backend);
+    fprintf(out, ",\n  \"ctrl_batch_no_ext\": ");
+    check_ctrl_batch(out, device, &no_ext_backend);
+    fprintf(out, ",\n  \"load_struct\": ");
+    check_load_struct(out, device, &acam_synthetic_backend);
+    fprintf(out, ",\n  \"load_struct_no_ext\": ");
+    check_load_struct(out, device, &no_ext_backend);
+    fprintf(out, ",\n  \"frame_refs\": ");
+    check_frame_refs(out, device);
+    fprintf(out, ",\n  \"pools\": ");
+    check_pools(out, device);
+    fprintf(out, ",\n  \"try_dequeue\": ");
+    check_try_dequeue(out);
+    fprintf(out, ",\n  \"worker\": ");
+    check_worker(out, device);
+    fprintf(out, ",\n  \"group\": ");
+    check_group(out);
+    fprintf(out, ",\n  \"mjpeg\": ");
+    check_mjpeg(out, device);
+    fprintf(out, ",\n  \"writer\": ");
+    check_writer(out, device);
+    fprintf(out, ",\n  \"shm\": ");
+    check_shm(out);
+    fprintf(out, ",\n  \"failures\": %u\n}\n", failures);
+
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,795 @@
+#include "acam_control.h"
+
+#include <time.h>
+
+/**
+ * @brief Frame conversion benchmark. For every instruction set the CPU supports,
+ * checks that acam_yuyv_to_rgb24 (all four acam_color_t), acam_yuyv_to_nv12,
+ * acam_yuyv_to_i420, acam_yuyv_scale_rgb24 (box and bilinear, split across
+ * threads), acam_stats_compute and acam_jpeg_encode produce byte for byte what the
+ * scalar kernels produce on one thread, on random frames of awkward sizes, and that
+ * nothing is written past the output size. The scalar kernels are first checked
+ * against values known without them, see known_scale, known_stats and known_jpeg.
+ * Then times each conversion of a 1920x1080 frame and prints the results as JSON
+ * with percentiles. The scaling runs produce the 640x480 and 320x240 thumbnails of
+ * the frame's centred 4:3 region in one call; the statistics runs cover two frames,
+ * so the second has a motion score. The JPEG runs reuse one encoder per size and
+ * thread count, as a capture loop would, and noise is the hardest content to
+ * compress. Exits non-zero on any mismatch, or if the threaded JPEG run on the
+ * default instruction set misses JPEG_CORE_BUDGET_US shared between its cores.
+ *
+ * Usage: acam_convert_bench [--iterations N] [--output FILE] [--label NAME]
+ *
+ */
+
+#define GUARD_BYTES 64
+#define GUARD_VALUE 0xa5
+#define JPEG_RESTART_ROWS 4 //fixed, so the JPEG does not depend on the number of threads
+#define JPEG_TIMED "jpeg_q85_4_threads" //the conversion held to the 1080p JPEG budget
+#define JPEG_CORE_BUDGET_US 80000 //median 1080p JPEG of noise on one core; divided by the cores the encoder can use
+
+typedef enum
+{
+    OP_RGB24 = 0,
+    OP_NV12,
+    OP_I420,
+    OP_SCALE, //two thumbnails of the centred 4:3 region, see scale_targets
+    OP_STATS, //statistics of the frame without its last row after those of the frame without its first, see stats
+    OP_JPEG, //the JPEG's size as a size_t, then the JPEG
+} op_t;
+
+typedef struct
+{
+    const char *name;
+    op_t op;
+    acam_color_t color;
+    acam_scale_filter_t filter;
+    unsigned int threads;
+    unsigned int step; //statistics sampling step
+    unsigned int quality; //JPEG quality
+} conversion_t;
+
+static const conversion_t conversions[] = {
+    {.name = "rgb24_bt601_limited", .op = OP_RGB24, .color = ACAM_BT601_LIMITED},
+    {.name = "rgb24_bt601_full", .op = OP_RGB24, .color = ACAM_BT601_FULL},
+    {.name = "rgb24_bt709_limited", .op = OP_RGB24, .color = ACAM_BT709_LIMITED},
+    {.name = "rgb24_bt709_full", .op = OP_RGB24, .color = ACAM_BT709_FULL},
+    {.name = "nv12", .op = OP_NV12},
+    {.name = "i420", .op = OP_I420},
+    {.name = "scale_box_640x480_320x240", .op = OP_SCALE, .color = ACAM_BT601_LIMITED, .filter = ACAM_SCALE_BOX, .threads = 1},
+    {.name = "scale_bilinear_640x480_320x240", .op = OP_SCALE, .color = ACAM_BT601_LIMITED, .filter = ACAM_SCALE_BILINEAR, .threads = 1},
+    {.name = "scale_box_640x480_320x240_4_threads", .op = OP_SCALE, .color = ACAM_BT601_LIMITED, .filter = ACAM_SCALE_BOX, .threads = 4},
+    {.name = "stats_2_frames_step_1", .op = OP_STATS, .threads = 1, .step = 1},
+    {.name = "stats_2_frames_step_2", .op = OP_STATS, .threads = 1, .step = 2},
+    {.name = "jpeg_q85", .op = OP_JPEG, .color = ACAM_BT601_LIMITED, .threads = 1, .quality = 85},
+    {.name = "jpeg_q85_4_threads", .op = OP_JPEG, .color = ACAM_BT601_LIMITED, .threads = 4, .quality = 85},
+};
+#define CONVERSION_COUNT (sizeof(conversions) / sizeof(conversions[0]))
+
+static const char *isa_names[__ACAM_ISA_COUNT] = {"auto", "scalar", "sse4.1", "avx2", "neon"};
+
+//frame sizes checked against the scalar kernels: full HD plus widths that leave SIMD tails and odd heights
+static const unsigned int check_sizes[][2] = {{1920, 1080}, {1282, 7}, {66, 3}, {34, 2}, {2, 1}};
+#define CHECK_SIZE_COUNT (sizeof(check_sizes) / sizeof(check_sizes[0]))
+
+/**
+ * @brief Fills the two targets of OP_SCALE for a frame: the centred region with a 4:3
+ * aspect ratio at 4/9 and 2/9 of its height (640x480 and 320x240 for 1920x1080),
+ * written one after the other from @param dst. Returns the bytes they take.
+ */
+static size_t scale_targets(const conversion_t *conv, unsigned int width, unsigned int height, uint8_t *dst,
+                            acam_scale_target_t targets[2])
+{
+    unsigned int crop_width = (uint64_t)height * 4 / 3 < width ? height * 4 / 3 : width;
+    size_t offset = 0;
+    for (int i = 0; i < 2; i++)
+    {
+        acam_scale_target_t *t = &targets[i];
+        memset(t, 0, sizeof(*t));
+        t->crop_x = (width - crop_width) / 2;
+        t->crop_width = crop_width;
+        t->crop_height = height;
+        t->width = crop_width * (4 >> i) / 9 ? crop_width * (4 >> i) / 9 : 1;
+        t->height = height * (4 >> i) / 9 ? height * (4 >> i) / 9 : 1;
+        t->filter = conv != NULL ? conv->filter : ACAM_SCALE_BOX;
+        t->dst = dst != NULL ? dst + offset : NULL;
+        t->dst_size = (size_t)t->width * t->height * 3;
+        offset += t->dst_size;
+    }
+    return offset;
+}
+
+/**
+ * @brief Runs a statistics pass over two frames cut from one: without its last row,
+ * then without its first, so the second sees every row move by one. Writes the
+ * statistics of the second to @param dst.
+ */
+static int stats(const conversion_t *conv, const acam_buffer_t *buffer, unsigned int width, unsigned int height, uint8_t *dst)
+{
+    acam_stats_config_t config = {0};
+    config.step = conv->step;
+    config.motion_threshold = 4;
+    unsigned int rows = height > 1 ? height - 1 : height;
+    int ret;
+    acam_stats_t *pass = acam_stats_create(width, rows, &config, &ret);
+    if (pass == NULL)
+    {
+        return ret;
+    }
+
+    acam_frame_stats_t result;
+    acam_buffer_t frame = *buffer;
+    frame.bytes_used = width * rows * 2;
+    ret = acam_stats_compute(pass, &frame, &result);
+    frame.buf += (height - rows) * width * 2;
+    if (ret == 0)
+    {
+        ret = acam_stats_compute(pass, &frame, &result);
+    }
+    if (ret == 0)
+    {
+        memcpy(dst, &result, sizeof(result));
+    }
+    acam_stats_destroy(pass);
+    return ret;
+}
+
+static acam_jpeg_encoder_t *encoder; //the last JPEG encoder, see jpeg
+static unsigned int encoder_width, encoder_height, encoder_threads;
+
+/**
+ * @brief Compresses a frame, creating an encoder only when the size or thread count
+ * changes. Writes the JPEG's size, then the JPEG, to @param dst.
+ */
+static int jpeg(const conversion_t *conv, const acam_buffer_t *buffer, unsigned int width, unsigned int height, uint8_t *dst,
+                size_t dst_size)
+{
+    if (encoder == NULL || encoder_width != width || encoder_height != height || encoder_threads != conv->threads)
+    {
+        if (encoder != NULL)
+        {
+            acam_jpeg_encoder_destroy(encoder);
+        }
+        acam_jpeg_config_t config = {conv->quality, conv->threads, JPEG_RESTART_ROWS, conv->color};
+        int ret;
+        if ((encoder = acam_jpeg_encoder_create(width, height, &config, &ret)) == NULL)
+        {
+            return ret;
+        }
+        encoder_width = width;
+        encoder_height = height;
+        encoder_threads = conv->threads;
+    }
+
+    const uint8_t *data;
+    size_t size;
+    int ret = acam_jpeg_encode(encoder, buffer, &data, &size);
+    if (ret != 0)
+    {
+        return ret;
+    }
+    if (size > dst_size - sizeof(size))
+    {
+        return ENOSPC;
+    }
+    memcpy(dst, &size, sizeof(size));
+    memcpy(dst + sizeof(size), data, size);
+    return 0;
+}
+
+static size_t output_size(op_t op, unsigned int width, unsigned int height)
+{
+    if (op == OP_JPEG)
+    {
+        return sizeof(size_t) + (size_t)width * height * 4 + 4096; //past the worst case of noise
+    }
+    if (op == OP_STATS)
+    {
+        return sizeof(acam_frame_stats_t);
+    }
+    if (op == OP_SCALE)
+    {
+        acam_scale_target_t targets[2];
+        return scale_targets(NULL, width, height, NULL, targets);
+    }
+    if (op == OP_RGB24)
+    {
+        return (size_t)width * height * 3;
+    }
+    return (size_t)width * height + (size_t)width * ((height + 1) / 2);
+}
+
+static int convert(const conversion_t *conv, const acam_buffer_t *buffer, unsigned int width, unsigned int height, uint8_t *dst)
+{
+    size_t size = output_size(conv->op, width, height);
+    switch (conv->op)
+    {
+    case OP_RGB24:
+        return acam_yuyv_to_rgb24(buffer, width, height, conv->color, dst, size);
+    case OP_NV12:
+        return acam_yuyv_to_nv12(buffer, width, height, dst, size);
+    case OP_SCALE:
+    {
+        acam_scale_target_t targets[2];
+        scale_targets(conv, width, height, dst, targets);
+        return acam_yuyv_scale_rgb24(buffer, width, height, conv->color, targets, 2, conv->threads);
+    }
+    case OP_STATS:
+        return stats(conv, buffer, width, height, dst);
+    case OP_JPEG:
+        return jpeg(conv, buffer, width, height, dst, size);
+    default:
+        return acam_yuyv_to_i420(buffer, width, height, dst, size);
+    }
+}
+
+static uint32_t rng_state = 0x12345678;
+
+static uint8_t random_byte(void)
+{
+    // xorshift32, so runs are reproducible
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return (uint8_t)rng_state;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *us, size_t count, double p)
+{
+    // nearest-rank on sorted samples
+    size_t rank = (size_t)(p / 100.0 * count + 0.5);
+    if (rank < 1)
+    {
+        rank = 1;
+    }
+    if (rank > count)
+    {
+        rank = count;
+    }
+    return us[rank - 1];
+}
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void *xmalloc(size_t size)
+{
+    void *p = malloc(size);
+    if (p == NULL)
+    {
+        perror("Allocating frame");
+        exit(1);
+    }
+    return p;
+}
+
+/**
+ * @brief Runs one conversion with the current instruction set and with the scalar
+ * kernels on the same random frame and compares the outputs and guard bytes.
+ *
+ * @return 0 if they match, 1 otherwise.
+ */
+static int check(acam_isa_t isa, const conversion_t *conv, unsigned int width, unsigned int height)
+{
+    acam_buffer_t buffer = {0};
+    buffer.bytes_used = width * height * 2;
+    buffer.length = buffer.bytes_used;
+    buffer.buf = xmalloc(buffer.length);
+    for (uint32_t i = 0; i < buffer.length; i++)
+    {
+        buffer.buf[i] = random_byte();
+    }
+
+    size_t size = output_size(conv->op, width, height);
+    uint8_t *expected = xmalloc(size + GUARD_BYTES);
+    uint8_t *actual = xmalloc(size + GUARD_BYTES);
+    memset(expected, GUARD_VALUE, size + GUARD_BYTES);
+    memset(actual, GUARD_VALUE, size + GUARD_BYTES);
+
+    conversion_t reference = *conv;
+    reference.threads = 1;
+    int ret = acam_convert_set_isa(ACAM_ISA_SCALAR);
+    if (ret == 0)
+    {
+        ret = convert(&reference, &buffer, width, height, expected);
+    }
+    if (ret == 0)
+    {
+        ret = acam_convert_set_isa(isa);
+    }
+    if (ret == 0)
+    {
+        ret = convert(conv, &buffer, width, height, actual);
+    }
+
+    int status = 0;
+    if (ret != 0)
+    {
+        fprintf(stderr, "%s %s %ux%u failed: %s\n", isa_names[isa], conv->name, width, height, strerror(ret));
+        status = 1;
+    }
+    else
+    {
+        for (size_t i = 0; i < size + GUARD_BYTES; i++)
+        {
+            if (expected[i] != actual[i])
+            {
+                fprintf(stderr, "%s %s %ux%u differs from scalar at byte %zu%s: %u != %u\n", isa_names[isa], conv->name, width, height,
+                        i, i >= size ? " (past the output)" : "", actual[i], expected[i]);
+                status = 1;
+                break;
+            }
+        }
+    }
+
+    free(buffer.buf);
+    free(expected);
+    free(actual);
+    return status;
+}
+
+#define RAMP_WIDTH 80 //frame of the ramp known_scale halves, with room around its crop
+#define RAMP_HEIGHT 56
+
+/**
+ * @brief Fills a YUYV frame with a luma of @param y0 + @param dx * x + @param dy * y
+ * and a constant chroma.
+ */
+static void fill_yuyv(acam_buffer_t *buffer, unsigned int width, unsigned int height, int y0, int dx, int dy, uint8_t u, uint8_t v)
+{
+    for (unsigned int y = 0; y < height; y++)
+    {
+        uint8_t *row = (uint8_t *)buffer->buf + (size_t)y * width * 2;
+        for (unsigned int x = 0; x < width; x++)
+        {
+            row[2 * x] = (uint8_t)(y0 + dx * (int)x + dy * (int)y);
+            row[2 * x + 1] = x % 2 ? v : u;
+        }
+    }
+}
+
+/**
+ * @brief Checks the scalar scaling kernels against values known without them. A flat
+ * field must come out of both filters, at every check size, as the colour of its
+ * pixel converted unscaled. A gray ramp of luma x + y, halved from a crop of a larger
+ * frame, must give full-range gray of exactly the mean of each 2x2 block: the box
+ * averages it, and bilinear taps land halfway between the two rows and columns.
+ *
+ * @return 0 if every value matches, 1 otherwise.
+ */
+static int known_scale(void)
+{
+    const uint8_t flat[4] = {126, 90, 126, 200};
+    uint8_t pixel[6];
+    acam_buffer_t two = {0};
+    two.buf = (char *)flat;
+    two.bytes_used = two.length = sizeof(flat);
+    acam_convert_set_isa(ACAM_ISA_SCALAR);
+    if (acam_yuyv_to_rgb24(&two, 2, 1, ACAM_BT601_LIMITED, pixel, sizeof(pixel)) != 0)
+    {
+        fprintf(stderr, "Converting the flat field's pixel failed\n");
+        return 1;
+    }
+
+    int status = 0;
+    for (acam_scale_filter_t filter = ACAM_SCALE_BOX; filter < __ACAM_SCALE_FILTER_COUNT; filter++)
+    {
+        conversion_t conv = {.op = OP_SCALE, .color = ACAM_BT601_LIMITED, .filter = filter, .threads = 1};
+        for (size_t s = 0; s < CHECK_SIZE_COUNT; s++)
+        {
+            unsigned int width = check_sizes[s][0], height = check_sizes[s][1];
+            acam_buffer_t buffer = {0};
+            buffer.bytes_used = buffer.length = width * height * 2;
+            buffer.buf = xmalloc(buffer.length);
+            fill_yuyv(&buffer, width, height, flat[0], 0, 0, flat[1], flat[3]);
+            size_t size = output_size(OP_SCALE, width, height);
+            uint8_t *dst = xmalloc(size);
+            int ret = convert(&conv, &buffer, width, height, dst);
+            size_t i = 0;
+            while (ret == 0 && i < size && dst[i] == pixel[i % 3])
+            {
+                i++;
+            }
+            if (ret != 0)
+            {
+                fprintf(stderr, "Scaling a flat %ux%u field with filter %d failed: %s\n", width, height, filter, strerror(ret));
+                status = 1;
+            }
+            else if (i < size)
+            {
+                fprintf(stderr, "Scaling a flat %ux%u field with filter %d gave %u at byte %zu, not %u\n", width, height, filter,
+                        dst[i], i, pixel[i % 3]);
+                status = 1;
+            }
+            free(buffer.buf);
+            free(dst);
+        }
+    }
+
+    acam_buffer_t ramp = {0};
+    ramp.bytes_used = ramp.length = RAMP_WIDTH * RAMP_HEIGHT * 2;
+    ramp.buf = xmalloc(ramp.length);
+    fill_yuyv(&ramp, RAMP_WIDTH, RAMP_HEIGHT, 0, 1, 1, 128, 128);
+    const unsigned int crop_x = 8, crop_y = 4, out_width = RAMP_WIDTH / 2 - crop_x, out_height = RAMP_HEIGHT / 2 - crop_y;
+    uint8_t dst[RAMP_WIDTH * RAMP_HEIGHT * 3 / 4];
+    for (acam_scale_filter_t filter = ACAM_SCALE_BOX; filter < __ACAM_SCALE_FILTER_COUNT; filter++)
+    {
+        acam_scale_target_t target = {0};
+        target.crop_x = crop_x;
+        target.crop_y = crop_y;
+        target.crop_width = 2 * out_width;
+        target.crop_height = 2 * out_height;
+        target.width = out_width;
+        target.height = out_height;
+        target.filter = filter;
+        target.dst = dst;
+        target.dst_size = (size_t)out_width * out_height * 3;
+        int ret = acam_yuyv_scale_rgb24(&ramp, RAMP_WIDTH, RAMP_HEIGHT, ACAM_BT601_FULL, &target, 1, 1);
+        for (unsigned int i = 0; ret == 0 && i < target.dst_size; i++)
+        {
+            unsigned int ox = i / 3 % out_width, oy = i / 3 / out_width;
+            unsigned int expected = crop_x + crop_y + 2 * ox + 2 * oy + 1;
+            if (dst[i] != expected)
+            {
+                fprintf(stderr, "Halving a ramp with filter %d gave %u at %u,%u, not %u\n", filter, dst[i], ox, oy, expected);
+                ret = EDOM;
+            }
+        }
+        if (ret != 0)
+        {
+            fprintf(stderr, "Halving a ramp with filter %d failed: %s\n", filter, strerror(ret));
+            status = 1;
+        }
+    }
+    free(ramp.buf);
+    return status;
+}
+
+#define STATS_WIDTH 128 //frame of known_stats: two motion blocks side by side
+#define STATS_HEIGHT 64
+
+/**
+ * @brief Compares one statistic with its known value, reporting a mismatch.
+ *
+ * @return 0 if they match, 1 otherwise.
+ */
+static int known_value(const char *what, unsigned int step, double value, double expected)
+{
+    double diff = value > expected ? value - expected : expected - value;
+    if (diff > 1e-9 * (expected + 1))
+    {
+        fprintf(stderr, "Statistics with step %u gave a %s of %f, not %f\n", step, what, value, expected);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Checks the scalar statistics kernels against values known without them. On
+ * a ramp of luma x + y every Sobel gradient is 8 * step in both directions, so the
+ * sharpness is 2 * (8 * step)^2, and the mean and variance are those of the sampled
+ * columns and rows added up. A flat frame has no spread and no sharpness. Raising
+ * the left block of a flat frame by 20 must move the mean change of the two blocks
+ * by 10 and count one moving block; the same frame again must show no motion.
+ *
+ * @return 0 if every value matches, 1 otherwise.
+ */
+static int known_stats(void)
+{
+    acam_buffer_t frame = {0};
+    frame.bytes_used = frame.length = STATS_WIDTH * STATS_HEIGHT * 2;
+    frame.buf = xmalloc(frame.length);
+    acam_frame_stats_t result;
+    acam_convert_set_isa(ACAM_ISA_SCALAR);
+
+    int status = 0;
+    for (unsigned int step = 1; step <= 2; step++)
+    {
+        acam_stats_config_t config = {.step = step, .block = 64, .motion_threshold = 4};
+        int ret;
+        acam_stats_t *pass = acam_stats_create(STATS_WIDTH, STATS_HEIGHT, &config, &ret);
+        if (pass == NULL)
+        {
+            fprintf(stderr, "Creating a statistics pass with step %u failed: %s\n", step, strerror(ret));
+            status = 1;
+            continue;
+        }
+
+        fill_yuyv(&frame, STATS_WIDTH, STATS_HEIGHT, 0, 1, 1, 128, 128);
+        unsigned int columns = STATS_WIDTH / step, rows = STATS_HEIGHT / step;
+        ret = acam_stats_compute(pass, &frame, &result);
+        if (ret == 0)
+        {
+            double mean = step * (columns - 1) / 2.0 + step * (rows - 1) / 2.0;
+            double variance = step * step * ((columns * columns - 1) / 12.0 + (rows * rows - 1) / 12.0);
+            status |= known_value("ramp's sample count", step, result.samples, columns * rows);
+            status |= known_value("ramp's mean", step, result.mean, mean);
+            status |= known_value("ramp's variance", step, result.variance, variance);
+            status |= known_value("ramp's sharpness", step, result.sharpness, 2 * 64.0 * step * step);
+            status |= known_value("first frame's motion blocks", step, result.blocks, 0);
+        }
+
+        fill_yuyv(&frame, STATS_WIDTH, STATS_HEIGHT, 100, 0, 0, 128, 128);
+        acam_stats_reset(pass);
+        if (ret == 0 && (ret = acam_stats_compute(pass, &frame, &result)) == 0)
+        {
+            status |= known_value("flat frame's mean", step, result.mean, 100);
+            status |= known_value("flat frame's histogram count", step, result.histogram[100], columns * rows);
+            status |= known_value("flat frame's variance", step, result.variance, 0);
+            status |= known_value("flat frame's sharpness", step, result.sharpness, 0);
+        }
+
+        for (unsigned int y = 0; y < STATS_HEIGHT; y++)
+        {
+            for (unsigned int x = 0; x < STATS_WIDTH / 2; x++)
+            {
+                frame.buf[(size_t)y * STATS_WIDTH * 2 + 2 * x] = 120;
+            }
+        }
+        if (ret == 0 && (ret = acam_stats_compute(pass, &frame, &result)) == 0)
+        {
+            status |= known_value("motion of a raised block", step, result.motion, 10);
+            status |= known_value("moving block count", step, result.moving_blocks, 1);
+            status |= known_value("compared block count", step, result.blocks, 2);
+        }
+        if (ret == 0 && (ret = acam_stats_compute(pass, &frame, &result)) == 0)
+        {
+            status |= known_value("motion of a repeated frame", step, result.motion, 0);
+            status |= known_value("moving block count of a repeated frame", step, result.moving_blocks, 0);
+        }
+        if (ret != 0)
+        {
+            fprintf(stderr, "Statistics with step %u failed: %s\n", step, strerror(ret));
+            status = 1;
+        }
+        acam_stats_destroy(pass);
+    }
+    free(frame.buf);
+    return status;
+}
+
+/**
+ * @brief Checks the scalar JPEG encoder by decoding what it produces: the DC
+ * coefficients of a 1920x1080 frame encoded on four threads in restart intervals
+ * must give, within the DC quantization step, the mean of every 8x8 luma block and
+ * of every 8x8 block of chroma pairs of the source. The frame is a full-range
+ * pattern that wraps around, so the blocks hold edges as well as slopes.
+ *
+ * @return 0 if every block matches, 1 otherwise.
+ */
+static int known_jpeg(void)
+{
+    const unsigned int width = 1920, height = 1080;
+    acam_buffer_t frame = {0};
+    frame.bytes_used = frame.length = width * height * 2;
+    frame.buf = xmalloc(frame.length);
+    for (unsigned int y = 0; y < height; y++)
+    {
+        uint8_t *row = (uint8_t *)frame.buf + (size_t)y * width * 2;
+        for (unsigned int x = 0; x < width; x++)
+        {
+            row[2 * x] = (uint8_t)(7 * x + 13 * y);
+            row[2 * x + 1] = x % 2 ? (uint8_t)(11 * (x / 2) + 2 * y) : (uint8_t)(5 * (x / 2) + 3 * y);
+        }
+    }
+
+    acam_convert_set_isa(ACAM_ISA_SCALAR);
+    acam_jpeg_config_t config = {85, 4, JPEG_RESTART_ROWS, ACAM_BT601_FULL};
+    int ret;
+    acam_jpeg_encoder_t *enc = acam_jpeg_encoder_create(width, height, &config, &ret);
+    const uint8_t *data = NULL;
+    size_t size = 0;
+    acam_buffer_t jpeg = {0};
+    if (enc != NULL && (ret = acam_jpeg_encode(enc, &frame, &data, &size)) == 0)
+    {
+        jpeg.buf = (char *)data;
+        jpeg.bytes_used = jpeg.length = size;
+    }
+
+    acam_mjpeg_dc_t dc;
+    uint8_t *planes = NULL;
+    if (ret == 0 && (ret = acam_mjpeg_decode_dc(&jpeg, NULL, 0, &dc)) == ENOBUFS)
+    {
+        planes = xmalloc(dc.size);
+        ret = acam_mjpeg_decode_dc(&jpeg, planes, dc.size, &dc);
+    }
+    int status = ret != 0;
+    if (ret != 0)
+    {
+        fprintf(stderr, "Encoding and decoding the DC of a JPEG failed: %s\n", strerror(ret));
+    }
+    else if (dc.components != 3 || dc.plane_width[0] != width / 8 || dc.plane_height[0] != height / 8 ||
+             dc.plane_width[1] != width / 16 || dc.plane_height[1] != height / 8)
+    {
+        fprintf(stderr, "The JPEG decoded to %u planes of %ux%u and %ux%u\n", dc.components, dc.plane_width[0], dc.plane_height[0],
+                dc.plane_width[1], dc.plane_height[1]);
+        status = 1;
+    }
+    for (unsigned int c = 0; status == 0 && c < 3; c++)
+    {
+        //a luma block is 8x8 pixels, a chroma block 8x8 pairs; offsets of the component's bytes in a pixel pair
+        unsigned int offset = c == 0 ? 0 : 2 * c - 1, step = c == 0 ? 2 : 4;
+        for (unsigned int by = 0; status == 0 && by < dc.plane_height[c]; by++)
+        {
+            for (unsigned int bx = 0; bx < dc.plane_width[c]; bx++)
+            {
+                unsigned int sum = 0;
+                for (unsigned int y = 8 * by; y < 8 * by + 8; y++)
+                {
+                    const uint8_t *p = (const uint8_t *)frame.buf + (size_t)y * width * 2 + 8 * step * bx + offset;
+                    for (unsigned int i = 0; i < 8; i++)
+                    {
+                        sum += p[step * i];
+                    }
+                }
+                int decoded = dc.planes[c][(size_t)by * dc.plane_width[c] + bx];
+                int mean = (sum + 32) / 64;
+                if (decoded < mean - 1 || decoded > mean + 1)
+                {
+                    fprintf(stderr, "Block %u,%u of component %u decoded to %d, its mean is %d\n", bx, by, c, decoded, mean);
+                    status = 1;
+                    break;
+                }
+            }
+        }
+    }
+
+    if (enc != NULL)
+    {
+        acam_jpeg_encoder_destroy(enc);
+    }
+    free(planes);
+    free(frame.buf);
+    return status;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [--iterations N] [--output FILE] [--label NAME]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    const char *output = NULL;
+    const char *label = "";
+    int iterations = 50;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 < argc && strcmp(argv[i], "--iterations") == 0)
+        {
+            iterations = atoi(argv[++i]);
+        }
+        else if (i + 1 < argc && strcmp(argv[i], "--output") == 0)
+        {
+            output = argv[++i];
+        }
+        else if (i + 1 < argc && strcmp(argv[i], "--label") == 0)
+        {
+            label = argv[++i];
+        }
+        else
+        {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (iterations < 1)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    FILE *out = stdout;
+    if (output != NULL && (out = fopen(output, "w")) == NULL)
+    {
+        perror("Opening output file");
+        return 1;
+    }
+
+    const unsigned int width = 1920, height = 1080;
+    acam_buffer_t frame = {0};
+    frame.bytes_used = width * height * 2;
+    frame.length = frame.bytes_used;
+    frame.buf = xmalloc(frame.length);
+    for (uint32_t i = 0; i < frame.length; i++)
+    {
+        frame.buf[i] = random_byte();
+    }
+    uint8_t *dst = xmalloc(output_size(OP_JPEG, width, height));
+    double *us = xmalloc(iterations * sizeof(double));
+
+    acam_convert_set_isa(ACAM_ISA_AUTO);
+    acam_isa_t default_isa = acam_convert_get_isa();
+    double jpeg_p50_us = 0;
+    unsigned int jpeg_threads = 1;
+    fprintf(out, "{\"label\": \"%s\", \"width\": %u, \"height\": %u, \"iterations\": %d, \"default_isa\": \"%s\", ", label,
+            width, height, iterations, isa_names[default_isa]);
+
+    int status = 0, first = 1;
+    int scale_known = known_scale() == 0, stats_known = known_stats() == 0, jpeg_known = known_jpeg() == 0;
+    status |= !scale_known || !stats_known || !jpeg_known;
+    fprintf(out, "\"scalar_known_values\": {\"scale\": %s, \"stats\": %s, \"jpeg_dc\": %s}, \"isas\": [",
+            scale_known ? "true" : "false", stats_known ? "true" : "false", jpeg_known ? "true" : "false");
+    for (int isa = ACAM_ISA_SCALAR; isa < __ACAM_ISA_COUNT; isa++)
+    {
+        if (acam_convert_set_isa(isa) != 0)
+        {
+            continue; // not supported by this CPU or build
+        }
+
+        fprintf(out, "%s{\"isa\": \"%s\", ", first ? "" : ", ", isa_names[isa]);
+        first = 0;
+        for (size_t c = 0; c < CONVERSION_COUNT; c++)
+        {
+            int mismatch = 0;
+            for (size_t s = 0; s < CHECK_SIZE_COUNT; s++)
+            {
+                mismatch |= check(isa, &conversions[c], check_sizes[s][0], check_sizes[s][1]);
+            }
+            status |= mismatch;
+
+            acam_convert_set_isa(isa);
+            for (int i = 0; i < iterations; i++)
+            {
+                double start = now_us();
+                if (convert(&conversions[c], &frame, width, height, dst) != 0)
+                {
+                    status = 1;
+                }
+                us[i] = now_us() - start;
+            }
+            qsort(us, iterations, sizeof(double), compare_double);
+            if (isa == default_isa && strcmp(conversions[c].name, JPEG_TIMED) == 0)
+            {
+                jpeg_p50_us = percentile(us, iterations, 50);
+                jpeg_threads = conversions[c].threads;
+            }
+            double sum = 0;
+            for (int i = 0; i < iterations; i++)
+            {
+                sum += us[i];
+            }
+            fprintf(out, "\"%s\": {\"matches_scalar\": %s, \"min_us\": %.3f, \"mean_us\": %.3f, \"p50_us\": %.3f, \"p99_us\": %.3f}%s",
+                    conversions[c].name, mismatch ? "false" : "true", us[0], sum / iterations, percentile(us, iterations, 50),
+                    percentile(us, iterations, 99), c + 1 < CONVERSION_COUNT ? ", " : "");
+        }
+        fprintf(out, "}");
+    }
+    //the encoder splits the frame between its threads, so the budget shrinks with the cores they can run on
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    double jpeg_budget_us = (double)JPEG_CORE_BUDGET_US / (cores > 0 && cores < jpeg_threads ? cores : jpeg_threads);
+    int jpeg_in_budget = jpeg_p50_us <= jpeg_budget_us;
+    if (!jpeg_in_budget)
+    {
+        fprintf(stderr, "%s took %.0f us at the median on %s, over its budget of %.0f us\n", JPEG_TIMED, jpeg_p50_us,
+                isa_names[default_isa], jpeg_budget_us);
+        status = 1;
+    }
+    fprintf(out, "], \"jpeg_1080p\": {\"isa\": \"%s\", \"p50_us\": %.3f, \"budget_us\": %.0f, \"within_budget\": %s}, \"status\": %d}\n",
+            isa_names[default_isa], jpeg_p50_us, jpeg_budget_us, jpeg_in_budget ? "true" : "false", status);
+
+    if (encoder != NULL)
+    {
+        acam_jpeg_encoder_destroy(encoder);
+    }
+    free(frame.buf);
+    free(dst);
+    free(us);
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+
+    return status;
+}